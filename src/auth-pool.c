@@ -0,0 +1,330 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/auth-pool.h"
+#include "src/err.h"
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+/* Jobs that can wait for a worker */
+static const int AUTH_QUEUE_CAP = 256;
+
+static ip_login_t *find_ip_login(auth_pool_t *auth_pool, const char *ip)
+{
+	/* Only addresses with checks in flight are listed, so this stays
+	short */
+	for(int i = 0; i < auth_pool->ip_login_cnt; i++)
+		if(strcmp(auth_pool->ip_login_arr[i].ip, ip) == 0)
+			return &auth_pool->ip_login_arr[i];
+	
+	return NULL;
+}
+
+static void release_ip_login(auth_pool_t *auth_pool, const char *ip)
+{
+	ip_login_t *ip_login = find_ip_login(auth_pool, ip);
+	
+	if(ip_login == NULL) return;
+	
+	ip_login->login_cnt -= 1;
+	
+	if(ip_login->login_cnt > 0) return;
+	
+	auth_pool->ip_login_cnt -= 1;
+	*ip_login = auth_pool->ip_login_arr[auth_pool->ip_login_cnt];
+}
+
+static int run_auth_worker(void *data)
+{
+	auth_pool_t *auth_pool = data;
+	
+	for(;;)
+	{
+		SDL_LockMutex(auth_pool->mutex);
+		
+		while(auth_pool->job_cnt == 0 && !auth_pool->is_quitting)
+			SDL_CondWait(auth_pool->cond, auth_pool->mutex);
+		
+		if(auth_pool->is_quitting)
+		{
+			SDL_UnlockMutex(auth_pool->mutex);
+			break;
+		}
+		
+		auth_job_t *job = auth_pool->job_ring[auth_pool->job_head];
+		
+		auth_pool->job_head = (auth_pool->job_head + 1) % auth_pool->job_cap;
+		auth_pool->job_cnt -= 1;
+		SDL_UnlockMutex(auth_pool->mutex);
+		
+		/* The slow part runs without the lock */
+		job->is_verified = crypto_pwhash_str_verify
+		(
+			auth_pool->password_hash,
+			job->password,
+			job->password_len
+		) == 0;
+		
+		sodium_memzero(job->password, sizeof(job->password));
+		
+		SDL_LockMutex(auth_pool->mutex);
+		release_ip_login(auth_pool, job->ip);
+		SDL_UnlockMutex(auth_pool->mutex);
+		
+		auth_pool->done(auth_pool->done_data, job);
+	}
+	
+	return 0;
+}
+
+bool read_password_hash
+(
+	const char *path,
+	char password_hash[crypto_pwhash_STRBYTES]
+)
+{
+	FILE *file = fopen(path, "r");
+	
+	if(file == NULL)
+	{
+		print_errno_err("fopen");
+		return false;
+	}
+	
+	/* The file holds the hash on its first line, as printed by
+	susurrc-server -H */
+	bool read_success =
+		fgets(password_hash, crypto_pwhash_STRBYTES, file) != NULL;
+	
+	fclose(file);
+	
+	if(read_success)
+		password_hash[strcspn(password_hash, "\r\n")] = '\0';
+	
+	if
+	(
+		!read_success ||
+		strncmp
+		(
+			password_hash,
+			crypto_pwhash_argon2id_STRPREFIX,
+			strlen(crypto_pwhash_argon2id_STRPREFIX)
+		) != 0
+	)
+	{
+		print_err("read_password_hash", "Expected an Argon2id hash");
+		return false;
+	}
+	
+	return true;
+}
+
+bool print_password_hash(void)
+{
+	char password[MAX_MSG_LEN];
+	char password_hash[crypto_pwhash_STRBYTES];
+	
+	if(fgets(password, sizeof(password), stdin) == NULL)
+	{
+		print_err("print_password_hash", "Could not read the password");
+		return false;
+	}
+	
+	password[strcspn(password, "\r\n")] = '\0';
+	
+	int hash_return = crypto_pwhash_str_alg
+	(
+		password_hash,
+		password,
+		strlen(password),
+		crypto_pwhash_OPSLIMIT_INTERACTIVE,
+		crypto_pwhash_MEMLIMIT_INTERACTIVE,
+		crypto_pwhash_ALG_ARGON2ID13
+	);
+	
+	sodium_memzero(password, sizeof(password));
+	
+	if(hash_return != 0)
+	{
+		print_err("crypto_pwhash_str_alg", "Out of memory");
+		return false;
+	}
+	
+	printf("%s\n", password_hash);
+	
+	return true;
+}
+
+bool init_auth_pool
+(
+	auth_pool_t *auth_pool,
+	const char *password_hash,
+	int worker_cnt,
+	int max_ip_login_cnt,
+	auth_done_t done,
+	void *done_data
+)
+{
+	auth_pool->is_quitting = false;
+	auth_pool->job_cnt = 0;
+	auth_pool->job_cap = AUTH_QUEUE_CAP;
+	auth_pool->job_head = 0;
+	auth_pool->worker_cnt = 0;
+	auth_pool->max_ip_login_cnt = max_ip_login_cnt;
+	auth_pool->ip_login_cnt = 0;
+	auth_pool->done = done;
+	auth_pool->done_data = done_data;
+	strcpy(auth_pool->password_hash, password_hash);
+	auth_pool->job_ring = malloc(AUTH_QUEUE_CAP * sizeof(auth_job_t *));
+	auth_pool->cond = SDL_CreateCond();
+	auth_pool->mutex = SDL_CreateMutex();
+	auth_pool->worker_arr = malloc(worker_cnt * sizeof(SDL_Thread *));
+	
+	/* Every queued or running job can come from a different address */
+	auth_pool->ip_login_arr = malloc
+	(
+		(AUTH_QUEUE_CAP + worker_cnt) * sizeof(ip_login_t)
+	);
+	
+	bool init_success =
+		auth_pool->job_ring != NULL &&
+		auth_pool->cond != NULL &&
+		auth_pool->mutex != NULL &&
+		auth_pool->worker_arr != NULL &&
+		auth_pool->ip_login_arr != NULL;
+	
+	if(!init_success)
+		print_err("init_auth_pool", "Could not allocate the pool");
+	
+	for(int i = 0; init_success && i < worker_cnt; i++)
+	{
+		auth_pool->worker_arr[i] = SDL_CreateThread
+		(
+			run_auth_worker,
+			"susurrc-auth",
+			auth_pool
+		);
+		
+		if(auth_pool->worker_arr[i] == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			init_success = false;
+		}
+		else
+		{
+			auth_pool->worker_cnt += 1;
+		}
+	}
+	
+	if(!init_success) terminate_auth_pool(auth_pool);
+	
+	return init_success;
+}
+
+void terminate_auth_pool(auth_pool_t *auth_pool)
+{
+	if(auth_pool->mutex != NULL && auth_pool->cond != NULL)
+	{
+		SDL_LockMutex(auth_pool->mutex);
+		auth_pool->is_quitting = true;
+		SDL_CondBroadcast(auth_pool->cond);
+		SDL_UnlockMutex(auth_pool->mutex);
+	}
+	
+	for(int i = 0; i < auth_pool->worker_cnt; i++)
+		SDL_WaitThread(auth_pool->worker_arr[i], NULL);
+	
+	/* Whatever the workers did not get to is simply dropped */
+	for(int i = 0; i < auth_pool->job_cnt; i++)
+	{
+		int job_index = (auth_pool->job_head + i) % auth_pool->job_cap;
+		
+		sodium_memzero
+		(
+			auth_pool->job_ring[job_index]->password,
+			MAX_MSG_LEN
+		);
+		
+		free(auth_pool->job_ring[job_index]);
+	}
+	
+	if(auth_pool->cond != NULL) SDL_DestroyCond(auth_pool->cond);
+	
+	if(auth_pool->mutex != NULL) SDL_DestroyMutex(auth_pool->mutex);
+	
+	free(auth_pool->job_ring);
+	free(auth_pool->worker_arr);
+	free(auth_pool->ip_login_arr);
+	sodium_memzero(auth_pool->password_hash, crypto_pwhash_STRBYTES);
+	auth_pool->job_cnt = 0;
+	auth_pool->worker_cnt = 0;
+	auth_pool->job_ring = NULL;
+	auth_pool->worker_arr = NULL;
+	auth_pool->ip_login_arr = NULL;
+	auth_pool->cond = NULL;
+	auth_pool->mutex = NULL;
+}
+
+auth_status_t submit_auth_job(auth_pool_t *auth_pool, auth_job_t *job)
+{
+	auth_status_t auth_status = AUTH_STATUS_QUEUED;
+	
+	SDL_LockMutex(auth_pool->mutex);
+	
+	ip_login_t *ip_login = find_ip_login(auth_pool, job->ip);
+	
+	if(ip_login != NULL && ip_login->login_cnt >= auth_pool->max_ip_login_cnt)
+	{
+		auth_status = AUTH_STATUS_IP_LIMIT;
+	}
+	else if(auth_pool->job_cnt == auth_pool->job_cap)
+	{
+		auth_status = AUTH_STATUS_BUSY;
+	}
+	else
+	{
+		if(ip_login == NULL)
+		{
+			ip_login = &auth_pool->ip_login_arr[auth_pool->ip_login_cnt];
+			strcpy(ip_login->ip, job->ip);
+			ip_login->login_cnt = 0;
+			auth_pool->ip_login_cnt += 1;
+		}
+		
+		ip_login->login_cnt += 1;
+		
+		int job_index =
+			(auth_pool->job_head + auth_pool->job_cnt) % auth_pool->job_cap;
+		
+		auth_pool->job_ring[job_index] = job;
+		auth_pool->job_cnt += 1;
+		SDL_CondSignal(auth_pool->cond);
+	}
+	
+	SDL_UnlockMutex(auth_pool->mutex);
+	
+	return auth_status;
+}
@@ -0,0 +1,111 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef AUTH_POOL_H
+#define AUTH_POOL_H
+
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/net.h"
+#include "src/server-net.h"
+#include "stdbool.h"
+
+typedef enum auth_status_t
+{
+	AUTH_STATUS_QUEUED,
+	AUTH_STATUS_BUSY,
+	AUTH_STATUS_IP_LIMIT
+}
+auth_status_t;
+
+/* Struct for one password check.  The pool only reads ip and the password.
+The other fields belong to whoever submitted the job and come back with the
+result */
+typedef struct auth_job_t
+{
+	bool is_verified;
+	int shard_id;
+	unsigned long conn_id;
+	void *client;
+	char ip[MAX_IP_LEN];
+	int password_len;
+	char password[MAX_MSG_LEN];
+}
+auth_job_t;
+
+/* Called on a worker thread with each finished job, which the callee now
+owns */
+typedef void (*auth_done_t)(void *data, auth_job_t *job);
+
+/* Struct for the checks in flight from one address */
+typedef struct ip_login_t
+{
+	char ip[MAX_IP_LEN];
+	int login_cnt;
+}
+ip_login_t;
+
+/* Struct for the threads that run the deliberately slow password hash away
+from the reactors.  The queue is bounded, and so is the number of checks
+any one address can have queued or running.  The mutex guards everything
+but the hash */
+typedef struct auth_pool_t
+{
+	bool is_quitting;
+	int job_cnt;
+	int job_cap;
+	int job_head;
+	int worker_cnt;
+	int max_ip_login_cnt;
+	int ip_login_cnt;
+	auth_done_t done;
+	void *done_data;
+	char password_hash[crypto_pwhash_STRBYTES];
+	auth_job_t **job_ring;
+	ip_login_t *ip_login_arr;
+	SDL_cond *cond;
+	SDL_mutex *mutex;
+	SDL_Thread **worker_arr;
+}
+auth_pool_t;
+
+bool read_password_hash
+(
+	const char *path,
+	char password_hash[crypto_pwhash_STRBYTES]
+);
+
+bool print_password_hash(void);
+
+bool init_auth_pool
+(
+	auth_pool_t *auth_pool,
+	const char *password_hash,
+	int worker_cnt,
+	int max_ip_login_cnt,
+	auth_done_t done,
+	void *done_data
+);
+
+void terminate_auth_pool(auth_pool_t *auth_pool);
+auth_status_t submit_auth_job(auth_pool_t *auth_pool, auth_job_t *job);
+
+#endif /* AUTH_POOL_H */
@@ -0,0 +1,283 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "ctype.h"
+#include "src/channel.h"
+#include "src/err.h"
+#include "src/server-net.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+/* A power of two */
+static const int INITIAL_BUCKET_CNT = 64;
+
+static const int INITIAL_MEMBER_CAP = 8;
+
+static uint32_t hash_channel_name(const char *name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	
+	for(; *name != '\0'; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	
+	return hash;
+}
+
+static channel_t **find_channel_link
+(
+	channel_table_t *channel_table,
+	const char *name
+)
+{
+	uint32_t bucket = hash_channel_name(name) & (channel_table->bucket_cnt - 1);
+	channel_t **link = &channel_table->bucket_arr[bucket];
+	
+	while(*link != NULL && strcmp((*link)->name, name) != 0)
+		link = &(*link)->next;
+	
+	return link;
+}
+
+static void grow_channel_table(channel_table_t *channel_table)
+{
+	int new_bucket_cnt = channel_table->bucket_cnt * 2;
+	channel_t **new_bucket_arr = calloc(new_bucket_cnt, sizeof(channel_t *));
+	
+	/* Longer chains still work, so a failed resize is not fatal */
+	if(new_bucket_arr == NULL) return;
+	
+	for(int i = 0; i < channel_table->bucket_cnt; i++)
+	{
+		channel_t *channel = channel_table->bucket_arr[i];
+		
+		while(channel != NULL)
+		{
+			channel_t *next = channel->next;
+			uint32_t bucket =
+				hash_channel_name(channel->name) & (new_bucket_cnt - 1);
+			
+			channel->next = new_bucket_arr[bucket];
+			new_bucket_arr[bucket] = channel;
+			channel = next;
+		}
+	}
+	
+	free(channel_table->bucket_arr);
+	channel_table->bucket_arr = new_bucket_arr;
+	channel_table->bucket_cnt = new_bucket_cnt;
+}
+
+bool init_channel_table(channel_table_t *channel_table)
+{
+	channel_table->bucket_cnt = INITIAL_BUCKET_CNT;
+	channel_table->channel_cnt = 0;
+	channel_table->bucket_arr = calloc(INITIAL_BUCKET_CNT, sizeof(channel_t *));
+	
+	if(channel_table->bucket_arr == NULL)
+	{
+		print_err("init_channel_table", "Could not allocate the channels");
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_channel_table(channel_table_t *channel_table)
+{
+	if(channel_table->bucket_arr != NULL)
+		for(int i = 0; i < channel_table->bucket_cnt; i++)
+		{
+			channel_t *channel = channel_table->bucket_arr[i];
+			
+			while(channel != NULL)
+			{
+				channel_t *next = channel->next;
+				
+				sodium_memzero(channel->room_key, sizeof(channel->room_key));
+				free(channel->member_arr);
+				free(channel);
+				channel = next;
+			}
+		}
+	
+	free(channel_table->bucket_arr);
+	channel_table->bucket_arr = NULL;
+	channel_table->channel_cnt = 0;
+}
+
+bool is_channel_name_valid(const char *name)
+{
+	int name_len = strlen(name);
+	
+	if(name_len == 0 || name_len > MAX_CHANNEL_NAME_LEN) return false;
+	
+	for(int i = 0; i < name_len; i++)
+		if(!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_')
+			return false;
+	
+	return true;
+}
+
+channel_t *find_channel(channel_table_t *channel_table, const char *name)
+{
+	return *find_channel_link(channel_table, name);
+}
+
+int find_client_channel(client_t *client, const char *name)
+{
+	/* Clients are in a handful of channels at most */
+	for(int i = 0; i < client->channel_cnt; i++)
+		if(strcmp(client->channel_arr[i].channel->name, name) == 0) return i;
+	
+	return -1;
+}
+
+bool join_channel
+(
+	channel_table_t *channel_table,
+	client_t *client,
+	const char *name
+)
+{
+	if(client->channel_cnt == MAX_CLIENT_CHANNEL_CNT) return false;
+	
+	channel_t **link = find_channel_link(channel_table, name);
+	channel_t *channel = *link;
+	
+	/* The first member on this shard brings the channel into existence */
+	if(channel == NULL)
+	{
+		channel = malloc(sizeof(*channel));
+		
+		if(channel == NULL)
+		{
+			print_err("join_channel", "Could not allocate the channel");
+			return false;
+		}
+		
+		strcpy(channel->name, name);
+		channel->room_key_id = 0;
+		channel->member_cnt = 0;
+		channel->member_cap = 0;
+		channel->member_arr = NULL;
+		channel->next = NULL;
+		*link = channel;
+		channel_table->channel_cnt += 1;
+	}
+	
+	if(channel->member_cnt == channel->member_cap)
+	{
+		int new_member_cap =
+			channel->member_cap ? channel->member_cap * 2 : INITIAL_MEMBER_CAP;
+		
+		client_t **new_member_arr = realloc
+		(
+			channel->member_arr,
+			new_member_cap * sizeof(client_t *)
+		);
+		
+		if(new_member_arr == NULL)
+		{
+			print_err("join_channel", "Could not grow the channel");
+			return false;
+		}
+		
+		channel->member_arr = new_member_arr;
+		channel->member_cap = new_member_cap;
+	}
+	
+	client_channel_t *client_channel = &client->channel_arr[client->channel_cnt];
+	
+	client_channel->channel = channel;
+	client_channel->member_index = channel->member_cnt;
+	channel->member_arr[channel->member_cnt] = client;
+	channel->member_cnt += 1;
+	
+	/* The new member must not read what was sealed before it joined */
+	channel->is_room_key_stale = true;
+	
+	/* Posts go to the channel joined last */
+	client->current_channel = client->channel_cnt;
+	client->channel_cnt += 1;
+	
+	if(channel_table->channel_cnt > channel_table->bucket_cnt)
+		grow_channel_table(channel_table);
+	
+	return true;
+}
+
+void leave_channel
+(
+	channel_table_t *channel_table,
+	client_t *client,
+	int client_channel_index
+)
+{
+	client_channel_t *client_channel = &client->channel_arr[client_channel_index];
+	channel_t *channel = client_channel->channel;
+	int member_index = client_channel->member_index;
+	
+	/* Move the channel's last member into the gap and fix up the index it
+	keeps for this channel */
+	channel->member_cnt -= 1;
+	
+	if(member_index != channel->member_cnt)
+	{
+		client_t *moved_client = channel->member_arr[channel->member_cnt];
+		int moved_index = find_client_channel(moved_client, channel->name);
+		
+		channel->member_arr[member_index] = moved_client;
+		moved_client->channel_arr[moved_index].member_index = member_index;
+	}
+	
+	/* Same for the client's own list of channels */
+	client->channel_cnt -= 1;
+	client->channel_arr[client_channel_index] =
+		client->channel_arr[client->channel_cnt];
+	
+	if(client->current_channel == client_channel_index)
+		client->current_channel = client->channel_cnt - 1;
+	else if(client->current_channel == client->channel_cnt)
+		client->current_channel = client_channel_index;
+	
+	/* Nor may the one that left read what is sealed after */
+	channel->is_room_key_stale = true;
+	
+	if(channel->member_cnt > 0) return;
+	
+	/* Nobody on this shard is left in the channel */
+	channel_t **link = find_channel_link(channel_table, channel->name);
+	
+	*link = channel->next;
+	channel_table->channel_cnt -= 1;
+	sodium_memzero(channel->room_key, sizeof(channel->room_key));
+	free(channel->member_arr);
+	free(channel);
+}
+
+void leave_all_channels(channel_table_t *channel_table, client_t *client)
+{
+	while(client->channel_cnt > 0)
+		leave_channel(channel_table, client, client->channel_cnt - 1);
+}
@@ -0,0 +1,80 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "src/server-net.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* Struct for a named channel on one shard.  Its members are kept in a
+dense array so a post only walks the clients that are in the channel.
+Each member remembers its own index (client_channel_t) for removal.  In
+group mode the channel's posts are sealed with its own room key, which
+only its members on this shard are given.  Every join and leave marks the
+key stale, and a new one is made before anything else is sealed with it */
+typedef struct channel_t
+{
+	char name[MAX_CHANNEL_NAME_LEN + 1];
+	bool is_room_key_stale;
+	uint32_t room_key_id;
+	int member_cnt;
+	int member_cap;
+	client_t **member_arr;
+	struct channel_t *next;
+	unsigned char room_key[crypto_secretbox_KEYBYTES];
+}
+channel_t;
+
+/* Struct for a shard's channels, hashed by name.  A channel exists as long
+as it has members on the shard */
+typedef struct channel_table_t
+{
+	int bucket_cnt;
+	int channel_cnt;
+	channel_t **bucket_arr;
+}
+channel_table_t;
+
+bool init_channel_table(channel_table_t *channel_table);
+void terminate_channel_table(channel_table_t *channel_table);
+bool is_channel_name_valid(const char *name);
+channel_t *find_channel(channel_table_t *channel_table, const char *name);
+int find_client_channel(client_t *client, const char *name);
+
+bool join_channel
+(
+	channel_table_t *channel_table,
+	client_t *client,
+	const char *name
+);
+
+void leave_channel
+(
+	channel_table_t *channel_table,
+	client_t *client,
+	int client_channel_index
+);
+
+void leave_all_channels(channel_table_t *channel_table, client_t *client);
+
+#endif /* CHANNEL_H */
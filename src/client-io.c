@@ -0,0 +1,1020 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/client-io.h"
+#include "src/compress.h"
+#include "src/err.h"
+#include "src/file-transfer.h"
+#include "src/net.h"
+#include "src/presence.h"
+#include "src/ring.h"
+#include "SDL2/SDL_net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+
+/* Powers of two, as the rings require */
+static const size_t CMD_RING_CAP = 256;
+static const size_t EVENT_RING_CAP = 1024;
+
+/* Frames read in one go before the UI is handed the batch */
+static const int RECV_BATCH_LEN = 256;
+
+static const int EVENT_RETRY_DELAY = 1;
+
+static void notify_client_io(client_io_t *client_io)
+{
+	/* One dispatch covers everything queued until the UI acknowledges it */
+	if(!atomic_exchange(&client_io->is_notify_pending, true))
+		client_io->notify(client_io->notify_data);
+}
+
+static void push_client_event
+(
+	client_io_t *client_io,
+	client_event_type_t type,
+	const char *text
+)
+{
+	int text_len = strlen(text);
+	client_event_t *event = malloc(sizeof(*event) + text_len + 1);
+	
+	if(event == NULL)
+	{
+		print_err("push_client_event", "Out of memory");
+		return;
+	}
+	
+	event->type = type;
+	memcpy(event->text, text, text_len + 1);
+	
+	/* A full ring means the UI is behind.  Stop reading from the server
+	until it catches up, which also pushes back on the server */
+	while(!push_ring(&client_io->event_ring, event))
+	{
+		if(atomic_load(&client_io->is_quitting))
+		{
+			free(event);
+			return;
+		}
+		
+		notify_client_io(client_io);
+		SDL_Delay(EVENT_RETRY_DELAY);
+	}
+	
+	client_io->has_new_events = true;
+}
+
+static void push_presence_events
+(
+	client_io_t *client_io,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	presence_t presence;
+	
+	for(int offset = 0; offset < payload_len;)
+	{
+		int presence_len = read_presence
+		(
+			payload + offset,
+			payload_len - offset,
+			&presence
+		);
+		
+		if(presence_len < 0)
+		{
+			print_err("push_presence_events", "Invalid presence");
+			return;
+		}
+		
+		offset += presence_len;
+		
+		client_event_t *event = malloc(sizeof(*event) + 1);
+		
+		if(event == NULL)
+		{
+			print_err("push_presence_events", "Out of memory");
+			return;
+		}
+		
+		event->type = CLIENT_EVENT_PRESENCE;
+		event->presence = presence;
+		event->text[0] = '\0';
+		
+		/* Never worth holding up the server connection for.  The UI gets
+		the rest of the batch, or a later one, once it catches up */
+		if(!push_ring(&client_io->event_ring, event))
+		{
+			free(event);
+			return;
+		}
+		
+		client_io->has_new_events = true;
+	}
+}
+
+static void push_file_event
+(
+	client_io_t *client_io,
+	client_event_type_t type,
+	const char *text,
+	const char *name
+)
+{
+	char event_text[MAX_MSG_LEN];
+	
+	snprintf(event_text, MAX_MSG_LEN, "file: %s %s", text, name);
+	push_client_event(client_io, type, event_text);
+}
+
+static void close_transfers(client_io_t *client_io)
+{
+	client_cmd_t *cmd;
+	
+	/* Every SEND_FILE gets its UPLOAD_DONE, sent or not */
+	if(client_io->upload.is_active)
+	{
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_UPLOAD_DONE,
+			"Could not send",
+			client_io->upload.name
+		);
+		
+		close_upload(&client_io->upload);
+	}
+	
+	while(client_io->upload_cmd_cnt > 0)
+	{
+		cmd = client_io->upload_cmd_arr[client_io->upload_cmd_head];
+		client_io->upload_cmd_head =
+			(client_io->upload_cmd_head + 1) % MAX_PENDING_UPLOAD_CNT;
+		client_io->upload_cmd_cnt -= 1;
+		
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_UPLOAD_DONE,
+			"Could not send",
+			cmd->text
+		);
+		
+		free(cmd);
+	}
+	
+	for(int i = 0; i < MAX_DOWNLOAD_CNT; i++)
+	{
+		download_t *download = &client_io->download_arr[i];
+		
+		if(!download->is_active) continue;
+		
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_MSG,
+			"Could not receive",
+			download->name
+		);
+		
+		close_download(download, false);
+	}
+}
+
+static void set_server_fd(client_io_t *client_io, int fd)
+{
+	SDL_LockMutex(client_io->fd_mutex);
+	close_socket(&client_io->server_fd);
+	client_io->server_fd = fd;
+	
+	/* Too late to be shut down by terminate_client_io, so do it here */
+	if(fd >= 0 && atomic_load(&client_io->is_quitting)) shutdown(fd, SHUT_RDWR);
+	
+	SDL_UnlockMutex(client_io->fd_mutex);
+}
+
+static void disconnect_from_server(client_io_t *client_io)
+{
+	client_io->out_len = 0;
+	
+	if(client_io->server_fd < 0) return;
+	
+	close_transfers(client_io);
+	set_server_fd(client_io, -1);
+	init_session(&client_io->session);
+	push_client_event(client_io, CLIENT_EVENT_DISCONNECTED, "");
+}
+
+static void connect_to_server
+(
+	client_io_t *client_io,
+	const char *hostname,
+	int port
+)
+{
+	int server_fd;
+	
+	/* Close any active connection beforehand so the client doesn't
+	accidentally fill up unnecessary slots */
+	close_transfers(client_io);
+	set_server_fd(client_io, -1);
+	
+	/* The socket is only published once connected.  Until then the connect
+	timeout is what bounds the wait */
+	bool connect_success = setup_server_connection(&server_fd, hostname, port);
+	
+	if(connect_success) set_server_fd(client_io, server_fd);
+	
+	/* Generate a keypair and exchange public keys with the server.  This
+	happens once per connection */
+	if(connect_success)
+	{
+		crypto_box_keypair(client_io->pubkey, client_io->privkey);
+		
+		connect_success = exchange_pubkeys
+		(
+			client_io->server_fd,
+			&client_io->session,
+			client_io->privkey,
+			client_io->pubkey
+		);
+	}
+	
+	if(connect_success)
+	{
+		/* Compression starts once the server offers the same dictionary */
+		if(client_io->has_dict)
+			client_io->session.compressor = &client_io->compressor;
+		
+		push_client_event(client_io, CLIENT_EVENT_CONNECTED, hostname);
+	}
+	else
+	{
+		print_err("connect_to_server", "Could not connect to server");
+		set_server_fd(client_io, -1);
+		push_client_event(client_io, CLIENT_EVENT_DISCONNECTED, "");
+	}
+}
+
+static bool is_socket_readable(int fd)
+{
+	struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+	
+	return poll(&pollfd, 1, 0) > 0;
+}
+
+static void flush_server_msgs(client_io_t *client_io)
+{
+	int out_len = client_io->out_len;
+	
+	client_io->out_len = 0;
+	
+	if(out_len == 0 || client_io->server_fd < 0) return;
+	
+	if(!send_all(client_io->server_fd, client_io->out_buf, out_len))
+		disconnect_from_server(client_io);
+}
+
+static bool make_room_for_frame(client_io_t *client_io)
+{
+	if(client_io->out_len + MAX_FRAME_LEN > CLIENT_OUT_BUF_LEN)
+		flush_server_msgs(client_io);
+	
+	return client_io->server_fd >= 0;
+}
+
+static void queue_server_msg(client_io_t *client_io, const char *msg)
+{
+	if(!make_room_for_frame(client_io)) return;
+	
+	/* Sealed straight into the buffer.  Everything the UI posted in one go
+	leaves in a single write */
+	int frame_len = seal_msg_frame
+	(
+		client_io->out_buf + client_io->out_len,
+		(const unsigned char *)msg,
+		strlen(msg),
+		&client_io->session
+	);
+	
+	if(frame_len > 0) client_io->out_len += frame_len;
+}
+
+static void queue_server_frame
+(
+	client_io_t *client_io,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	if(!make_room_for_frame(client_io)) return;
+	
+	int frame_len = seal_frame
+	(
+		client_io->out_buf + client_io->out_len,
+		type,
+		payload,
+		payload_len,
+		&client_io->session
+	);
+	
+	if(frame_len > 0) client_io->out_len += frame_len;
+}
+
+static void queue_presence(client_io_t *client_io, presence_state_t state)
+{
+	unsigned char payload = state;
+	
+	queue_server_frame(client_io, FRAME_TYPE_PRESENCE, &payload, 1);
+}
+
+static void queue_file_cancel(client_io_t *client_io, uint32_t id)
+{
+	unsigned char payload[FILE_ID_LEN];
+	
+	SDLNet_Write32(id, payload);
+	queue_server_frame(client_io, FRAME_TYPE_FILE_CANCEL, payload, FILE_ID_LEN);
+}
+
+static void start_next_upload(client_io_t *client_io)
+{
+	int payload_len;
+	unsigned char payload[MAX_PAYLOAD_LEN];
+	
+	while(!client_io->upload.is_active && client_io->upload_cmd_cnt > 0)
+	{
+		client_cmd_t *cmd =
+			client_io->upload_cmd_arr[client_io->upload_cmd_head];
+		
+		client_io->upload_cmd_head =
+			(client_io->upload_cmd_head + 1) % MAX_PENDING_UPLOAD_CNT;
+		client_io->upload_cmd_cnt -= 1;
+		
+		bool open_success = open_upload
+		(
+			&client_io->upload,
+			cmd->text,
+			client_io->next_upload_id,
+			payload,
+			&payload_len
+		);
+		
+		/* The top bit is left to the server's own ids */
+		client_io->next_upload_id =
+			(client_io->next_upload_id + 1) & ~FILE_RELAY_ID_BIT;
+		
+		/* Chunks only go out once the server grants credit for them */
+		if(open_success)
+		{
+			queue_server_frame
+			(
+				client_io,
+				FRAME_TYPE_FILE_START,
+				payload,
+				payload_len
+			);
+		}
+		else
+		{
+			push_file_event
+			(
+				client_io,
+				CLIENT_EVENT_UPLOAD_DONE,
+				"Could not send",
+				cmd->text
+			);
+		}
+		
+		free(cmd);
+	}
+}
+
+static void queue_upload(client_io_t *client_io, client_cmd_t *cmd)
+{
+	if
+	(
+		client_io->server_fd < 0 ||
+		client_io->upload_cmd_cnt == MAX_PENDING_UPLOAD_CNT
+	)
+	{
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_UPLOAD_DONE,
+			"Could not send",
+			cmd->text
+		);
+		
+		free(cmd);
+		return;
+	}
+	
+	int tail = client_io->upload_cmd_head + client_io->upload_cmd_cnt;
+	
+	client_io->upload_cmd_arr[tail % MAX_PENDING_UPLOAD_CNT] = cmd;
+	client_io->upload_cmd_cnt += 1;
+	start_next_upload(client_io);
+}
+
+static void send_upload_chunks(client_io_t *client_io)
+{
+	upload_t *upload = &client_io->upload;
+	
+	if(!upload->is_active || upload->credit_cnt <= 0) return;
+	
+	/* Only as many chunks as the server has room for are in flight, so
+	anything the UI posts meanwhile waits behind a window at most.  Chat
+	queued before this point has already gone out */
+	while(upload->is_active && upload->credit_cnt > 0)
+	{
+		int frame_len;
+		
+		if(!make_room_for_frame(client_io)) return;
+		
+		chunk_status_t chunk_status = seal_upload_chunk
+		(
+			upload,
+			client_io->out_buf + client_io->out_len,
+			&frame_len
+		);
+		
+		if(chunk_status == CHUNK_STATUS_ERROR)
+		{
+			queue_file_cancel(client_io, upload->id);
+			
+			push_file_event
+			(
+				client_io,
+				CLIENT_EVENT_UPLOAD_DONE,
+				"Could not send",
+				upload->name
+			);
+			
+			close_upload(upload);
+			start_next_upload(client_io);
+			continue;
+		}
+		
+		client_io->out_len += frame_len;
+		
+		if(chunk_status == CHUNK_STATUS_DONE)
+		{
+			push_file_event
+			(
+				client_io,
+				CLIENT_EVENT_UPLOAD_DONE,
+				"Sent",
+				upload->name
+			);
+			
+			close_upload(upload);
+			start_next_upload(client_io);
+		}
+	}
+	
+	flush_server_msgs(client_io);
+}
+
+static download_t *find_download(client_io_t *client_io, uint32_t id)
+{
+	for(int i = 0; i < MAX_DOWNLOAD_CNT; i++)
+	{
+		download_t *download = &client_io->download_arr[i];
+		
+		if(download->is_active && download->id == id) return download;
+	}
+	
+	return NULL;
+}
+
+static void start_download
+(
+	client_io_t *client_io,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	char event_text[MAX_MSG_LEN];
+	download_t *download = NULL;
+	
+	if(payload_len < FILE_START_LEN) return;
+	
+	for(int i = 0; download == NULL && i < MAX_DOWNLOAD_CNT; i++)
+		if(!client_io->download_arr[i].is_active)
+			download = &client_io->download_arr[i];
+	
+	/* Turning a file down tells the server to stop relaying it here */
+	if
+	(
+		client_io->download_dir == NULL ||
+		download == NULL ||
+		!open_download(download, client_io->download_dir, payload, payload_len)
+	)
+	{
+		queue_file_cancel(client_io, SDLNet_Read32(payload));
+		
+		push_client_event
+		(
+			client_io,
+			CLIENT_EVENT_MSG,
+			client_io->download_dir == NULL ?
+				"file: Skipped a file (receiving files is off)" :
+				"file: Could not receive a file"
+		);
+		
+		return;
+	}
+	
+	snprintf
+	(
+		event_text,
+		MAX_MSG_LEN,
+		"file: Receiving %s (%llu bytes)",
+		download->name,
+		(unsigned long long)download->len
+	);
+	
+	push_client_event(client_io, CLIENT_EVENT_MSG, event_text);
+}
+
+static void recv_download_chunk
+(
+	client_io_t *client_io,
+	const unsigned char *body,
+	int body_len
+)
+{
+	/* Chunks of a file given up on may still be on the way */
+	download_t *download = find_download(client_io, SDLNet_Read32(body));
+	
+	if(download == NULL) return;
+	
+	chunk_status_t chunk_status = write_download_chunk
+	(
+		download,
+		body,
+		body_len
+	);
+	
+	if(chunk_status == CHUNK_STATUS_DONE)
+	{
+		push_file_event(client_io, CLIENT_EVENT_MSG, "Saved", download->path);
+		close_download(download, true);
+	}
+	else if(chunk_status == CHUNK_STATUS_ERROR)
+	{
+		queue_file_cancel(client_io, download->id);
+		
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_MSG,
+			"Could not receive",
+			download->name
+		);
+		
+		close_download(download, false);
+	}
+}
+
+static void cancel_transfer(client_io_t *client_io, uint32_t id)
+{
+	download_t *download = find_download(client_io, id);
+	
+	/* The server turns down a file with nowhere to go */
+	if(client_io->upload.is_active && client_io->upload.id == id)
+	{
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_UPLOAD_DONE,
+			"Could not send",
+			client_io->upload.name
+		);
+		
+		close_upload(&client_io->upload);
+		start_next_upload(client_io);
+	}
+	else if(download != NULL)
+	{
+		push_file_event
+		(
+			client_io,
+			CLIENT_EVENT_MSG,
+			"Cancelled",
+			download->name
+		);
+		
+		close_download(download, false);
+	}
+}
+
+static void handle_server_frame
+(
+	client_io_t *client_io,
+	frame_type_t type,
+	unsigned char *payload,
+	int payload_len,
+	bool *is_valid
+)
+{
+	char msg[MAX_MSG_LEN];
+	upload_t *upload = &client_io->upload;
+	
+	*is_valid = true;
+	
+	switch(type)
+	{
+		case FRAME_TYPE_FILE_START:
+			start_download(client_io, payload, payload_len);
+			break;
+		case FRAME_TYPE_FILE_CHUNK:
+			recv_download_chunk(client_io, payload, payload_len);
+			break;
+		case FRAME_TYPE_FILE_ACK:
+			if
+			(
+				payload_len == FILE_ACK_LEN &&
+				upload->is_active &&
+				SDLNet_Read32(payload) == upload->id
+			)
+				upload->credit_cnt += SDLNet_Read32(payload + FILE_ID_LEN);
+			
+			break;
+		case FRAME_TYPE_FILE_CANCEL:
+			if(payload_len == FILE_ID_LEN)
+				cancel_transfer(client_io, SDLNet_Read32(payload));
+			
+			break;
+		case FRAME_TYPE_PRESENCE:
+		case FRAME_TYPE_ROOM_PRESENCE:
+			push_presence_events(client_io, payload, payload_len);
+			break;
+		default:
+			*is_valid = read_msg_frame
+			(
+				type,
+				payload,
+				payload_len,
+				msg,
+				&client_io->msg_data,
+				client_io->server_fd,
+				&client_io->session
+			);
+			
+			/* Room key frames leave the message empty */
+			if(*is_valid && strcmp(msg, "") != 0)
+				push_client_event(client_io, CLIENT_EVENT_MSG, msg);
+			
+			break;
+	}
+}
+
+static void recv_server_msgs(client_io_t *client_io)
+{
+	frame_type_t type;
+	int payload_len;
+	unsigned char payload[MAX_PAYLOAD_LEN];
+	
+	/* Keep reading while frames are waiting so a flood of messages reaches
+	the UI in a few large batches instead of many small ones */
+	for(int i = 0; i < RECV_BATCH_LEN; i++)
+	{
+		bool is_valid = recv_frame
+		(
+			&type,
+			payload,
+			&payload_len,
+			&client_io->msg_data,
+			client_io->server_fd,
+			&client_io->session
+		);
+		
+		if(is_valid)
+			handle_server_frame
+			(
+				client_io,
+				type,
+				payload,
+				payload_len,
+				&is_valid
+			);
+		
+		if(!is_valid)
+		{
+			disconnect_from_server(client_io);
+			return;
+		}
+		
+		if(!is_socket_readable(client_io->server_fd)) break;
+	}
+	
+	/* Files turned down on the way */
+	flush_server_msgs(client_io);
+}
+
+static bool handle_client_cmds(client_io_t *client_io)
+{
+	client_cmd_t *cmd;
+	bool is_running = true;
+	
+	clear_wake_pipe(client_io->wake_fd_arr[0]);
+	atomic_store(&client_io->is_wake_pending, false);
+	
+	while((cmd = pop_ring(&client_io->cmd_ring)) != NULL)
+	{
+		/* Sends queued so far go out before the connection changes */
+		bool is_send =
+			cmd->type == CLIENT_CMD_SEND ||
+			cmd->type == CLIENT_CMD_SET_PRESENCE;
+		
+		if(!is_send) flush_server_msgs(client_io);
+		
+		switch(cmd->type)
+		{
+			case CLIENT_CMD_CONNECT:
+				connect_to_server(client_io, cmd->text, cmd->num);
+				break;
+			case CLIENT_CMD_DISCONNECT:
+				disconnect_from_server(client_io);
+				break;
+			case CLIENT_CMD_SEND:
+				queue_server_msg(client_io, cmd->text);
+				break;
+			case CLIENT_CMD_SET_PRESENCE:
+				queue_presence(client_io, cmd->num);
+				break;
+			case CLIENT_CMD_SEND_FILE:
+				/* Kept until the file is sent */
+				queue_upload(client_io, cmd);
+				continue;
+			case CLIENT_CMD_QUIT:
+				is_running = false;
+				break;
+		}
+		
+		free(cmd);
+	}
+	
+	flush_server_msgs(client_io);
+	
+	return is_running;
+}
+
+static int run_client_io(void *data)
+{
+	client_io_t *client_io = data;
+	bool is_running = true;
+	
+	while(is_running)
+	{
+		/* Sleep until the server sends something or the UI posts a
+		command */
+		struct pollfd pollfd_arr[2] =
+		{
+			{.fd = client_io->wake_fd_arr[0], .events = POLLIN},
+			{.fd = client_io->server_fd, .events = POLLIN}
+		};
+		
+		int pollfd_cnt = client_io->server_fd >= 0 ? 2 : 1;
+		
+		if(poll(pollfd_arr, pollfd_cnt, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			print_errno_err("poll");
+			break;
+		}
+		
+		/* The socket goes first.  A command may replace it */
+		if(pollfd_cnt == 2 && pollfd_arr[1].revents != 0)
+			recv_server_msgs(client_io);
+		
+		if(pollfd_arr[0].revents != 0)
+			is_running = handle_client_cmds(client_io);
+		
+		/* File chunks go last, behind anything the UI just posted */
+		if(is_running) send_upload_chunks(client_io);
+		
+		/* Hand over everything from this pass at once */
+		if(client_io->has_new_events)
+		{
+			client_io->has_new_events = false;
+			notify_client_io(client_io);
+		}
+	}
+	
+	close_transfers(client_io);
+	set_server_fd(client_io, -1);
+	
+	return 0;
+}
+
+bool init_client_io
+(
+	client_io_t *client_io,
+	const char *dict_path,
+	const char *download_dir,
+	client_io_notify_t notify,
+	void *notify_data
+)
+{
+	atomic_init(&client_io->is_notify_pending, false);
+	atomic_init(&client_io->is_quitting, false);
+	atomic_init(&client_io->is_wake_pending, false);
+	client_io->has_dict = false;
+	client_io->has_new_events = false;
+	client_io->server_fd = -1;
+	client_io->out_len = 0;
+	client_io->wake_fd_arr[0] = -1;
+	client_io->wake_fd_arr[1] = -1;
+	client_io->upload_cmd_head = 0;
+	client_io->upload_cmd_cnt = 0;
+	client_io->next_upload_id = 0;
+	client_io->download_dir = download_dir;
+	client_io->upload.is_active = false;
+	
+	for(int i = 0; i < MAX_DOWNLOAD_CNT; i++)
+		client_io->download_arr[i].is_active = false;
+	
+	client_io->notify = notify;
+	client_io->notify_data = notify_data;
+	client_io->cmd_ring.cell_arr = NULL;
+	client_io->event_ring.cell_arr = NULL;
+	client_io->fd_mutex = SDL_CreateMutex();
+	client_io->thread = NULL;
+	init_session(&client_io->session);
+	
+	bool init_success = client_io->fd_mutex != NULL;
+	
+	if(!init_success) print_libsdl_err("SDL_CreateMutex");
+	
+	if(init_success) init_success = open_wake_pipe(client_io->wake_fd_arr);
+	
+	if(init_success && dict_path != NULL)
+	{
+		init_success = load_compress_dict(&client_io->dict, dict_path);
+		
+		if(init_success)
+		{
+			init_success = init_compressor
+			(
+				&client_io->compressor,
+				&client_io->dict
+			);
+			
+			if(!init_success) free_compress_dict(&client_io->dict);
+		}
+		
+		client_io->has_dict = init_success;
+	}
+	
+	if(init_success)
+		init_success = init_ring(&client_io->cmd_ring, CMD_RING_CAP);
+	
+	if(init_success)
+		init_success = init_ring(&client_io->event_ring, EVENT_RING_CAP);
+	
+	if(init_success)
+	{
+		client_io->thread = SDL_CreateThread
+		(
+			run_client_io,
+			"client_io",
+			client_io
+		);
+		
+		if(client_io->thread == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			init_success = false;
+		}
+	}
+	
+	if(!init_success) terminate_client_io(client_io);
+	
+	return init_success;
+}
+
+void terminate_client_io(client_io_t *client_io)
+{
+	void *data;
+	
+	/* Stop the thread first.  It gives up on any event the UI will no
+	longer drain, and shutting the socket down ends a read or write that
+	would otherwise block it */
+	if(client_io->thread != NULL)
+	{
+		SDL_LockMutex(client_io->fd_mutex);
+		atomic_store(&client_io->is_quitting, true);
+		
+		if(client_io->server_fd >= 0)
+			shutdown(client_io->server_fd, SHUT_RDWR);
+		
+		SDL_UnlockMutex(client_io->fd_mutex);
+		
+		while(!post_client_cmd(client_io, CLIENT_CMD_QUIT, "", 0))
+			SDL_Delay(EVENT_RETRY_DELAY);
+		
+		SDL_WaitThread(client_io->thread, NULL);
+		client_io->thread = NULL;
+	}
+	
+	if(client_io->cmd_ring.cell_arr != NULL)
+		while((data = pop_ring(&client_io->cmd_ring)) != NULL) free(data);
+	
+	if(client_io->event_ring.cell_arr != NULL)
+		while((data = pop_ring(&client_io->event_ring)) != NULL) free(data);
+	
+	terminate_ring(&client_io->cmd_ring);
+	terminate_ring(&client_io->event_ring);
+	close_socket(&client_io->wake_fd_arr[0]);
+	close_socket(&client_io->wake_fd_arr[1]);
+	sodium_memzero(client_io->privkey, sizeof(client_io->privkey));
+	init_session(&client_io->session);
+	
+	if(client_io->fd_mutex != NULL) SDL_DestroyMutex(client_io->fd_mutex);
+	
+	client_io->fd_mutex = NULL;
+	
+	if(client_io->has_dict)
+	{
+		terminate_compressor(&client_io->compressor);
+		free_compress_dict(&client_io->dict);
+		client_io->has_dict = false;
+	}
+}
+
+bool post_client_cmd
+(
+	client_io_t *client_io,
+	client_cmd_type_t type,
+	const char *text,
+	int num
+)
+{
+	int text_len = strlen(text);
+	client_cmd_t *cmd = malloc(sizeof(*cmd) + text_len + 1);
+	
+	if(cmd == NULL)
+	{
+		print_err("post_client_cmd", "Out of memory");
+		return false;
+	}
+	
+	cmd->type = type;
+	cmd->num = num;
+	memcpy(cmd->text, text, text_len + 1);
+	
+	if(!push_ring(&client_io->cmd_ring, cmd))
+	{
+		free(cmd);
+		return false;
+	}
+	
+	if(!atomic_exchange(&client_io->is_wake_pending, true))
+		signal_wake_pipe(client_io->wake_fd_arr[1]);
+	
+	return true;
+}
+
+void ack_client_io_notify(client_io_t *client_io)
+{
+	/* Called by the UI before it drains the events, so anything pushed
+	after this point gets a dispatch of its own */
+	atomic_store(&client_io->is_notify_pending, false);
+}
+
+client_event_t *pop_client_event(client_io_t *client_io)
+{
+	return pop_ring(&client_io->event_ring);
+}
@@ -0,0 +1,154 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef CLIENT_IO_H
+#define CLIENT_IO_H
+
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/compress.h"
+#include "src/file-transfer.h"
+#include "src/net.h"
+#include "src/presence.h"
+#include "src/ring.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* Sealed messages waiting to go out in one write.  Room for several whole
+frames */
+#define CLIENT_OUT_BUF_LEN 65536
+
+/* Files received at once, and files waiting behind the one being sent */
+#define MAX_DOWNLOAD_CNT 4
+#define MAX_PENDING_UPLOAD_CNT 16
+
+typedef enum client_cmd_type_t
+{
+	CLIENT_CMD_CONNECT,
+	CLIENT_CMD_DISCONNECT,
+	CLIENT_CMD_SEND,
+	CLIENT_CMD_SEND_FILE,
+	CLIENT_CMD_SET_PRESENCE,
+	CLIENT_CMD_QUIT
+}
+client_cmd_type_t;
+
+typedef enum client_event_type_t
+{
+	CLIENT_EVENT_CONNECTED,
+	CLIENT_EVENT_DISCONNECTED,
+	CLIENT_EVENT_MSG,
+	CLIENT_EVENT_UPLOAD_DONE,
+	CLIENT_EVENT_PRESENCE
+}
+client_event_type_t;
+
+/* Struct for a request from the UI to the I/O thread.  text holds the
+hostname for CONNECT, the message for SEND and the path for SEND_FILE.  num
+holds the port for CONNECT and the presence state for SET_PRESENCE */
+typedef struct client_cmd_t
+{
+	client_cmd_type_t type;
+	int num;
+	char text[];
+}
+client_cmd_t;
+
+/* Struct for something the I/O thread reports back to the UI.  text holds
+the hostname for CONNECTED and the decrypted message for MSG.  Every
+SEND_FILE ends in one UPLOAD_DONE, whose text says how it went.  presence
+is only set for PRESENCE, one event per user that changed.  Those are
+dropped rather than waited for when the UI falls behind */
+typedef struct client_event_t
+{
+	client_event_type_t type;
+	presence_t presence;
+	char text[];
+}
+client_event_t;
+
+/* Called on the I/O thread when events become available after the UI has
+drained the previous batch.  It has to be safe to call from any thread */
+typedef void (*client_io_notify_t)(void *data);
+
+/* Struct for the thread that owns the server connection.  The UI only
+touches the two rings, the flags and the wake pipe, and shuts server_fd
+down under fd_mutex when it stops the thread, so that a blocked read or
+write returns.  Everything else belongs to the I/O thread, which takes the
+mutex only to change server_fd.  The dictionary is optional (has_dict), and
+files are only received with a download directory */
+typedef struct client_io_t
+{
+	atomic_bool is_notify_pending;
+	atomic_bool is_quitting;
+	atomic_bool is_wake_pending;
+	bool has_dict;
+	bool has_new_events;
+	int server_fd;
+	int out_len;
+	int wake_fd_arr[2];
+	int upload_cmd_head;
+	int upload_cmd_cnt;
+	uint32_t next_upload_id;
+	const char *download_dir;
+	client_io_notify_t notify;
+	void *notify_data;
+	compress_dict_t dict;
+	compressor_t compressor;
+	msg_data_t msg_data;
+	ring_t cmd_ring;
+	ring_t event_ring;
+	session_t session;
+	SDL_mutex *fd_mutex;
+	upload_t upload;
+	download_t download_arr[MAX_DOWNLOAD_CNT];
+	client_cmd_t *upload_cmd_arr[MAX_PENDING_UPLOAD_CNT];
+	SDL_Thread *thread;
+	unsigned char privkey[crypto_box_SECRETKEYBYTES];
+	unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
+	unsigned char out_buf[CLIENT_OUT_BUF_LEN];
+}
+client_io_t;
+
+bool init_client_io
+(
+	client_io_t *client_io,
+	const char *dict_path,
+	const char *download_dir,
+	client_io_notify_t notify,
+	void *notify_data
+);
+
+void terminate_client_io(client_io_t *client_io);
+
+bool post_client_cmd
+(
+	client_io_t *client_io,
+	client_cmd_type_t type,
+	const char *text,
+	int num
+);
+
+void ack_client_io_notify(client_io_t *client_io);
+client_event_t *pop_client_event(client_io_t *client_io);
+
+#endif /* CLIENT_IO_H */
@@ -0,0 +1,144 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "src/client-table.h"
+#include "src/err.h"
+#include "src/server-net.h"
+#include "stdbool.h"
+#include "stdlib.h"
+
+static const int INITIAL_ACTIVE_CLIENT_CAP = 64;
+
+bool init_client_table(client_table_t *client_table, int max_client_cnt)
+{
+	int cap = INITIAL_ACTIVE_CLIENT_CAP;
+	
+	if(cap > max_client_cnt) cap = max_client_cnt;
+	
+	client_table->max_client_cnt = max_client_cnt;
+	client_table->alloc_client_cnt = 0;
+	client_table->active_client_cnt = 0;
+	client_table->active_client_cap = cap;
+	client_table->active_client_arr = malloc(cap * sizeof(client_t *));
+	client_table->free_client_list = NULL;
+	
+	if(client_table->active_client_arr == NULL)
+	{
+		print_err("init_client_table", "Could not allocate the client table");
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_client_table(client_table_t *client_table)
+{
+	/* Active clients must be removed (and their sockets closed) by the
+	caller first.  Everything else is on the free list */
+	while(client_table->free_client_list != NULL)
+	{
+		client_t *client = client_table->free_client_list;
+		
+		client_table->free_client_list = client->next_free;
+		free(client);
+	}
+	
+	free(client_table->active_client_arr);
+	client_table->active_client_arr = NULL;
+	client_table->active_client_cnt = 0;
+	client_table->alloc_client_cnt = 0;
+}
+
+client_t *add_client_to_table(client_table_t *client_table)
+{
+	client_t *client = NULL;
+	
+	if(client_table->active_client_cnt >= client_table->max_client_cnt)
+		return NULL;
+	
+	/* Make room in the dense array first so a failure leaves nothing to
+	undo */
+	if(client_table->active_client_cnt == client_table->active_client_cap)
+	{
+		int new_cap = client_table->active_client_cap * 2;
+		
+		if(new_cap > client_table->max_client_cnt)
+			new_cap = client_table->max_client_cnt;
+		
+		client_t **new_active_client_arr = realloc
+		(
+			client_table->active_client_arr,
+			new_cap * sizeof(client_t *)
+		);
+		
+		if(new_active_client_arr == NULL)
+		{
+			print_err("add_client_to_table", "Could not grow the table");
+			return NULL;
+		}
+		
+		client_table->active_client_arr = new_active_client_arr;
+		client_table->active_client_cap = new_cap;
+	}
+	
+	/* Reuse a departed client's memory if there is any */
+	if(client_table->free_client_list != NULL)
+	{
+		client = client_table->free_client_list;
+		client_table->free_client_list = client->next_free;
+	}
+	else
+	{
+		client = malloc(sizeof(*client));
+		
+		if(client == NULL)
+		{
+			print_err("add_client_to_table", "Could not allocate a client");
+			return NULL;
+		}
+		
+		client_table->alloc_client_cnt += 1;
+	}
+	
+	init_client(client);
+	client->active_index = client_table->active_client_cnt;
+	client->next_free = NULL;
+	
+	client_table->active_client_arr[client->active_index] = client;
+	client_table->active_client_cnt += 1;
+	
+	return client;
+}
+
+void remove_client_from_table(client_table_t *client_table, client_t *client)
+{
+	/* Move the last active client into the departed client's place */
+	int last = client_table->active_client_cnt - 1;
+	client_t *last_client = client_table->active_client_arr[last];
+	
+	client_table->active_client_arr[client->active_index] = last_client;
+	last_client->active_index = client->active_index;
+	client_table->active_client_cnt -= 1;
+	
+	client->active_index = -1;
+	client->next_free = client_table->free_client_list;
+	client_table->free_client_list = client;
+}
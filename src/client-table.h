@@ -0,0 +1,48 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include "src/server-net.h"
+#include "stdbool.h"
+
+/* Struct for the server's clients.  Clients are allocated one at a time as
+the server fills up and are never moved, so pointers to them stay valid.
+Departed clients go on a free list for reuse and connected clients are kept
+in a dense array so that broadcasts only walk live connections */
+typedef struct client_table_t
+{
+	int max_client_cnt;
+	int alloc_client_cnt;
+	int active_client_cnt;
+	int active_client_cap;
+	client_t **active_client_arr;
+	client_t *free_client_list;
+}
+client_table_t;
+
+bool init_client_table(client_table_t *client_table, int max_client_cnt);
+void terminate_client_table(client_table_t *client_table);
+client_t *add_client_to_table(client_table_t *client_table);
+void remove_client_from_table(client_table_t *client_table, client_t *client);
+
+#endif /* CLIENT_TABLE_H */
@@ -0,0 +1,277 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "SDL2/SDL.h"
+#include "src/compress.h"
+#include "src/err.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "zdict.h"
+#include "zstd.h"
+
+/* A low level is plenty with a dictionary doing most of the work, and
+keeps compression cheap enough for every message */
+static const int COMPRESS_LEVEL = 3;
+
+static unsigned long long get_ns_since(Uint64 start_counter)
+{
+	Uint64 elapsed = SDL_GetPerformanceCounter() - start_counter;
+	
+	return elapsed * 1000000000.0 / SDL_GetPerformanceFrequency();
+}
+
+static void *read_dict_file(const char *path, size_t *len)
+{
+	FILE *file = fopen(path, "rb");
+	void *buf = NULL;
+	
+	if(file == NULL)
+	{
+		print_errno_err("fopen");
+		return NULL;
+	}
+	
+	if(fseek(file, 0, SEEK_END) == 0)
+	{
+		long file_len = ftell(file);
+		
+		if(file_len > 0 && fseek(file, 0, SEEK_SET) == 0)
+			buf = malloc(file_len);
+		
+		if(buf != NULL && fread(buf, 1, file_len, file) != (size_t)file_len)
+		{
+			free(buf);
+			buf = NULL;
+		}
+		
+		*len = file_len;
+	}
+	
+	fclose(file);
+	
+	if(buf == NULL) print_err("read_dict_file", "Could not read the file");
+	
+	return buf;
+}
+
+bool load_compress_dict(compress_dict_t *dict, const char *path)
+{
+	size_t len;
+	void *buf = read_dict_file(path, &len);
+	
+	dict->id = 0;
+	dict->cdict = NULL;
+	dict->ddict = NULL;
+	
+	if(buf == NULL) return false;
+	
+	/* The id is what the two sides compare when they connect, so raw
+	content without one will not do */
+	dict->id = ZSTD_getDictID_fromDict(buf, len);
+	
+	if(dict->id == 0)
+	{
+		print_err("load_compress_dict", "Not a trained dictionary");
+		free(buf);
+		return false;
+	}
+	
+	dict->cdict = ZSTD_createCDict(buf, len, COMPRESS_LEVEL);
+	dict->ddict = ZSTD_createDDict(buf, len);
+	free(buf);
+	
+	if(dict->cdict == NULL || dict->ddict == NULL)
+	{
+		print_err("load_compress_dict", "Could not load the dictionary");
+		free_compress_dict(dict);
+		return false;
+	}
+	
+	return true;
+}
+
+void free_compress_dict(compress_dict_t *dict)
+{
+	ZSTD_freeCDict(dict->cdict);
+	ZSTD_freeDDict(dict->ddict);
+	dict->id = 0;
+	dict->cdict = NULL;
+	dict->ddict = NULL;
+}
+
+bool train_compress_dict
+(
+	const char *path,
+	const void *sample_buf,
+	const size_t *sample_len_arr,
+	unsigned int sample_cnt
+)
+{
+	unsigned char dict_buf[COMPRESS_DICT_LEN];
+	
+	size_t dict_len = ZDICT_trainFromBuffer
+	(
+		dict_buf,
+		sizeof(dict_buf),
+		sample_buf,
+		sample_len_arr,
+		sample_cnt
+	);
+	
+	if(ZDICT_isError(dict_len))
+	{
+		print_err("ZDICT_trainFromBuffer", ZDICT_getErrorName(dict_len));
+		return false;
+	}
+	
+	FILE *file = fopen(path, "wb");
+	
+	if(file == NULL)
+	{
+		print_errno_err("fopen");
+		return false;
+	}
+	
+	bool write_success = fwrite(dict_buf, 1, dict_len, file) == dict_len;
+	
+	if(fclose(file) != 0 || !write_success)
+	{
+		print_errno_err("fwrite");
+		return false;
+	}
+	
+	printf
+	(
+		"Trained a %zu byte dictionary from %u messages\n",
+		dict_len,
+		sample_cnt
+	);
+	
+	return true;
+}
+
+bool init_compressor(compressor_t *compressor, const compress_dict_t *dict)
+{
+	compressor->dict = dict;
+	compressor->cctx = ZSTD_createCCtx();
+	compressor->dctx = ZSTD_createDCtx();
+	memset(&compressor->stats, 0, sizeof(compressor->stats));
+	
+	if(compressor->cctx == NULL || compressor->dctx == NULL)
+	{
+		print_err("init_compressor", "Could not allocate the contexts");
+		terminate_compressor(compressor);
+		return false;
+	}
+	
+	/* The peer already knows the dictionary and nothing checks the
+	content, so leave the id and checksum out of every frame */
+	ZSTD_CCtx_refCDict(compressor->cctx, dict->cdict);
+	ZSTD_CCtx_setParameter(compressor->cctx, ZSTD_c_dictIDFlag, 0);
+	ZSTD_CCtx_setParameter(compressor->cctx, ZSTD_c_checksumFlag, 0);
+	ZSTD_DCtx_refDDict(compressor->dctx, dict->ddict);
+	
+	return true;
+}
+
+void terminate_compressor(compressor_t *compressor)
+{
+	ZSTD_freeCCtx(compressor->cctx);
+	ZSTD_freeDCtx(compressor->dctx);
+	compressor->dict = NULL;
+	compressor->cctx = NULL;
+	compressor->dctx = NULL;
+}
+
+int compress_payload
+(
+	compressor_t *compressor,
+	unsigned char *dst,
+	const unsigned char *src,
+	int src_len
+)
+{
+	if(src_len < MIN_COMPRESS_LEN)
+	{
+		compressor->stats.skip_cnt += 1;
+		return -1;
+	}
+	
+	Uint64 start_counter = SDL_GetPerformanceCounter();
+	
+	/* Anything that does not come out smaller is sent as it is.  dst only
+	needs to be as long as src for that */
+	size_t dst_len = ZSTD_compress2
+	(
+		compressor->cctx,
+		dst,
+		src_len - 1,
+		src,
+		src_len
+	);
+	
+	compressor->stats.compress_ns += get_ns_since(start_counter);
+	
+	if(ZSTD_isError(dst_len))
+	{
+		compressor->stats.skip_cnt += 1;
+		return -1;
+	}
+	
+	compressor->stats.compress_cnt += 1;
+	compressor->stats.in_len += src_len;
+	compressor->stats.out_len += dst_len;
+	
+	return dst_len;
+}
+
+int decompress_payload
+(
+	compressor_t *compressor,
+	unsigned char *dst,
+	int dst_cap,
+	const unsigned char *src,
+	int src_len
+)
+{
+	Uint64 start_counter = SDL_GetPerformanceCounter();
+	
+	size_t dst_len = ZSTD_decompressDCtx
+	(
+		compressor->dctx,
+		dst,
+		dst_cap,
+		src,
+		src_len
+	);
+	
+	compressor->stats.decompress_ns += get_ns_since(start_counter);
+	
+	if(ZSTD_isError(dst_len))
+	{
+		print_err("ZSTD_decompressDCtx", ZSTD_getErrorName(dst_len));
+		return -1;
+	}
+	
+	return dst_len;
+}
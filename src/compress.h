@@ -0,0 +1,100 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "zstd.h"
+
+/* Payloads shorter than this are always sent as they are.  The dictionary
+does well on short chat lines, but not on a handful of bytes */
+#define MIN_COMPRESS_LEN 24
+
+/* Size of a trained dictionary */
+#define COMPRESS_DICT_LEN 16384
+
+/* Struct for a dictionary loaded once and shared read-only by every
+thread.  Both sides of a connection must have the one with the same id */
+typedef struct compress_dict_t
+{
+	unsigned int id;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+}
+compress_dict_t;
+
+/* Struct for what compression has cost and saved.  in_len and out_len only
+cover payloads that were sent compressed */
+typedef struct compress_stats_t
+{
+	unsigned long long compress_cnt;
+	unsigned long long skip_cnt;
+	unsigned long long in_len;
+	unsigned long long out_len;
+	unsigned long long compress_ns;
+	unsigned long long decompress_ns;
+}
+compress_stats_t;
+
+/* Struct for one thread's compression contexts, which cannot be shared */
+typedef struct compressor_t
+{
+	const compress_dict_t *dict;
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	compress_stats_t stats;
+}
+compressor_t;
+
+bool load_compress_dict(compress_dict_t *dict, const char *path);
+void free_compress_dict(compress_dict_t *dict);
+
+bool train_compress_dict
+(
+	const char *path,
+	const void *sample_buf,
+	const size_t *sample_len_arr,
+	unsigned int sample_cnt
+);
+
+bool init_compressor(compressor_t *compressor, const compress_dict_t *dict);
+void terminate_compressor(compressor_t *compressor);
+
+int compress_payload
+(
+	compressor_t *compressor,
+	unsigned char *dst,
+	const unsigned char *src,
+	int src_len
+);
+
+int decompress_payload
+(
+	compressor_t *compressor,
+	unsigned char *dst,
+	int dst_cap,
+	const unsigned char *src,
+	int src_len
+);
+
+#endif /* COMPRESS_H */
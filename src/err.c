@@ -18,20 +18,125 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
+#include "errno.h"
 #include "SDL2/SDL.h"
 #include "src/err.h"
+#include "stdio.h"
+#include "string.h"
 
+/* Errors go to stderr so that stdout only carries what a program is meant
+to print, such as the messages susurrc-cli receives */
 void print_err(const char *func_name, const char *err_msg)
 {
-	printf("%s err: %s\n", func_name, err_msg);
+	fprintf(stderr, "%s err: %s\n", func_name, err_msg);
 }
 
 void print_libsdl_err(const char *func_name)
 {
-	printf("%s err: %s\n", func_name, SDL_GetError());
+	fprintf(stderr, "%s err: %s\n", func_name, SDL_GetError());
+}
+
+void print_errno_err(const char *func_name)
+{
+	fprintf(stderr, "%s err: %s\n", func_name, strerror(errno));
+}
+
+void print_client_arg_err(void)
+{
+	printf
+	(
+		"Usage: susurrc [-l scrollback lines] [-o download dir] "
+		"[-z dictionary]\n"
+		"  -l  lines of transcript to keep before trimming the oldest\n"
+		"  -o  save files sent to the channel here.  Send one with "
+		"/send <path>\n"
+		"  -z  compress messages with this dictionary if the server has it\n"
+	);
 }
 
 void print_server_arg_err(void)
 {
-	printf("Usage: susurrc-server [port]\n");
+	printf
+	(
+		"Usage: susurrc-server [-c max clients] [-w max queued bytes] [-d] "
+		"[-g] [-s seconds] [-l log dir] [-r replay count] [-R log segments] "
+		"[-f 0-2] [-p password hash file] [-a auth threads] "
+		"[-m stats socket] [-z dictionary] [-L link port] [-P host:port]... "
+		"[-K link key file] [-u] [port] [threads]\n"
+		"       susurrc-server -H < password\n"
+		"       susurrc-server -l log dir -T dictionary\n"
+		"  -d  drop a slow client's oldest messages instead of disconnecting "
+		"it\n"
+		"  -g  seal each broadcast once with its channel's room key\n"
+		"  -s  print per-thread send counters at this interval\n"
+		"  -l  keep a log of room traffic in this directory and replay the "
+		"latest to new clients\n"
+		"  -r  messages replayed to a new client (default 50)\n"
+		"  -R  16 MiB log segments kept before the oldest is deleted.  0 keeps "
+		"them all (default 64)\n"
+		"  -f  log syncing: 0 never, 1 once a second (default), 2 after every "
+		"batch\n"
+		"  -p  ask clients for the password whose hash is in this file\n"
+		"  -a  threads checking passwords (default 2)\n"
+		"  -m  serve counters and latency histograms on this UNIX socket\n"
+		"  -z  compress messages to clients that have this dictionary\n"
+		"  -L  accept relay links from other servers on this port\n"
+		"  -P  link to the server whose link port this is.  Repeat for more "
+		"peers\n"
+		"  -K  32-byte key every linked server shares.  Needed with -L and "
+		"-P\n"
+		"  -u  do socket I/O through io_uring, falling back to epoll where "
+		"the kernel lacks it or it was not built in\n"
+		"  -T  train a dictionary on the messages in the log and exit\n"
+		"  -H  print the hash of the password read from stdin and exit\n"
+		"  threads defaults to 1.  0 starts one per core\n"
+	);
+}
+
+void print_bench_arg_err(void)
+{
+	printf
+	(
+		"Usage: susurrc-bench [-n clients] [-r msgs per sec] [-s sizes] "
+		"[-t seconds] [-p password] [-j] [port] [hostname]\n"
+		"  -n  simulated clients (default 10)\n"
+		"  -r  messages sent per second across all clients (default 1000).  "
+		"0 sends as fast as possible\n"
+		"  -s  comma-separated message sizes picked at random (default 64)\n"
+		"  -t  seconds to send for (default 10)\n"
+		"  -p  password for servers started with -p\n"
+		"  -j  print the results as one line of JSON\n"
+		"  hostname defaults to 127.0.0.1\n"
+	);
+}
+
+void print_micro_arg_err(void)
+{
+	printf
+	(
+		"Usage: susurrc-micro [-s sizes] [-t milliseconds] [-j] [name]\n"
+		"  -s  comma-separated payload sizes (default 16,64,256,1024,4000)\n"
+		"  -t  time to spend on each measurement (default 200)\n"
+		"  -j  print one line of JSON per measurement\n"
+		"  name runs only the benchmarks whose names contain it\n"
+	);
+}
+
+void print_cli_arg_err(void)
+{
+	fprintf
+	(
+		stderr,
+		"Usage: susurrc-cli [-p password] [-c channel] [-q] [-k] "
+		"[-o download dir] [-z dictionary] hostname port\n"
+		"  Sends each line of stdin as a message and prints each message "
+		"received\n"
+		"  -p  log in to a server started with -p\n"
+		"  -c  post to this channel instead of the default one\n"
+		"  -q  leave out notices from the server\n"
+		"  -k  keep printing messages after stdin ends\n"
+		"  -o  save files sent to the channel here.  A line /send <path> "
+		"sends one\n"
+		"  -z  compress messages with this dictionary if the server has it\n"
+	);
 }
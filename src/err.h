@@ -23,7 +23,12 @@ SOFTWARE. */
 
 void print_err(const char *func_name, const char *err_msg);
 void print_libsdl_err(const char *func_name);
+void print_errno_err(const char *func_name);
+void print_client_arg_err(void);
 void print_server_arg_err(void);
+void print_bench_arg_err(void);
+void print_micro_arg_err(void);
+void print_cli_arg_err(void);
 
 #endif /* ERR_H */
 
@@ -0,0 +1,938 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "netdb.h"
+#include "netinet/in.h"
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "SDL2/SDL_net.h"
+#include "sodium.h"
+#include "src/channel.h"
+#include "src/err.h"
+#include "src/federation.h"
+#include "src/frame-pool.h"
+#include "src/net.h"
+#include "src/out-queue.h"
+#include "src/ring.h"
+#include "src/server-net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+
+/* Messages waiting for the federation thread.  A power of two */
+static const size_t FEDERATION_INBOX_CAP = 16384;
+
+/* A peer that is down is dialed again this often.  Links that take
+longer than LINK_HANDSHAKE_TIMEOUT to come up are dropped, so a dead host
+costs nothing but the retries */
+static const Uint32 LINK_RETRY_INTERVAL = 2000;
+static const Uint32 LINK_HANDSHAKE_TIMEOUT = 5000;
+
+/* A link this far behind is dropped and dialed again */
+static const int MAX_LINK_QUEUED_LEN = 8 * 1024 * 1024;
+
+/* Struct for a message on its way from a shard to the federation thread */
+typedef struct federation_msg_t
+{
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	int msg_len;
+	char msg[];
+}
+federation_msg_t;
+
+static void write_uint64(unsigned char *buf, uint64_t value)
+{
+	SDLNet_Write32((Uint32)(value >> 32), buf);
+	SDLNet_Write32((Uint32)value, buf + 4);
+}
+
+static uint64_t read_uint64(const unsigned char *buf)
+{
+	return (uint64_t)SDLNet_Read32(buf) << 32 | SDLNet_Read32(buf + 4);
+}
+
+static bool load_link_key(federation_t *federation, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	
+	if(file == NULL)
+	{
+		print_errno_err("fopen");
+		return false;
+	}
+	
+	size_t read_len = fread
+	(
+		federation->link_key,
+		1,
+		crypto_auth_KEYBYTES,
+		file
+	);
+	
+	fclose(file);
+	
+	if(read_len != crypto_auth_KEYBYTES)
+	{
+		print_err("load_link_key", "The link key file is too short");
+		return false;
+	}
+	
+	return true;
+}
+
+static bool add_dialed_link
+(
+	federation_t *federation,
+	link_t *link,
+	const char *peer
+)
+{
+	char host[MAX_LINK_NAME_LEN];
+	struct addrinfo hints;
+	struct addrinfo *addr_list;
+	const char *port = strrchr(peer, ':');
+	
+	if(port == NULL || port == peer || strlen(peer) >= MAX_LINK_NAME_LEN)
+	{
+		print_err("add_dialed_link", "Peers are given as host:port");
+		return false;
+	}
+	
+	snprintf(host, MAX_LINK_NAME_LEN, "%.*s", (int)(port - peer), peer);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	/* Resolved once.  Redialing a peer that went away should not wait on
+	the resolver */
+	int gai_return = getaddrinfo(host, port + 1, &hints, &addr_list);
+	
+	if(gai_return != 0)
+	{
+		print_err("getaddrinfo", gai_strerror(gai_return));
+		return false;
+	}
+	
+	link->is_active = true;
+	link->is_dialed = true;
+	link->retry_ticks = SDL_GetTicks() - LINK_RETRY_INTERVAL;
+	link->addr_len = addr_list->ai_addrlen;
+	memcpy(&link->addr, addr_list->ai_addr, addr_list->ai_addrlen);
+	strcpy(link->name, peer);
+	freeaddrinfo(addr_list);
+	
+	return true;
+}
+
+static void close_link(link_t *link)
+{
+	if(link->state == LINK_STATE_UP)
+		printf("Relay link to %s is down\n", link->name);
+	
+	close_socket(&link->conn.fd);
+	terminate_out_queue(&link->conn.out_queue);
+	init_client(&link->conn);
+	link->state = LINK_STATE_DOWN;
+	link->peer_node_id = 0;
+	link->retry_ticks = SDL_GetTicks();
+	
+	/* The slot of a link dialed in is free for the next one */
+	if(!link->is_dialed) link->is_active = false;
+}
+
+static void queue_link_frame
+(
+	federation_t *federation,
+	link_t *link,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	/* Each link has its own session key, so every link gets its own frame.
+	It is sealed straight into the buffer the queue will hold */
+	frame_buf_t *buf = alloc_frame_buf
+	(
+		&federation->frame_pool,
+		SEALED_FRAME_LEN(payload_len)
+	);
+	
+	if(buf == NULL)
+	{
+		close_link(link);
+		return;
+	}
+	
+	buf->len = seal_frame
+	(
+		buf->data,
+		type,
+		payload,
+		payload_len,
+		&link->conn.session
+	);
+	
+	/* A peer that stops reading is cut off rather than left to eat
+	memory.  Whatever it missed is gone, as it would be for a client */
+	int queued_len = link->conn.out_queue.queued_len + buf->len;
+	
+	if(buf->len < 0)
+	{
+		close_link(link);
+	}
+	else if(queued_len > MAX_LINK_QUEUED_LEN)
+	{
+		print_err("queue_link_frame", "Relay link is too slow");
+		close_link(link);
+	}
+	else if(!push_out_frame(&link->conn.out_queue, buf, false))
+	{
+		close_link(link);
+	}
+	
+	release_frame_buf(buf);
+}
+
+static void send_link_hello(federation_t *federation, link_t *link)
+{
+	unsigned char hello[LINK_HELLO_LEN];
+	
+	/* The tag covers this end's public key, so it is worthless to anyone
+	without the private key that goes with it */
+	write_uint64(hello, federation->node_id);
+	
+	crypto_auth
+	(
+		hello + NODE_ID_LEN,
+		federation->pubkey,
+		crypto_box_PUBLICKEYBYTES,
+		federation->link_key
+	);
+	
+	queue_link_frame
+	(
+		federation,
+		link,
+		FRAME_TYPE_LINK_HELLO,
+		hello,
+		LINK_HELLO_LEN
+	);
+}
+
+static void start_link(federation_t *federation, link_t *link)
+{
+	link->state = LINK_STATE_HANDSHAKE;
+	link->retry_ticks = SDL_GetTicks();
+	
+	/* Both ends send their public key first, the same way clients do */
+	frame_buf_t *buf = copy_frame_buf
+	(
+		&federation->frame_pool,
+		federation->pubkey,
+		crypto_box_PUBLICKEYBYTES
+	);
+	
+	if(buf == NULL)
+	{
+		close_link(link);
+		return;
+	}
+	
+	if(!push_out_frame(&link->conn.out_queue, buf, false)) close_link(link);
+	
+	release_frame_buf(buf);
+}
+
+static void dial_link(federation_t *federation, link_t *link)
+{
+	link->retry_ticks = SDL_GetTicks();
+	link->conn.fd = socket(link->addr.ss_family, SOCK_STREAM, 0);
+	
+	if(link->conn.fd < 0)
+	{
+		print_errno_err("socket");
+		return;
+	}
+	
+	if(!set_nonblocking(link->conn.fd))
+	{
+		close_socket(&link->conn.fd);
+		return;
+	}
+	
+	set_nodelay(link->conn.fd);
+	
+	/* The connection completes in the background, so a peer that is down
+	never holds up the links that are not */
+	int connect_return = connect
+	(
+		link->conn.fd,
+		(const struct sockaddr *)&link->addr,
+		link->addr_len
+	);
+	
+	if(connect_return == 0)
+	{
+		start_link(federation, link);
+		return;
+	}
+	
+	if(errno != EINPROGRESS)
+	{
+		close_socket(&link->conn.fd);
+		return;
+	}
+	
+	link->state = LINK_STATE_CONNECTING;
+}
+
+static void finish_dial(federation_t *federation, link_t *link)
+{
+	int sock_err = 0;
+	socklen_t sock_err_len = sizeof(sock_err);
+	
+	int getsockopt_return = getsockopt
+	(
+		link->conn.fd,
+		SOL_SOCKET,
+		SO_ERROR,
+		&sock_err,
+		&sock_err_len
+	);
+	
+	/* Refused or unreachable.  Tried again later without a fuss */
+	if(getsockopt_return != 0 || sock_err != 0)
+	{
+		close_link(link);
+		return;
+	}
+	
+	start_link(federation, link);
+}
+
+static void accept_links(federation_t *federation)
+{
+	int fd;
+	
+	while(accept_client(federation->listen_fd, &fd))
+	{
+		link_t *link = NULL;
+		
+		for(int i = 0; link == NULL && i < MAX_LINK_CNT; i++)
+			if(!federation->link_arr[i].is_active)
+				link = &federation->link_arr[i];
+		
+		if(link == NULL)
+		{
+			print_err("accept_links", "Too many relay links");
+			close_socket(&fd);
+			continue;
+		}
+		
+		link->is_active = true;
+		link->is_dialed = false;
+		link->conn.fd = fd;
+		read_client_ip(&link->conn);
+		strcpy(link->name, link->conn.ip);
+		start_link(federation, link);
+	}
+}
+
+static void send_to_links
+(
+	federation_t *federation,
+	const link_t *from_link,
+	uint64_t node_id,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	/* Once per link.  Not back where it came from, nor to the node it
+	started on */
+	for(int i = 0; i < MAX_LINK_CNT; i++)
+	{
+		link_t *link = &federation->link_arr[i];
+		
+		if
+		(
+			link->state != LINK_STATE_UP ||
+			link == from_link ||
+			link->peer_node_id == node_id
+		)
+			continue;
+		
+		queue_link_frame
+		(
+			federation,
+			link,
+			FRAME_TYPE_RELAY,
+			payload,
+			payload_len
+		);
+	}
+}
+
+static void drain_federation_inbox(federation_t *federation)
+{
+	federation_msg_t *federation_msg;
+	unsigned char *payload = federation->payload;
+	
+	clear_wake_pipe(federation->wake_fd_arr[0]);
+	atomic_store(&federation->is_wake_pending, false);
+	
+	while((federation_msg = pop_ring(&federation->inbox)) != NULL)
+	{
+		int channel_name_len = strlen(federation_msg->channel_name);
+		int msg_len = federation_msg->msg_len;
+		
+		/* A message right at the length limit loses its end to the
+		header */
+		if(msg_len > MAX_PAYLOAD_LEN - RELAY_HEADER_LEN - channel_name_len)
+			msg_len = MAX_PAYLOAD_LEN - RELAY_HEADER_LEN - channel_name_len;
+		
+		/* Numbered here, where only this thread counts */
+		write_uint64(payload, federation->node_id);
+		write_uint64(payload + NODE_ID_LEN, federation->next_seq);
+		payload[2 * NODE_ID_LEN] = channel_name_len;
+		
+		memcpy
+		(
+			payload + RELAY_HEADER_LEN,
+			federation_msg->channel_name,
+			channel_name_len
+		);
+		
+		memcpy
+		(
+			payload + RELAY_HEADER_LEN + channel_name_len,
+			federation_msg->msg,
+			msg_len
+		);
+		
+		federation->next_seq += 1;
+		
+		send_to_links
+		(
+			federation,
+			NULL,
+			federation->node_id,
+			payload,
+			RELAY_HEADER_LEN + channel_name_len + msg_len
+		);
+		
+		free(federation_msg);
+	}
+}
+
+static bool handle_link_hello
+(
+	federation_t *federation,
+	link_t *link,
+	int payload_len
+)
+{
+	const unsigned char *payload = federation->payload;
+	
+	if
+	(
+		payload_len != LINK_HELLO_LEN ||
+		crypto_auth_verify
+		(
+			payload + NODE_ID_LEN,
+			link->conn.session.peer_pubkey,
+			crypto_box_PUBLICKEYBYTES,
+			federation->link_key
+		) != 0
+	)
+	{
+		print_err("handle_link_hello", "The peer has a different link key");
+		return false;
+	}
+	
+	link->peer_node_id = read_uint64(payload);
+	
+	if(link->peer_node_id == federation->node_id)
+	{
+		print_err("handle_link_hello", "This server is linked to itself");
+		return false;
+	}
+	
+	link->state = LINK_STATE_UP;
+	printf("Relay link to %s is up\n", link->name);
+	
+	return true;
+}
+
+static bool handle_relay_frame
+(
+	federation_t *federation,
+	link_t *link,
+	int payload_len
+)
+{
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	const unsigned char *payload = federation->payload;
+	
+	if(payload_len < RELAY_HEADER_LEN) return false;
+	
+	uint64_t node_id = read_uint64(payload);
+	uint64_t seq = read_uint64(payload + NODE_ID_LEN);
+	int channel_name_len = payload[2 * NODE_ID_LEN];
+	int msg_len = payload_len - RELAY_HEADER_LEN - channel_name_len;
+	
+	if(channel_name_len > MAX_CHANNEL_NAME_LEN || msg_len < 1) return false;
+	
+	memcpy(channel_name, payload + RELAY_HEADER_LEN, channel_name_len);
+	channel_name[channel_name_len] = '\0';
+	
+	if(!is_channel_name_valid(channel_name)) return false;
+	
+	/* One of ours came back round, or another link got it here first */
+	if(node_id == federation->node_id) return true;
+	
+	if(mark_msg_seen(&federation->seen_table, node_id, seq)) return true;
+	
+	federation->deliver
+	(
+		federation->deliver_data,
+		node_id,
+		seq,
+		channel_name,
+		(const char *)payload + RELAY_HEADER_LEN + channel_name_len,
+		msg_len
+	);
+	
+	/* Passed on as it came, so every node sees the same id */
+	send_to_links(federation, link, node_id, payload, payload_len);
+	
+	return true;
+}
+
+static bool handle_link_frame
+(
+	federation_t *federation,
+	link_t *link,
+	frame_type_t type,
+	int payload_len
+)
+{
+	/* Nothing is taken from a peer before it proves it has the key */
+	if(link->state != LINK_STATE_UP)
+	{
+		return
+			type == FRAME_TYPE_LINK_HELLO &&
+			handle_link_hello(federation, link, payload_len);
+	}
+	
+	if(type == FRAME_TYPE_RELAY)
+		return handle_relay_frame(federation, link, payload_len);
+	
+	print_err("handle_link_frame", "Unexpected frame");
+	return false;
+}
+
+static void read_link(federation_t *federation, link_t *link)
+{
+	frame_type_t type;
+	int payload_len;
+	pop_status_t pop_status;
+	recv_status_t recv_status;
+	
+	do
+	{
+		recv_status = fill_client_buf(&link->conn);
+		
+		if(recv_status == RECV_STATUS_CLOSED)
+		{
+			close_link(link);
+			return;
+		}
+		
+		do
+		{
+			bool had_key = link->conn.session.has_key;
+			
+			pop_status = pop_client_frame
+			(
+				&link->conn,
+				federation->pubkey,
+				federation->privkey,
+				&type,
+				federation->payload,
+				&payload_len
+			);
+			
+			/* Prove the link key as soon as there is a session to send it
+			over */
+			if(!had_key && link->conn.session.has_key)
+				send_link_hello(federation, link);
+			
+			if(link->conn.fd < 0) return;
+			
+			bool is_valid = pop_status != POP_STATUS_ERROR;
+			
+			if(pop_status == POP_STATUS_FRAME)
+			{
+				is_valid = handle_link_frame
+				(
+					federation,
+					link,
+					type,
+					payload_len
+				);
+			}
+			
+			if(!is_valid)
+			{
+				close_link(link);
+				return;
+			}
+		}
+		while(pop_status == POP_STATUS_FRAME);
+	}
+	while(recv_status == RECV_STATUS_DATA);
+}
+
+static void flush_link(link_t *link)
+{
+	unsigned long send_call_cnt = 0;
+	
+	/* Whatever does not fit now waits for POLLOUT */
+	flush_status_t flush_status = flush_out_queue
+	(
+		&link->conn.out_queue,
+		link->conn.fd,
+		&send_call_cnt
+	);
+	
+	if(flush_status == FLUSH_STATUS_ERROR) close_link(link);
+}
+
+static int get_link_wait_timeout(federation_t *federation)
+{
+	int timeout = -1;
+	
+	for(int i = 0; i < MAX_LINK_CNT; i++)
+	{
+		link_t *link = &federation->link_arr[i];
+		Uint32 interval;
+		
+		if(link->state == LINK_STATE_DOWN && link->is_dialed)
+			interval = LINK_RETRY_INTERVAL;
+		else if(link->is_active && link->state != LINK_STATE_UP)
+			interval = LINK_HANDSHAKE_TIMEOUT;
+		else
+			continue;
+		
+		Uint32 elapsed = SDL_GetTicks() - link->retry_ticks;
+		int wait_timeout = elapsed >= interval ? 0 : interval - elapsed;
+		
+		if(timeout < 0 || wait_timeout < timeout) timeout = wait_timeout;
+	}
+	
+	return timeout;
+}
+
+static void check_link_timers(federation_t *federation)
+{
+	for(int i = 0; i < MAX_LINK_CNT; i++)
+	{
+		link_t *link = &federation->link_arr[i];
+		Uint32 elapsed = SDL_GetTicks() - link->retry_ticks;
+		
+		if(link->state == LINK_STATE_DOWN && link->is_dialed)
+		{
+			if(elapsed >= LINK_RETRY_INTERVAL) dial_link(federation, link);
+		}
+		else if(link->is_active && link->state != LINK_STATE_UP)
+		{
+			if(elapsed >= LINK_HANDSHAKE_TIMEOUT) close_link(link);
+		}
+	}
+}
+
+static int run_federation(void *data)
+{
+	federation_t *federation = data;
+	struct pollfd pollfd_arr[MAX_LINK_CNT + 2];
+	link_t *polled_link_arr[MAX_LINK_CNT + 2];
+	
+	while(!atomic_load(&federation->is_quitting))
+	{
+		int pollfd_cnt = 2;
+		
+		/* poll skips the listening socket when there is none */
+		pollfd_arr[0].fd = federation->wake_fd_arr[0];
+		pollfd_arr[0].events = POLLIN;
+		pollfd_arr[1].fd = federation->listen_fd;
+		pollfd_arr[1].events = POLLIN;
+		
+		for(int i = 0; i < MAX_LINK_CNT; i++)
+		{
+			link_t *link = &federation->link_arr[i];
+			
+			if(link->conn.fd < 0) continue;
+			
+			pollfd_arr[pollfd_cnt].fd = link->conn.fd;
+			pollfd_arr[pollfd_cnt].events = POLLIN;
+			
+			if
+			(
+				link->state == LINK_STATE_CONNECTING ||
+				link->conn.out_queue.queued_len > 0
+			)
+				pollfd_arr[pollfd_cnt].events |= POLLOUT;
+			
+			polled_link_arr[pollfd_cnt] = link;
+			pollfd_cnt += 1;
+		}
+		
+		int poll_return = poll
+		(
+			pollfd_arr,
+			pollfd_cnt,
+			get_link_wait_timeout(federation)
+		);
+		
+		if(poll_return < 0 && errno != EINTR)
+		{
+			print_errno_err("poll");
+			break;
+		}
+		
+		if(poll_return > 0 && pollfd_arr[0].revents != 0)
+			drain_federation_inbox(federation);
+		
+		if(poll_return > 0 && pollfd_arr[1].revents != 0)
+			accept_links(federation);
+		
+		for(int i = 2; poll_return > 0 && i < pollfd_cnt; i++)
+		{
+			link_t *link = polled_link_arr[i];
+			
+			/* Skip links closed earlier in this pass */
+			if
+			(
+				pollfd_arr[i].revents == 0 ||
+				link->conn.fd != pollfd_arr[i].fd
+			)
+				continue;
+			
+			if(link->state == LINK_STATE_CONNECTING)
+				finish_dial(federation, link);
+			else
+				read_link(federation, link);
+		}
+		
+		/* Everything queued in this pass goes out together */
+		for(int i = 0; i < MAX_LINK_CNT; i++)
+		{
+			link_t *link = &federation->link_arr[i];
+			
+			if
+			(
+				link->conn.fd >= 0 &&
+				link->state != LINK_STATE_CONNECTING &&
+				link->conn.out_queue.queued_len > 0
+			)
+				flush_link(link);
+		}
+		
+		check_link_timers(federation);
+	}
+	
+	return 0;
+}
+
+bool init_federation
+(
+	federation_t *federation,
+	const char *key_path,
+	int port,
+	int peer_cnt,
+	char *peer_arr[],
+	federation_deliver_t deliver,
+	void *deliver_data
+)
+{
+	atomic_init(&federation->is_quitting, false);
+	atomic_init(&federation->is_wake_pending, false);
+	federation->listen_fd = -1;
+	federation->wake_fd_arr[0] = -1;
+	federation->wake_fd_arr[1] = -1;
+	init_seen_table(&federation->seen_table);
+	federation->next_seq = 1;
+	federation->deliver = deliver;
+	federation->deliver_data = deliver_data;
+	federation->inbox.cell_arr = NULL;
+	federation->thread = NULL;
+	init_frame_pool(&federation->frame_pool);
+	
+	for(int i = 0; i < MAX_LINK_CNT; i++)
+	{
+		link_t *link = &federation->link_arr[i];
+		
+		link->is_active = false;
+		link->is_dialed = false;
+		link->state = LINK_STATE_DOWN;
+		link->peer_node_id = 0;
+		link->retry_ticks = 0;
+		strcpy(link->name, "");
+		init_client(&link->conn);
+	}
+	
+	/* A fresh id every run, since the sequence numbers start over.  Zero
+	stands for this server in the log, so no node is numbered that */
+	federation->node_id = 0;
+	
+	while(federation->node_id == 0)
+		randombytes_buf(&federation->node_id, sizeof(federation->node_id));
+	crypto_box_keypair(federation->pubkey, federation->privkey);
+	
+	bool init_success = peer_cnt <= MAX_LINK_CNT;
+	
+	if(!init_success) print_err("init_federation", "Too many peers");
+	
+	if(init_success) init_success = load_link_key(federation, key_path);
+	
+	for(int i = 0; init_success && i < peer_cnt; i++)
+	{
+		init_success = add_dialed_link
+		(
+			federation,
+			&federation->link_arr[i],
+			peer_arr[i]
+		);
+	}
+	
+	if(init_success && port > 0)
+		init_success = open_listen_socket(&federation->listen_fd, port);
+	
+	if(init_success) init_success = open_wake_pipe(federation->wake_fd_arr);
+	
+	if(init_success)
+		init_success = init_ring(&federation->inbox, FEDERATION_INBOX_CAP);
+	
+	if(init_success)
+	{
+		federation->thread = SDL_CreateThread
+		(
+			run_federation,
+			"susurrc-federation",
+			federation
+		);
+		
+		if(federation->thread == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			init_success = false;
+		}
+	}
+	
+	if(init_success)
+		printf
+		(
+			"Relaying as node %016llx to %d peers\n",
+			(unsigned long long)federation->node_id,
+			peer_cnt
+		);
+	else
+		terminate_federation(federation);
+	
+	return init_success;
+}
+
+void terminate_federation(federation_t *federation)
+{
+	federation_msg_t *federation_msg;
+	
+	if(federation->thread != NULL)
+	{
+		atomic_store(&federation->is_quitting, true);
+		signal_wake_pipe(federation->wake_fd_arr[1]);
+		SDL_WaitThread(federation->thread, NULL);
+		federation->thread = NULL;
+	}
+	
+	if(federation->inbox.cell_arr != NULL)
+		while((federation_msg = pop_ring(&federation->inbox)) != NULL)
+			free(federation_msg);
+	
+	for(int i = 0; i < MAX_LINK_CNT; i++)
+	{
+		link_t *link = &federation->link_arr[i];
+		
+		close_socket(&link->conn.fd);
+		terminate_out_queue(&link->conn.out_queue);
+		link->is_active = false;
+	}
+	
+	terminate_frame_pool(&federation->frame_pool);
+	terminate_ring(&federation->inbox);
+	close_socket(&federation->listen_fd);
+	close_socket(&federation->wake_fd_arr[0]);
+	close_socket(&federation->wake_fd_arr[1]);
+	sodium_memzero(federation->link_key, sizeof(federation->link_key));
+	sodium_memzero(federation->privkey, sizeof(federation->privkey));
+}
+
+bool forward_to_federation
+(
+	federation_t *federation,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+)
+{
+	federation_msg_t *federation_msg = malloc
+	(
+		sizeof(*federation_msg) + msg_len
+	);
+	
+	if(federation_msg == NULL)
+	{
+		print_err("forward_to_federation", "Could not allocate the message");
+		return false;
+	}
+	
+	strcpy(federation_msg->channel_name, channel_name);
+	federation_msg->msg_len = msg_len;
+	memcpy(federation_msg->msg, msg, msg_len);
+	
+	/* Local members still get the message.  Only the other nodes miss
+	it */
+	if(!push_ring(&federation->inbox, federation_msg))
+	{
+		print_err("forward_to_federation", "Federation inbox is full");
+		free(federation_msg);
+		return false;
+	}
+	
+	if(!atomic_exchange(&federation->is_wake_pending, true))
+		signal_wake_pipe(federation->wake_fd_arr[1]);
+	
+	return true;
+}
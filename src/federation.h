@@ -0,0 +1,137 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/frame-pool.h"
+#include "src/ring.h"
+#include "src/seen.h"
+#include "src/server-net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "sys/socket.h"
+
+#define MAX_LINK_CNT 16
+#define MAX_LINK_NAME_LEN 300
+
+/* LINK_HELLO holds the sender's node id and a crypto_auth tag of its
+public key under the shared link key.  RELAY holds the id of the node the
+message started on, its sequence number there and the channel name (a
+length byte first), followed by the message */
+#define NODE_ID_LEN 8
+#define LINK_HELLO_LEN (NODE_ID_LEN + crypto_auth_BYTES)
+#define RELAY_HEADER_LEN (2 * NODE_ID_LEN + 1)
+
+typedef enum link_state_t
+{
+	LINK_STATE_DOWN,
+	LINK_STATE_CONNECTING,
+	LINK_STATE_HANDSHAKE,
+	LINK_STATE_UP
+}
+link_state_t;
+
+/* Struct for a connection to another server.  Links to the configured
+peers are dialed and redialed, and links the peers dial in take the slots
+after them.  Either way both ends exchange keys and prove they hold the
+link key before anything is relayed.  conn is only used for its socket,
+session and buffers */
+typedef struct link_t
+{
+	bool is_active;
+	bool is_dialed;
+	link_state_t state;
+	uint64_t peer_node_id;
+	Uint32 retry_ticks;
+	socklen_t addr_len;
+	struct sockaddr_storage addr;
+	char name[MAX_LINK_NAME_LEN];
+	client_t conn;
+}
+link_t;
+
+/* Called on the federation thread with each message relayed from another
+node, once per message however many links it arrives on.  node_id and seq
+number the message where it started */
+typedef void (*federation_deliver_t)
+(
+	void *data,
+	uint64_t node_id,
+	uint64_t seq,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+);
+
+/* Struct for the thread that links this server to others into one room.
+Shards hand it their messages through the inbox, and it numbers them and
+writes them to every link once.  Messages from a link are delivered here
+and passed on to every other link, unless their id was seen before.  That
+stops them going round in circles however the nodes are linked */
+typedef struct federation_t
+{
+	atomic_bool is_quitting;
+	atomic_bool is_wake_pending;
+	int listen_fd;
+	int wake_fd_arr[2];
+	int link_cnt;
+	uint64_t node_id;
+	uint64_t next_seq;
+	federation_deliver_t deliver;
+	void *deliver_data;
+	ring_t inbox;
+	SDL_Thread *thread;
+	frame_pool_t frame_pool;
+	link_t link_arr[MAX_LINK_CNT];
+	seen_table_t seen_table;
+	unsigned char link_key[crypto_auth_KEYBYTES];
+	unsigned char privkey[crypto_box_SECRETKEYBYTES];
+	unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
+	unsigned char payload[MAX_PAYLOAD_LEN];
+}
+federation_t;
+
+bool init_federation
+(
+	federation_t *federation,
+	const char *key_path,
+	int port,
+	int peer_cnt,
+	char *peer_arr[],
+	federation_deliver_t deliver,
+	void *deliver_data
+);
+
+void terminate_federation(federation_t *federation);
+
+bool forward_to_federation
+(
+	federation_t *federation,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+);
+
+#endif /* FEDERATION_H */
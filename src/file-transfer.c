@@ -0,0 +1,378 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "fcntl.h"
+#include "SDL2/SDL_net.h"
+#include "sodium.h"
+#include "src/err.h"
+#include "src/file-transfer.h"
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+static bool read_file_all(int fd, unsigned char *buf, int len)
+{
+	int read_len = 0;
+	
+	while(read_len < len)
+	{
+		ssize_t read_return = read(fd, buf + read_len, len - read_len);
+		
+		if(read_return < 0 && errno == EINTR) continue;
+		
+		if(read_return < 0)
+		{
+			print_errno_err("read");
+			return false;
+		}
+		
+		/* The file got shorter since it was opened */
+		if(read_return == 0)
+		{
+			print_err("read_file_all", "Unexpected end of file");
+			return false;
+		}
+		
+		read_len += read_return;
+	}
+	
+	return true;
+}
+
+static bool write_file_all(int fd, const unsigned char *buf, int len)
+{
+	int write_len = 0;
+	
+	while(write_len < len)
+	{
+		ssize_t write_return = write(fd, buf + write_len, len - write_len);
+		
+		if(write_return < 0 && errno == EINTR) continue;
+		
+		if(write_return < 0)
+		{
+			print_errno_err("write");
+			return false;
+		}
+		
+		write_len += write_return;
+	}
+	
+	return true;
+}
+
+bool open_upload
+(
+	upload_t *upload,
+	const char *path,
+	uint32_t id,
+	unsigned char *payload,
+	int *payload_len
+)
+{
+	struct stat file_stat;
+	unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+	unsigned char *header = payload + FILE_ID_LEN + 8;
+	
+	/* Only the last part of the path is sent */
+	const char *name = strrchr(path, '/');
+	
+	name = name == NULL ? path : name + 1;
+	
+	int name_len = strlen(name);
+	
+	if(name_len == 0 || name_len > MAX_FILE_NAME_LEN)
+	{
+		print_err("open_upload", "Invalid file name");
+		return false;
+	}
+	
+	upload->fd = open(path, O_RDONLY | O_CLOEXEC);
+	
+	if(upload->fd < 0)
+	{
+		print_errno_err("open");
+		return false;
+	}
+	
+	if(fstat(upload->fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+	{
+		print_err("open_upload", "Not a regular file");
+		close(upload->fd);
+		upload->fd = -1;
+		return false;
+	}
+	
+	upload->is_active = true;
+	upload->credit_cnt = 0;
+	upload->id = id;
+	upload->len = file_stat.st_size;
+	upload->sent_len = 0;
+	memcpy(upload->name, name, name_len + 1);
+	
+	/* Every transfer gets a fresh key.  The stream authenticates each chunk
+	and their order, and its final tag catches a file cut short */
+	crypto_secretstream_xchacha20poly1305_keygen(key);
+	crypto_secretstream_xchacha20poly1305_init_push
+	(
+		&upload->state,
+		header,
+		key
+	);
+	
+	SDLNet_Write32(id, payload);
+	SDLNet_Write32((Uint32)(upload->len >> 32), payload + FILE_ID_LEN);
+	SDLNet_Write32((Uint32)upload->len, payload + FILE_ID_LEN + 4);
+	
+	memcpy
+	(
+		header + crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+		key,
+		sizeof(key)
+	);
+	
+	memcpy(payload + FILE_START_LEN, name, name_len);
+	*payload_len = FILE_START_LEN + name_len;
+	sodium_memzero(key, sizeof(key));
+	
+	return true;
+}
+
+chunk_status_t seal_upload_chunk
+(
+	upload_t *upload,
+	unsigned char *frame,
+	int *frame_len
+)
+{
+	unsigned char chunk[FILE_CHUNK_LEN];
+	unsigned char *body = frame + FRAME_HEADER_LEN;
+	uint64_t left_len = upload->len - upload->sent_len;
+	int chunk_len = left_len < FILE_CHUNK_LEN ? (int)left_len : FILE_CHUNK_LEN;
+	bool is_final = (uint64_t)chunk_len == left_len;
+	
+	if(!read_file_all(upload->fd, chunk, chunk_len)) return CHUNK_STATUS_ERROR;
+	
+	*frame_len = FRAME_HEADER_LEN + FILE_CHUNK_OVERHEAD + chunk_len;
+	SDLNet_Write32((Uint32)(FILE_CHUNK_OVERHEAD + chunk_len), frame);
+	frame[4] = FRAME_TYPE_FILE_CHUNK;
+	SDLNet_Write32(upload->id, body);
+	body[FILE_ID_LEN] = is_final ? FILE_CHUNK_FINAL : 0;
+	
+	crypto_secretstream_xchacha20poly1305_push
+	(
+		&upload->state,
+		body + FILE_ID_LEN + 1,
+		NULL,
+		chunk,
+		chunk_len,
+		NULL,
+		0,
+		is_final ?
+			crypto_secretstream_xchacha20poly1305_TAG_FINAL :
+			crypto_secretstream_xchacha20poly1305_TAG_MESSAGE
+	);
+	
+	upload->sent_len += chunk_len;
+	upload->credit_cnt -= 1;
+	
+	return is_final ? CHUNK_STATUS_DONE : CHUNK_STATUS_MORE;
+}
+
+void close_upload(upload_t *upload)
+{
+	if(!upload->is_active) return;
+	
+	close(upload->fd);
+	upload->fd = -1;
+	upload->is_active = false;
+	sodium_memzero(&upload->state, sizeof(upload->state));
+}
+
+static bool open_download_file(download_t *download, const char *dir)
+{
+	/* An existing file is never overwritten.  The transfer id tells two
+	files of the same name apart */
+	snprintf(download->path, PATH_MAX, "%s/%s", dir, download->name);
+	
+	download->fd = open
+	(
+		download->path,
+		O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		0600
+	);
+	
+	if(download->fd < 0 && errno == EEXIST)
+	{
+		snprintf
+		(
+			download->path,
+			PATH_MAX,
+			"%s/%lu-%s",
+			dir,
+			(unsigned long)download->id,
+			download->name
+		);
+		
+		download->fd = open
+		(
+			download->path,
+			O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			0600
+		);
+	}
+	
+	if(download->fd < 0)
+	{
+		print_errno_err("open");
+		return false;
+	}
+	
+	return true;
+}
+
+bool open_download
+(
+	download_t *download,
+	const char *dir,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	const unsigned char *header = payload + FILE_ID_LEN + 8;
+	const unsigned char *key =
+		header + crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+	
+	int name_len = payload_len - FILE_START_LEN;
+	
+	if
+	(
+		name_len < 1 ||
+		name_len > MAX_FILE_NAME_LEN ||
+		memchr(payload + FILE_START_LEN, '\0', name_len) != NULL
+	)
+	{
+		print_err("open_download", "Invalid file name");
+		return false;
+	}
+	
+	download->id = SDLNet_Read32(payload);
+	download->len = (uint64_t)SDLNet_Read32(payload + FILE_ID_LEN) << 32;
+	download->len |= SDLNet_Read32(payload + FILE_ID_LEN + 4);
+	download->recv_len = 0;
+	memcpy(download->name, payload + FILE_START_LEN, name_len);
+	download->name[name_len] = '\0';
+	
+	/* The name comes from another user.  Keep it inside the directory, and
+	neither hidden nor ".." */
+	for(int i = 0; i < name_len; i++)
+		if(download->name[i] == '/') download->name[i] = '_';
+	
+	if(download->name[0] == '.') download->name[0] = '_';
+	
+	int init_return = crypto_secretstream_xchacha20poly1305_init_pull
+	(
+		&download->state,
+		header,
+		key
+	);
+	
+	if(init_return != 0)
+	{
+		print_err("open_download", "Invalid stream header");
+		return false;
+	}
+	
+	if(!open_download_file(download, dir)) return false;
+	
+	download->is_active = true;
+	
+	return true;
+}
+
+chunk_status_t write_download_chunk
+(
+	download_t *download,
+	const unsigned char *body,
+	int body_len
+)
+{
+	unsigned char chunk[FILE_CHUNK_LEN];
+	unsigned long long chunk_len;
+	unsigned char tag;
+	
+	int pull_return = crypto_secretstream_xchacha20poly1305_pull
+	(
+		&download->state,
+		chunk,
+		&chunk_len,
+		&tag,
+		body + FILE_ID_LEN + 1,
+		body_len - FILE_ID_LEN - 1,
+		NULL,
+		0
+	);
+	
+	if(pull_return != 0)
+	{
+		print_err("write_download_chunk", "Failed to decrypt the chunk");
+		return CHUNK_STATUS_ERROR;
+	}
+	
+	/* The stream's tag is what counts.  The flag only has to agree with
+	it */
+	bool is_final = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+	
+	if
+	(
+		is_final != (body[FILE_ID_LEN] == FILE_CHUNK_FINAL) ||
+		download->recv_len + chunk_len > download->len ||
+		!write_file_all(download->fd, chunk, chunk_len)
+	)
+		return CHUNK_STATUS_ERROR;
+	
+	download->recv_len += chunk_len;
+	
+	if(!is_final) return CHUNK_STATUS_MORE;
+	
+	return
+		download->recv_len == download->len ?
+		CHUNK_STATUS_DONE :
+		CHUNK_STATUS_ERROR;
+}
+
+void close_download(download_t *download, bool is_complete)
+{
+	if(!download->is_active) return;
+	
+	close(download->fd);
+	download->fd = -1;
+	download->is_active = false;
+	sodium_memzero(&download->state, sizeof(download->state));
+	
+	/* A partial file is of no use to anyone */
+	if(!is_complete) unlink(download->path);
+}
@@ -0,0 +1,104 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include "limits.h"
+#include "sodium.h"
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+typedef enum chunk_status_t
+{
+	CHUNK_STATUS_MORE,
+	CHUNK_STATUS_DONE,
+	CHUNK_STATUS_ERROR
+}
+chunk_status_t;
+
+/* Struct for the file being sent.  Only one chunk of it is ever in memory,
+and the server hands out credit_cnt (how many more chunks may be sent) as
+the recipients keep up */
+typedef struct upload_t
+{
+	bool is_active;
+	int fd;
+	int credit_cnt;
+	uint32_t id;
+	uint64_t len;
+	uint64_t sent_len;
+	crypto_secretstream_xchacha20poly1305_state state;
+	char name[MAX_FILE_NAME_LEN + 1];
+}
+upload_t;
+
+/* Struct for a file being received, written out chunk by chunk */
+typedef struct download_t
+{
+	bool is_active;
+	int fd;
+	uint32_t id;
+	uint64_t len;
+	uint64_t recv_len;
+	crypto_secretstream_xchacha20poly1305_state state;
+	char name[MAX_FILE_NAME_LEN + 1];
+	char path[PATH_MAX];
+}
+download_t;
+
+bool open_upload
+(
+	upload_t *upload,
+	const char *path,
+	uint32_t id,
+	unsigned char *payload,
+	int *payload_len
+);
+
+chunk_status_t seal_upload_chunk
+(
+	upload_t *upload,
+	unsigned char *frame,
+	int *frame_len
+);
+
+void close_upload(upload_t *upload);
+
+bool open_download
+(
+	download_t *download,
+	const char *dir,
+	const unsigned char *payload,
+	int payload_len
+);
+
+chunk_status_t write_download_chunk
+(
+	download_t *download,
+	const unsigned char *body,
+	int body_len
+);
+
+void close_download(download_t *download, bool is_complete);
+
+#endif /* FILE_TRANSFER_H */
@@ -0,0 +1,171 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#include "src/err.h"
+#include "src/frame-pool.h"
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include "string.h"
+
+static const int INITIAL_SLAB_CAP = 8;
+static const int SLAB_LEN = 65536;
+
+/* Every frame fits the largest class.  The smaller ones keep short chat
+frames, which make up most of the traffic, from each pinning a buffer
+that could hold a full payload */
+static const int frame_class_len_arr[FRAME_CLASS_CNT] =
+{
+	256,
+	1024,
+	MAX_FRAME_LEN
+};
+
+static int get_buf_stride(int class_id)
+{
+	int align = _Alignof(frame_buf_t);
+	int len = sizeof(frame_buf_t) + frame_class_len_arr[class_id];
+	
+	return (len + align - 1) / align * align;
+}
+
+static bool add_slab(frame_pool_t *pool, int class_id)
+{
+	if(pool->slab_cnt == pool->slab_cap)
+	{
+		int new_cap = pool->slab_cap ? pool->slab_cap * 2 : INITIAL_SLAB_CAP;
+		
+		unsigned char **new_slab_arr = realloc
+		(
+			pool->slab_arr,
+			new_cap * sizeof(unsigned char *)
+		);
+		
+		if(new_slab_arr == NULL) return false;
+		
+		pool->slab_arr = new_slab_arr;
+		pool->slab_cap = new_cap;
+	}
+	
+	unsigned char *slab = malloc(SLAB_LEN);
+	
+	if(slab == NULL) return false;
+	
+	pool->slab_arr[pool->slab_cnt] = slab;
+	pool->slab_cnt += 1;
+	
+	/* Thread the whole slab onto the class's free list */
+	int stride = get_buf_stride(class_id);
+	
+	for(int offset = 0; offset + stride <= SLAB_LEN; offset += stride)
+	{
+		frame_buf_t *buf = (frame_buf_t *)(slab + offset);
+		
+		buf->class_id = class_id;
+		buf->pool = pool;
+		buf->next_free = pool->free_list_arr[class_id];
+		pool->free_list_arr[class_id] = buf;
+	}
+	
+	return true;
+}
+
+void init_frame_pool(frame_pool_t *pool)
+{
+	pool->slab_cnt = 0;
+	pool->slab_cap = 0;
+	pool->slab_arr = NULL;
+	
+	for(int i = 0; i < FRAME_CLASS_CNT; i++)
+		pool->free_list_arr[i] = NULL;
+}
+
+void terminate_frame_pool(frame_pool_t *pool)
+{
+	/* Every queue holding one of the frames has to be terminated first */
+	for(int i = 0; i < pool->slab_cnt; i++)
+		free(pool->slab_arr[i]);
+	
+	free(pool->slab_arr);
+	init_frame_pool(pool);
+}
+
+frame_buf_t *alloc_frame_buf(frame_pool_t *pool, int max_len)
+{
+	int class_id = 0;
+	
+	while(class_id < FRAME_CLASS_CNT && frame_class_len_arr[class_id] < max_len)
+		class_id += 1;
+	
+	if(class_id == FRAME_CLASS_CNT)
+	{
+		print_err("alloc_frame_buf", "Frame is too long");
+		return NULL;
+	}
+	
+	if(pool->free_list_arr[class_id] == NULL && !add_slab(pool, class_id))
+	{
+		print_err("alloc_frame_buf", "Could not allocate a slab");
+		return NULL;
+	}
+	
+	frame_buf_t *buf = pool->free_list_arr[class_id];
+	
+	pool->free_list_arr[class_id] = buf->next_free;
+	buf->ref_cnt = 1;
+	buf->len = 0;
+	buf->next_free = NULL;
+	
+	return buf;
+}
+
+frame_buf_t *copy_frame_buf
+(
+	frame_pool_t *pool,
+	const unsigned char *frame,
+	int frame_len
+)
+{
+	frame_buf_t *buf = alloc_frame_buf(pool, frame_len);
+	
+	if(buf == NULL) return NULL;
+	
+	memcpy(buf->data, frame, frame_len);
+	buf->len = frame_len;
+	
+	return buf;
+}
+
+void ref_frame_buf(frame_buf_t *buf)
+{
+	buf->ref_cnt += 1;
+}
+
+void release_frame_buf(frame_buf_t *buf)
+{
+	buf->ref_cnt -= 1;
+	
+	if(buf->ref_cnt > 0) return;
+	
+	buf->next_free = buf->pool->free_list_arr[buf->class_id];
+	buf->pool->free_list_arr[buf->class_id] = buf;
+}
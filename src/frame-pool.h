@@ -0,0 +1,70 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+/* Small, medium and full-size frames */
+#define FRAME_CLASS_CNT 3
+
+/* Struct for a frame that every queue it was pushed to shares.  Its bytes
+are never written again once it has been pushed, and it goes back to its
+pool when the last reference is released.  The count is not atomic, since
+a pool and every queue holding its frames belong to a single thread */
+typedef struct frame_buf_t
+{
+	int ref_cnt;
+	int len;
+	int class_id;
+	struct frame_pool_t *pool;
+	struct frame_buf_t *next_free;
+	unsigned char data[];
+}
+frame_buf_t;
+
+/* Struct for a thread's frame allocator.  Buffers are carved out of slabs
+in a few size classes and kept on free lists until the pool is terminated,
+so a busy thread stops calling malloc once its traffic has settled */
+typedef struct frame_pool_t
+{
+	int slab_cnt;
+	int slab_cap;
+	unsigned char **slab_arr;
+	frame_buf_t *free_list_arr[FRAME_CLASS_CNT];
+}
+frame_pool_t;
+
+void init_frame_pool(frame_pool_t *pool);
+void terminate_frame_pool(frame_pool_t *pool);
+frame_buf_t *alloc_frame_buf(frame_pool_t *pool, int max_len);
+
+frame_buf_t *copy_frame_buf
+(
+	frame_pool_t *pool,
+	const unsigned char *frame,
+	int frame_len
+);
+
+void ref_frame_buf(frame_buf_t *buf);
+void release_frame_buf(frame_buf_t *buf);
+
+#endif /* FRAME_POOL_H */
@@ -0,0 +1,98 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "src/histogram.h"
+#include "stdint.h"
+#include "string.h"
+
+int get_histogram_bucket_index(uint64_t value)
+{
+	if(value < 2 * HISTOGRAM_SUB_BUCKET_CNT) return value;
+	
+	/* Keep the top HISTOGRAM_SUB_BUCKET_BITS + 1 bits.  The shift picks the
+	power of two and the kept bits pick the bucket within it */
+	int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+	
+	return shift * HISTOGRAM_SUB_BUCKET_CNT + (int)(value >> shift);
+}
+
+static uint64_t get_bucket_value(int index)
+{
+	if(index < 2 * HISTOGRAM_SUB_BUCKET_CNT) return index;
+	
+	/* Report the top of the bucket so percentiles are never understated */
+	int shift = index / HISTOGRAM_SUB_BUCKET_CNT - 1;
+	uint64_t mantissa = index - shift * HISTOGRAM_SUB_BUCKET_CNT;
+	
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void init_histogram(histogram_t *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void record_histogram(histogram_t *histogram, uint64_t value)
+{
+	histogram->cnt += 1;
+	histogram->sum += value;
+	
+	if(value > histogram->max) histogram->max = value;
+	
+	histogram->bucket_arr[get_histogram_bucket_index(value)] += 1;
+}
+
+void merge_histogram(histogram_t *histogram, const histogram_t *other)
+{
+	histogram->cnt += other->cnt;
+	histogram->sum += other->sum;
+	
+	if(other->max > histogram->max) histogram->max = other->max;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKET_CNT; i++)
+		histogram->bucket_arr[i] += other->bucket_arr[i];
+}
+
+uint64_t get_histogram_percentile(const histogram_t *histogram, double pct)
+{
+	if(histogram->cnt == 0) return 0;
+	
+	/* The rank of the value wanted, counting from 1 */
+	uint64_t rank = (uint64_t)(pct / 100.0 * histogram->cnt + 0.5);
+	uint64_t seen_cnt = 0;
+	
+	if(rank < 1) rank = 1;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKET_CNT; i++)
+	{
+		seen_cnt += histogram->bucket_arr[i];
+		
+		if(seen_cnt >= rank)
+		{
+			uint64_t value = get_bucket_value(i);
+			
+			/* The top of the last bucket can be past anything recorded */
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	
+	return histogram->max;
+}
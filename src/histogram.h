@@ -0,0 +1,52 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "stdint.h"
+
+/* Values below 2 * HISTOGRAM_SUB_BUCKET_CNT get a bucket each.  Above that,
+every power of two is split into HISTOGRAM_SUB_BUCKET_CNT buckets, which
+keeps any reported value within about 3% of the real one */
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKET_CNT (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKET_CNT \
+	((65 - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKET_CNT)
+
+/* Struct for a log-linear histogram of 64-bit values.  Its size is fixed no
+matter how many values are recorded */
+typedef struct histogram_t
+{
+	uint64_t cnt;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket_arr[HISTOGRAM_BUCKET_CNT];
+}
+histogram_t;
+
+int get_histogram_bucket_index(uint64_t value);
+void init_histogram(histogram_t *histogram);
+void record_histogram(histogram_t *histogram, uint64_t value);
+void merge_histogram(histogram_t *histogram, const histogram_t *other);
+uint64_t get_histogram_percentile(const histogram_t *histogram, double pct);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,417 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "src/err.h"
+#include "src/histogram.h"
+#include "src/metrics.h"
+#include "src/net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
+#include "unistd.h"
+
+static const int STATS_BACKLOG = 16;
+
+/* Names in the same order as the enums */
+static const char *COUNTER_NAME_ARR[COUNTER_CNT] =
+{
+	"connections_opened_total",
+	"connections_closed_total",
+	"connections_rejected_total",
+	"messages_in_total",
+	"messages_out_total",
+	"bytes_in_total",
+	"bytes_out_total",
+	"broadcasts_total",
+	"crypto_failures_total",
+	"send_calls_total",
+	"queue_overflows_total",
+	"compress_in_bytes_total",
+	"compress_out_bytes_total",
+	"compress_skips_total",
+	"compress_nanoseconds_total",
+	"decompress_nanoseconds_total",
+	"presence_drops_total",
+	"broadcast_holds_total",
+	"broadcast_drops_total"
+};
+
+static const char *GAUGE_NAME_ARR[GAUGE_CNT] =
+{
+	"clients",
+	"queued_bytes",
+	"write_blocked_clients"
+};
+
+static const char *LATENCY_NAME_ARR[LATENCY_CNT] =
+{
+	"fanout_latency_us",
+	"loop_time_us"
+};
+
+static const double QUANTILE_ARR[] = {50.0, 90.0, 99.0, 99.9};
+
+static void store_relaxed(atomic_ullong *value, unsigned long long n)
+{
+	atomic_store_explicit(value, n, memory_order_relaxed);
+}
+
+static unsigned long long load_relaxed(atomic_ullong *value)
+{
+	return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static void read_latency
+(
+	metrics_histogram_t *metrics_histogram,
+	histogram_t *histogram
+)
+{
+	/* The writer may be halfway through a record, so cnt can be off by one
+	from the buckets.  Percentiles are worked out from the buckets */
+	histogram->cnt += load_relaxed(&metrics_histogram->cnt);
+	histogram->sum += load_relaxed(&metrics_histogram->sum);
+	
+	uint64_t max = load_relaxed(&metrics_histogram->max);
+	
+	if(max > histogram->max) histogram->max = max;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKET_CNT; i++)
+		histogram->bucket_arr[i] +=
+			load_relaxed(&metrics_histogram->bucket_arr[i]);
+}
+
+static void write_latency
+(
+	FILE *file,
+	stats_server_t *stats_server,
+	latency_t latency
+)
+{
+	histogram_t *histogram = malloc(sizeof(histogram_t));
+	
+	if(histogram == NULL) return;
+	
+	init_histogram(histogram);
+	
+	/* Latencies are reported across all the threads */
+	for(int i = 0; i < stats_server->metrics_cnt; i++)
+		read_latency
+		(
+			&stats_server->metrics_arr[i].latency_arr[latency],
+			histogram
+		);
+	
+	uint64_t bucket_cnt = 0;
+	
+	for(int i = 0; i < HISTOGRAM_BUCKET_CNT; i++)
+		bucket_cnt += histogram->bucket_arr[i];
+	
+	histogram->cnt = bucket_cnt;
+	
+	for(size_t i = 0; i < sizeof(QUANTILE_ARR) / sizeof(double); i++)
+		fprintf
+		(
+			file,
+			"susurrc_%s{quantile=\"%g\"} %.3f\n",
+			LATENCY_NAME_ARR[latency],
+			QUANTILE_ARR[i] / 100.0,
+			get_histogram_percentile(histogram, QUANTILE_ARR[i]) / 1000.0
+		);
+	
+	fprintf
+	(
+		file,
+		"susurrc_%s_max %.3f\n"
+		"susurrc_%s_sum %.3f\n"
+		"susurrc_%s_count %llu\n",
+		LATENCY_NAME_ARR[latency],
+		histogram->max / 1000.0,
+		LATENCY_NAME_ARR[latency],
+		histogram->sum / 1000.0,
+		LATENCY_NAME_ARR[latency],
+		(unsigned long long)histogram->cnt
+	);
+	
+	free(histogram);
+}
+
+static void write_stats(stats_server_t *stats_server, int fd)
+{
+	FILE *file = fdopen(fd, "w");
+	
+	if(file == NULL)
+	{
+		print_errno_err("fdopen");
+		close(fd);
+		return;
+	}
+	
+	uint64_t uptime_ns = get_elapsed_ns
+	(
+		stats_server->start_counter,
+		SDL_GetPerformanceCounter()
+	);
+	
+	/* One sample per line, in the text format most scrapers read.  Counters
+	and gauges are per thread */
+	fprintf(file, "susurrc_uptime_seconds %.3f\n", uptime_ns / 1000000000.0);
+	
+	for(int i = 0; i < COUNTER_CNT; i++)
+		for(int j = 0; j < stats_server->metrics_cnt; j++)
+			fprintf
+			(
+				file,
+				"susurrc_%s{shard=\"%d\"} %llu\n",
+				COUNTER_NAME_ARR[i],
+				j,
+				load_relaxed(&stats_server->metrics_arr[j].counter_arr[i])
+			);
+	
+	for(int i = 0; i < GAUGE_CNT; i++)
+		for(int j = 0; j < stats_server->metrics_cnt; j++)
+			fprintf
+			(
+				file,
+				"susurrc_%s{shard=\"%d\"} %lld\n",
+				GAUGE_NAME_ARR[i],
+				j,
+				atomic_load_explicit
+				(
+					&stats_server->metrics_arr[j].gauge_arr[i],
+					memory_order_relaxed
+				)
+			);
+	
+	for(int i = 0; i < LATENCY_CNT; i++)
+		write_latency(file, stats_server, i);
+	
+	fclose(file);
+}
+
+static int run_stats_server(void *data)
+{
+	stats_server_t *stats_server = data;
+	
+	while(!atomic_load(&stats_server->is_quitting))
+	{
+		struct pollfd pollfd_arr[2] =
+		{
+			{.fd = stats_server->listen_fd, .events = POLLIN},
+			{.fd = stats_server->wake_fd_arr[0], .events = POLLIN}
+		};
+		
+		if(poll(pollfd_arr, 2, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			print_errno_err("poll");
+			break;
+		}
+		
+		if(pollfd_arr[0].revents == 0) continue;
+		
+		int fd = accept(stats_server->listen_fd, NULL, NULL);
+		
+		if(fd < 0)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				print_errno_err("accept");
+			
+			continue;
+		}
+		
+		write_stats(stats_server, fd);
+	}
+	
+	return 0;
+}
+
+static bool open_stats_socket(stats_server_t *stats_server)
+{
+	struct sockaddr_un addr;
+	
+	if(strlen(stats_server->path) >= sizeof(addr.sun_path))
+	{
+		print_err("open_stats_socket", "Socket path is too long");
+		return false;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, stats_server->path);
+	
+	stats_server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	
+	if(stats_server->listen_fd < 0)
+	{
+		print_errno_err("socket");
+		return false;
+	}
+	
+	/* A socket file left behind by an earlier run would fail the bind */
+	unlink(stats_server->path);
+	
+	if(bind(stats_server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+	{
+		print_errno_err("bind");
+		return false;
+	}
+	
+	/* Only the server's own user gets to read the stats */
+	if(chmod(stats_server->path, 0600) != 0)
+	{
+		print_errno_err("chmod");
+		return false;
+	}
+	
+	if(listen(stats_server->listen_fd, STATS_BACKLOG) != 0)
+	{
+		print_errno_err("listen");
+		return false;
+	}
+	
+	return set_nonblocking(stats_server->listen_fd);
+}
+
+void init_metrics(metrics_t *metrics)
+{
+	for(int i = 0; i < COUNTER_CNT; i++)
+		atomic_init(&metrics->counter_arr[i], 0);
+	
+	for(int i = 0; i < GAUGE_CNT; i++)
+		atomic_init(&metrics->gauge_arr[i], 0);
+	
+	for(int i = 0; i < LATENCY_CNT; i++)
+	{
+		metrics_histogram_t *histogram = &metrics->latency_arr[i];
+		
+		atomic_init(&histogram->cnt, 0);
+		atomic_init(&histogram->sum, 0);
+		atomic_init(&histogram->max, 0);
+		
+		for(int j = 0; j < HISTOGRAM_BUCKET_CNT; j++)
+			atomic_init(&histogram->bucket_arr[j], 0);
+	}
+}
+
+void record_latency(metrics_t *metrics, latency_t latency, uint64_t ns)
+{
+	metrics_histogram_t *histogram = &metrics->latency_arr[latency];
+	atomic_ullong *bucket =
+		&histogram->bucket_arr[get_histogram_bucket_index(ns)];
+	
+	store_relaxed(&histogram->cnt, load_relaxed(&histogram->cnt) + 1);
+	store_relaxed(&histogram->sum, load_relaxed(&histogram->sum) + ns);
+	store_relaxed(bucket, load_relaxed(bucket) + 1);
+	
+	if(ns > load_relaxed(&histogram->max)) store_relaxed(&histogram->max, ns);
+}
+
+uint64_t get_elapsed_ns(Uint64 start_counter, Uint64 end_counter)
+{
+	Uint64 counter_freq = SDL_GetPerformanceFrequency();
+	
+	/* The counter ticks in nanoseconds on most platforms, which skips the
+	arithmetic */
+	if(counter_freq == 1000000000) return end_counter - start_counter;
+	
+	return (end_counter - start_counter) * 1000000000.0 / counter_freq;
+}
+
+bool init_stats_server
+(
+	stats_server_t *stats_server,
+	const char *path,
+	metrics_t *metrics_arr,
+	int metrics_cnt
+)
+{
+	atomic_init(&stats_server->is_quitting, false);
+	stats_server->listen_fd = -1;
+	stats_server->metrics_cnt = metrics_cnt;
+	stats_server->wake_fd_arr[0] = -1;
+	stats_server->wake_fd_arr[1] = -1;
+	stats_server->start_counter = SDL_GetPerformanceCounter();
+	stats_server->path = strdup(path);
+	stats_server->metrics_arr = metrics_arr;
+	stats_server->thread = NULL;
+	
+	bool init_success = stats_server->path != NULL;
+	
+	if(!init_success)
+		print_err("init_stats_server", "Could not allocate the path");
+	
+	if(init_success) init_success = open_stats_socket(stats_server);
+	
+	if(init_success) init_success = open_wake_pipe(stats_server->wake_fd_arr);
+	
+	if(init_success)
+	{
+		stats_server->thread = SDL_CreateThread
+		(
+			run_stats_server,
+			"susurrc-stats",
+			stats_server
+		);
+		
+		if(stats_server->thread == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			init_success = false;
+		}
+	}
+	
+	if(init_success)
+		printf("Serving stats on %s\n", path);
+	else
+		terminate_stats_server(stats_server);
+	
+	return init_success;
+}
+
+void terminate_stats_server(stats_server_t *stats_server)
+{
+	if(stats_server->thread != NULL)
+	{
+		atomic_store(&stats_server->is_quitting, true);
+		signal_wake_pipe(stats_server->wake_fd_arr[1]);
+		SDL_WaitThread(stats_server->thread, NULL);
+		stats_server->thread = NULL;
+	}
+	
+	if(stats_server->listen_fd >= 0) unlink(stats_server->path);
+	
+	close_socket(&stats_server->listen_fd);
+	close_socket(&stats_server->wake_fd_arr[0]);
+	close_socket(&stats_server->wake_fd_arr[1]);
+	free(stats_server->path);
+	stats_server->path = NULL;
+}
@@ -0,0 +1,156 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "SDL2/SDL.h"
+#include "src/histogram.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* Totals that only ever go up */
+typedef enum counter_t
+{
+	COUNTER_CONN_OPENED,
+	COUNTER_CONN_CLOSED,
+	COUNTER_CONN_REJECTED,
+	COUNTER_MSG_IN,
+	COUNTER_MSG_OUT,
+	COUNTER_BYTE_IN,
+	COUNTER_BYTE_OUT,
+	COUNTER_BROADCAST,
+	COUNTER_CRYPTO_FAIL,
+	COUNTER_SEND_CALL,
+	COUNTER_QUEUE_OVERFLOW,
+	COUNTER_COMPRESS_IN_BYTE,
+	COUNTER_COMPRESS_OUT_BYTE,
+	COUNTER_COMPRESS_SKIP,
+	COUNTER_COMPRESS_NS,
+	COUNTER_DECOMPRESS_NS,
+	COUNTER_PRESENCE_DROP,
+	COUNTER_BROADCAST_HOLD,
+	COUNTER_BROADCAST_DROP,
+	COUNTER_CNT
+}
+counter_t;
+
+/* Current levels */
+typedef enum gauge_t
+{
+	GAUGE_CLIENT,
+	GAUGE_QUEUED_BYTE,
+	GAUGE_WRITE_BLOCKED_CLIENT,
+	GAUGE_CNT
+}
+gauge_t;
+
+/* Latencies, in nanoseconds */
+typedef enum latency_t
+{
+	LATENCY_FANOUT,
+	LATENCY_LOOP,
+	LATENCY_CNT
+}
+latency_t;
+
+/* Struct for a histogram that one thread records into while another reads
+it.  Same buckets as histogram_t */
+typedef struct metrics_histogram_t
+{
+	atomic_ullong cnt;
+	atomic_ullong sum;
+	atomic_ullong max;
+	atomic_ullong bucket_arr[HISTOGRAM_BUCKET_CNT];
+}
+metrics_histogram_t;
+
+/* Struct for one thread's metrics.  Only the owning thread writes, so
+updates are plain relaxed loads and stores (no locked instructions) and the
+stats thread reads whatever was last stored */
+typedef struct metrics_t
+{
+	atomic_ullong counter_arr[COUNTER_CNT];
+	atomic_llong gauge_arr[GAUGE_CNT];
+	metrics_histogram_t latency_arr[LATENCY_CNT];
+}
+metrics_t;
+
+/* Struct for the thread answering on the stats socket.  Every connection
+gets one snapshot of all the metrics and is closed */
+typedef struct stats_server_t
+{
+	atomic_bool is_quitting;
+	int listen_fd;
+	int metrics_cnt;
+	int wake_fd_arr[2];
+	Uint64 start_counter;
+	char *path;
+	metrics_t *metrics_arr;
+	SDL_Thread *thread;
+}
+stats_server_t;
+
+static inline void add_counter
+(
+	metrics_t *metrics,
+	counter_t counter,
+	unsigned long long n
+)
+{
+	atomic_ullong *value = &metrics->counter_arr[counter];
+	
+	atomic_store_explicit
+	(
+		value,
+		atomic_load_explicit(value, memory_order_relaxed) + n,
+		memory_order_relaxed
+	);
+}
+
+static inline void add_gauge(metrics_t *metrics, gauge_t gauge, long long n)
+{
+	atomic_llong *value = &metrics->gauge_arr[gauge];
+	
+	atomic_store_explicit
+	(
+		value,
+		atomic_load_explicit(value, memory_order_relaxed) + n,
+		memory_order_relaxed
+	);
+}
+
+void init_metrics(metrics_t *metrics);
+void record_latency(metrics_t *metrics, latency_t latency, uint64_t ns);
+uint64_t get_elapsed_ns(Uint64 start_counter, Uint64 end_counter);
+
+bool init_stats_server
+(
+	stats_server_t *stats_server,
+	const char *path,
+	metrics_t *metrics_arr,
+	int metrics_cnt
+);
+
+void terminate_stats_server(stats_server_t *stats_server);
+
+#endif /* METRICS_H */
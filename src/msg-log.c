@@ -0,0 +1,1302 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "dirent.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "src/err.h"
+#include "src/msg-log.h"
+#include "src/net.h"
+#include "src/ring.h"
+#include "src/seen.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/file.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+/* Segments are preallocated at this size and mapped whole */
+static const size_t LOG_SEGMENT_LEN = 16 * 1024 * 1024;
+
+static const int LOG_INDEX_INTERVAL = 64;
+static const Uint32 LOG_SYNC_INTERVAL = 1000;
+static const int INITIAL_INDEX_CAP = 64;
+static const int INITIAL_SEGMENT_CAP = 8;
+static const int INITIAL_CHANNEL_BUCKET_CNT = 16;
+static const size_t INITIAL_SNAPSHOT_LEN = 4096;
+static const int MAX_PATH_LEN = 4096;
+
+/* Records waiting for the writer.  A power of two */
+static const size_t LOG_INBOX_CAP = 16384;
+
+/* Struct for the header in front of every record on disk.  The channel
+name follows it, and then the message.  Records start on 8-byte boundaries
+so headers can be read in place.  A zero msg_len (the preallocated tail) or
+a bad checksum ends a segment.  A relayed message keeps the node id and
+sequence number it started with, and this server's own have an origin_id
+of zero */
+typedef struct log_record_header_t
+{
+	uint32_t msg_len;
+	uint32_t checksum;
+	uint64_t seq;
+	uint64_t origin_id;
+	uint64_t origin_seq;
+	uint32_t channel_len;
+	uint32_t unused;
+}
+log_record_header_t;
+
+/* Struct for a message on its way from a shard to the writer */
+typedef struct log_record_t
+{
+	uint64_t origin_id;
+	uint64_t origin_seq;
+	int channel_len;
+	char channel_name[MAX_CHANNEL_NAME_LEN];
+	int msg_len;
+	char msg[];
+}
+log_record_t;
+
+/* Struct for records copied out of the log for a reader.  They keep their
+on-disk layout, back to back */
+typedef struct log_snapshot_t
+{
+	size_t len;
+	size_t cap;
+	unsigned char *buf;
+}
+log_snapshot_t;
+
+static size_t get_record_len(int channel_len, int msg_len)
+{
+	size_t len = sizeof(log_record_header_t) + channel_len + msg_len;
+	
+	return (len + 7) & ~(size_t)7;
+}
+
+static uint32_t hash_uint64(uint32_t hash, uint64_t value)
+{
+	for(int i = 0; i < 8; i++)
+		hash = (hash ^ ((value >> (i * 8)) & 0xff)) * 16777619u;
+	
+	return hash;
+}
+
+static uint32_t checksum_record
+(
+	const log_record_header_t *header,
+	const unsigned char *body
+)
+{
+	/* FNV-1a over the sequence numbers, the origin, the channel and the
+	message.  Enough to notice a record that was only partly written before
+	a crash */
+	uint32_t hash = 2166136261u;
+	
+	hash = hash_uint64(hash, header->seq);
+	hash = hash_uint64(hash, header->origin_id);
+	hash = hash_uint64(hash, header->origin_seq);
+	
+	for(uint32_t i = 0; i < header->channel_len + header->msg_len; i++)
+		hash = (hash ^ body[i]) * 16777619u;
+	
+	return hash;
+}
+
+static uint32_t hash_channel_name(const char *name, int name_len)
+{
+	uint32_t hash = 2166136261u;
+	
+	for(int i = 0; i < name_len; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	
+	return hash;
+}
+
+static log_channel_t **find_log_channel_link
+(
+	msg_log_t *msg_log,
+	const char *name,
+	int name_len
+)
+{
+	uint32_t bucket =
+		hash_channel_name(name, name_len) & (msg_log->channel_bucket_cnt - 1);
+	
+	log_channel_t **link = &msg_log->channel_bucket_arr[bucket];
+	
+	while
+	(
+		*link != NULL &&
+		(
+			(int)strlen((*link)->name) != name_len ||
+			memcmp((*link)->name, name, name_len) != 0
+		)
+	)
+		link = &(*link)->next;
+	
+	return link;
+}
+
+static void grow_log_channel_table(msg_log_t *msg_log)
+{
+	int new_bucket_cnt = msg_log->channel_bucket_cnt * 2;
+	log_channel_t **new_bucket_arr = calloc(new_bucket_cnt, sizeof(void *));
+	
+	/* A table that cannot grow just gets longer chains */
+	if(new_bucket_arr == NULL) return;
+	
+	for(int i = 0; i < msg_log->channel_bucket_cnt; i++)
+	{
+		log_channel_t *channel = msg_log->channel_bucket_arr[i];
+		
+		while(channel != NULL)
+		{
+			log_channel_t *next = channel->next;
+			
+			uint32_t bucket = hash_channel_name
+			(
+				channel->name,
+				strlen(channel->name)
+			) & (new_bucket_cnt - 1);
+			
+			channel->next = new_bucket_arr[bucket];
+			new_bucket_arr[bucket] = channel;
+			channel = next;
+		}
+	}
+	
+	free(msg_log->channel_bucket_arr);
+	msg_log->channel_bucket_arr = new_bucket_arr;
+	msg_log->channel_bucket_cnt = new_bucket_cnt;
+}
+
+static void add_recent_entry
+(
+	msg_log_t *msg_log,
+	const char *name,
+	int name_len,
+	uint64_t seq,
+	size_t offset
+)
+{
+	if(msg_log->recent_cap == 0) return;
+	
+	log_channel_t **link = find_log_channel_link(msg_log, name, name_len);
+	log_channel_t *channel = *link;
+	
+	if(channel == NULL)
+	{
+		channel = malloc(sizeof(*channel));
+		
+		if(channel != NULL)
+			channel->recent_arr =
+				malloc(msg_log->recent_cap * sizeof(log_index_entry_t));
+		
+		/* The record is still logged.  Only this channel's replays miss
+		it */
+		if(channel == NULL || channel->recent_arr == NULL)
+		{
+			print_err("add_recent_entry", "Could not add the channel");
+			free(channel);
+			return;
+		}
+		
+		memcpy(channel->name, name, name_len);
+		channel->name[name_len] = '\0';
+		channel->recent_cnt = 0;
+		channel->recent_start = 0;
+		channel->next = NULL;
+		*link = channel;
+		msg_log->channel_cnt += 1;
+		
+		if(msg_log->channel_cnt > msg_log->channel_bucket_cnt)
+			grow_log_channel_table(msg_log);
+	}
+	
+	/* A full ring overwrites its oldest entry */
+	int index = channel->recent_start + channel->recent_cnt;
+	
+	if(channel->recent_cnt < msg_log->recent_cap)
+		channel->recent_cnt += 1;
+	else
+		channel->recent_start += 1;
+	
+	channel->recent_start %= msg_log->recent_cap;
+	index %= msg_log->recent_cap;
+	channel->recent_arr[index].seq = seq;
+	channel->recent_arr[index].offset = offset;
+}
+
+static void drop_stale_log_channels(msg_log_t *msg_log, uint64_t first_seq)
+{
+	/* A channel whose latest record went with a deleted segment has nothing
+	left to replay */
+	for(int i = 0; i < msg_log->channel_bucket_cnt; i++)
+	{
+		log_channel_t **link = &msg_log->channel_bucket_arr[i];
+		
+		while(*link != NULL)
+		{
+			log_channel_t *channel = *link;
+			
+			int last_index =
+				(channel->recent_start + channel->recent_cnt - 1) %
+				msg_log->recent_cap;
+			
+			if(channel->recent_arr[last_index].seq >= first_seq)
+			{
+				link = &channel->next;
+				continue;
+			}
+			
+			*link = channel->next;
+			free(channel->recent_arr);
+			free(channel);
+			msg_log->channel_cnt -= 1;
+		}
+	}
+}
+
+static void terminate_log_channels(msg_log_t *msg_log)
+{
+	if(msg_log->channel_bucket_arr == NULL) return;
+	
+	/* Pretend every record is gone */
+	if(msg_log->recent_cap > 0) drop_stale_log_channels(msg_log, UINT64_MAX);
+	
+	free(msg_log->channel_bucket_arr);
+	msg_log->channel_bucket_arr = NULL;
+}
+
+static bool add_index_entry(log_segment_t *segment, uint64_t seq, size_t offset)
+{
+	if(segment->index_cnt == segment->index_cap)
+	{
+		int new_index_cap =
+			segment->index_cap ? segment->index_cap * 2 : INITIAL_INDEX_CAP;
+		
+		log_index_entry_t *new_index_arr = realloc
+		(
+			segment->index_arr,
+			new_index_cap * sizeof(log_index_entry_t)
+		);
+		
+		if(new_index_arr == NULL)
+		{
+			print_err("add_index_entry", "Could not grow the index");
+			return false;
+		}
+		
+		segment->index_arr = new_index_arr;
+		segment->index_cap = new_index_cap;
+	}
+	
+	segment->index_arr[segment->index_cnt].seq = seq;
+	segment->index_arr[segment->index_cnt].offset = offset;
+	segment->index_cnt += 1;
+	
+	return true;
+}
+
+static void recover_segment(msg_log_t *msg_log, log_segment_t *segment)
+{
+	uint64_t expected_seq = segment->base_seq;
+	size_t offset = 0;
+	
+	/* Rebuild the length, the sparse index and the channels' latest records
+	by walking the records.  The first one that does not check out marks the
+	end of the segment */
+	while(offset + sizeof(log_record_header_t) <= segment->map_len)
+	{
+		log_record_header_t *header =
+			(log_record_header_t *)(segment->map + offset);
+		
+		int msg_len = header->msg_len;
+		int channel_len = header->channel_len;
+		size_t record_len = get_record_len(channel_len, msg_len);
+		const unsigned char *body = (const unsigned char *)(header + 1);
+		
+		if
+		(
+			msg_len == 0 ||
+			msg_len > MAX_MSG_LEN ||
+			channel_len > MAX_CHANNEL_NAME_LEN ||
+			offset + record_len > segment->map_len ||
+			header->seq != expected_seq ||
+			header->checksum != checksum_record(header, body)
+		)
+			break;
+		
+		if((expected_seq - segment->base_seq) % LOG_INDEX_INTERVAL == 0)
+			if(!add_index_entry(segment, expected_seq, offset)) break;
+		
+		add_recent_entry
+		(
+			msg_log,
+			(const char *)body,
+			channel_len,
+			expected_seq,
+			offset
+		);
+		
+		/* So a relayed message that turns up again after a restart is still
+		known */
+		if(header->origin_id != 0)
+		{
+			mark_msg_seen
+			(
+				&msg_log->seen_table,
+				header->origin_id,
+				header->origin_seq
+			);
+		}
+		
+		offset += record_len;
+		expected_seq += 1;
+	}
+	
+	segment->len = offset;
+	segment->end_seq = expected_seq;
+}
+
+static void get_segment_path
+(
+	const msg_log_t *msg_log,
+	uint64_t base_seq,
+	char path[MAX_PATH_LEN]
+)
+{
+	snprintf
+	(
+		path,
+		MAX_PATH_LEN,
+		"%s/%020llu.seg",
+		msg_log->dir,
+		(unsigned long long)base_seq
+	);
+}
+
+static bool open_segment
+(
+	msg_log_t *msg_log,
+	log_segment_t *segment,
+	uint64_t base_seq,
+	bool is_new
+)
+{
+	char path[MAX_PATH_LEN];
+	struct stat file_stat;
+	
+	segment->base_seq = base_seq;
+	segment->end_seq = base_seq;
+	segment->index_cnt = 0;
+	segment->index_cap = 0;
+	segment->len = 0;
+	segment->index_arr = NULL;
+	
+	get_segment_path(msg_log, base_seq, path);
+	
+	int fd = msg_log->is_read_only ?
+		open(path, O_RDONLY) :
+		open(path, O_RDWR | O_CREAT, 0600);
+	
+	if(fd < 0)
+	{
+		print_errno_err("open");
+		return false;
+	}
+	
+	/* New segments are sized up front so appends are plain stores into the
+	mapping */
+	if(is_new && ftruncate(fd, LOG_SEGMENT_LEN) != 0)
+	{
+		print_errno_err("ftruncate");
+		close(fd);
+		return false;
+	}
+	
+	if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		print_err("open_segment", "Could not size the segment");
+		close(fd);
+		return false;
+	}
+	
+	segment->map_len = file_stat.st_size;
+	
+	segment->map = mmap
+	(
+		NULL,
+		segment->map_len,
+		msg_log->is_read_only ? PROT_READ : PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		fd,
+		0
+	);
+	
+	/* The mapping keeps the file open on its own, and msync needs no
+	descriptor */
+	close(fd);
+	
+	if(segment->map == MAP_FAILED)
+	{
+		print_errno_err("mmap");
+		return false;
+	}
+	
+	if(!is_new) recover_segment(msg_log, segment);
+	
+	return true;
+}
+
+static bool add_segment(msg_log_t *msg_log, log_segment_t *segment)
+{
+	bool add_success = true;
+	
+	SDL_LockMutex(msg_log->mutex);
+	
+	if(msg_log->segment_cnt == msg_log->segment_cap)
+	{
+		int new_segment_cap = msg_log->segment_cap * 2;
+		
+		log_segment_t *new_segment_arr = realloc
+		(
+			msg_log->segment_arr,
+			new_segment_cap * sizeof(log_segment_t)
+		);
+		
+		if(new_segment_arr == NULL)
+		{
+			add_success = false;
+		}
+		else
+		{
+			msg_log->segment_arr = new_segment_arr;
+			msg_log->segment_cap = new_segment_cap;
+		}
+	}
+	
+	if(add_success)
+	{
+		msg_log->segment_arr[msg_log->segment_cnt] = *segment;
+		msg_log->segment_cnt += 1;
+	}
+	
+	SDL_UnlockMutex(msg_log->mutex);
+	
+	if(!add_success)
+	{
+		print_err("add_segment", "Could not grow the segment list");
+		munmap(segment->map, segment->map_len);
+		free(segment->index_arr);
+	}
+	
+	return add_success;
+}
+
+static bool open_new_segment(msg_log_t *msg_log, uint64_t base_seq)
+{
+	log_segment_t segment;
+	
+	/* Opened and sized before the mutex is taken, so readers never wait on
+	the filesystem */
+	return
+		open_segment(msg_log, &segment, base_seq, true) &&
+		add_segment(msg_log, &segment);
+}
+
+static void drop_old_segments(msg_log_t *msg_log)
+{
+	char path[MAX_PATH_LEN];
+	log_segment_t segment;
+	
+	if(msg_log->max_segment_cnt <= 0) return;
+	
+	/* The oldest segments go first, and the one being written is never among
+	them.  Each leaves the list under the mutex but is unmapped and deleted
+	outside it.  Only the writer changes the list, so it can read the count
+	without the mutex */
+	while(msg_log->segment_cnt > msg_log->max_segment_cnt)
+	{
+		SDL_LockMutex(msg_log->mutex);
+		
+		segment = msg_log->segment_arr[0];
+		msg_log->segment_cnt -= 1;
+		
+		memmove
+		(
+			msg_log->segment_arr,
+			msg_log->segment_arr + 1,
+			msg_log->segment_cnt * sizeof(log_segment_t)
+		);
+		
+		if(msg_log->recent_cap > 0)
+			drop_stale_log_channels(msg_log, msg_log->segment_arr[0].base_seq);
+		
+		SDL_UnlockMutex(msg_log->mutex);
+		
+		munmap(segment.map, segment.map_len);
+		free(segment.index_arr);
+		get_segment_path(msg_log, segment.base_seq, path);
+		
+		if(unlink(path) != 0) print_errno_err("unlink");
+	}
+}
+
+static int compare_base_seqs(const void *a, const void *b)
+{
+	uint64_t base_seq_a = *(const uint64_t *)a;
+	uint64_t base_seq_b = *(const uint64_t *)b;
+	
+	return (base_seq_a > base_seq_b) - (base_seq_a < base_seq_b);
+}
+
+static bool load_segments(msg_log_t *msg_log)
+{
+	int base_seq_cnt = 0;
+	int base_seq_cap = INITIAL_SEGMENT_CAP;
+	uint64_t *base_seq_arr = malloc(base_seq_cap * sizeof(uint64_t));
+	struct dirent *entry;
+	
+	DIR *dir = opendir(msg_log->dir);
+	
+	if(dir == NULL || base_seq_arr == NULL)
+	{
+		print_errno_err("opendir");
+		
+		if(dir != NULL) closedir(dir);
+		
+		free(base_seq_arr);
+		return false;
+	}
+	
+	/* Segment files are named after the first sequence number they hold */
+	while((entry = readdir(dir)) != NULL)
+	{
+		unsigned long long base_seq;
+		char suffix[8];
+		
+		if(sscanf(entry->d_name, "%20llu.%7s", &base_seq, suffix) != 2)
+			continue;
+		
+		if(strcmp(suffix, "seg") != 0) continue;
+		
+		if(base_seq_cnt == base_seq_cap)
+		{
+			uint64_t *new_base_seq_arr = realloc
+			(
+				base_seq_arr,
+				base_seq_cap * 2 * sizeof(uint64_t)
+			);
+			
+			if(new_base_seq_arr == NULL) break;
+			
+			base_seq_arr = new_base_seq_arr;
+			base_seq_cap *= 2;
+		}
+		
+		base_seq_arr[base_seq_cnt] = base_seq;
+		base_seq_cnt += 1;
+	}
+	
+	closedir(dir);
+	qsort(base_seq_arr, base_seq_cnt, sizeof(uint64_t), compare_base_seqs);
+	
+	bool load_success = true;
+	log_segment_t loaded_segment;
+	
+	for(int i = 0; load_success && i < base_seq_cnt; i++)
+		load_success =
+			open_segment(msg_log, &loaded_segment, base_seq_arr[i], false) &&
+			add_segment(msg_log, &loaded_segment);
+	
+	free(base_seq_arr);
+	
+	if(!load_success) return false;
+	
+	/* A reader takes the log as it finds it */
+	if(msg_log->is_read_only)
+	{
+		if(msg_log->segment_cnt == 0)
+		{
+			print_err("load_segments", "The log is empty");
+			return false;
+		}
+		
+		msg_log->next_seq =
+			msg_log->segment_arr[msg_log->segment_cnt - 1].end_seq;
+		
+		return true;
+	}
+	
+	/* Start the log on first use */
+	if(msg_log->segment_cnt == 0) return open_new_segment(msg_log, 0);
+	
+	/* The limit may have been lowered since the last run */
+	drop_old_segments(msg_log);
+	
+	/* Carry on from the last intact record.  Anything past it is cleared
+	so a torn tail can never be mistaken for records written later */
+	log_segment_t *segment = &msg_log->segment_arr[msg_log->segment_cnt - 1];
+	
+	msg_log->next_seq = segment->end_seq;
+	memset(segment->map + segment->len, 0, segment->map_len - segment->len);
+	msg_log->synced_len = 0;
+	msg_log->is_dirty = true;
+	
+	return true;
+}
+
+static void sync_msg_log(msg_log_t *msg_log)
+{
+	if(!msg_log->is_dirty) return;
+	
+	log_segment_t *segment = &msg_log->segment_arr[msg_log->segment_cnt - 1];
+	
+	/* Only the pages written since the last sync need to go out */
+	size_t page_len = sysconf(_SC_PAGESIZE);
+	size_t start = msg_log->synced_len - msg_log->synced_len % page_len;
+	
+	if
+	(
+		segment->len > start &&
+		msync(segment->map + start, segment->len - start, MS_SYNC) != 0
+	)
+		print_errno_err("msync");
+	
+	msg_log->synced_len = segment->len;
+	msg_log->is_dirty = false;
+	msg_log->sync_ticks = SDL_GetTicks();
+}
+
+static bool rotate_segment(msg_log_t *msg_log)
+{
+	/* The full segment is finished for good.  Make sure it is on disk
+	before moving on */
+	if(msg_log->durability != LOG_DURABILITY_NONE) sync_msg_log(msg_log);
+	
+	if(!open_new_segment(msg_log, msg_log->next_seq)) return false;
+	
+	msg_log->synced_len = 0;
+	drop_old_segments(msg_log);
+	
+	return true;
+}
+
+static void write_record(msg_log_t *msg_log, const log_record_t *record)
+{
+	size_t record_len = get_record_len(record->channel_len, record->msg_len);
+	log_segment_t *segment = &msg_log->segment_arr[msg_log->segment_cnt - 1];
+	
+	/* The federation only delivers a relayed message once, but it forgets
+	origins it has not heard from lately.  The log keeps its own account so
+	an echo that slips through is not written twice */
+	bool is_seen =
+		record->origin_id != 0 &&
+		mark_msg_seen
+		(
+			&msg_log->seen_table,
+			record->origin_id,
+			record->origin_seq
+		);
+	
+	if(is_seen) return;
+	
+	if(segment->len + record_len > segment->map_len)
+	{
+		if(!rotate_segment(msg_log))
+		{
+			print_err("write_record", "Dropping a record");
+			return;
+		}
+		
+		segment = &msg_log->segment_arr[msg_log->segment_cnt - 1];
+	}
+	
+	uint64_t seq = msg_log->next_seq;
+	size_t offset = segment->len;
+	
+	log_record_header_t *header =
+		(log_record_header_t *)(segment->map + offset);
+	
+	unsigned char *body = (unsigned char *)(header + 1);
+	
+	/* Readers stop at len, so the record is written without the mutex.  Any
+	page faults on the fresh pages are the writer's alone */
+	memcpy(body, record->channel_name, record->channel_len);
+	memcpy(body + record->channel_len, record->msg, record->msg_len);
+	header->msg_len = record->msg_len;
+	header->seq = seq;
+	header->origin_id = record->origin_id;
+	header->origin_seq = record->origin_seq;
+	header->channel_len = record->channel_len;
+	header->unused = 0;
+	header->checksum = checksum_record(header, body);
+	
+	/* Publishing it only takes the mutex for a few stores */
+	SDL_LockMutex(msg_log->mutex);
+	
+	if((seq - segment->base_seq) % LOG_INDEX_INTERVAL == 0)
+		add_index_entry(segment, seq, offset);
+	
+	add_recent_entry
+	(
+		msg_log,
+		record->channel_name,
+		record->channel_len,
+		seq,
+		offset
+	);
+	
+	segment->len += record_len;
+	msg_log->next_seq += 1;
+	segment->end_seq = msg_log->next_seq;
+	
+	SDL_UnlockMutex(msg_log->mutex);
+	
+	msg_log->is_dirty = true;
+}
+
+static void drain_log_inbox(msg_log_t *msg_log)
+{
+	log_record_t *record;
+	
+	clear_wake_pipe(msg_log->wake_fd_arr[0]);
+	atomic_store(&msg_log->is_wake_pending, false);
+	
+	while((record = pop_ring(&msg_log->inbox)) != NULL)
+	{
+		write_record(msg_log, record);
+		free(record);
+	}
+}
+
+static int get_sync_timeout(msg_log_t *msg_log)
+{
+	if(msg_log->durability != LOG_DURABILITY_INTERVAL || !msg_log->is_dirty)
+		return -1;
+	
+	Uint32 elapsed = SDL_GetTicks() - msg_log->sync_ticks;
+	
+	return elapsed >= LOG_SYNC_INTERVAL ? 0 : LOG_SYNC_INTERVAL - elapsed;
+}
+
+static int run_msg_log(void *data)
+{
+	msg_log_t *msg_log = data;
+	
+	while(!atomic_load(&msg_log->is_quitting))
+	{
+		struct pollfd pollfd =
+		{
+			.fd = msg_log->wake_fd_arr[0],
+			.events = POLLIN
+		};
+		
+		if(poll(&pollfd, 1, get_sync_timeout(msg_log)) < 0 && errno != EINTR)
+		{
+			print_errno_err("poll");
+			break;
+		}
+		
+		drain_log_inbox(msg_log);
+		
+		/* Batching the syncs is what keeps appends cheap.  Everything
+		written since the last one goes out together */
+		if
+		(
+			msg_log->durability == LOG_DURABILITY_BATCH ||
+			(
+				msg_log->durability == LOG_DURABILITY_INTERVAL &&
+				get_sync_timeout(msg_log) == 0
+			)
+		)
+			sync_msg_log(msg_log);
+	}
+	
+	/* Nothing is lost on a clean shutdown, whatever the durability */
+	drain_log_inbox(msg_log);
+	sync_msg_log(msg_log);
+	
+	return 0;
+}
+
+static bool lock_msg_log(msg_log_t *msg_log)
+{
+	msg_log->lock_fd = open(msg_log->dir, O_RDONLY);
+	
+	if(msg_log->lock_fd < 0)
+	{
+		print_errno_err("open");
+		return false;
+	}
+	
+	/* Readers may share the directory with each other, but never with the
+	writer, which clears the tail and deletes old segments under them */
+	int lock_op = msg_log->is_read_only ? LOCK_SH : LOCK_EX;
+	
+	if(flock(msg_log->lock_fd, lock_op | LOCK_NB) == 0) return true;
+	
+	if(errno == EWOULDBLOCK)
+		print_err("lock_msg_log", "The log is in use by another process");
+	else
+		print_errno_err("flock");
+	
+	close(msg_log->lock_fd);
+	msg_log->lock_fd = -1;
+	
+	return false;
+}
+
+static bool start_msg_log
+(
+	msg_log_t *msg_log,
+	const char *dir,
+	bool is_read_only,
+	log_durability_t durability,
+	int max_segment_cnt,
+	int recent_cap
+)
+{
+	atomic_init(&msg_log->is_quitting, false);
+	atomic_init(&msg_log->is_wake_pending, false);
+	msg_log->is_read_only = is_read_only;
+	msg_log->is_dirty = false;
+	msg_log->lock_fd = -1;
+	msg_log->wake_fd_arr[0] = -1;
+	msg_log->wake_fd_arr[1] = -1;
+	msg_log->segment_cnt = 0;
+	msg_log->segment_cap = INITIAL_SEGMENT_CAP;
+	msg_log->max_segment_cnt = max_segment_cnt;
+	msg_log->recent_cap = recent_cap;
+	msg_log->channel_bucket_cnt = INITIAL_CHANNEL_BUCKET_CNT;
+	msg_log->channel_cnt = 0;
+	msg_log->durability = durability;
+	msg_log->synced_len = 0;
+	msg_log->next_seq = 0;
+	init_seen_table(&msg_log->seen_table);
+	msg_log->sync_ticks = SDL_GetTicks();
+	msg_log->dir = strdup(dir);
+	msg_log->segment_arr = malloc(INITIAL_SEGMENT_CAP * sizeof(log_segment_t));
+	
+	msg_log->channel_bucket_arr =
+		calloc(INITIAL_CHANNEL_BUCKET_CNT, sizeof(log_channel_t *));
+	
+	msg_log->inbox.cell_arr = NULL;
+	msg_log->mutex = SDL_CreateMutex();
+	msg_log->thread = NULL;
+	
+	bool init_success =
+		msg_log->dir != NULL &&
+		msg_log->segment_arr != NULL &&
+		msg_log->channel_bucket_arr != NULL &&
+		msg_log->mutex != NULL;
+	
+	if(!init_success) print_err("init_msg_log", "Could not allocate the log");
+	
+	if
+	(
+		init_success &&
+		!is_read_only &&
+		mkdir(dir, 0700) != 0 &&
+		errno != EEXIST
+	)
+	{
+		print_errno_err("mkdir");
+		init_success = false;
+	}
+	
+	if(init_success) init_success = lock_msg_log(msg_log);
+	
+	if(init_success) init_success = load_segments(msg_log);
+	
+	if(init_success && !is_read_only)
+		init_success = open_wake_pipe(msg_log->wake_fd_arr);
+	
+	if(init_success && !is_read_only)
+		init_success = init_ring(&msg_log->inbox, LOG_INBOX_CAP);
+	
+	if(init_success && !is_read_only)
+	{
+		msg_log->thread = SDL_CreateThread
+		(
+			run_msg_log,
+			"susurrc-log",
+			msg_log
+		);
+		
+		if(msg_log->thread == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			init_success = false;
+		}
+	}
+	
+	if(!init_success) terminate_msg_log(msg_log);
+	
+	return init_success;
+}
+
+bool init_msg_log
+(
+	msg_log_t *msg_log,
+	const char *dir,
+	log_durability_t durability,
+	int max_segment_cnt,
+	int recent_cap
+)
+{
+	if
+	(
+		!start_msg_log
+		(
+			msg_log,
+			dir,
+			false,
+			durability,
+			max_segment_cnt,
+			recent_cap
+		)
+	)
+		return false;
+	
+	printf
+	(
+		"Logging to %s from message %llu\n",
+		dir,
+		(unsigned long long)msg_log->next_seq
+	);
+	
+	return true;
+}
+
+bool init_read_only_msg_log(msg_log_t *msg_log, const char *dir)
+{
+	/* Nothing on disk changes, the tail included, and nothing old is
+	deleted */
+	return start_msg_log(msg_log, dir, true, LOG_DURABILITY_NONE, 0, 0);
+}
+
+void terminate_msg_log(msg_log_t *msg_log)
+{
+	log_record_t *record;
+	
+	/* Let the writer finish what it has first */
+	if(msg_log->thread != NULL)
+	{
+		atomic_store(&msg_log->is_quitting, true);
+		signal_wake_pipe(msg_log->wake_fd_arr[1]);
+		SDL_WaitThread(msg_log->thread, NULL);
+		msg_log->thread = NULL;
+	}
+	
+	if(msg_log->inbox.cell_arr != NULL)
+		while((record = pop_ring(&msg_log->inbox)) != NULL) free(record);
+	
+	for(int i = 0; i < msg_log->segment_cnt; i++)
+	{
+		log_segment_t *segment = &msg_log->segment_arr[i];
+		
+		munmap(segment->map, segment->map_len);
+		free(segment->index_arr);
+	}
+	
+	terminate_log_channels(msg_log);
+	terminate_ring(&msg_log->inbox);
+	close_socket(&msg_log->wake_fd_arr[0]);
+	close_socket(&msg_log->wake_fd_arr[1]);
+	
+	/* Closing the directory lets go of the lock */
+	if(msg_log->lock_fd >= 0) close(msg_log->lock_fd);
+	
+	msg_log->lock_fd = -1;
+	
+	if(msg_log->mutex != NULL) SDL_DestroyMutex(msg_log->mutex);
+	
+	free(msg_log->segment_arr);
+	free(msg_log->dir);
+	msg_log->segment_cnt = 0;
+	msg_log->segment_arr = NULL;
+	msg_log->dir = NULL;
+	msg_log->mutex = NULL;
+}
+
+bool append_msg_log
+(
+	msg_log_t *msg_log,
+	uint64_t origin_id,
+	uint64_t origin_seq,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+)
+{
+	log_record_t *record = malloc(sizeof(*record) + msg_len);
+	
+	if(record == NULL)
+	{
+		print_err("append_msg_log", "Could not allocate the record");
+		return false;
+	}
+	
+	record->origin_id = origin_id;
+	record->origin_seq = origin_seq;
+	record->channel_len = strnlen(channel_name, MAX_CHANNEL_NAME_LEN);
+	memcpy(record->channel_name, channel_name, record->channel_len);
+	record->msg_len = msg_len;
+	memcpy(record->msg, msg, msg_len);
+	
+	/* The message still goes out if the writer is this far behind.  It is
+	only missing from the history */
+	if(!push_ring(&msg_log->inbox, record))
+	{
+		print_err("append_msg_log", "Log inbox is full");
+		free(record);
+		return false;
+	}
+	
+	if(!atomic_exchange(&msg_log->is_wake_pending, true))
+		signal_wake_pipe(msg_log->wake_fd_arr[1]);
+	
+	return true;
+}
+
+static int find_segment(const msg_log_t *msg_log, uint64_t seq)
+{
+	int low = 0;
+	int high = msg_log->segment_cnt - 1;
+	
+	/* Find the last segment starting at or before seq */
+	while(low < high)
+	{
+		int mid = (low + high + 1) / 2;
+		
+		if(msg_log->segment_arr[mid].base_seq <= seq)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	
+	return low;
+}
+
+static bool copy_record
+(
+	log_snapshot_t *snapshot,
+	const log_record_header_t *header
+)
+{
+	size_t record_len = get_record_len(header->channel_len, header->msg_len);
+	
+	if(snapshot->len + record_len > snapshot->cap)
+	{
+		size_t new_cap = snapshot->cap ? snapshot->cap : INITIAL_SNAPSHOT_LEN;
+		
+		while(new_cap < snapshot->len + record_len) new_cap *= 2;
+		
+		unsigned char *new_buf = realloc(snapshot->buf, new_cap);
+		
+		if(new_buf == NULL)
+		{
+			print_err("copy_record", "Could not grow the snapshot");
+			return false;
+		}
+		
+		snapshot->buf = new_buf;
+		snapshot->cap = new_cap;
+	}
+	
+	memcpy(snapshot->buf + snapshot->len, header, record_len);
+	snapshot->len += record_len;
+	
+	return true;
+}
+
+static void copy_segments
+(
+	msg_log_t *msg_log,
+	uint64_t first_seq,
+	int max_cnt,
+	log_snapshot_t *snapshot
+)
+{
+	int low = find_segment(msg_log, first_seq);
+	int copy_cnt = 0;
+	
+	for(int i = low; i < msg_log->segment_cnt; i++)
+	{
+		log_segment_t *segment = &msg_log->segment_arr[i];
+		size_t offset = 0;
+		
+		/* The sparse index gets within LOG_INDEX_INTERVAL records of
+		first_seq.  The rest is a short walk */
+		if(i == low && segment->index_cnt > 0)
+		{
+			int index_low = 0;
+			int index_high = segment->index_cnt - 1;
+			
+			while(index_low < index_high)
+			{
+				int mid = (index_low + index_high + 1) / 2;
+				
+				if(segment->index_arr[mid].seq <= first_seq)
+					index_low = mid;
+				else
+					index_high = mid - 1;
+			}
+			
+			offset = segment->index_arr[index_low].offset;
+		}
+		
+		while(offset < segment->len)
+		{
+			log_record_header_t *header =
+				(log_record_header_t *)(segment->map + offset);
+			
+			offset += get_record_len(header->channel_len, header->msg_len);
+			
+			if(header->seq < first_seq) continue;
+			
+			if(!copy_record(snapshot, header)) return;
+			
+			copy_cnt += 1;
+			
+			if(copy_cnt == max_cnt) return;
+		}
+	}
+}
+
+static int read_snapshot
+(
+	log_snapshot_t *snapshot,
+	msg_log_reader_t reader,
+	void *data
+)
+{
+	size_t offset = 0;
+	int read_cnt = 0;
+	
+	/* The copy is the reader's alone, so it can seal and queue at its own
+	pace while the writer carries on */
+	while(offset < snapshot->len)
+	{
+		log_record_header_t *header =
+			(log_record_header_t *)(snapshot->buf + offset);
+		
+		const char *msg =
+			(const char *)(header + 1) + header->channel_len;
+		
+		offset += get_record_len(header->channel_len, header->msg_len);
+		read_cnt += 1;
+		
+		if(!reader(data, msg, header->msg_len)) break;
+	}
+	
+	free(snapshot->buf);
+	
+	return read_cnt;
+}
+
+int read_recent_msg_log
+(
+	msg_log_t *msg_log,
+	int cnt,
+	msg_log_reader_t reader,
+	void *data
+)
+{
+	log_snapshot_t snapshot = {.len = 0, .cap = 0, .buf = NULL};
+	
+	if(cnt <= 0) return 0;
+	
+	SDL_LockMutex(msg_log->mutex);
+	
+	uint64_t first_seq =
+		msg_log->next_seq > (uint64_t)cnt ? msg_log->next_seq - cnt : 0;
+	
+	copy_segments(msg_log, first_seq, cnt, &snapshot);
+	SDL_UnlockMutex(msg_log->mutex);
+	
+	return read_snapshot(&snapshot, reader, data);
+}
+
+int read_channel_msg_log
+(
+	msg_log_t *msg_log,
+	const char *channel_name,
+	int cnt,
+	msg_log_reader_t reader,
+	void *data
+)
+{
+	log_snapshot_t snapshot = {.len = 0, .cap = 0, .buf = NULL};
+	
+	if(cnt <= 0 || msg_log->recent_cap == 0) return 0;
+	
+	SDL_LockMutex(msg_log->mutex);
+	
+	log_channel_t *channel = *find_log_channel_link
+	(
+		msg_log,
+		channel_name,
+		strnlen(channel_name, MAX_CHANNEL_NAME_LEN)
+	);
+	
+	/* The channel's own latest records, however much other traffic came
+	in between.  Entries older than the oldest segment went with it */
+	if(channel != NULL)
+	{
+		if(cnt > channel->recent_cnt) cnt = channel->recent_cnt;
+		
+		for(int i = channel->recent_cnt - cnt; i < channel->recent_cnt; i++)
+		{
+			log_index_entry_t *entry = &channel->recent_arr
+			[
+				(channel->recent_start + i) % msg_log->recent_cap
+			];
+			
+			if(entry->seq < msg_log->segment_arr[0].base_seq) continue;
+			
+			log_segment_t *segment =
+				&msg_log->segment_arr[find_segment(msg_log, entry->seq)];
+			
+			const log_record_header_t *header =
+				(const log_record_header_t *)(segment->map + entry->offset);
+			
+			if(!copy_record(&snapshot, header)) break;
+		}
+	}
+	
+	SDL_UnlockMutex(msg_log->mutex);
+	
+	return read_snapshot(&snapshot, reader, data);
+}
@@ -0,0 +1,167 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef MSG_LOG_H
+#define MSG_LOG_H
+
+#include "SDL2/SDL.h"
+#include "src/net.h"
+#include "src/ring.h"
+#include "src/seen.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+/* How hard the log tries to survive a crash.  NONE leaves writing back to
+the kernel, INTERVAL syncs at most once per LOG_SYNC_INTERVAL and BATCH
+syncs after every batch the writer drains */
+typedef enum log_durability_t
+{
+	LOG_DURABILITY_NONE = 0,
+	LOG_DURABILITY_INTERVAL = 1,
+	LOG_DURABILITY_BATCH = 2
+}
+log_durability_t;
+
+/* Struct for one entry of a segment's sparse index.  Every
+LOG_INDEX_INTERVAL-th record gets one.  Channels point at their latest
+records the same way */
+typedef struct log_index_entry_t
+{
+	uint64_t seq;
+	size_t offset;
+}
+log_index_entry_t;
+
+/* Struct for one segment file, mapped whole.  The file is closed as soon
+as it is mapped, so segments cost no descriptors.  len covers the records
+readers may see, and end_seq follows the last of them */
+typedef struct log_segment_t
+{
+	uint64_t base_seq;
+	uint64_t end_seq;
+	int index_cnt;
+	int index_cap;
+	size_t len;
+	size_t map_len;
+	log_index_entry_t *index_arr;
+	unsigned char *map;
+}
+log_segment_t;
+
+/* Struct for the latest records of one channel, a ring of the log's
+recent_cap entries starting at recent_start.  Chained by name in the log's
+channel table */
+typedef struct log_channel_t
+{
+	char name[MAX_CHANNEL_NAME_LEN + 1];
+	int recent_cnt;
+	int recent_start;
+	log_index_entry_t *recent_arr;
+	struct log_channel_t *next;
+}
+log_channel_t;
+
+/* Struct for the append-only log of room traffic.  Shards hand records to
+the writer thread through the inbox, so appending never touches the disk
+on their side.  The writer copies a record into the mapping past len and
+then takes the mutex only to publish it, so readers never wait on its page
+faults.  Readers copy what they need out under the mutex and work on the
+copy.  Once there are more than max_segment_cnt segments (zero for no
+limit) the oldest are deleted.  Each channel remembers where its latest
+recent_cap records are (none when recent_cap is zero).  seen_table holds
+the origins of the relayed records, which only the writer touches.  A log
+opened read-only maps its segments read-only and has no writer.  lock_fd
+holds an advisory lock on the directory, exclusive for a writer and shared
+for readers */
+typedef struct msg_log_t
+{
+	atomic_bool is_quitting;
+	atomic_bool is_wake_pending;
+	bool is_read_only;
+	bool is_dirty;
+	int lock_fd;
+	int wake_fd_arr[2];
+	int segment_cnt;
+	int segment_cap;
+	int max_segment_cnt;
+	int recent_cap;
+	int channel_bucket_cnt;
+	int channel_cnt;
+	log_durability_t durability;
+	size_t synced_len;
+	uint64_t next_seq;
+	Uint32 sync_ticks;
+	seen_table_t seen_table;
+	char *dir;
+	log_segment_t *segment_arr;
+	log_channel_t **channel_bucket_arr;
+	ring_t inbox;
+	SDL_mutex *mutex;
+	SDL_Thread *thread;
+}
+msg_log_t;
+
+/* Called for each replayed message in order.  Returning false stops the
+replay */
+typedef bool (*msg_log_reader_t)(void *data, const char *msg, int msg_len);
+
+bool init_msg_log
+(
+	msg_log_t *msg_log,
+	const char *dir,
+	log_durability_t durability,
+	int max_segment_cnt,
+	int recent_cap
+);
+
+bool init_read_only_msg_log(msg_log_t *msg_log, const char *dir);
+void terminate_msg_log(msg_log_t *msg_log);
+
+bool append_msg_log
+(
+	msg_log_t *msg_log,
+	uint64_t origin_id,
+	uint64_t origin_seq,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+);
+
+int read_recent_msg_log
+(
+	msg_log_t *msg_log,
+	int cnt,
+	msg_log_reader_t reader,
+	void *data
+);
+
+int read_channel_msg_log
+(
+	msg_log_t *msg_log,
+	const char *channel_name,
+	int cnt,
+	msg_log_reader_t reader,
+	void *data
+);
+
+#endif /* MSG_LOG_H */
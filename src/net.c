@@ -19,284 +19,984 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
 #include "SDL2/SDL_net.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "netdb.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "poll.h"
 #include "src/err.h"
 #include "src/net.h"
-#include "src/susurrc.h"
 #include "stdbool.h"
+#include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "sys/socket.h"
+#include "unistd.h"
 
-bool setup_server_connection
+/* How long (in milliseconds) each of a host's addresses gets to accept the
+connection */
+static const int CONNECT_TIMEOUT = 10000;
+
+static bool connect_with_timeout
 (
-	IPaddress *server_ip,
-	TCPsocket *server_socket,
-	const char *hostname,
-	int port
+	int fd,
+	const struct sockaddr *addr,
+	socklen_t addr_len
 )
 {
-	bool setup_success = true; 
+	int flags = fcntl(fd, F_GETFL, 0);
+	int connect_err = 0;
+	socklen_t err_len = sizeof(connect_err);
+	struct pollfd pollfd = {.fd = fd, .events = POLLOUT};
+	
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) return false;
 	
-	/* Attempt to determine a remote host IP given a hostname OR create a
-	server given a NULL hostname */
-	if(SDLNet_ResolveHost(server_ip, hostname, port) != 0)
+	/* Connecting in the background lets an address that never answers time
+	out instead of holding the caller for minutes */
+	if(connect(fd, addr, addr_len) != 0)
 	{
-		print_err("SDLNet_ResolveHost", "Could not resolve the host");
-		setup_success = false;
+		if(errno != EINPROGRESS) return false;
+		
+		if(poll(&pollfd, 1, CONNECT_TIMEOUT) <= 0) return false;
+		
+		if
+		(
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_err, &err_len) != 0 ||
+			connect_err != 0
+		)
+			return false;
 	}
 	
-	*server_socket = NULL;
+	/* Frames are read and written whole from here on */
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+bool setup_server_connection(int *server_fd, const char *hostname, int port)
+{
+	char port_str[16];
+	struct addrinfo hints;
+	struct addrinfo *addr_list;
+	
+	*server_fd = -1;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	
+	/* Resolve the hostname and try each address it has until one of them
+	accepts the connection */
+	int gai_return = getaddrinfo(hostname, port_str, &hints, &addr_list);
+	
+	if(gai_return != 0)
+	{
+		print_err("getaddrinfo", gai_strerror(gai_return));
+		return false;
+	}
 	
-	/* Attempt to open the server socket if the host was successfuly
-	resolved */
-	if(setup_success)
-		*server_socket = SDLNet_TCP_Open(server_ip);
+	for(struct addrinfo *addr = addr_list; addr != NULL; addr = addr->ai_next)
+	{
+		*server_fd = socket(addr->ai_family, addr->ai_socktype, 0);
+		
+		if(*server_fd < 0) continue;
+		
+		if(connect_with_timeout(*server_fd, addr->ai_addr, addr->ai_addrlen))
+			break;
 		
-	if(*server_socket == NULL)
+		close_socket(server_fd);
+	}
+	
+	freeaddrinfo(addr_list);
+	
+	if(*server_fd < 0)
 	{
-		print_err("SDLNet_TCP_Open", "Could not open the server socket");
-		setup_success = false;
+		print_err("connect", "Could not open the server socket");
+		return false;
 	}
 	
-	return setup_success;
+	set_nodelay(*server_fd);
+	
+	return true;
 }
 
-bool init_client_socket_set
-(
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *server_socket
-)
+void set_nodelay(int fd)
 {
-	bool init_success = true;
+	int nodelay = 1;
+	
+	/* Chat frames are small and latency sensitive */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
 
-	*socket_set = NULL;
-	*socket_set = SDLNet_AllocSocketSet(1);
+void close_socket(int *fd)
+{
+	if(*fd >= 0) close(*fd);
 	
-	if(*socket_set == NULL)
+	*fd = -1;
+}
+
+bool set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
 	{
-		print_libsdl_err("SDLNet_AllocSocketSet");
-		init_success = false;
+		print_errno_err("fcntl");
+		return false;
 	}
 	
-	if(init_success)
-		if(SDLNet_TCP_AddSocket(*socket_set, *server_socket) < 0)
-		{
-			print_libsdl_err("SDLNet_TCP_AddSocket");
-			init_success = false;
-		}
+	return true;
+}
+
+bool open_wake_pipe(int wake_fd_arr[2])
+{
+	/* A pipe lets other threads interrupt a reactor wait.  Both ends are
+	non-blocking so a full pipe never stalls the signalling thread */
+	if(pipe(wake_fd_arr) != 0)
+	{
+		print_errno_err("pipe");
+		return false;
+	}
 	
-	return init_success;
+	if(!set_nonblocking(wake_fd_arr[0]) || !set_nonblocking(wake_fd_arr[1]))
+	{
+		close_socket(&wake_fd_arr[0]);
+		close_socket(&wake_fd_arr[1]);
+		return false;
+	}
+	
+	return true;
+}
+
+void signal_wake_pipe(int write_fd)
+{
+	const char wake_byte = 0;
+	
+	/* A full pipe already means a wakeup is pending */
+	while(write(write_fd, &wake_byte, 1) < 0 && errno == EINTR);
 }
 
-bool init_server_socket_set
+void clear_wake_pipe(int read_fd)
+{
+	char buf[64];
+	
+	while(read(read_fd, buf, sizeof(buf)) > 0);
+}
+
+void init_session(session_t *session)
+{
+	sodium_memzero(session, sizeof(*session));
+	session->has_key = false;
+	session->is_compressed = false;
+	session->room_key_cnt = 0;
+	session->compressor = NULL;
+}
+
+bool update_session
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *server_socket
+	session_t *session,
+	const unsigned char peer_pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char privkey[crypto_box_SECRETKEYBYTES]
 )
 {
-	bool init_success = true;
+	/* Reuse the session keys as long as the peer keeps the same public
+	key.  Only a new peer (or a peer with a new keypair) costs a scalar
+	multiplication */
+	if
+	(
+		session->has_key &&
+		sodium_memcmp
+		(
+			session->peer_pubkey,
+			peer_pubkey,
+			crypto_box_PUBLICKEYBYTES
+		) == 0
+	)
+		return true;
 	
-	/* One plus the max client count to account for the maximum number of
-	clients AND the server socket */
-	*socket_set = NULL;
-	*socket_set = SDLNet_AllocSocketSet(1 + MAX_CLIENT_CNT);
+	/* Links between servers have no fixed sides, so the lower public key
+	takes the client's.  A peer that sends this side's own key back could
+	only be echoing it */
+	int key_order = memcmp(pubkey, peer_pubkey, crypto_box_PUBLICKEYBYTES);
+	int kx_return = -1;
 	
-	if(*socket_set == NULL)
+	if(key_order < 0)
+		kx_return = crypto_kx_client_session_keys
+		(
+			session->rx_key,
+			session->tx_key,
+			pubkey,
+			privkey,
+			peer_pubkey
+		);
+	else if(key_order > 0)
+		kx_return = crypto_kx_server_session_keys
+		(
+			session->rx_key,
+			session->tx_key,
+			pubkey,
+			privkey,
+			peer_pubkey
+		);
+	
+	if(kx_return != 0)
 	{
-		print_libsdl_err("SDLNet_AllocSocketSet");
-		init_success = false;
+		print_err("update_session", "Failed to compute the session keys");
+		init_session(session);
+		return false;
 	}
 	
-	if(init_success)
-		if(SDLNet_TCP_AddSocket(*socket_set, *server_socket) < 0)
+	memcpy(session->peer_pubkey, peer_pubkey, crypto_box_PUBLICKEYBYTES);
+	session->has_key = true;
+	
+	return true;
+}
+
+bool send_all(int fd, const void *buf, int len)
+{
+	/* A blocking send may still be cut short by a signal */
+	int send_len = 0;
+	
+	while(send_len < len)
+	{
+		ssize_t send_return = send
+		(
+			fd,
+			(const char *)buf + send_len,
+			len - send_len,
+			MSG_NOSIGNAL
+		);
+		
+		if(send_return < 0 && errno == EINTR) continue;
+		
+		if(send_return <= 0)
 		{
-			print_libsdl_err("SDLNet_TCP_AddSocket");
-			init_success = false;
+			print_errno_err("send");
+			return false;
 		}
+		
+		send_len += send_return;
+	}
 	
-	return init_success;
+	return true;
 }
 
-void init_client_arr(client_t *client_arr, int client_cnt)
+static bool recv_all(int fd, void *buf, int len)
 {
-	for(int i = 0; i < client_cnt; i++)
+	/* recv may return fewer bytes than requested, so keep reading until the
+	whole buffer is filled or the connection fails */
+	int recv_len = 0;
+	
+	while(recv_len < len)
 	{
-		client_arr[i].is_logged_in = false;
-		strcpy(client_arr[i].username, "user");
-		client_arr[i].socket = NULL;
+		ssize_t recv_return = recv
+		(
+			fd,
+			(char *)buf + recv_len,
+			len - recv_len,
+			0
+		);
+		
+		if(recv_return < 0 && errno == EINTR) continue;
+		
+		if(recv_return <= 0) return false;
+		
+		recv_len += recv_return;
 	}
+	
+	return true;
 }
 
-void send_msg
+static unsigned char *start_frame
 (
-	const char *msg,
-	msg_data_t *msg_data,
-	TCPsocket *server_socket,
-	unsigned char privkey[crypto_box_SECRETKEYBYTES],
-	unsigned char pubkey[crypto_box_PUBLICKEYBYTES]
+	unsigned char *frame,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len
 )
 {
-	/* Abort on an empty message (results in a strange looping behavior
-	otherwise) */
-	if(strcmp(msg, "") == 0) return;
+	int body_len = FRAME_OVERHEAD + payload_len;
+	unsigned char *plaintext =
+		frame + FRAME_HEADER_LEN + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
 	
-	/* Create a dummy buffer for prompting the receiver */
-	const char dummy_buf[MAX_MSG_LEN] = "DUMMY";
+	/* Write the header */
+	SDLNet_Write32((Uint32)body_len, frame);
+	frame[4] = (unsigned char)type;
 	
-	/* Prompt the receiver to send its public key */
-	SDLNet_TCP_Send
-	(
-		*server_socket,
-		dummy_buf,
-		MAX_MSG_LEN
-	);
+	/* Lay the type and the payload out where their ciphertext goes.  Both
+	box and secretbox encrypt in place */
+	plaintext[0] = (unsigned char)type;
+	memcpy(plaintext + FRAME_TYPE_LEN, payload, payload_len);
+	
+	return plaintext;
+}
+
+static bool finish_open
+(
+	unsigned char *payload,
+	int *payload_len,
+	frame_type_t type,
+	const unsigned char *plaintext,
+	int body_len
+)
+{
+	/* Only the sealed type can be trusted.  A header that disagrees with
+	it was changed on the way */
+	if(plaintext[0] != (unsigned char)type)
+	{
+		print_err("open_frame", "Frame type does not match");
+		return false;
+	}
+	
+	*payload_len = body_len - FRAME_OVERHEAD;
+	memcpy(payload, plaintext + FRAME_TYPE_LEN, *payload_len);
+	
+	return true;
+}
+
+int seal_frame
+(
+	unsigned char *frame,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	const session_t *session
+)
+{
+	if(payload_len < 0 || payload_len > MAX_PAYLOAD_LEN)
+	{
+		print_err("seal_frame", "Payload is too long");
+		return -1;
+	}
 	
-	/* Receive the receiver's public key */
-	SDLNet_TCP_Recv
+	unsigned char *nonce = frame + FRAME_HEADER_LEN;
+	unsigned char *ciphertext = nonce + crypto_box_NONCEBYTES;
+	unsigned char *plaintext = start_frame(frame, type, payload, payload_len);
+	
+	/* Generate the nonce and encrypt the type and payload behind it */
+	randombytes_buf(nonce, crypto_box_NONCEBYTES);
+	
+	int encryption_return = crypto_box_easy_afternm
 	(
-		*server_socket,
-		msg_data,
-		sizeof(*msg_data)
+		ciphertext,
+		plaintext,
+		FRAME_TYPE_LEN + payload_len,
+		nonce,
+		session->tx_key
 	);
 	
-	/* Generate the nonce and encrypt the message.  Store it in the message
-	data */
+	if(encryption_return != 0)
+	{
+		print_err
+		(
+			"crypto_box_easy_afternm",
+			"Failed to encrypt the message"
+		);
+		
+		return -1;
+	}
+	
+	return SEALED_FRAME_LEN(payload_len);
+}
+
+int seal_msg_frame
+(
+	unsigned char *frame,
+	const unsigned char *payload,
+	int payload_len,
+	const session_t *session
+)
+{
+	unsigned char zpayload[MAX_PAYLOAD_LEN];
+	
+	/* Fall back to a plain frame whenever compression does not pay off */
+	if(session->is_compressed && session->compressor != NULL)
+	{
+		int zpayload_len = compress_payload
+		(
+			session->compressor,
+			zpayload,
+			payload,
+			payload_len
+		);
+		
+		if(zpayload_len > 0)
+		{
+			return seal_frame
+			(
+				frame,
+				FRAME_TYPE_ZMSG,
+				zpayload,
+				zpayload_len,
+				session
+			);
+		}
+	}
+	
+	return seal_frame(frame, FRAME_TYPE_MSG, payload, payload_len, session);
+}
+
+int seal_room_frame
+(
+	unsigned char *frame,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	uint32_t room_key_id,
+	const unsigned char room_key[crypto_secretbox_KEYBYTES]
+)
+{
+	if(payload_len < 0 || payload_len > MAX_PAYLOAD_LEN)
+	{
+		print_err("seal_room_frame", "Payload is too long");
+		return -1;
+	}
+	
+	unsigned char *nonce = frame + FRAME_HEADER_LEN;
+	unsigned char *ciphertext = nonce + crypto_secretbox_NONCEBYTES;
+	unsigned char *plaintext = start_frame(frame, type, payload, payload_len);
+	
+	/* The key id tells the members which of their keys opens the frame.  The
+	random rest of the nonce is still far too long to repeat */
+	SDLNet_Write32(room_key_id, nonce);
+	
 	randombytes_buf
 	(
-		msg_data->nonce,
-		sizeof(msg_data->nonce)
+		nonce + ROOM_KEY_ID_LEN,
+		crypto_secretbox_NONCEBYTES - ROOM_KEY_ID_LEN
 	);
 	
-	int encryption_return = crypto_box_easy
+	int encryption_return = crypto_secretbox_easy
 	(
-		msg_data->ciphertext,
-		(unsigned char *)msg,
-		MAX_MSG_LEN,
-		msg_data->nonce,
-		msg_data->pubkey,
-		privkey
+		ciphertext,
+		plaintext,
+		FRAME_TYPE_LEN + payload_len,
+		nonce,
+		room_key
 	);
 	
 	if(encryption_return != 0)
-		print_err("crypto_box_easy", "Failed to encrypt the message");
+	{
+		print_err("crypto_secretbox_easy", "Failed to encrypt the message");
+		return -1;
+	}
 	
-	/* Copy the sender's public key to the message data */
-	memcpy
+	return SEALED_FRAME_LEN(payload_len);
+}
+
+bool parse_frame_header
+(
+	const unsigned char *header,
+	frame_type_t *type,
+	int *body_len
+)
+{
+	Uint32 len = SDLNet_Read32(header);
+	Uint32 min_len = FRAME_OVERHEAD;
+	Uint32 max_len = FRAME_OVERHEAD + MAX_PAYLOAD_LEN;
+	
+	*type = (frame_type_t)header[4];
+	
+	/* File chunks are passed on as they are, so the whole body has to fit
+	where a payload would */
+	if(*type == FRAME_TYPE_FILE_CHUNK)
+	{
+		min_len = FILE_CHUNK_OVERHEAD;
+		max_len = MAX_PAYLOAD_LEN;
+	}
+	
+	/* Reject lengths that cannot hold a nonce and MAC, or that would
+	overflow the receive buffer */
+	if(len < min_len || len > max_len)
+	{
+		print_err("parse_frame_header", "Invalid frame length");
+		return false;
+	}
+	
+	*body_len = (int)len;
+	
+	return true;
+}
+
+bool open_frame
+(
+	unsigned char *payload,
+	int *payload_len,
+	frame_type_t type,
+	const unsigned char *body,
+	int body_len,
+	const session_t *session
+)
+{
+	unsigned char plaintext[FRAME_TYPE_LEN + MAX_PAYLOAD_LEN];
+	
+	int decryption_return = crypto_box_open_easy_afternm
 	(
-		msg_data->pubkey,
-		pubkey,
-		crypto_box_PUBLICKEYBYTES * sizeof(unsigned char)
+		plaintext,
+		body + crypto_box_NONCEBYTES,
+		body_len - crypto_box_NONCEBYTES,
+		body,
+		session->rx_key
 	);
 	
-	/* Send the message data to the receiver */
-	SDLNet_TCP_Send(*server_socket, msg_data, sizeof(*msg_data));
+	if(decryption_return != 0)
+	{	
+		print_err
+		(
+			"crypto_box_open_easy_afternm",
+			"Failed to decrypt the message"
+		);
+		
+		return false;
+	}
+	
+	return finish_open(payload, payload_len, type, plaintext, body_len);
 }
 
-bool recv_msg
+bool open_room_frame
 (
-	char *msg,
-	msg_data_t *msg_data,
-	TCPsocket *server_socket,
-	unsigned char privkey[crypto_box_SECRETKEYBYTES],
-	unsigned char pubkey[crypto_box_PUBLICKEYBYTES]
+	unsigned char *payload,
+	int *payload_len,
+	frame_type_t type,
+	const unsigned char *body,
+	int body_len,
+	const unsigned char room_key[crypto_secretbox_KEYBYTES]
 )
 {
-	/* Clear the message string */
-	memset(msg, 0, MAX_MSG_LEN);
-
-	/* Create a dummy buffer for receiving the sender's dummy data */
-	char dummy_buf[MAX_MSG_LEN];
-
-	/* Receive the sender's prompt */
-	SDLNet_TCP_Recv
+	unsigned char plaintext[FRAME_TYPE_LEN + MAX_PAYLOAD_LEN];
+	
+	int decryption_return = crypto_secretbox_open_easy
 	(
-		*server_socket,
-		dummy_buf,
-		MAX_MSG_LEN
+		plaintext,
+		body + crypto_secretbox_NONCEBYTES,
+		body_len - crypto_secretbox_NONCEBYTES,
+		body,
+		room_key
 	);
 	
-	/* Send the receiver's public key to the sender */
-	memcpy
+	if(decryption_return != 0)
+	{
+		print_err
+		(
+			"crypto_secretbox_open_easy",
+			"Failed to decrypt the message"
+		);
+		
+		return false;
+	}
+	
+	return finish_open(payload, payload_len, type, plaintext, body_len);
+}
+
+bool decompress_frame
+(
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len,
+	const session_t *session
+)
+{
+	unsigned char zpayload[MAX_PAYLOAD_LEN];
+	
+	if(*type != FRAME_TYPE_ZMSG && *type != FRAME_TYPE_ROOM_ZMSG) return true;
+	
+	if(session->compressor == NULL)
+	{
+		print_err("decompress_frame", "No dictionary for this connection");
+		return false;
+	}
+	
+	memcpy(zpayload, payload, *payload_len);
+	
+	*payload_len = decompress_payload
 	(
-		msg_data->pubkey,
-		pubkey,
-		crypto_box_PUBLICKEYBYTES * sizeof(unsigned char)
+		session->compressor,
+		payload,
+		MAX_PAYLOAD_LEN,
+		zpayload,
+		*payload_len
 	);
 	
-	SDLNet_TCP_Send
+	if(*payload_len < 0) return false;
+	
+	/* The rest of the code only ever sees plain messages */
+	if(*type == FRAME_TYPE_ZMSG) *type = FRAME_TYPE_MSG;
+	else *type = FRAME_TYPE_ROOM_MSG;
+	
+	return true;
+}
+
+static const room_key_t *find_room_key
+(
+	const session_t *session,
+	uint32_t room_key_id
+)
+{
+	/* A client holds a handful of keys at most */
+	for(int i = 0; i < session->room_key_cnt; i++)
+		if(session->room_key_arr[i].id == room_key_id)
+			return &session->room_key_arr[i];
+	
+	return NULL;
+}
+
+static bool update_room_key
+(
+	session_t *session,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	int channel_name_len = payload_len - ROOM_KEY_LEN;
+	int i;
+	
+	if(channel_name_len < 0 || channel_name_len > MAX_CHANNEL_NAME_LEN)
+	{
+		print_err("update_room_key", "Invalid room key");
+		return false;
+	}
+	
+	memcpy(channel_name, payload + ROOM_KEY_LEN, channel_name_len);
+	channel_name[channel_name_len] = '\0';
+	
+	/* A channel only ever has one key, so a new one replaces the last */
+	for(i = 0; i < session->room_key_cnt; i++)
+		if(strcmp(session->room_key_arr[i].channel_name, channel_name) == 0)
+			break;
+	
+	uint32_t room_key_id = SDLNet_Read32(payload);
+	
+	/* The client has left the channel.  Its last key goes in the gap */
+	if(room_key_id == 0)
+	{
+		if(i == session->room_key_cnt) return true;
+		
+		session->room_key_cnt -= 1;
+		session->room_key_arr[i] = session->room_key_arr[session->room_key_cnt];
+		
+		sodium_memzero
+		(
+			&session->room_key_arr[session->room_key_cnt],
+			sizeof(room_key_t)
+		);
+		
+		return true;
+	}
+	
+	if(i == MAX_ROOM_KEY_CNT)
+	{
+		print_err("update_room_key", "Too many room keys");
+		return false;
+	}
+	
+	if(i == session->room_key_cnt) session->room_key_cnt += 1;
+	
+	room_key_t *room_key = &session->room_key_arr[i];
+	
+	room_key->id = room_key_id;
+	strcpy(room_key->channel_name, channel_name);
+	
+	memcpy
 	(
-		*server_socket,
-		msg_data,
-		sizeof(*msg_data)
+		room_key->key,
+		payload + ROOM_KEY_ID_LEN,
+		crypto_secretbox_KEYBYTES
 	);
 	
-	/* Receiver the sender's message data */
-	SDLNet_TCP_Recv(*server_socket, msg_data, sizeof(msg_data_t));
-	
-	/* Decrypt the message */
-	unsigned char umsg[MAX_MSG_LEN];
+	return true;
+}
+
+bool send_frame
+(
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	msg_data_t *msg_data,
+	int fd,
+	session_t *session
+)
+{
+	/* The session key is established by exchange_pubkeys on connect */
+	if(!session->has_key)
+	{
+		print_err("send_frame", "No session key for this connection");
+		return false;
+	}
 	
-	int decryption_return = crypto_box_open_easy
+	msg_data->frame_len = seal_frame
 	(
-		umsg,
-		msg_data->ciphertext,
-		CIPHERTEXT_LEN,
-		msg_data->nonce,
-		msg_data->pubkey,
-		privkey
+		msg_data->frame,
+		type,
+		payload,
+		payload_len,
+		session
 	);
 	
-	if(decryption_return != 0)
-	{	
-		print_err("crypto_box_open_easy", "Failed to decrypt the message");
+	if(msg_data->frame_len < 0) return false;
+	
+	/* Send the whole frame in a single write */
+	return send_all(fd, msg_data->frame, msg_data->frame_len);
+}
+
+bool recv_frame
+(
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len,
+	msg_data_t *msg_data,
+	int fd,
+	session_t *session
+)
+{
+	int body_len;
+
+	if(!session->has_key)
+	{
+		print_err("recv_frame", "No session key for this connection");
 		return false;
 	}
-	else
+	
+	/* Read the header first to learn how long the body is */
+	if(!recv_all(fd, msg_data->frame, FRAME_HEADER_LEN)) return false;
+	
+	if(!parse_frame_header(msg_data->frame, type, &body_len)) return false;
+	
+	unsigned char *body = msg_data->frame + FRAME_HEADER_LEN;
+	
+	if(!recv_all(fd, body, body_len)) return false;
+	
+	msg_data->frame_len = FRAME_HEADER_LEN + body_len;
+	
+	/* The transfer's own key opens file chunks, so they are handed over
+	unopened */
+	if(*type == FRAME_TYPE_FILE_CHUNK)
 	{
-		strcpy(msg, (char *)umsg);
+		memcpy(payload, body, body_len);
+		*payload_len = body_len;
 		return true;
 	}
+	
+	bool open_success;
+	
+	/* Room messages are sealed with a room key instead of the session key.
+	The nonce says which one */
+	bool is_room_frame =
+		*type == FRAME_TYPE_ROOM_MSG ||
+		*type == FRAME_TYPE_ROOM_ZMSG ||
+		*type == FRAME_TYPE_ROOM_PRESENCE;
+	
+	if(is_room_frame)
+	{
+		const room_key_t *room_key = find_room_key
+		(
+			session,
+			SDLNet_Read32(body)
+		);
+		
+		if(room_key == NULL)
+		{
+			print_err("recv_frame", "No room key for this frame");
+			return false;
+		}
+		
+		open_success = open_room_frame
+		(
+			payload,
+			payload_len,
+			*type,
+			body,
+			body_len,
+			room_key->key
+		);
+	}
+	else
+	{
+		open_success = open_frame
+		(
+			payload,
+			payload_len,
+			*type,
+			body,
+			body_len,
+			session
+		);
+	}
+	
+	if(!open_success) return false;
+	
+	return decompress_frame(type, payload, payload_len, session);
+}
+
+bool exchange_pubkeys
+(
+	int fd,
+	session_t *session,
+	unsigned char privkey[crypto_box_SECRETKEYBYTES],
+	unsigned char pubkey[crypto_box_PUBLICKEYBYTES]
+)
+{
+	unsigned char peer_pubkey[crypto_box_PUBLICKEYBYTES];
+
+	/* Both sides send their public key first and then read the peer's.  The
+	keys are small enough that neither send can block on the other */
+	if(!send_all(fd, pubkey, crypto_box_PUBLICKEYBYTES)) return false;
+	
+	if(!recv_all(fd, peer_pubkey, crypto_box_PUBLICKEYBYTES))
+	{
+		print_err("exchange_pubkeys", "Could not receive the peer's key");
+		return false;
+	}
+	
+	/* Compute the session keys once.  Every message on this connection is
+	sealed and opened with them from now on */
+	init_session(session);
+	return update_session(session, peer_pubkey, pubkey, privkey);
 }
 
-void add_client_to_server
+void send_msg
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *socket,
-	TCPsocket *server_socket,
-	int *connected_client_cnt
+	const char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
 )
 {
-	/* Reject a connection if the max number of clients is reached.  It will
-	simply make the client wait until another person leaves.  Then it will
-	autoconnect them */
-	if(*connected_client_cnt >= MAX_CLIENT_CNT) return;
+	/* Abort on an empty message (results in a strange looping behavior
+	otherwise) */
+	if(strcmp(msg, "") == 0) return;
 	
-	/* Add the socket to the set if it is not NULL.  Close it otherwise */
-	*socket = SDLNet_TCP_Accept(*server_socket);
+	/* Messages longer than the receiver's buffer are truncated.  The
+	terminator is not sent */
+	int msg_len = strlen(msg);
 	
-	if(*socket)
+	if(msg_len > MAX_MSG_LEN - 1) msg_len = MAX_MSG_LEN - 1;
+	
+	if(!session->has_key)
 	{
-		SDLNet_TCP_AddSocket(*socket_set, *socket);
-		*connected_client_cnt += 1;
+		print_err("send_msg", "No session key for this connection");
+		return;
 	}
-	else
+	
+	msg_data->frame_len = seal_msg_frame
+	(
+		msg_data->frame,
+		(const unsigned char *)msg,
+		msg_len,
+		session
+	);
+	
+	if(msg_data->frame_len < 0) return;
+	
+	send_all(server_fd, msg_data->frame, msg_data->frame_len);
+}
+
+bool read_msg_frame
+(
+	frame_type_t type,
+	unsigned char *umsg,
+	int msg_len,
+	char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
+)
+{
+	/* Clear the message string */
+	memset(msg, 0, MAX_MSG_LEN);
+	
+	/* Clients that do not take files or show presence just skip them */
+	if(type >= FRAME_TYPE_FILE_START && type <= FRAME_TYPE_FILE_CANCEL)
+		return true;
+	
+	if(type == FRAME_TYPE_PRESENCE || type == FRAME_TYPE_ROOM_PRESENCE)
+		return true;
+	
+	/* A new room key leaves the message empty.  The caller skips empty
+	messages */
+	if(type == FRAME_TYPE_ROOM_KEY)
+	{
+		bool update_success = update_room_key(session, umsg, msg_len);
+		
+		sodium_memzero(umsg, msg_len);
+		
+		return update_success;
+	}
+	
+	/* The server offers its dictionary.  Agree by echoing the id back if
+	it is the one loaded here, otherwise stay uncompressed */
+	if(type == FRAME_TYPE_DICT)
+	{
+		if
+		(
+			msg_len != DICT_PAYLOAD_LEN ||
+			session->compressor == NULL ||
+			SDLNet_Read32(umsg) != session->compressor->dict->id
+		)
+			return true;
+		
+		session->is_compressed = true;
+		
+		return send_frame
+		(
+			FRAME_TYPE_DICT,
+			umsg,
+			msg_len,
+			msg_data,
+			server_fd,
+			session
+		);
+	}
+	
+	if
+	(
+		(type != FRAME_TYPE_MSG && type != FRAME_TYPE_ROOM_MSG) ||
+		msg_len > MAX_MSG_LEN - 1
+	)
 	{
-		SDLNet_TCP_Close(*socket);
+		print_err("recv_msg", "Unexpected frame");
+		return false;
 	}
+	
+	memcpy(msg, umsg, msg_len);
+	msg[msg_len] = '\0';
+	
+	return true;
 }
 
-void remove_client_from_server
+bool recv_msg
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *socket,
-	int *connected_client_cnt
+	char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
 )
 {
-	/* Remove the socket from the set and close the
-	connection */
-	SDLNet_TCP_DelSocket(*socket_set, *socket);
-	SDLNet_TCP_Close(*socket);
-	*connected_client_cnt -= 1;
-	
-	/* Set the socket to NULL so that false connections aren't detected */
-	*socket = NULL;
+	frame_type_t type;
+	int msg_len;
+	unsigned char umsg[MAX_PAYLOAD_LEN];
+	
+	bool recv_success = recv_frame
+	(
+		&type,
+		umsg,
+		&msg_len,
+		msg_data,
+		server_fd,
+		session
+	);
+	
+	if(!recv_success) return false;
+	
+	return read_msg_frame
+	(
+		type,
+		umsg,
+		msg_len,
+		msg,
+		msg_data,
+		server_fd,
+		session
+	);
 }
@@ -21,87 +21,270 @@ SOFTWARE. */
 #ifndef NET_H
 #define NET_H
 
-#include "SDL2/SDL_net.h"
 #include "sodium.h"
+#include "src/compress.h"
 #include "stdbool.h"
+#include "stdint.h"
 
-#define MAX_MSG_LEN 256
+#define MAX_MSG_LEN 4096
 #define MAX_USERNAME_LEN 16
+#define MAX_CHANNEL_NAME_LEN 32
+#define MAX_CLIENT_CHANNEL_CNT 16
 
-#define CIPHERTEXT_LEN MAX_MSG_LEN + crypto_box_MACBYTES
+/* Frames on the wire are a 32-bit big-endian body length and an 8-bit frame
+type, followed by the body (the nonce and then the ciphertext of the
+payload).  Only the real payload bytes are encrypted and sent.  The type is
+sealed again in front of the payload, so the MAC covers it and a frame
+whose header was retyped on the way fails to open */
+#define FRAME_HEADER_LEN 5
+#define FRAME_TYPE_LEN 1
+#define FRAME_OVERHEAD \
+	(crypto_box_NONCEBYTES + crypto_box_MACBYTES + FRAME_TYPE_LEN)
+#define MAX_PAYLOAD_LEN MAX_MSG_LEN
+#define SEALED_FRAME_LEN(payload_len) \
+	(FRAME_HEADER_LEN + FRAME_OVERHEAD + (payload_len))
+#define MAX_FRAME_LEN SEALED_FRAME_LEN(MAX_PAYLOAD_LEN)
 
-/* Struct for encrypted messages and their accompanying data (both sending
-and receiving) */
+/* MSG and ROOM_KEY frames are sealed with the connection's session key.
+ROOM_MSG frames are sealed once with their channel's room key
+(crypto_secretbox, which has the same nonce and MAC sizes) and the same
+bytes go to every member.
+The Z variants carry a payload compressed with the shared dictionary,
+which is only used after both sides have agreed on it with DICT frames (a
+32-bit big-endian dictionary id).  Compression happens before encryption,
+since ciphertext does not compress.  FILE_CHUNK frames are the exception to
+the sealing: their body is a transfer id, a flags byte and a chunk already
+encrypted with that transfer's own crypto_secretstream key, which travels
+in the sealed FILE_START frame.  The server relays chunks without opening
+them.  LINK_HELLO and RELAY frames only travel between servers.  PRESENCE
+frames carry the online, away and typing signals described in presence.h,
+and ROOM_PRESENCE is their room-key counterpart */
+typedef enum frame_type_t
+{
+	FRAME_TYPE_MSG = 1,
+	FRAME_TYPE_ROOM_KEY = 2,
+	FRAME_TYPE_ROOM_MSG = 3,
+	FRAME_TYPE_DICT = 4,
+	FRAME_TYPE_ZMSG = 5,
+	FRAME_TYPE_ROOM_ZMSG = 6,
+	FRAME_TYPE_FILE_START = 7,
+	FRAME_TYPE_FILE_CHUNK = 8,
+	FRAME_TYPE_FILE_ACK = 9,
+	FRAME_TYPE_FILE_CANCEL = 10,
+	FRAME_TYPE_LINK_HELLO = 11,
+	FRAME_TYPE_RELAY = 12,
+	FRAME_TYPE_PRESENCE = 13,
+	FRAME_TYPE_ROOM_PRESENCE = 14
+}
+frame_type_t;
+
+#define DICT_PAYLOAD_LEN 4
+
+/* The first ROOM_KEY_ID_LEN bytes of a room frame's nonce are the 32-bit
+big-endian id of the key that sealed it, and the rest is random.  A
+ROOM_KEY frame holds the id, the key and then the name of the channel it
+is for.  The presence key has an empty name, and an id of 0 takes back the
+key of a channel the client has left.  A client holds a key for each of
+its channels and the presence key */
+#define ROOM_KEY_ID_LEN 4
+#define ROOM_KEY_LEN (ROOM_KEY_ID_LEN + crypto_secretbox_KEYBYTES)
+#define MAX_ROOM_KEY_CNT (MAX_CLIENT_CHANNEL_CNT + 1)
+
+/* Transfer ids are 32-bit big-endian.  FILE_START holds the id, the 64-bit
+file size, the secretstream header and key and then the name.  FILE_ACK
+holds the id and how many more chunks the sender may send, and
+FILE_CANCEL just the id.  Senders number their own files with the top bit
+clear and the server numbers relayed files with it set, so a FILE_CANCEL
+from a client is never ambiguous */
+#define FILE_ID_LEN 4
+#define FILE_RELAY_ID_BIT 0x80000000u
+#define MAX_FILE_NAME_LEN 255
+#define FILE_START_LEN (int)(FILE_ID_LEN + 8 + \
+	crypto_secretstream_xchacha20poly1305_HEADERBYTES + \
+	crypto_secretstream_xchacha20poly1305_KEYBYTES)
+#define FILE_ACK_LEN (2 * FILE_ID_LEN)
+
+/* A chunk body fits the same buffers as any other payload.  The flag marks
+the last chunk for the server, which never opens the chunks */
+#define FILE_CHUNK_OVERHEAD \
+	(int)(FILE_ID_LEN + 1 + crypto_secretstream_xchacha20poly1305_ABYTES)
+#define FILE_CHUNK_LEN (MAX_PAYLOAD_LEN - FILE_CHUNK_OVERHEAD)
+#define FILE_CHUNK_FINAL 1
+
+/* Struct for a serialized frame (both sending and receiving).  Public keys
+are exchanged once on connect, so only the nonce and ciphertext travel with
+each message */
 typedef struct msg_data_t
 {
-	unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
-	unsigned char nonce[crypto_box_NONCEBYTES];
-	unsigned char ciphertext[CIPHERTEXT_LEN];	
+	int frame_len;
+	unsigned char frame[MAX_FRAME_LEN];
 }
 msg_data_t;
 
-/* Struct for each client's data (including the socket) */
-typedef struct client_t
+/* Struct for a room key the server has handed out and the channel it is
+for */
+typedef struct room_key_t
+{
+	uint32_t id;
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	unsigned char key[crypto_secretbox_KEYBYTES];
+}
+room_key_t;
+
+/* Struct for the session keys (crypto_kx) and the peer public key they were
+computed for.  Frames are sealed with tx_key and opened with rx_key, so a
+frame sent back to its sender does not open.  Computing them once avoids an
+X25519 scalar multiplication for every message.  Clients also keep the
+latest room keys the server sent them.  The compressor belongs to the thread
+that owns the connection and is null without a dictionary.  is_compressed
+is set once the peer has agreed on the same dictionary */
+typedef struct session_t
 {
-	bool is_logged_in;
-	char username[MAX_USERNAME_LEN];
-	TCPsocket socket;
+	bool has_key;
+	bool is_compressed;
+	int room_key_cnt;
+	compressor_t *compressor;
+	unsigned char peer_pubkey[crypto_box_PUBLICKEYBYTES];
+	unsigned char rx_key[crypto_kx_SESSIONKEYBYTES];
+	unsigned char tx_key[crypto_kx_SESSIONKEYBYTES];
+	room_key_t room_key_arr[MAX_ROOM_KEY_CNT];
 }
-client_t;
+session_t;
+
+bool setup_server_connection(int *server_fd, const char *hostname, int port);
+void set_nodelay(int fd);
+void close_socket(int *fd);
+bool set_nonblocking(int fd);
+bool send_all(int fd, const void *buf, int len);
+bool open_wake_pipe(int wake_fd_arr[2]);
+void signal_wake_pipe(int write_fd);
+void clear_wake_pipe(int read_fd);
+
+void init_session(session_t *session);
 
-bool setup_server_connection
+bool update_session
 (
-	IPaddress *server_ip,
-	TCPsocket *server_socket,
-	const char *hostname,
-	int port
+	session_t *session,
+	const unsigned char peer_pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char privkey[crypto_box_SECRETKEYBYTES]
 );
 
-bool init_client_socket_set
+int seal_frame
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *server_socket
+	unsigned char *frame,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	const session_t *session
 );
 
-bool init_server_socket_set
+int seal_msg_frame
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *server_socket
+	unsigned char *frame,
+	const unsigned char *payload,
+	int payload_len,
+	const session_t *session
 );
 
-void init_client_arr(client_t *client_arr, int client_cnt);
+int seal_room_frame
+(
+	unsigned char *frame,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	uint32_t room_key_id,
+	const unsigned char room_key[crypto_secretbox_KEYBYTES]
+);
 
-void send_msg
+bool parse_frame_header
 (
-	const char *msg,
+	const unsigned char *header,
+	frame_type_t *type,
+	int *body_len
+);
+
+bool open_frame
+(
+	unsigned char *payload,
+	int *payload_len,
+	frame_type_t type,
+	const unsigned char *body,
+	int body_len,
+	const session_t *session
+);
+
+bool open_room_frame
+(
+	unsigned char *payload,
+	int *payload_len,
+	frame_type_t type,
+	const unsigned char *body,
+	int body_len,
+	const unsigned char room_key[crypto_secretbox_KEYBYTES]
+);
+
+bool decompress_frame
+(
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len,
+	const session_t *session
+);
+
+bool send_frame
+(
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
 	msg_data_t *msg_data,
-	TCPsocket *server_socket,
-	unsigned char privkey[crypto_box_SECRETKEYBYTES],
-	unsigned char pubkey[crypto_box_PUBLICKEYBYTES]
+	int fd,
+	session_t *session
 );
 
-bool recv_msg
+bool recv_frame
 (
-	char *msg,
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len,
 	msg_data_t *msg_data,
-	TCPsocket *server_socket,
+	int fd,
+	session_t *session
+);
+
+bool exchange_pubkeys
+(
+	int fd,
+	session_t *session,
 	unsigned char privkey[crypto_box_SECRETKEYBYTES],
 	unsigned char pubkey[crypto_box_PUBLICKEYBYTES]
 );
 
-void add_client_to_server
+void send_msg
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *socket,
-	TCPsocket *server_socket,
-	int *connected_client_cnt
+	const char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
 );
 
-void remove_client_from_server
+bool read_msg_frame
 (
-	SDLNet_SocketSet *socket_set,
-	TCPsocket *socket,
-	int *connected_client_cnt
+	frame_type_t type,
+	unsigned char *umsg,
+	int msg_len,
+	char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
+);
+
+bool recv_msg
+(
+	char *msg,
+	msg_data_t *msg_data,
+	int server_fd,
+	session_t *session
 );
 
 #endif /* NET_H */
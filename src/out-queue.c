@@ -0,0 +1,335 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "src/err.h"
+#include "src/frame-pool.h"
+#include "src/out-queue.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "sys/uio.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const int INITIAL_FRAME_CAP = 8;
+
+static out_frame_t *get_out_frame(const out_queue_t *out_queue, int i)
+{
+	return &out_queue->frame_ring[(out_queue->head + i) % out_queue->frame_cap];
+}
+
+static void pop_out_frame(out_queue_t *out_queue)
+{
+	out_frame_t *frame = get_out_frame(out_queue, 0);
+	
+	out_queue->queued_len -= frame->buf->len - out_queue->head_offset;
+	out_queue->head = (out_queue->head + 1) % out_queue->frame_cap;
+	out_queue->head_offset = 0;
+	out_queue->frame_cnt -= 1;
+	
+	release_frame_buf(frame->buf);
+}
+
+static bool grow_out_queue(out_queue_t *out_queue)
+{
+	int new_cap = out_queue->frame_cap ? out_queue->frame_cap * 2 :
+		INITIAL_FRAME_CAP;
+	
+	out_frame_t *new_frame_ring = malloc(new_cap * sizeof(out_frame_t));
+	
+	if(new_frame_ring == NULL) return false;
+	
+	/* Unwrap the ring so the head starts at zero again */
+	for(int i = 0; i < out_queue->frame_cnt; i++)
+		new_frame_ring[i] = *get_out_frame(out_queue, i);
+	
+	free(out_queue->frame_ring);
+	out_queue->frame_ring = new_frame_ring;
+	out_queue->frame_cap = new_cap;
+	out_queue->head = 0;
+	
+	return true;
+}
+
+void init_out_queue(out_queue_t *out_queue)
+{
+	out_queue->frame_cnt = 0;
+	out_queue->sending_cnt = 0;
+	out_queue->frame_cap = 0;
+	out_queue->head = 0;
+	out_queue->head_offset = 0;
+	out_queue->queued_len = 0;
+	out_queue->frame_ring = NULL;
+}
+
+void terminate_out_queue(out_queue_t *out_queue)
+{
+	while(out_queue->frame_cnt > 0)
+		pop_out_frame(out_queue);
+	
+	free(out_queue->frame_ring);
+	init_out_queue(out_queue);
+}
+
+static bool push_frame
+(
+	out_queue_t *out_queue,
+	frame_buf_t *buf,
+	bool is_droppable,
+	bool is_ephemeral
+)
+{
+	if
+	(
+		out_queue->frame_cnt == out_queue->frame_cap &&
+		!grow_out_queue(out_queue)
+	)
+	{
+		print_err("push_out_frame", "Could not grow the queue");
+		return false;
+	}
+	
+	int tail = (out_queue->head + out_queue->frame_cnt) % out_queue->frame_cap;
+	
+	/* No copy.  The frame is shared with whoever else it was pushed to */
+	ref_frame_buf(buf);
+	out_queue->frame_ring[tail].is_droppable = is_droppable;
+	out_queue->frame_ring[tail].is_ephemeral = is_ephemeral;
+	out_queue->frame_ring[tail].buf = buf;
+	out_queue->frame_cnt += 1;
+	out_queue->queued_len += buf->len;
+	
+	return true;
+}
+
+static int drop_out_frames
+(
+	out_queue_t *out_queue,
+	int max_queued_len,
+	bool is_ephemeral_only
+)
+{
+	int dropped_cnt = 0;
+	
+	/* A partly written head frame has to be finished, otherwise the peer
+	would lose track of the frame boundaries.  Frames still being sent are
+	out of reach too */
+	int i = out_queue->head_offset > 0 ? 1 : 0;
+	
+	if(i < out_queue->sending_cnt) i = out_queue->sending_cnt;
+	
+	while
+	(
+		out_queue->queued_len > max_queued_len &&
+		i < out_queue->frame_cnt
+	)
+	{
+		out_frame_t *frame = get_out_frame(out_queue, i);
+		
+		if
+		(
+			!frame->is_droppable ||
+			(is_ephemeral_only && !frame->is_ephemeral)
+		)
+		{
+			i += 1;
+			continue;
+		}
+		
+		if(i == 0)
+		{
+			pop_out_frame(out_queue);
+		}
+		else
+		{
+			frame_buf_t *buf = frame->buf;
+			
+			/* Close the gap by shifting the newer frames down */
+			for(int j = i; j < out_queue->frame_cnt - 1; j++)
+				*get_out_frame(out_queue, j) = *get_out_frame(out_queue, j + 1);
+			
+			out_queue->frame_cnt -= 1;
+			out_queue->queued_len -= buf->len;
+			release_frame_buf(buf);
+		}
+		
+		dropped_cnt += 1;
+	}
+	
+	return dropped_cnt;
+}
+
+bool push_out_frame
+(
+	out_queue_t *out_queue,
+	frame_buf_t *buf,
+	bool is_droppable
+)
+{
+	return push_frame(out_queue, buf, is_droppable, false);
+}
+
+bool push_ephemeral_out_frame(out_queue_t *out_queue, frame_buf_t *buf)
+{
+	return push_frame(out_queue, buf, true, true);
+}
+
+int drop_oldest_out_frames(out_queue_t *out_queue, int max_queued_len)
+{
+	/* Ephemeral frames go first, whatever their age */
+	int dropped_cnt = drop_out_frames(out_queue, max_queued_len, true);
+	
+	return dropped_cnt + drop_out_frames(out_queue, max_queued_len, false);
+}
+
+int drop_ephemeral_out_frames(out_queue_t *out_queue, int max_queued_len)
+{
+	return drop_out_frames(out_queue, max_queued_len, true);
+}
+
+int gather_out_frames
+(
+	const out_queue_t *out_queue,
+	int max_frame_cnt,
+	struct iovec iov_arr[],
+	frame_buf_t *buf_arr[]
+)
+{
+	int frame_cnt = out_queue->frame_cnt;
+	
+	if(frame_cnt > max_frame_cnt) frame_cnt = max_frame_cnt;
+	
+	/* Starting with whatever is left of the head frame */
+	for(int i = 0; i < frame_cnt; i++)
+	{
+		out_frame_t *frame = get_out_frame(out_queue, i);
+		int offset = i == 0 ? out_queue->head_offset : 0;
+		
+		iov_arr[i].iov_base = frame->buf->data + offset;
+		iov_arr[i].iov_len = frame->buf->len - offset;
+		
+		if(buf_arr != NULL) buf_arr[i] = frame->buf;
+	}
+	
+	return frame_cnt;
+}
+
+void advance_out_queue(out_queue_t *out_queue, size_t len)
+{
+	/* Pop every frame that went out whole (pop_out_frame accounts for what
+	was left of each) and note how far into the next one the kernel got */
+	while(len > 0)
+	{
+		out_frame_t *frame = get_out_frame(out_queue, 0);
+		size_t left_len = frame->buf->len - out_queue->head_offset;
+		
+		if(len < left_len)
+		{
+			out_queue->head_offset += len;
+			out_queue->queued_len -= len;
+			break;
+		}
+		
+		len -= left_len;
+		pop_out_frame(out_queue);
+	}
+}
+
+static flush_status_t flush_out_frames
+(
+	out_queue_t *out_queue,
+	int fd,
+	int frame_cnt,
+	unsigned long *send_call_cnt
+)
+{
+	struct iovec iov_arr[FLUSH_IOV_CNT];
+	struct msghdr msg;
+	int end_frame_cnt = out_queue->frame_cnt - frame_cnt;
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov_arr;
+
+	while(out_queue->frame_cnt > end_frame_cnt)
+	{
+		/* Gather as many queued frames as fit into a single call */
+		int max_iov_cnt = out_queue->frame_cnt - end_frame_cnt;
+		
+		if(max_iov_cnt > FLUSH_IOV_CNT) max_iov_cnt = FLUSH_IOV_CNT;
+		
+		msg.msg_iovlen =
+			gather_out_frames(out_queue, max_iov_cnt, iov_arr, NULL);
+		
+		/* sendmsg rather than writev so SIGPIPE can be suppressed */
+		ssize_t send_return = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		
+		*send_call_cnt += 1;
+		
+		if(send_return < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return FLUSH_STATUS_AGAIN;
+			
+			print_errno_err("sendmsg");
+			return FLUSH_STATUS_ERROR;
+		}
+		
+		advance_out_queue(out_queue, send_return);
+	}
+	
+	return FLUSH_STATUS_DONE;
+}
+
+flush_status_t flush_out_queue
+(
+	out_queue_t *out_queue,
+	int fd,
+	unsigned long *send_call_cnt
+)
+{
+	return flush_out_frames
+	(
+		out_queue,
+		fd,
+		out_queue->frame_cnt,
+		send_call_cnt
+	);
+}
+
+flush_status_t finish_out_frame
+(
+	out_queue_t *out_queue,
+	int fd,
+	unsigned long *send_call_cnt
+)
+{
+	/* Only what is left of a partly written head frame.  Frames from
+	another queue can follow it on the same stream after that */
+	if(out_queue->head_offset == 0) return FLUSH_STATUS_DONE;
+	
+	return flush_out_frames(out_queue, fd, 1, send_call_cnt);
+}
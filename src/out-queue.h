@@ -0,0 +1,108 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include "src/frame-pool.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "sys/uio.h"
+
+/* The most frames gathered into one sendmsg call.  Well under IOV_MAX
+everywhere */
+#define FLUSH_IOV_CNT 64
+
+/* Result of writing a queue to a non-blocking socket */
+typedef enum flush_status_t
+{
+	FLUSH_STATUS_DONE,
+	FLUSH_STATUS_AGAIN,
+	FLUSH_STATUS_ERROR
+}
+flush_status_t;
+
+/* Struct for a frame waiting to be sent.  The queue holds a reference to
+the buffer, which other queues may share.  Frames the peer cannot do
+without (keys, for example) are never dropped.  Ephemeral frames (presence)
+are droppable and go before anything else */
+typedef struct out_frame_t
+{
+	bool is_droppable;
+	bool is_ephemeral;
+	frame_buf_t *buf;
+}
+out_frame_t;
+
+/* Struct for a client's bounded outbound queue.  Frames sit in a ring in
+send order and head_offset bytes of the head frame have already been
+written.  The first sending_cnt frames are in a send the kernel has not
+finished yet, and are never dropped */
+typedef struct out_queue_t
+{
+	int frame_cnt;
+	int sending_cnt;
+	int frame_cap;
+	int head;
+	int head_offset;
+	int queued_len;
+	out_frame_t *frame_ring;
+}
+out_queue_t;
+
+void init_out_queue(out_queue_t *out_queue);
+void terminate_out_queue(out_queue_t *out_queue);
+
+bool push_out_frame
+(
+	out_queue_t *out_queue,
+	frame_buf_t *buf,
+	bool is_droppable
+);
+
+bool push_ephemeral_out_frame(out_queue_t *out_queue, frame_buf_t *buf);
+int drop_oldest_out_frames(out_queue_t *out_queue, int max_queued_len);
+int drop_ephemeral_out_frames(out_queue_t *out_queue, int max_queued_len);
+flush_status_t flush_out_queue
+(
+	out_queue_t *out_queue,
+	int fd,
+	unsigned long *send_call_cnt
+);
+
+int gather_out_frames
+(
+	const out_queue_t *out_queue,
+	int max_frame_cnt,
+	struct iovec iov_arr[],
+	frame_buf_t *buf_arr[]
+);
+
+void advance_out_queue(out_queue_t *out_queue, size_t len);
+
+flush_status_t finish_out_frame
+(
+	out_queue_t *out_queue,
+	int fd,
+	unsigned long *send_call_cnt
+);
+
+#endif /* OUT_QUEUE_H */
@@ -0,0 +1,274 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#include "SDL2/SDL_net.h"
+#include "src/err.h"
+#include "src/net.h"
+#include "src/presence.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+/* Room for a small server's users before the first resize.  Ids are masked
+into the buckets, so the count has to stay a power of two */
+static const int INITIAL_BUCKET_CNT = 64;
+
+static presence_node_t **find_presence_link
+(
+	presence_table_t *presence_table,
+	uint32_t id
+)
+{
+	/* Ids are handed out in order, so the low bits spread well enough */
+	uint32_t bucket = id & (presence_table->bucket_cnt - 1);
+	presence_node_t **link = &presence_table->bucket_arr[bucket];
+	
+	while(*link != NULL && (*link)->presence.id != id)
+		link = &(*link)->next;
+	
+	return link;
+}
+
+static void grow_presence_table(presence_table_t *presence_table)
+{
+	int new_bucket_cnt = presence_table->bucket_cnt * 2;
+	presence_node_t **new_bucket_arr =
+		calloc(new_bucket_cnt, sizeof(presence_node_t *));
+	
+	/* The users stay where they are.  Finding one by id just takes a few
+	more steps until the next update tries again */
+	if(new_bucket_arr == NULL) return;
+	
+	for(int i = 0; i < presence_table->bucket_cnt; i++)
+	{
+		presence_node_t *node = presence_table->bucket_arr[i];
+		
+		while(node != NULL)
+		{
+			presence_node_t *next = node->next;
+			uint32_t bucket = node->presence.id & (new_bucket_cnt - 1);
+			
+			node->next = new_bucket_arr[bucket];
+			new_bucket_arr[bucket] = node;
+			node = next;
+		}
+	}
+	
+	free(presence_table->bucket_arr);
+	presence_table->bucket_arr = new_bucket_arr;
+	presence_table->bucket_cnt = new_bucket_cnt;
+}
+
+static int write_presence_str(unsigned char *payload, const char *str)
+{
+	int str_len = strlen(str);
+	
+	payload[0] = str_len;
+	memcpy(payload + 1, str, str_len);
+	
+	return 1 + str_len;
+}
+
+static int read_presence_str
+(
+	const unsigned char *payload,
+	int payload_len,
+	char *str,
+	int max_str_len
+)
+{
+	if(payload_len < 1 || payload[0] > max_str_len) return -1;
+	
+	int str_len = payload[0];
+	
+	if(1 + str_len > payload_len) return -1;
+	
+	memcpy(str, payload + 1, str_len);
+	str[str_len] = '\0';
+	
+	return 1 + str_len;
+}
+
+int write_presence(unsigned char *payload, const presence_t *presence)
+{
+	int len = PRESENCE_ID_LEN + 1;
+	
+	SDLNet_Write32(presence->id, payload);
+	payload[PRESENCE_ID_LEN] = presence->state;
+	
+	if(presence->is_self) payload[PRESENCE_ID_LEN] |= PRESENCE_SELF_BIT;
+	
+	len += write_presence_str(payload + len, presence->username);
+	len += write_presence_str(payload + len, presence->channel_name);
+	
+	return len;
+}
+
+int read_presence
+(
+	const unsigned char *payload,
+	int payload_len,
+	presence_t *presence
+)
+{
+	int len = PRESENCE_ID_LEN + 1;
+	
+	if(payload_len < len) return -1;
+	
+	presence->id = SDLNet_Read32(payload);
+	presence->change_ticks = 0;
+	presence->is_self = payload[PRESENCE_ID_LEN] & PRESENCE_SELF_BIT;
+	presence->state = payload[PRESENCE_ID_LEN] & ~PRESENCE_SELF_BIT;
+	
+	if(presence->id == 0 || presence->state >= PRESENCE_STATE_CNT) return -1;
+	
+	int str_len = read_presence_str
+	(
+		payload + len,
+		payload_len - len,
+		presence->username,
+		MAX_USERNAME_LEN - 1
+	);
+	
+	if(str_len < 0) return -1;
+	
+	len += str_len;
+	str_len = read_presence_str
+	(
+		payload + len,
+		payload_len - len,
+		presence->channel_name,
+		MAX_CHANNEL_NAME_LEN
+	);
+	
+	if(str_len < 0) return -1;
+	
+	return len + str_len;
+}
+
+bool init_presence_table(presence_table_t *presence_table)
+{
+	presence_table->bucket_cnt = INITIAL_BUCKET_CNT;
+	presence_table->presence_cnt = 0;
+	presence_table->bucket_arr =
+		calloc(INITIAL_BUCKET_CNT, sizeof(presence_node_t *));
+	
+	if(presence_table->bucket_arr == NULL)
+	{
+		print_err("init_presence_table", "Could not allocate the users");
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_presence_table(presence_table_t *presence_table)
+{
+	if(presence_table->bucket_arr != NULL)
+		clear_presence_table(presence_table);
+	
+	free(presence_table->bucket_arr);
+	presence_table->bucket_arr = NULL;
+}
+
+void clear_presence_table(presence_table_t *presence_table)
+{
+	for(int i = 0; i < presence_table->bucket_cnt; i++)
+	{
+		presence_node_t *node = presence_table->bucket_arr[i];
+		
+		while(node != NULL)
+		{
+			presence_node_t *next = node->next;
+			
+			free(node);
+			node = next;
+		}
+		
+		presence_table->bucket_arr[i] = NULL;
+	}
+	
+	presence_table->presence_cnt = 0;
+}
+
+bool update_presence_table
+(
+	presence_table_t *presence_table,
+	const presence_t *presence
+)
+{
+	presence_node_t **link = find_presence_link(presence_table, presence->id);
+	presence_node_t *node = *link;
+	
+	if(presence->state == PRESENCE_STATE_OFFLINE)
+	{
+		if(node == NULL) return true;
+		
+		*link = node->next;
+		free(node);
+		presence_table->presence_cnt -= 1;
+		
+		return true;
+	}
+	
+	if(node == NULL)
+	{
+		node = malloc(sizeof(*node));
+		
+		if(node == NULL)
+		{
+			print_err("update_presence_table", "Could not allocate the user");
+			return false;
+		}
+		
+		node->next = NULL;
+		*link = node;
+		presence_table->presence_cnt += 1;
+	}
+	
+	node->presence = *presence;
+	node->presence.is_self = false;
+	
+	/* Every presence frame looks its users up by id, so there are never
+	more users than buckets */
+	if(presence_table->presence_cnt > presence_table->bucket_cnt)
+		grow_presence_table(presence_table);
+	
+	return true;
+}
+
+void read_presence_table
+(
+	presence_table_t *presence_table,
+	presence_reader_t reader,
+	void *data
+)
+{
+	for(int i = 0; i < presence_table->bucket_cnt; i++)
+	{
+		presence_node_t *node = presence_table->bucket_arr[i];
+		
+		for(; node != NULL; node = node->next)
+			if(!reader(data, &node->presence)) return;
+	}
+}
@@ -0,0 +1,120 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* A client sends a PRESENCE frame holding just a state byte whenever its
+user goes online, away or starts typing.  Clients that never send one are
+never sent any, so older clients do not see frames they cannot read.  The
+first one (even before logging in) asks for a snapshot, and after that the
+server sends batches
+of entries, each a 32-bit big-endian presence id, a state byte, and the
+username and channel as a length byte followed by the bytes.  The channel
+is only set for typing.  The top bit of the state marks the receiver's own
+entry, which starts a snapshot of the whole room */
+#define PRESENCE_ID_LEN 4
+#define PRESENCE_SELF_BIT 0x80
+#define MAX_PRESENCE_LEN \
+	(PRESENCE_ID_LEN + 3 + MAX_USERNAME_LEN - 1 + MAX_CHANNEL_NAME_LEN)
+
+/* A typing user is heard from again every interval, and counts as having
+stopped after the timeout without a word.  Both in milliseconds */
+#define PRESENCE_TYPING_INTERVAL 3000
+#define PRESENCE_TYPING_TIMEOUT 6000
+
+typedef enum presence_state_t
+{
+	PRESENCE_STATE_OFFLINE,
+	PRESENCE_STATE_ONLINE,
+	PRESENCE_STATE_AWAY,
+	PRESENCE_STATE_TYPING,
+	PRESENCE_STATE_CNT
+}
+presence_state_t;
+
+/* Struct for what is known about one user.  The id is the server's, and
+tells apart users that share a name.  Zero is never handed out.
+change_ticks is not sent.  A receiver stamps it to time out typing */
+typedef struct presence_t
+{
+	bool is_self;
+	uint32_t id;
+	uint32_t change_ticks;
+	presence_state_t state;
+	char username[MAX_USERNAME_LEN];
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+}
+presence_t;
+
+typedef struct presence_node_t
+{
+	presence_t presence;
+	struct presence_node_t *next;
+}
+presence_node_t;
+
+/* Struct for the users currently present, hashed by id.  Going offline
+removes a user */
+typedef struct presence_table_t
+{
+	int bucket_cnt;
+	int presence_cnt;
+	presence_node_t **bucket_arr;
+}
+presence_table_t;
+
+/* Called for every user in a table until it returns false.  The entry may
+be changed, but not removed */
+typedef bool (*presence_reader_t)(void *data, presence_t *presence);
+
+int write_presence(unsigned char *payload, const presence_t *presence);
+
+int read_presence
+(
+	const unsigned char *payload,
+	int payload_len,
+	presence_t *presence
+);
+
+bool init_presence_table(presence_table_t *presence_table);
+void terminate_presence_table(presence_table_t *presence_table);
+void clear_presence_table(presence_table_t *presence_table);
+
+bool update_presence_table
+(
+	presence_table_t *presence_table,
+	const presence_t *presence
+);
+
+void read_presence_table
+(
+	presence_table_t *presence_table,
+	presence_reader_t reader,
+	void *data
+);
+
+#endif /* PRESENCE_H */
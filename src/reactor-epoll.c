@@ -0,0 +1,229 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "src/err.h"
+#include "src/reactor-uring.h"
+#include "src/reactor.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include "sys/epoll.h"
+#include "unistd.h"
+
+/* With io_uring preferred, every call is handed to the ring and the epoll
+descriptor is never opened.  The ring is only there if it was built in */
+struct reactor_t
+{
+	int epoll_fd;
+	uring_t *uring;
+	struct epoll_event epoll_event_arr[REACTOR_EVENT_CNT];
+};
+
+/* Only set before the reactors are created, on the main thread */
+static bool is_uring_preferred = false;
+static bool is_uring_used = false;
+
+void prefer_uring_reactor(void)
+{
+	is_uring_preferred = true;
+}
+
+bool init_reactor(reactor_t **reactor)
+{
+	*reactor = malloc(sizeof(**reactor));
+	
+	if(*reactor == NULL)
+	{
+		print_err("init_reactor", "Could not allocate the reactor");
+		return false;
+	}
+	
+	(*reactor)->epoll_fd = -1;
+	(*reactor)->uring = NULL;
+	
+	/* A kernel that turns the first ring down will turn down the rest, so
+	the fallback is only reported once */
+	if(is_uring_preferred)
+	{
+		if(init_uring(&(*reactor)->uring))
+		{
+			is_uring_used = true;
+			return true;
+		}
+		
+		print_err("init_reactor", "Falling back to epoll");
+		is_uring_preferred = false;
+	}
+	
+	(*reactor)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	
+	if((*reactor)->epoll_fd < 0)
+	{
+		print_errno_err("epoll_create1");
+		free(*reactor);
+		*reactor = NULL;
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_reactor(reactor_t **reactor)
+{
+	if(*reactor == NULL) return;
+	
+	terminate_uring(&(*reactor)->uring);
+	
+	if((*reactor)->epoll_fd >= 0) close((*reactor)->epoll_fd);
+	
+	free(*reactor);
+	*reactor = NULL;
+}
+
+bool add_to_reactor(reactor_t *reactor, int fd, void *data)
+{
+	if(reactor->uring != NULL) return add_to_uring(reactor->uring, fd, data);
+	
+	/* Edge-triggered, so the owner must drain a descriptor (read or write
+	until EAGAIN) every time it is reported.  Write readiness is always
+	subscribed to; with EPOLLET it is only reported when the socket goes
+	from full to writable again */
+	struct epoll_event event;
+	
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = data;
+	
+	if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+	{
+		print_errno_err("epoll_ctl");
+		return false;
+	}
+	
+	return true;
+}
+
+bool accept_with_reactor(reactor_t *reactor, int fd, void *data)
+{
+	if(reactor->uring != NULL)
+		return accept_with_uring(reactor->uring, fd, data);
+	
+	return add_to_reactor(reactor, fd, data);
+}
+
+bool read_with_reactor(reactor_t *reactor, int fd, void *data)
+{
+	if(reactor->uring != NULL) return read_with_uring(reactor->uring, fd, data);
+	
+	return add_to_reactor(reactor, fd, data);
+}
+
+void remove_from_reactor(reactor_t *reactor, int fd)
+{
+	if(reactor->uring != NULL)
+	{
+		remove_from_uring(reactor->uring, fd);
+		return;
+	}
+	
+	/* Closing the descriptor removes it too, but only once every duplicate
+	of it is closed, so remove it explicitly */
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+bool does_reactor_do_io(const reactor_t *reactor)
+{
+	return reactor->uring != NULL;
+}
+
+bool send_with_reactor
+(
+	reactor_t *reactor,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+)
+{
+	if(reactor->uring != NULL)
+		return send_with_uring(reactor->uring, fd, msg, data);
+	
+	print_err("send_with_reactor", "epoll only reports readiness");
+	return false;
+}
+
+bool set_reactor_write_interest
+(
+	reactor_t *reactor,
+	int fd,
+	void *data,
+	bool is_interested
+)
+{
+	/* Nothing to change.  io_uring sends are never waited on, and EPOLLOUT
+	is always subscribed and, being edge-triggered, costs nothing while the
+	socket stays writable */
+	return true;
+}
+
+int wait_for_reactor
+(
+	reactor_t *reactor,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+)
+{
+	if(reactor->uring != NULL)
+		return wait_for_uring(reactor->uring, event_arr, timeout);
+	
+	int ready_cnt = epoll_wait
+	(
+		reactor->epoll_fd,
+		reactor->epoll_event_arr,
+		REACTOR_EVENT_CNT,
+		timeout
+	);
+	
+	if(ready_cnt < 0)
+	{
+		/* A signal interrupting the wait is not an error */
+		if(errno != EINTR) print_errno_err("epoll_wait");
+		return 0;
+	}
+	
+	for(int i = 0; i < ready_cnt; i++)
+	{
+		uint32_t events = reactor->epoll_event_arr[i].events;
+		
+		event_arr[i].data = reactor->epoll_event_arr[i].data.ptr;
+		event_arr[i].type = REACTOR_EVENT_TYPE_READY;
+		event_arr[i].is_readable = (events & EPOLLIN) != 0;
+		event_arr[i].is_writable = (events & EPOLLOUT) != 0;
+		
+		event_arr[i].is_hung_up =
+			(events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+	}
+	
+	return ready_cnt;
+}
+
+const char *get_reactor_name(void)
+{
+	return is_uring_used ? "io_uring" : "epoll";
+}
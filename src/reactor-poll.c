@@ -0,0 +1,246 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "poll.h"
+#include "src/err.h"
+#include "src/reactor.h"
+#include "stdbool.h"
+#include "stdlib.h"
+
+/* Portable fallback for systems without epoll.  It is level-triggered, which
+is harmless since owners drain descriptors anyway, and it scans every
+registered descriptor on each wait */
+
+static const int INITIAL_POLL_FD_CAP = 64;
+
+struct reactor_t
+{
+	int poll_fd_cnt;
+	int poll_fd_cap;
+	struct pollfd *poll_fd_arr;
+	void **data_arr;
+};
+
+static bool grow_reactor(reactor_t *reactor)
+{
+	int new_cap = reactor->poll_fd_cap * 2;
+	
+	struct pollfd *new_poll_fd_arr = realloc
+	(
+		reactor->poll_fd_arr,
+		new_cap * sizeof(*new_poll_fd_arr)
+	);
+	
+	if(new_poll_fd_arr == NULL) return false;
+	
+	reactor->poll_fd_arr = new_poll_fd_arr;
+	
+	void **new_data_arr = realloc
+	(
+		reactor->data_arr,
+		new_cap * sizeof(*new_data_arr)
+	);
+	
+	if(new_data_arr == NULL) return false;
+	
+	reactor->data_arr = new_data_arr;
+	reactor->poll_fd_cap = new_cap;
+	
+	return true;
+}
+
+void prefer_uring_reactor(void)
+{
+	/* Nothing to fall back from.  poll is all there is */
+	print_err("prefer_uring_reactor", "io_uring is only available on Linux");
+}
+
+bool init_reactor(reactor_t **reactor)
+{
+	*reactor = calloc(1, sizeof(**reactor));
+	
+	if(*reactor != NULL)
+	{
+		(*reactor)->poll_fd_cap = INITIAL_POLL_FD_CAP;
+		
+		(*reactor)->poll_fd_arr =
+			malloc(INITIAL_POLL_FD_CAP * sizeof(struct pollfd));
+			
+		(*reactor)->data_arr = malloc(INITIAL_POLL_FD_CAP * sizeof(void *));
+	}
+	
+	if
+	(
+		*reactor == NULL ||
+		(*reactor)->poll_fd_arr == NULL ||
+		(*reactor)->data_arr == NULL
+	)
+	{
+		print_err("init_reactor", "Could not allocate the reactor");
+		terminate_reactor(reactor);
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_reactor(reactor_t **reactor)
+{
+	if(*reactor == NULL) return;
+	
+	free((*reactor)->poll_fd_arr);
+	free((*reactor)->data_arr);
+	free(*reactor);
+	*reactor = NULL;
+}
+
+bool add_to_reactor(reactor_t *reactor, int fd, void *data)
+{
+	if(reactor->poll_fd_cnt == reactor->poll_fd_cap && !grow_reactor(reactor))
+	{
+		print_err("add_to_reactor", "Could not grow the reactor");
+		return false;
+	}
+	
+	int i = reactor->poll_fd_cnt;
+	
+	reactor->poll_fd_arr[i].fd = fd;
+	reactor->poll_fd_arr[i].events = POLLIN;
+	reactor->poll_fd_arr[i].revents = 0;
+	reactor->data_arr[i] = data;
+	reactor->poll_fd_cnt += 1;
+	
+	return true;
+}
+
+bool accept_with_reactor(reactor_t *reactor, int fd, void *data)
+{
+	/* The owner accepts when the socket is reported readable */
+	return add_to_reactor(reactor, fd, data);
+}
+
+bool read_with_reactor(reactor_t *reactor, int fd, void *data)
+{
+	return add_to_reactor(reactor, fd, data);
+}
+
+void remove_from_reactor(reactor_t *reactor, int fd)
+{
+	/* Swap the last descriptor into the removed one's place */
+	for(int i = 0; i < reactor->poll_fd_cnt; i++)
+		if(reactor->poll_fd_arr[i].fd == fd)
+		{
+			int last = reactor->poll_fd_cnt - 1;
+			
+			reactor->poll_fd_arr[i] = reactor->poll_fd_arr[last];
+			reactor->data_arr[i] = reactor->data_arr[last];
+			reactor->poll_fd_cnt -= 1;
+			
+			return;
+		}
+}
+
+bool does_reactor_do_io(const reactor_t *reactor)
+{
+	return false;
+}
+
+bool send_with_reactor
+(
+	reactor_t *reactor,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+)
+{
+	print_err("send_with_reactor", "poll only reports readiness");
+	return false;
+}
+
+bool set_reactor_write_interest
+(
+	reactor_t *reactor,
+	int fd,
+	void *data,
+	bool is_interested
+)
+{
+	/* poll is level-triggered, so POLLOUT is only asked for while there is
+	something waiting to be written */
+	for(int i = 0; i < reactor->poll_fd_cnt; i++)
+		if(reactor->poll_fd_arr[i].fd == fd)
+		{
+			reactor->poll_fd_arr[i].events =
+				is_interested ? POLLIN | POLLOUT : POLLIN;
+			
+			return true;
+		}
+	
+	return false;
+}
+
+int wait_for_reactor
+(
+	reactor_t *reactor,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+)
+{
+	int ready_cnt = poll(reactor->poll_fd_arr, reactor->poll_fd_cnt, timeout);
+	
+	if(ready_cnt < 0)
+	{
+		if(errno != EINTR) print_errno_err("poll");
+		return 0;
+	}
+	
+	int event_cnt = 0;
+	
+	for
+	(
+		int i = 0;
+		i < reactor->poll_fd_cnt && event_cnt < REACTOR_EVENT_CNT;
+		i++
+	)
+	{
+		short revents = reactor->poll_fd_arr[i].revents;
+		
+		if(revents == 0) continue;
+		
+		event_arr[event_cnt].data = reactor->data_arr[i];
+		event_arr[event_cnt].type = REACTOR_EVENT_TYPE_READY;
+		event_arr[event_cnt].is_readable = (revents & POLLIN) != 0;
+		event_arr[event_cnt].is_writable = (revents & POLLOUT) != 0;
+		
+		event_arr[event_cnt].is_hung_up =
+			(revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+		
+		event_cnt += 1;
+	}
+	
+	return event_cnt;
+}
+
+const char *get_reactor_name(void)
+{
+	return "poll";
+}
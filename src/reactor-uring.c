@@ -0,0 +1,781 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#include "errno.h"
+#include "linux/io_uring.h"
+#include "src/err.h"
+#include "src/reactor-uring.h"
+#include "src/reactor.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/epoll.h"
+#include "sys/mman.h"
+#include "sys/socket.h"
+#include "sys/syscall.h"
+#include "unistd.h"
+
+/* Deferred task running is the newest thing used here.  Older headers
+cannot build this file, so it is left out unless make io_uring=yes */
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#error "io_uring needs the headers of Linux 6.1 or newer"
+#endif
+
+/* Socket I/O through io_uring.  Listening sockets get one multishot accept
+and clients one multishot recv, both armed once when they are added.  recv
+picks its buffers from a ring of them registered with the kernel, so no
+memory is tied up by idle clients.  Sends are SENDMSG calls straight from
+the owner's iovecs, with a completion for each.  Anything else, like the
+shards' wake pipes, gets a multishot poll and is reported as ready the way
+epoll would.  Arming, sending and removing only queue submissions.  They
+reach the kernel with the next wait, in the same io_uring_enter call that
+collects the completions, so a loop pass costs one system call however
+much it did.  Poll masks share their bits with epoll's */
+
+static const unsigned SQ_ENTRY_CNT = 1024;
+static const unsigned CQ_ENTRY_CNT = 8192;
+static const int INITIAL_ENTRY_CAP = 64;
+
+/* The provided buffers.  Both counts must be powers of two */
+#define RECV_BUF_CNT 512
+static const unsigned RECV_BUF_LEN = 4096;
+static const unsigned short RECV_BUF_GROUP = 0;
+
+/* What a submission was for, in the low bits of its user data.  Above
+them are the descriptor and its generation, except for SEND, where they
+are the owner's pointer (which is why it has to be aligned to 8 bytes).
+Completions of cancellations carry CANCEL_USER_DATA instead */
+typedef enum uring_op_t
+{
+	URING_OP_POLL,
+	URING_OP_RECV,
+	URING_OP_ACCEPT,
+	URING_OP_SEND
+}
+uring_op_t;
+
+static const int URING_OP_BIT_CNT = 3;
+static const uint64_t URING_OP_MASK = 7;
+static const uint64_t CANCEL_USER_DATA = UINT64_MAX;
+
+/* Struct for what the ring knows about a descriptor.  gen changes every
+time the descriptor is removed, so completions of operations armed before
+then are told apart even once the number has been reused.  A stalled entry
+is an accept that failed, which is armed again on the next wait */
+typedef struct uring_entry_t
+{
+	bool is_active;
+	bool is_stalled;
+	uring_op_t op;
+	uint32_t gen;
+	void *data;
+}
+uring_entry_t;
+
+struct uring_t
+{
+	int ring_fd;
+	bool is_enabled;
+	unsigned sq_entry_cnt;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_index_arr;
+	struct io_uring_sqe *sqe_arr;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqe_arr;
+	void *ring_map;
+	size_t ring_map_len;
+	size_t sqe_map_len;
+	int entry_cap;
+	int stalled_cnt;
+	uring_entry_t *entry_arr;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	unsigned char *recv_buf_arr;
+	unsigned short buf_tail;
+	
+	/* Buffers handed out with the last events, given back on the next
+	wait */
+	int lent_buf_cnt;
+	unsigned short lent_buf_arr[REACTOR_EVENT_CNT];
+};
+
+static uint64_t make_user_data(uint32_t gen, int fd, uring_op_t op)
+{
+	return ((uint64_t)gen << 32) | ((uint64_t)fd << URING_OP_BIT_CNT) | op;
+}
+
+static int enter_uring(uring_t *uring, unsigned min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	
+	/* The ring starts disabled, so its single issuer is whichever thread
+	uses it first rather than the one that set it up */
+	if(!uring->is_enabled)
+	{
+		if
+		(
+			syscall
+			(
+				__NR_io_uring_register,
+				uring->ring_fd,
+				IORING_REGISTER_ENABLE_RINGS,
+				NULL,
+				0
+			) != 0
+		)
+		{
+			print_errno_err("io_uring_register");
+			return -1;
+		}
+		
+		uring->is_enabled = true;
+	}
+	
+	memset(&arg, 0, sizeof(arg));
+	
+	/* A negative timeout waits for as long as it takes */
+	if(timeout >= 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	
+	/* The kernel's head says how much of the queue it has taken so far */
+	unsigned submit_cnt =
+		*uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	
+	return syscall
+	(
+		__NR_io_uring_enter,
+		uring->ring_fd,
+		submit_cnt,
+		min_complete,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg,
+		sizeof(arg)
+	);
+}
+
+static bool queue_uring_sqe(uring_t *uring, const struct io_uring_sqe *sqe)
+{
+	unsigned tail = *uring->sq_tail;
+	
+	/* A full queue is handed to the kernel straight away */
+	if
+	(
+		tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) ==
+		uring->sq_entry_cnt
+	)
+	{
+		enter_uring(uring, 0, 0);
+		
+		if
+		(
+			tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) ==
+			uring->sq_entry_cnt
+		)
+		{
+			print_err("queue_uring_sqe", "Submission queue is full");
+			return false;
+		}
+	}
+	
+	unsigned index = tail & *uring->sq_mask;
+	
+	uring->sqe_arr[index] = *sqe;
+	uring->sq_index_arr[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	
+	return true;
+}
+
+/* Arms whatever the descriptor's entry says it is for */
+static bool arm_uring_entry(uring_t *uring, int fd)
+{
+	uring_entry_t *entry = &uring->entry_arr[fd];
+	struct io_uring_sqe sqe;
+	
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.fd = fd;
+	sqe.user_data = make_user_data(entry->gen, fd, entry->op);
+	
+	if(entry->op == URING_OP_RECV)
+	{
+		sqe.opcode = IORING_OP_RECV;
+		sqe.ioprio = IORING_RECV_MULTISHOT;
+		sqe.flags = IOSQE_BUFFER_SELECT;
+		sqe.buf_group = RECV_BUF_GROUP;
+	}
+	else if(entry->op == URING_OP_ACCEPT)
+	{
+		sqe.opcode = IORING_OP_ACCEPT;
+		sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	else
+	{
+		uint32_t poll_mask = EPOLLIN | EPOLLRDHUP;
+		
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.len = IORING_POLL_ADD_MULTI;
+		
+		/* The kernel reads the mask as two swapped 16-bit halves on
+		big-endian machines */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		poll_mask = (poll_mask << 16) | (poll_mask >> 16);
+#endif
+		
+		sqe.poll32_events = poll_mask;
+	}
+	
+	return queue_uring_sqe(uring, &sqe);
+}
+
+static void lend_uring_buf(uring_t *uring, unsigned short buf_id)
+{
+	struct io_uring_buf *buf =
+		&uring->buf_ring->bufs[uring->buf_tail & (RECV_BUF_CNT - 1)];
+	
+	buf->addr = (uint64_t)(uintptr_t)
+		(uring->recv_buf_arr + (size_t)buf_id * RECV_BUF_LEN);
+	
+	buf->len = RECV_BUF_LEN;
+	buf->bid = buf_id;
+	uring->buf_tail += 1;
+}
+
+static void publish_uring_bufs(uring_t *uring)
+{
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static bool init_uring_bufs(uring_t *uring)
+{
+	uring->buf_ring_len = RECV_BUF_CNT * sizeof(struct io_uring_buf);
+	
+	/* The ring has to be page aligned */
+	uring->buf_ring = mmap
+	(
+		NULL,
+		uring->buf_ring_len,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	
+	if(uring->buf_ring == MAP_FAILED)
+	{
+		print_errno_err("mmap");
+		uring->buf_ring = NULL;
+		return false;
+	}
+	
+	uring->recv_buf_arr = malloc((size_t)RECV_BUF_CNT * RECV_BUF_LEN);
+	
+	if(uring->recv_buf_arr == NULL)
+	{
+		print_err("init_uring_bufs", "Could not allocate the buffers");
+		return false;
+	}
+	
+	struct io_uring_buf_reg reg;
+	
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = RECV_BUF_CNT;
+	reg.bgid = RECV_BUF_GROUP;
+	
+	if
+	(
+		syscall
+		(
+			__NR_io_uring_register,
+			uring->ring_fd,
+			IORING_REGISTER_PBUF_RING,
+			&reg,
+			1
+		) != 0
+	)
+	{
+		print_errno_err("io_uring_register");
+		return false;
+	}
+	
+	for(int i = 0; i < RECV_BUF_CNT; i++) lend_uring_buf(uring, i);
+	
+	publish_uring_bufs(uring);
+	
+	return true;
+}
+
+bool init_uring(uring_t **uring)
+{
+	struct io_uring_params params;
+	
+	memset(&params, 0, sizeof(params));
+	params.cq_entries = CQ_ENTRY_CNT;
+	
+	/* Only the shard's own thread ever touches its ring, which lets the
+	kernel run completion work when that thread waits instead of
+	interrupting it */
+	params.flags =
+		IORING_SETUP_CQSIZE |
+		IORING_SETUP_SUBMIT_ALL |
+		IORING_SETUP_SINGLE_ISSUER |
+		IORING_SETUP_DEFER_TASKRUN |
+		IORING_SETUP_R_DISABLED;
+	
+	/* Kernels without io_uring, with it switched off or older than 6.1 fail
+	right here */
+	int ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRY_CNT, &params);
+	
+	if(ring_fd < 0)
+	{
+		print_errno_err("io_uring_setup");
+		return false;
+	}
+	
+	unsigned feature_mask =
+		IORING_FEAT_SINGLE_MMAP |
+		IORING_FEAT_NODROP |
+		IORING_FEAT_EXT_ARG;
+	
+	if((params.features & feature_mask) != feature_mask)
+	{
+		print_err("init_uring", "The kernel's io_uring is too old");
+		close(ring_fd);
+		return false;
+	}
+	
+	*uring = malloc(sizeof(**uring));
+	
+	if(*uring == NULL)
+	{
+		print_err("init_uring", "Could not allocate the ring");
+		close(ring_fd);
+		return false;
+	}
+	
+	(*uring)->ring_fd = ring_fd;
+	(*uring)->is_enabled = false;
+	(*uring)->sq_entry_cnt = params.sq_entries;
+	(*uring)->sqe_arr = MAP_FAILED;
+	(*uring)->entry_cap = 0;
+	(*uring)->stalled_cnt = 0;
+	(*uring)->entry_arr = NULL;
+	(*uring)->buf_ring = NULL;
+	(*uring)->recv_buf_arr = NULL;
+	(*uring)->buf_tail = 0;
+	(*uring)->lent_buf_cnt = 0;
+	
+	/* Both rings share one mapping.  The entries have their own */
+	size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	
+	size_t cq_len =
+		params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	
+	(*uring)->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+	(*uring)->sqe_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	
+	(*uring)->ring_map = mmap
+	(
+		NULL,
+		(*uring)->ring_map_len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		ring_fd,
+		IORING_OFF_SQ_RING
+	);
+	
+	if((*uring)->ring_map != MAP_FAILED)
+	{
+		(*uring)->sqe_arr = mmap
+		(
+			NULL,
+			(*uring)->sqe_map_len,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,
+			ring_fd,
+			IORING_OFF_SQES
+		);
+	}
+	
+	if((*uring)->ring_map == MAP_FAILED || (*uring)->sqe_arr == MAP_FAILED)
+	{
+		print_errno_err("mmap");
+		terminate_uring(uring);
+		return false;
+	}
+	
+	unsigned char *ring_map = (*uring)->ring_map;
+	
+	(*uring)->sq_head = (unsigned *)(ring_map + params.sq_off.head);
+	(*uring)->sq_tail = (unsigned *)(ring_map + params.sq_off.tail);
+	(*uring)->sq_mask = (unsigned *)(ring_map + params.sq_off.ring_mask);
+	(*uring)->sq_index_arr = (unsigned *)(ring_map + params.sq_off.array);
+	(*uring)->cq_head = (unsigned *)(ring_map + params.cq_off.head);
+	(*uring)->cq_tail = (unsigned *)(ring_map + params.cq_off.tail);
+	(*uring)->cq_mask = (unsigned *)(ring_map + params.cq_off.ring_mask);
+	
+	(*uring)->cqe_arr =
+		(struct io_uring_cqe *)(ring_map + params.cq_off.cqes);
+	
+	if(!init_uring_bufs(*uring))
+	{
+		terminate_uring(uring);
+		return false;
+	}
+	
+	return true;
+}
+
+void terminate_uring(uring_t **uring)
+{
+	if(*uring == NULL) return;
+	
+	/* Closing the ring cancels everything still armed and unregisters the
+	buffers, so they are only freed after it */
+	if((*uring)->sqe_arr != MAP_FAILED)
+		munmap((*uring)->sqe_arr, (*uring)->sqe_map_len);
+	
+	if((*uring)->ring_map != MAP_FAILED)
+		munmap((*uring)->ring_map, (*uring)->ring_map_len);
+	
+	close((*uring)->ring_fd);
+	
+	if((*uring)->buf_ring != NULL)
+		munmap((*uring)->buf_ring, (*uring)->buf_ring_len);
+	
+	free((*uring)->recv_buf_arr);
+	free((*uring)->entry_arr);
+	free(*uring);
+	*uring = NULL;
+}
+
+static bool add_uring_entry(uring_t *uring, int fd, uring_op_t op, void *data)
+{
+	if(fd >= uring->entry_cap)
+	{
+		int new_cap = uring->entry_cap ? uring->entry_cap : INITIAL_ENTRY_CAP;
+		
+		while(new_cap <= fd) new_cap *= 2;
+		
+		uring_entry_t *new_entry_arr = realloc
+		(
+			uring->entry_arr,
+			new_cap * sizeof(uring_entry_t)
+		);
+		
+		if(new_entry_arr == NULL)
+		{
+			print_err("add_uring_entry", "Could not grow the descriptor table");
+			return false;
+		}
+		
+		memset
+		(
+			new_entry_arr + uring->entry_cap,
+			0,
+			(new_cap - uring->entry_cap) * sizeof(uring_entry_t)
+		);
+		
+		uring->entry_arr = new_entry_arr;
+		uring->entry_cap = new_cap;
+	}
+	
+	uring_entry_t *entry = &uring->entry_arr[fd];
+	
+	entry->is_active = true;
+	entry->is_stalled = false;
+	entry->op = op;
+	entry->data = data;
+	
+	if(arm_uring_entry(uring, fd)) return true;
+	
+	entry->is_active = false;
+	return false;
+}
+
+bool add_to_uring(uring_t *uring, int fd, void *data)
+{
+	return add_uring_entry(uring, fd, URING_OP_POLL, data);
+}
+
+bool accept_with_uring(uring_t *uring, int fd, void *data)
+{
+	return add_uring_entry(uring, fd, URING_OP_ACCEPT, data);
+}
+
+bool read_with_uring(uring_t *uring, int fd, void *data)
+{
+	return add_uring_entry(uring, fd, URING_OP_RECV, data);
+}
+
+void remove_from_uring(uring_t *uring, int fd)
+{
+	if(fd < 0 || fd >= uring->entry_cap) return;
+	
+	uring_entry_t *entry = &uring->entry_arr[fd];
+	
+	if(!entry->is_active) return;
+	
+	/* An armed operation holds on to the socket, so closing the descriptor
+	alone would not end the connection.  Sends are not cancelled here.
+	They finish, or fail once their owner shuts the socket down */
+	struct io_uring_sqe sqe;
+	
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = make_user_data(entry->gen, fd, entry->op);
+	sqe.user_data = CANCEL_USER_DATA;
+	
+	queue_uring_sqe(uring, &sqe);
+	
+	if(entry->is_stalled) uring->stalled_cnt -= 1;
+	
+	entry->is_active = false;
+	entry->is_stalled = false;
+	entry->gen += 1;
+}
+
+bool send_with_uring
+(
+	uring_t *uring,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+)
+{
+	if(((uintptr_t)data & URING_OP_MASK) != 0)
+	{
+		print_err("send_with_uring", "Send data is not aligned");
+		return false;
+	}
+	
+	struct io_uring_sqe sqe;
+	
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_SENDMSG;
+	sqe.fd = fd;
+	sqe.addr = (uint64_t)(uintptr_t)msg;
+	sqe.len = 1;
+	sqe.msg_flags = MSG_NOSIGNAL;
+	sqe.user_data = (uint64_t)(uintptr_t)data | URING_OP_SEND;
+	
+	return queue_uring_sqe(uring, &sqe);
+}
+
+/* Turns a completion into an event, or into nothing if it is stale or
+only says the kernel needs something armed again */
+static bool read_uring_cqe
+(
+	uring_t *uring,
+	const struct io_uring_cqe *cqe,
+	reactor_event_t *event
+)
+{
+	uint64_t user_data = cqe->user_data;
+	int res = cqe->res;
+	bool is_more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	bool has_buf = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+	unsigned short buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	
+	if(user_data == CANCEL_USER_DATA) return false;
+	
+	uring_op_t op = user_data & URING_OP_MASK;
+	
+	/* A send is reported even once its descriptor is gone, so the owner
+	always gets its data back */
+	if(op == URING_OP_SEND)
+	{
+		event->type = REACTOR_EVENT_TYPE_SEND;
+		event->data = (void *)(uintptr_t)(user_data & ~URING_OP_MASK);
+		event->result = res;
+		return true;
+	}
+	
+	int fd = (user_data & UINT32_MAX) >> URING_OP_BIT_CNT;
+	uring_entry_t *entry =
+		fd < uring->entry_cap ? &uring->entry_arr[fd] : NULL;
+	
+	/* Left over from a descriptor that was removed since.  A buffer it
+	picked goes straight back */
+	if(entry == NULL || !entry->is_active || entry->gen != user_data >> 32)
+	{
+		if(has_buf) lend_uring_buf(uring, buf_id);
+		return false;
+	}
+	
+	/* The kernel ends a multishot operation when it runs out of room for
+	completions or buffers, and an accept when it fails.  They are armed
+	again for as long as they are wanted.  A recv that reached the end of
+	the stream, or failed, has nothing left to read.  A failed accept would
+	only fail again (on EMFILE, for as long as no descriptor is freed), so
+	it waits for the next wait, after its owner has had a go at the
+	backlog */
+	bool is_rearmed =
+		res == -ENOBUFS ||
+		(op == URING_OP_RECV ? res > 0 : res >= 0);
+	
+	if(!is_more && op == URING_OP_ACCEPT && res < 0)
+	{
+		entry->is_stalled = true;
+		uring->stalled_cnt += 1;
+	}
+	
+	if(!is_more && is_rearmed) arm_uring_entry(uring, fd);
+	
+	if(res == -ENOBUFS) return false;
+	
+	event->data = entry->data;
+	event->result = res;
+	event->is_readable = false;
+	event->is_writable = false;
+	event->is_hung_up = false;
+	
+	if(op == URING_OP_RECV)
+	{
+		event->type = REACTOR_EVENT_TYPE_RECV;
+		event->buf = NULL;
+		
+		if(has_buf)
+		{
+			event->buf = uring->recv_buf_arr + (size_t)buf_id * RECV_BUF_LEN;
+			uring->lent_buf_arr[uring->lent_buf_cnt] = buf_id;
+			uring->lent_buf_cnt += 1;
+		}
+		
+		return true;
+	}
+	
+	if(op == URING_OP_ACCEPT)
+	{
+		event->type = REACTOR_EVENT_TYPE_ACCEPT;
+		
+		if(res >= 0) return true;
+		
+		/* The listening socket is reported as ready instead, so the owner
+		accepts from it itself, and turns connections away if it is out of
+		descriptors too */
+		if(res != -EMFILE && res != -ENFILE)
+		{
+			errno = -res;
+			print_errno_err("io_uring accept");
+		}
+		
+		event->type = REACTOR_EVENT_TYPE_READY;
+		event->is_readable = true;
+		return true;
+	}
+	
+	event->type = REACTOR_EVENT_TYPE_READY;
+	
+	/* A failed poll is passed on as a hang-up, so the owner's next read
+	finds out what went wrong */
+	if(res < 0)
+	{
+		errno = -res;
+		print_errno_err("io_uring poll");
+		event->is_hung_up = true;
+		return true;
+	}
+	
+	event->is_readable = (res & EPOLLIN) != 0;
+	event->is_hung_up = (res & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+	
+	return true;
+}
+
+int wait_for_uring
+(
+	uring_t *uring,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+)
+{
+	/* The owner is done with the buffers of the last events */
+	for(int i = 0; i < uring->lent_buf_cnt; i++)
+		lend_uring_buf(uring, uring->lent_buf_arr[i]);
+	
+	uring->lent_buf_cnt = 0;
+	publish_uring_bufs(uring);
+	
+	/* Accepts that failed on the last wait go back in now that the owner
+	has drained what it could */
+	for(int fd = 0; uring->stalled_cnt > 0 && fd < uring->entry_cap; fd++)
+	{
+		uring_entry_t *entry = &uring->entry_arr[fd];
+		
+		if(!entry->is_active || !entry->is_stalled) continue;
+		
+		entry->is_stalled = false;
+		uring->stalled_cnt -= 1;
+		arm_uring_entry(uring, fd);
+	}
+	
+	unsigned head = *uring->cq_head;
+	unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	
+	/* Completions already waiting are collected without sleeping, but the
+	queued submissions still go in */
+	int enter_return = enter_uring(uring, head == tail ? 1 : 0, timeout);
+	
+	/* Running out of time or being interrupted is not an error, and EBUSY
+	only means completions have to be collected first */
+	if
+	(
+		enter_return < 0 &&
+		errno != ETIME &&
+		errno != EINTR &&
+		errno != EBUSY
+	)
+		print_errno_err("io_uring_enter");
+	
+	int event_cnt = 0;
+	
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	
+	while(head != tail && event_cnt < REACTOR_EVENT_CNT)
+	{
+		struct io_uring_cqe *cqe = &uring->cqe_arr[head & *uring->cq_mask];
+		
+		head += 1;
+		
+		if(read_uring_cqe(uring, cqe, &event_arr[event_cnt])) event_cnt += 1;
+	}
+	
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	
+	/* Buffers of stale completions went back while reading them */
+	publish_uring_bufs(uring);
+	
+	return event_cnt;
+}
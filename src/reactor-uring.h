@@ -0,0 +1,111 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#ifndef REACTOR_URING_H
+#define REACTOR_URING_H
+
+#include "src/err.h"
+#include "src/reactor.h"
+#include "stdbool.h"
+#include "sys/socket.h"
+
+/* Opaque struct for an io_uring that does the socket I/O itself.  The
+epoll backend hands its work to one when asked to at startup */
+typedef struct uring_t uring_t;
+
+#ifdef SUSURRC_IO_URING
+
+bool init_uring(uring_t **uring);
+void terminate_uring(uring_t **uring);
+bool add_to_uring(uring_t *uring, int fd, void *data);
+bool accept_with_uring(uring_t *uring, int fd, void *data);
+bool read_with_uring(uring_t *uring, int fd, void *data);
+void remove_from_uring(uring_t *uring, int fd);
+
+bool send_with_uring
+(
+	uring_t *uring,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+);
+
+int wait_for_uring
+(
+	uring_t *uring,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+);
+
+#else
+
+/* Built without io_uring (make io_uring=yes builds it in).  No ring is
+ever set up, so nothing past init_uring is reached */
+static inline bool init_uring(uring_t **uring)
+{
+	print_err("init_uring", "Built without io_uring");
+	return false;
+}
+
+static inline void terminate_uring(uring_t **uring) {}
+
+static inline bool add_to_uring(uring_t *uring, int fd, void *data)
+{
+	return false;
+}
+
+static inline bool accept_with_uring(uring_t *uring, int fd, void *data)
+{
+	return false;
+}
+
+static inline bool read_with_uring(uring_t *uring, int fd, void *data)
+{
+	return false;
+}
+
+static inline void remove_from_uring(uring_t *uring, int fd) {}
+
+static inline bool send_with_uring
+(
+	uring_t *uring,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+)
+{
+	return false;
+}
+
+static inline int wait_for_uring
+(
+	uring_t *uring,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+)
+{
+	return 0;
+}
+
+#endif /* SUSURRC_IO_URING */
+
+#endif /* REACTOR_URING_H */
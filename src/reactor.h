@@ -0,0 +1,105 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "stdbool.h"
+#include "sys/socket.h"
+
+/* The maximum number of events returned by a single wait_for_reactor call */
+#define REACTOR_EVENT_CNT 256
+
+/* What an event reports.  READY is readiness, the only kind epoll and poll
+have.  io_uring does the socket I/O itself and reports what it did: RECV
+bytes it read into buf (result is the length, 0 once the peer has closed
+and -errno on an error), ACCEPT a new socket (result is the descriptor)
+and SEND how many bytes of a send_with_reactor message went out.  A
+listening socket it could not accept from is reported READY, and the owner
+accepts from it itself */
+typedef enum reactor_event_type_t
+{
+	REACTOR_EVENT_TYPE_READY,
+	REACTOR_EVENT_TYPE_RECV,
+	REACTOR_EVENT_TYPE_ACCEPT,
+	REACTOR_EVENT_TYPE_SEND
+}
+reactor_event_type_t;
+
+/* Struct for a ready file descriptor or a finished operation.  data is the
+pointer the descriptor was added with, or for SEND the one passed to
+send_with_reactor (which has to be aligned to 8 bytes and stay valid until
+its event, even if the descriptor is removed first).  A RECV buffer stays
+valid until the next wait */
+typedef struct reactor_event_t
+{
+	void *data;
+	reactor_event_type_t type;
+	bool is_readable;
+	bool is_writable;
+	bool is_hung_up;
+	int result;
+	const unsigned char *buf;
+}
+reactor_event_t;
+
+/* Opaque struct for the backend (epoll on Linux, poll elsewhere).  On
+Linux io_uring can be asked for instead, if it was built in.  Only
+does_reactor_do_io backends take send_with_reactor, and for the others
+accept_with_reactor and read_with_reactor are just add_to_reactor */
+typedef struct reactor_t reactor_t;
+
+void prefer_uring_reactor(void);
+
+bool init_reactor(reactor_t **reactor);
+void terminate_reactor(reactor_t **reactor);
+bool add_to_reactor(reactor_t *reactor, int fd, void *data);
+bool accept_with_reactor(reactor_t *reactor, int fd, void *data);
+bool read_with_reactor(reactor_t *reactor, int fd, void *data);
+void remove_from_reactor(reactor_t *reactor, int fd);
+bool does_reactor_do_io(const reactor_t *reactor);
+
+bool send_with_reactor
+(
+	reactor_t *reactor,
+	int fd,
+	const struct msghdr *msg,
+	void *data
+);
+
+bool set_reactor_write_interest
+(
+	reactor_t *reactor,
+	int fd,
+	void *data,
+	bool is_interested
+);
+
+int wait_for_reactor
+(
+	reactor_t *reactor,
+	reactor_event_t event_arr[REACTOR_EVENT_CNT],
+	int timeout
+);
+
+const char *get_reactor_name(void);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,140 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "src/err.h"
+#include "src/ring.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdlib.h"
+
+/* This is the bounded queue by Dmitry Vyukov.  A slot with seq equal to the
+position being pushed is free, and one with seq equal to the position plus
+one holds data ready for the consumer */
+
+bool init_ring(ring_t *ring, size_t cap)
+{
+	/* The mask only works for powers of two */
+	if(cap < 2 || (cap & (cap - 1)) != 0)
+	{
+		print_err("init_ring", "Capacity must be a power of two");
+		return false;
+	}
+	
+	ring->cell_arr = malloc(cap * sizeof(ring_cell_t));
+	
+	if(ring->cell_arr == NULL)
+	{
+		print_err("init_ring", "Could not allocate the ring");
+		return false;
+	}
+	
+	for(size_t i = 0; i < cap; i++)
+	{
+		atomic_init(&ring->cell_arr[i].seq, i);
+		ring->cell_arr[i].data = NULL;
+	}
+	
+	ring->mask = cap - 1;
+	atomic_init(&ring->tail, 0);
+	ring->head = 0;
+	
+	return true;
+}
+
+void terminate_ring(ring_t *ring)
+{
+	free(ring->cell_arr);
+	ring->cell_arr = NULL;
+}
+
+bool push_ring(ring_t *ring, void *data)
+{
+	size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	ring_cell_t *cell;
+	
+	for(;;)
+	{
+		cell = &ring->cell_arr[pos & ring->mask];
+		
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		
+		/* Signed so that the comparison survives the counters wrapping */
+		ptrdiff_t dif = (ptrdiff_t)(seq - pos);
+		
+		/* Claim the slot if it is free.  On failure pos is reloaded with
+		the current tail and the loop tries again */
+		if(dif == 0)
+		{
+			if
+			(
+				atomic_compare_exchange_weak_explicit
+				(
+					&ring->tail,
+					&pos,
+					pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed
+				)
+			)
+				break;
+		}
+		else if(dif < 0)
+		{
+			/* The consumer has not freed this slot yet, so the ring is
+			full */
+			return false;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		}
+	}
+	
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	
+	return true;
+}
+
+void *pop_ring(ring_t *ring)
+{
+	ring_cell_t *cell = &ring->cell_arr[ring->head & ring->mask];
+	
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	
+	/* Nothing published in this slot yet */
+	if(seq != ring->head + 1) return NULL;
+	
+	void *data = cell->data;
+	
+	/* Hand the slot back to producers one lap ahead */
+	atomic_store_explicit
+	(
+		&cell->seq,
+		ring->head + ring->mask + 1,
+		memory_order_release
+	);
+	
+	ring->head += 1;
+	
+	return data;
+}
@@ -0,0 +1,54 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef RING_H
+#define RING_H
+
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stddef.h"
+
+/* Struct for one slot of a ring.  seq tells producers and the consumer
+whose turn it is to use the slot */
+typedef struct ring_cell_t
+{
+	atomic_size_t seq;
+	void *data;
+}
+ring_cell_t;
+
+/* Struct for a bounded lock-free ring of pointers with any number of
+producers and a single consumer.  The capacity is a power of two */
+typedef struct ring_t
+{
+	size_t mask;
+	ring_cell_t *cell_arr;
+	_Alignas(64) atomic_size_t tail;
+	_Alignas(64) size_t head;
+}
+ring_t;
+
+bool init_ring(ring_t *ring, size_t cap);
+void terminate_ring(ring_t *ring);
+bool push_ring(ring_t *ring, void *data);
+void *pop_ring(ring_t *ring);
+
+#endif /* RING_H */
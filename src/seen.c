@@ -0,0 +1,103 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#include "SDL2/SDL.h"
+#include "src/seen.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "string.h"
+
+static origin_t *find_origin(seen_table_t *seen_table, uint64_t node_id)
+{
+	origin_t *oldest_origin = NULL;
+	
+	for(int i = 0; i < seen_table->origin_cnt; i++)
+	{
+		origin_t *origin = &seen_table->origin_arr[i];
+		
+		if(origin->node_id == node_id) return origin;
+		
+		if
+		(
+			oldest_origin == NULL ||
+			(Sint32)(origin->used_ticks - oldest_origin->used_ticks) < 0
+		)
+			oldest_origin = origin;
+	}
+	
+	/* A new origin takes a free slot, or that of the one heard from least
+	recently */
+	origin_t *origin = oldest_origin;
+	
+	if(seen_table->origin_cnt < MAX_ORIGIN_CNT)
+	{
+		origin = &seen_table->origin_arr[seen_table->origin_cnt];
+		seen_table->origin_cnt += 1;
+	}
+	
+	origin->node_id = node_id;
+	origin->max_seq = 0;
+	memset(origin->seen_arr, 0, sizeof(origin->seen_arr));
+	
+	return origin;
+}
+
+void init_seen_table(seen_table_t *seen_table)
+{
+	seen_table->origin_cnt = 0;
+}
+
+bool mark_msg_seen(seen_table_t *seen_table, uint64_t node_id, uint64_t seq)
+{
+	origin_t *origin = find_origin(seen_table, node_id);
+	
+	origin->used_ticks = SDL_GetTicks();
+	
+	/* Moving the window forward forgets the ids that fall out of it */
+	if(seq > origin->max_seq)
+	{
+		uint64_t clear_cnt = seq - origin->max_seq;
+		
+		if(clear_cnt > SEEN_WINDOW_LEN) clear_cnt = SEEN_WINDOW_LEN;
+		
+		for(uint64_t i = 0; i < clear_cnt; i++)
+		{
+			int bit = (seq - i) % SEEN_WINDOW_LEN;
+			
+			origin->seen_arr[bit / 64] &= ~((uint64_t)1 << bit % 64);
+		}
+		
+		origin->max_seq = seq;
+	}
+	else if(origin->max_seq - seq >= SEEN_WINDOW_LEN)
+	{
+		return true;
+	}
+	
+	int bit = seq % SEEN_WINDOW_LEN;
+	uint64_t mask = (uint64_t)1 << bit % 64;
+	bool is_seen = (origin->seen_arr[bit / 64] & mask) != 0;
+	
+	origin->seen_arr[bit / 64] |= mask;
+	
+	return is_seen;
+}
@@ -0,0 +1,60 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+
+#ifndef SEEN_H
+#define SEEN_H
+
+#include "SDL2/SDL.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* Origins whose recent message ids are remembered, and how far back.  A
+message more than SEEN_WINDOW_LEN behind the newest one from its origin is
+taken as seen */
+#define MAX_ORIGIN_CNT 64
+#define SEEN_WINDOW_LEN 1024
+
+/* Struct for the ids seen from one origin.  Bit seq % SEEN_WINDOW_LEN of
+seen_arr is set for each seq seen within the window below max_seq */
+typedef struct origin_t
+{
+	uint64_t node_id;
+	uint64_t max_seq;
+	Uint32 used_ticks;
+	uint64_t seen_arr[SEEN_WINDOW_LEN / 64];
+}
+origin_t;
+
+/* Struct for the message ids recently seen from every origin, each
+numbered (node id, seq) where it started.  When there are too many origins
+the one heard from least recently is forgotten */
+typedef struct seen_table_t
+{
+	int origin_cnt;
+	origin_t origin_arr[MAX_ORIGIN_CNT];
+}
+seen_table_t;
+
+void init_seen_table(seen_table_t *seen_table);
+bool mark_msg_seen(seen_table_t *seen_table, uint64_t node_id, uint64_t seq);
+
+#endif /* SEEN_H */
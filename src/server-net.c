@@ -0,0 +1,408 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "arpa/inet.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "src/err.h"
+#include "src/net.h"
+#include "src/presence.h"
+#include "src/server-net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "string.h"
+#include "sys/resource.h"
+#include "sys/socket.h"
+#include "unistd.h"
+
+static const int LISTEN_BACKLOG = 128;
+
+/* A descriptor held back for when accept runs out of them.  Giving it up
+makes room to accept a pending connection and close it, which takes it off
+the backlog so that an edge-triggered listener is reported again.  Whichever
+thread takes it holds it alone, and it stays open for the process */
+static atomic_int spare_fd = -1;
+
+static void reserve_spare_fd(void)
+{
+	int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	
+	if(fd < 0)
+	{
+		print_errno_err("open");
+		return;
+	}
+	
+	atomic_store(&spare_fd, fd);
+}
+
+static bool reject_pending_client(int listen_fd)
+{
+	int fd = atomic_exchange(&spare_fd, -1);
+	
+	if(fd < 0) return false;
+	
+	close(fd);
+	fd = accept(listen_fd, NULL, NULL);
+	
+	bool is_rejected = fd >= 0;
+	
+	if(is_rejected)
+	{
+		print_err("accept_client", "Out of descriptors, connection refused");
+		close(fd);
+	}
+	
+	reserve_spare_fd();
+	
+	return is_rejected;
+}
+
+int raise_fd_limit(void)
+{
+	struct rlimit limit;
+	
+	if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+	{
+		print_errno_err("getrlimit");
+		return 0;
+	}
+	
+	/* Raise the soft limit as far as the hard limit allows */
+	if(limit.rlim_cur < limit.rlim_max)
+	{
+		rlim_t soft_limit = limit.rlim_cur;
+		
+		limit.rlim_cur = limit.rlim_max;
+		
+		if(setrlimit(RLIMIT_NOFILE, &limit) != 0)
+			limit.rlim_cur = soft_limit;
+	}
+	
+	if(limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > INT_MAX)
+		return INT_MAX;
+	
+	return (int)limit.rlim_cur;
+}
+
+bool open_listen_socket(int *listen_fd, int port)
+{
+	struct sockaddr_in addr;
+	int reuse = 1;
+	
+	*listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	
+	if(*listen_fd < 0)
+	{
+		print_errno_err("socket");
+		return false;
+	}
+	
+	/* Allow restarting the server without waiting out TIME_WAIT */
+	setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	
+	if(bind(*listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		print_errno_err("bind");
+		close_socket(listen_fd);
+		return false;
+	}
+	
+	if(listen(*listen_fd, LISTEN_BACKLOG) != 0)
+	{
+		print_errno_err("listen");
+		close_socket(listen_fd);
+		return false;
+	}
+	
+	/* The listening socket is drained with accept until EAGAIN */
+	if(!set_nonblocking(*listen_fd))
+	{
+		close_socket(listen_fd);
+		return false;
+	}
+	
+	if(atomic_load(&spare_fd) < 0) reserve_spare_fd();
+	
+	return true;
+}
+
+bool accept_client(int listen_fd, int *fd)
+{
+	/* Returns false once no connections are pending (or on an error), so it
+	can be called in a loop */
+	for(;;)
+	{
+		*fd = accept(listen_fd, NULL, NULL);
+		
+		if(*fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			
+			/* Left pending, the connection would never be reported again.
+			Turn it away and carry on with the rest */
+			if(errno == EMFILE || errno == ENFILE)
+				if(reject_pending_client(listen_fd)) continue;
+			
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				print_errno_err("accept");
+			
+			return false;
+		}
+		
+		/* Writes go through the client's queue, so a slow reader can never
+		block the server */
+		if(set_nonblocking(*fd)) break;
+		
+		close_socket(fd);
+	}
+	
+	set_nodelay(*fd);
+	
+	return true;
+}
+
+void init_client(client_t *client)
+{
+	client->is_logged_in = false;
+	client->is_login_pending = false;
+	client->is_flush_pending = false;
+	client->is_write_blocked = false;
+	client->is_send_pending = false;
+	client->is_uploading = false;
+	client->is_unsent_limited = false;
+	client->is_presence_wanted = false;
+	client->is_presence_stale = false;
+	strcpy(client->ip, "");
+	strcpy(client->username, "user");
+	init_session(&client->session);
+	client->fd = -1;
+	client->login_fail_cnt = 0;
+	client->conn_id = 0;
+	client->in_len = 0;
+	init_out_queue(&client->out_queue);
+	init_out_queue(&client->file_queue);
+	client->upload_credit_cnt = 0;
+	client->upload_id = 0;
+	client->upload_file_id = 0;
+	strcpy(client->upload_channel_name, "");
+	client->relay_cnt = 0;
+	client->channel_cnt = 0;
+	client->current_channel = -1;
+	client->presence_id = 0;
+	client->presence_state = PRESENCE_STATE_OFFLINE;
+	client->presence_gen = 0;
+	client->presence_index = -1;
+}
+
+void read_client_ip(client_t *client)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	const void *ip_addr = NULL;
+	
+	strcpy(client->ip, "");
+	
+	if(getpeername(client->fd, (struct sockaddr *)&addr, &addr_len) != 0)
+	{
+		print_errno_err("getpeername");
+		return;
+	}
+	
+	if(addr.ss_family == AF_INET)
+		ip_addr = &((struct sockaddr_in *)&addr)->sin_addr;
+	else if(addr.ss_family == AF_INET6)
+		ip_addr = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+	
+	if(ip_addr != NULL)
+		inet_ntop(addr.ss_family, ip_addr, client->ip, MAX_IP_LEN);
+}
+
+void limit_unsent_len(int fd, int len)
+{
+	/* Whatever sits unsent in the kernel is ahead of any frame queued
+	later, so keep it short.  Without the option the socket buffer is the
+	only limit */
+#ifdef TCP_NOTSENT_LOWAT
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &len, sizeof(len)) != 0)
+		print_errno_err("setsockopt");
+#endif
+}
+
+void modify_msg_with_info
+(
+	char *msg,
+	const client_t *client,
+	const char *channel_name
+)
+{
+	char new_msg[MAX_MSG_LEN];
+	
+	/* Start the modified message with the channel and the client's username
+	and append the original message.  Messages are variable length now, so
+	truncate rather than overflow when the prefix pushes one past
+	MAX_MSG_LEN */
+	snprintf
+	(
+		new_msg,
+		MAX_MSG_LEN,
+		"[%s] %s: %s",
+		channel_name,
+		client->username,
+		msg
+	);
+	
+	/* Copy the modified message to the original message string */
+	strcpy(msg, new_msg);
+}
+
+recv_status_t fill_client_buf(client_t *client)
+{
+	/* The buffer always has room for at least one whole frame, so a full
+	buffer means the caller has frames to pop first */
+	if(client->in_len == MAX_FRAME_LEN) return RECV_STATUS_DATA;
+
+	for(;;)
+	{
+		ssize_t recv_return = recv
+		(
+			client->fd,
+			client->in_buf + client->in_len,
+			MAX_FRAME_LEN - client->in_len,
+			0
+		);
+		
+		if(recv_return > 0)
+		{
+			client->in_len += recv_return;
+			return RECV_STATUS_DATA;
+		}
+		
+		if(recv_return == 0) return RECV_STATUS_CLOSED;
+		
+		if(errno == EINTR) continue;
+		
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return RECV_STATUS_AGAIN;
+		
+		print_errno_err("recv");
+		return RECV_STATUS_CLOSED;
+	}
+}
+
+int append_client_buf(client_t *client, const unsigned char *buf, int len)
+{
+	/* Bytes io_uring has already read.  Only what fits goes in, and the
+	caller pops frames before handing over the rest */
+	int room_len = MAX_FRAME_LEN - client->in_len;
+	
+	if(len > room_len) len = room_len;
+	
+	memcpy(client->in_buf + client->in_len, buf, len);
+	client->in_len += len;
+	
+	return len;
+}
+
+static void consume_client_buf(client_t *client, int len)
+{
+	client->in_len -= len;
+	memmove(client->in_buf, client->in_buf + len, client->in_len);
+}
+
+pop_status_t pop_client_frame
+(
+	client_t *client,
+	const unsigned char pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char privkey[crypto_box_SECRETKEYBYTES],
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len
+)
+{
+	/* The first bytes from a client are its public key.  The session keys
+	are computed from it once */
+	if(!client->session.has_key)
+	{
+		if(client->in_len < (int)crypto_box_PUBLICKEYBYTES)
+			return POP_STATUS_PARTIAL;
+		
+		if
+		(
+			!update_session
+			(
+				&client->session,
+				client->in_buf,
+				pubkey,
+				privkey
+			)
+		)
+			return POP_STATUS_ERROR;
+		
+		consume_client_buf(client, crypto_box_PUBLICKEYBYTES);
+	}
+	
+	int body_len;
+
+	if(client->in_len < FRAME_HEADER_LEN) return POP_STATUS_PARTIAL;
+	
+	if(!parse_frame_header(client->in_buf, type, &body_len))
+		return POP_STATUS_ERROR;
+	
+	if(client->in_len < FRAME_HEADER_LEN + body_len)
+		return POP_STATUS_PARTIAL;
+	
+	bool open_success;
+	
+	/* File chunks are relayed as they are */
+	if(*type == FRAME_TYPE_FILE_CHUNK)
+	{
+		memcpy(payload, client->in_buf + FRAME_HEADER_LEN, body_len);
+		*payload_len = body_len;
+		open_success = true;
+	}
+	else
+	{
+		open_success = open_frame
+		(
+			payload,
+			payload_len,
+			*type,
+			client->in_buf + FRAME_HEADER_LEN,
+			body_len,
+			&client->session
+		);
+	}
+	
+	if(!open_success) return POP_STATUS_ERROR;
+	
+	consume_client_buf(client, FRAME_HEADER_LEN + body_len);
+	
+	return POP_STATUS_FRAME;
+}
@@ -0,0 +1,140 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef SERVER_NET_H
+#define SERVER_NET_H
+
+#include "src/net.h"
+#include "src/out-queue.h"
+#include "src/presence.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+#define MAX_IP_LEN 46
+
+/* Result of reading from a non-blocking client socket */
+typedef enum recv_status_t
+{
+	RECV_STATUS_DATA,
+	RECV_STATUS_AGAIN,
+	RECV_STATUS_CLOSED
+}
+recv_status_t;
+
+/* Result of pulling the next frame out of a client's input buffer */
+typedef enum pop_status_t
+{
+	POP_STATUS_FRAME,
+	POP_STATUS_PARTIAL,
+	POP_STATUS_ERROR
+}
+pop_status_t;
+
+/* Struct for one channel a client is in, and where the client sits in that
+channel's member array */
+typedef struct client_channel_t
+{
+	struct channel_t *channel;
+	int member_index;
+}
+client_channel_t;
+
+/* Struct for each client's data (including the socket and the bytes read
+from it that do not form a whole frame yet, and the frames waiting to be
+written to it).  Posts go to the current channel, an index into
+channel_arr.  File chunks wait in a queue of their own, which is only
+written once out_queue is empty.  A client sends one file at a time, and
+may send upload_credit_cnt more of its chunks.  relay_cnt counts the files
+being relayed to it.  presence_id is handed out on login, presence_state
+is the last state announced for the client, and presence_index is where
+the client's pending presence change sits while presence_gen matches its
+shard's window.  Only clients that have sent presence of their own are
+sent any (is_presence_wanted).  is_presence_stale is set once presence
+meant for the client has been dropped.  With io_uring, is_send_pending is
+set while the kernel has a send of the client's frames that it has not
+finished.  active_index and next_free belong to the client table */
+typedef struct client_t
+{
+	bool is_logged_in;
+	bool is_login_pending;
+	bool is_flush_pending;
+	bool is_write_blocked;
+	bool is_send_pending;
+	bool is_uploading;
+	bool is_unsent_limited;
+	bool is_presence_wanted;
+	bool is_presence_stale;
+	char ip[MAX_IP_LEN];
+	char username[MAX_USERNAME_LEN];
+	session_t session;
+	int fd;
+	int login_fail_cnt;
+	unsigned long conn_id;
+	int in_len;
+	unsigned char in_buf[MAX_FRAME_LEN];
+	out_queue_t out_queue;
+	out_queue_t file_queue;
+	int upload_credit_cnt;
+	uint32_t upload_id;
+	uint32_t upload_file_id;
+	char upload_channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	int relay_cnt;
+	int channel_cnt;
+	int current_channel;
+	client_channel_t channel_arr[MAX_CLIENT_CHANNEL_CNT];
+	uint32_t presence_id;
+	presence_state_t presence_state;
+	unsigned int presence_gen;
+	int presence_index;
+	int active_index;
+	struct client_t *next_free;
+}
+client_t;
+
+int raise_fd_limit(void);
+bool open_listen_socket(int *listen_fd, int port);
+bool accept_client(int listen_fd, int *fd);
+
+void init_client(client_t *client);
+void read_client_ip(client_t *client);
+void limit_unsent_len(int fd, int len);
+
+void modify_msg_with_info
+(
+	char *msg,
+	const client_t *client,
+	const char *channel_name
+);
+
+recv_status_t fill_client_buf(client_t *client);
+int append_client_buf(client_t *client, const unsigned char *buf, int len);
+
+pop_status_t pop_client_frame
+(
+	client_t *client,
+	const unsigned char pubkey[crypto_box_PUBLICKEYBYTES],
+	const unsigned char privkey[crypto_box_SECRETKEYBYTES],
+	frame_type_t *type,
+	unsigned char *payload,
+	int *payload_len
+);
+
+#endif /* SERVER_NET_H */
@@ -0,0 +1,522 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/err.h"
+#include "src/histogram.h"
+#include "src/init.h"
+#include "src/net.h"
+#include "stdatomic.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+#define MAX_SIZE_CNT 16
+
+/* Room left in a message for the channel and username the server puts in
+front of it */
+static const int MAX_BENCH_MSG_LEN = MAX_MSG_LEN - 128;
+
+/* Every message starts with its send time, so it can be no shorter than
+this */
+static const int MIN_BENCH_MSG_LEN = 24;
+
+/* How long to wait for every client to get into the channel, and for the
+last messages to arrive once sending stops */
+static const Uint32 JOIN_TIMEOUT = 10000;
+static const Uint32 DRAIN_TIMEOUT = 2000;
+
+static const int POLL_TIMEOUT = 10;
+
+/* Struct for the command line options */
+typedef struct bench_config_t
+{
+	bool is_json;
+	int port;
+	int client_cnt;
+	int rate;
+	int duration;
+	int size_cnt;
+	int size_arr[MAX_SIZE_CNT];
+	const char *hostname;
+	const char *password;
+}
+bench_config_t;
+
+/* Struct for one simulated client.  The sender thread only reads fd,
+is_closed and the session key, and the receiving thread owns everything
+else */
+typedef struct bench_client_t
+{
+	atomic_bool is_closed;
+	bool is_joined;
+	int fd;
+	session_t session;
+}
+bench_client_t;
+
+/* Struct for what the receiving side saw */
+typedef struct bench_result_t
+{
+	unsigned long sent_cnt;
+	unsigned long sent_len;
+	unsigned long recv_cnt;
+	unsigned long recv_len;
+	int joined_cnt;
+	int closed_cnt;
+	double elapsed;
+	histogram_t latency;
+}
+bench_result_t;
+
+static bench_config_t config;
+static bench_client_t *client_arr;
+static struct pollfd *poll_arr;
+static bench_result_t result;
+static Uint64 start_counter;
+static Uint64 counter_freq;
+static unsigned char privkey[crypto_box_SECRETKEYBYTES];
+static unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
+
+static bool parse_size_mix(char *arg)
+{
+	config.size_cnt = 0;
+	
+	for
+	(
+		char *size = strtok(arg, ",");
+		size != NULL;
+		size = strtok(NULL, ",")
+	)
+	{
+		if(config.size_cnt == MAX_SIZE_CNT) return false;
+		
+		config.size_arr[config.size_cnt] = atoi(size);
+		
+		if
+		(
+			config.size_arr[config.size_cnt] < MIN_BENCH_MSG_LEN ||
+			config.size_arr[config.size_cnt] > MAX_BENCH_MSG_LEN
+		)
+			return false;
+		
+		config.size_cnt += 1;
+	}
+	
+	return config.size_cnt > 0;
+}
+
+static bool parse_bench_args(int argc, char *argv[])
+{
+	int opt;
+	
+	config.is_json = false;
+	config.client_cnt = 10;
+	config.rate = 1000;
+	config.duration = 10;
+	config.size_cnt = 1;
+	config.size_arr[0] = 64;
+	config.hostname = "127.0.0.1";
+	config.password = NULL;
+	
+	while((opt = getopt(argc, argv, "jn:p:r:s:t:")) != -1)
+		switch(opt)
+		{
+			case 'j':
+				config.is_json = true;
+				break;
+			case 'n':
+				config.client_cnt = atoi(optarg);
+				break;
+			case 'p':
+				config.password = optarg;
+				break;
+			case 'r':
+				config.rate = atoi(optarg);
+				break;
+			case 's':
+				if(!parse_size_mix(optarg)) return false;
+				
+				break;
+			case 't':
+				config.duration = atoi(optarg);
+				break;
+			default:
+				return false;
+		}
+	
+	if(optind >= argc) return false;
+	
+	config.port = atoi(argv[optind]);
+	
+	if(optind + 1 < argc) config.hostname = argv[optind + 1];
+	
+	return
+		config.client_cnt >= 1 &&
+		config.rate >= 0 &&
+		config.duration >= 1;
+}
+
+static double get_elapsed_secs(Uint64 counter)
+{
+	return (double)(counter - start_counter) / counter_freq;
+}
+
+static bool connect_bench_clients(void)
+{
+	char login[MAX_MSG_LEN];
+	msg_data_t msg_data;
+	
+	client_arr = calloc(config.client_cnt, sizeof(bench_client_t));
+	poll_arr = calloc(config.client_cnt, sizeof(struct pollfd));
+	
+	if(client_arr == NULL || poll_arr == NULL)
+	{
+		print_err("connect_bench_clients", "Could not allocate the clients");
+		return false;
+	}
+	
+	if(config.password != NULL)
+		snprintf(login, MAX_MSG_LEN, "/login %s", config.password);
+	
+	for(int i = 0; i < config.client_cnt; i++)
+	{
+		bench_client_t *client = &client_arr[i];
+		
+		atomic_init(&client->is_closed, false);
+		client->is_joined = false;
+		client->fd = -1;
+		init_session(&client->session);
+		poll_arr[i].fd = -1;
+		poll_arr[i].events = POLLIN;
+		
+		if
+		(
+			!setup_server_connection
+			(
+				&client->fd,
+				config.hostname,
+				config.port
+			) ||
+			!exchange_pubkeys(client->fd, &client->session, privkey, pubkey)
+		)
+			return false;
+		
+		poll_arr[i].fd = client->fd;
+		
+		if(config.password != NULL)
+			send_msg(login, &msg_data, client->fd, &client->session);
+	}
+	
+	return true;
+}
+
+static void close_bench_clients(void)
+{
+	if(client_arr != NULL)
+		for(int i = 0; i < config.client_cnt; i++)
+			close_socket(&client_arr[i].fd);
+	
+	free(client_arr);
+	free(poll_arr);
+	client_arr = NULL;
+	poll_arr = NULL;
+}
+
+static void handle_bench_msg(bench_client_t *client, const char *msg)
+{
+	const char *stamp = strchr(msg, '#');
+	
+	/* Everyone starts in the default channel.  The notice says when */
+	if(strncmp(msg, "server: Joined ", 15) == 0 && !client->is_joined)
+	{
+		client->is_joined = true;
+		result.joined_cnt += 1;
+		return;
+	}
+	
+	if(stamp == NULL) return;
+	
+	/* Anything sent before this run (replayed from the server's log, say)
+	is not counted */
+	Uint64 sent_counter = strtoull(stamp + 1, NULL, 10);
+	Uint64 now = SDL_GetPerformanceCounter();
+	
+	if(sent_counter < start_counter || sent_counter > now) return;
+	
+	result.recv_cnt += 1;
+	result.recv_len += strlen(msg);
+	
+	record_histogram
+	(
+		&result.latency,
+		(now - sent_counter) * 1000000000.0 / counter_freq
+	);
+}
+
+static bool recv_bench_msgs(void)
+{
+	char msg[MAX_MSG_LEN];
+	msg_data_t msg_data;
+	
+	int ready_cnt = poll(poll_arr, config.client_cnt, POLL_TIMEOUT);
+	
+	if(ready_cnt < 0)
+	{
+		print_errno_err("poll");
+		return false;
+	}
+	
+	for(int i = 0; ready_cnt > 0 && i < config.client_cnt; i++)
+	{
+		if(poll_arr[i].revents == 0) continue;
+		
+		ready_cnt -= 1;
+		
+		/* A dropped client stays dropped.  Its losses show in the count */
+		if
+		(
+			!recv_msg
+			(
+				msg,
+				&msg_data,
+				client_arr[i].fd,
+				&client_arr[i].session
+			)
+		)
+		{
+			poll_arr[i].fd = -1;
+			atomic_store(&client_arr[i].is_closed, true);
+			result.closed_cnt += 1;
+			continue;
+		}
+		
+		if(msg[0] != '\0') handle_bench_msg(&client_arr[i], msg);
+	}
+	
+	return true;
+}
+
+static void wait_until(Uint64 due_counter)
+{
+	Uint64 now = SDL_GetPerformanceCounter();
+	
+	/* Sleep through most of the wait and spin through the last
+	millisecond, which SDL_Delay cannot hit reliably */
+	if(due_counter > now + counter_freq / 500)
+		SDL_Delay((due_counter - now) * 1000 / counter_freq - 1);
+	
+	while(SDL_GetPerformanceCounter() < due_counter);
+}
+
+static int run_sender(void *data)
+{
+	char msg[MAX_MSG_LEN];
+	msg_data_t msg_data;
+	int client_index = 0;
+	Uint64 end_counter = start_counter + config.duration * counter_freq;
+	
+	/* Messages are dealt out to the clients in turn, each due at a fixed
+	point in time so a slow send does not lower the offered rate */
+	for(unsigned long i = 0; ; i++)
+	{
+		if(config.rate > 0)
+			wait_until(start_counter + i * counter_freq / config.rate);
+		
+		Uint64 now = SDL_GetPerformanceCounter();
+		
+		if(now >= end_counter) break;
+		
+		/* Skip the clients the server has dropped */
+		bench_client_t *client = NULL;
+		
+		for(int j = 0; client == NULL && j < config.client_cnt; j++)
+		{
+			if(!atomic_load(&client_arr[client_index].is_closed))
+				client = &client_arr[client_index];
+			
+			client_index = (client_index + 1) % config.client_cnt;
+		}
+		
+		if(client == NULL) break;
+		
+		int msg_len =
+			config.size_arr[randombytes_uniform(config.size_cnt)];
+		int stamp_len = sprintf(msg, "#%llu#", (unsigned long long)now);
+		
+		memset(msg + stamp_len, 'x', msg_len - stamp_len);
+		msg[msg_len] = '\0';
+		send_msg(msg, &msg_data, client->fd, &client->session);
+		result.sent_cnt += 1;
+		result.sent_len += msg_len;
+	}
+	
+	return 0;
+}
+
+static bool run_bench(void)
+{
+	Uint32 ticks = SDL_GetTicks();
+	
+	/* Nothing is timed until every client is in the channel */
+	while(result.joined_cnt < config.client_cnt)
+	{
+		if(SDL_GetTicks() - ticks > JOIN_TIMEOUT)
+		{
+			print_err("run_bench", "Clients did not all join in time");
+			return false;
+		}
+		
+		if(!recv_bench_msgs()) return false;
+	}
+	
+	start_counter = SDL_GetPerformanceCounter();
+	
+	SDL_Thread *sender = SDL_CreateThread(run_sender, "susurrc-bench", NULL);
+	
+	if(sender == NULL)
+	{
+		print_libsdl_err("SDL_CreateThread");
+		return false;
+	}
+	
+	Uint64 end_counter = start_counter + config.duration * counter_freq;
+	
+	while(SDL_GetPerformanceCounter() < end_counter)
+		if(!recv_bench_msgs()) break;
+	
+	SDL_WaitThread(sender, NULL);
+	
+	/* Every message goes to every client, the sender included */
+	unsigned long expected_cnt = result.sent_cnt * config.client_cnt;
+	
+	ticks = SDL_GetTicks();
+	
+	while
+	(
+		result.recv_cnt < expected_cnt &&
+		result.closed_cnt < config.client_cnt &&
+		SDL_GetTicks() - ticks < DRAIN_TIMEOUT
+	)
+		if(!recv_bench_msgs()) break;
+	
+	result.elapsed = get_elapsed_secs(SDL_GetPerformanceCounter());
+	
+	return true;
+}
+
+static void print_bench_result(void)
+{
+	/* Latencies are recorded in nanoseconds and reported in
+	microseconds */
+	double p50 = get_histogram_percentile(&result.latency, 50.0) / 1000.0;
+	double p99 = get_histogram_percentile(&result.latency, 99.0) / 1000.0;
+	double p999 = get_histogram_percentile(&result.latency, 99.9) / 1000.0;
+	double max = result.latency.max / 1000.0;
+	unsigned long expected_cnt = result.sent_cnt * config.client_cnt;
+	unsigned long lost_cnt =
+		expected_cnt > result.recv_cnt ? expected_cnt - result.recv_cnt : 0;
+	
+	/* Rates are over the sending period.  Deliveries that trail in after it
+	still count, so a server that falls behind shows up as latency */
+	double msgs_per_sec = result.recv_cnt / (double)config.duration;
+	double bytes_per_sec = result.recv_len / (double)config.duration;
+	
+	if(config.is_json)
+	{
+		printf
+		(
+			"{\"clients\": %d, \"rate\": %d, \"duration\": %d, "
+			"\"sent\": %lu, \"sent_bytes\": %lu, \"received\": %lu, "
+			"\"received_bytes\": %lu, \"lost\": %lu, \"closed\": %d, "
+			"\"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+			"\"max_us\": %.1f}\n",
+			config.client_cnt,
+			config.rate,
+			config.duration,
+			result.sent_cnt,
+			result.sent_len,
+			result.recv_cnt,
+			result.recv_len,
+			lost_cnt,
+			result.closed_cnt,
+			msgs_per_sec,
+			bytes_per_sec,
+			p50,
+			p99,
+			p999,
+			max
+		);
+		
+		return;
+	}
+	
+	printf
+	(
+		"%d clients for %d s: sent %lu msgs (%lu bytes), received %lu "
+		"(%lu lost, %d clients dropped)\n"
+		"throughput: %.1f msgs/sec, %.1f bytes/sec\n"
+		"latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+		config.client_cnt,
+		config.duration,
+		result.sent_cnt,
+		result.sent_len,
+		result.recv_cnt,
+		lost_cnt,
+		result.closed_cnt,
+		msgs_per_sec,
+		bytes_per_sec,
+		p50,
+		p99,
+		p999,
+		max
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	if(!parse_bench_args(argc, argv))
+	{
+		print_bench_arg_err();
+		return 1;
+	}
+	
+	if(!init_libsodium()) return 1;
+	
+	crypto_box_keypair(pubkey, privkey);
+	counter_freq = SDL_GetPerformanceFrequency();
+	memset(&result, 0, sizeof(result));
+	init_histogram(&result.latency);
+	
+	bool bench_success = connect_bench_clients() && run_bench();
+	
+	if(bench_success) print_bench_result();
+	
+	close_bench_clients();
+	
+	return bench_success ? 0 : 1;
+}
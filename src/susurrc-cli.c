@@ -0,0 +1,388 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "errno.h"
+#include "poll.h"
+#include "SDL2/SDL.h"
+#include "src/client-io.h"
+#include "src/err.h"
+#include "src/init.h"
+#include "src/net.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+/* Bytes of stdin read at a time.  Lines are cut out of it */
+#define LINE_BUF_LEN 65536
+
+/* How long to wait for room in the command ring before trying again */
+static const int CMD_RETRY_TIMEOUT = 1;
+
+/* Struct for the command line options */
+typedef struct cli_config_t
+{
+	bool is_quiet;
+	bool is_staying;
+	int port;
+	const char *hostname;
+	const char *password;
+	const char *channel_name;
+	const char *dict_path;
+	const char *download_dir;
+}
+cli_config_t;
+
+static bool is_disconnecting;
+static bool is_ready;
+static bool is_stdin_done;
+static bool is_running;
+static int exit_code;
+static int line_len;
+static int upload_cnt;
+static int notify_fd_arr[2] = {-1, -1};
+static cli_config_t config;
+static client_io_t client_io;
+static char line_buf[LINE_BUF_LEN];
+
+static bool parse_cli_args(int argc, char *argv[])
+{
+	int opt;
+	
+	config.is_quiet = false;
+	config.is_staying = false;
+	config.password = NULL;
+	config.channel_name = NULL;
+	config.dict_path = NULL;
+	config.download_dir = NULL;
+	
+	while((opt = getopt(argc, argv, "c:ko:p:qz:")) != -1)
+		switch(opt)
+		{
+			case 'c':
+				config.channel_name = optarg;
+				break;
+			case 'k':
+				config.is_staying = true;
+				break;
+			case 'o':
+				config.download_dir = optarg;
+				break;
+			case 'p':
+				config.password = optarg;
+				break;
+			case 'q':
+				config.is_quiet = true;
+				break;
+			case 'z':
+				config.dict_path = optarg;
+				break;
+			default:
+				return false;
+		}
+	
+	if(optind + 2 != argc) return false;
+	
+	config.hostname = argv[optind];
+	config.port = atoi(argv[optind + 1]);
+	
+	return config.port > 0;
+}
+
+static void notify_main_thread(void *data)
+{
+	/* Called on the I/O thread.  The main loop polls the other end */
+	signal_wake_pipe(notify_fd_arr[1]);
+}
+
+static void post_cmd(client_cmd_type_t type, const char *text)
+{
+	/* Only reached for the few commands outside the stdin pipeline, so
+	waiting for room is fine */
+	while(!post_client_cmd(&client_io, type, text, config.port))
+		SDL_Delay(CMD_RETRY_TIMEOUT);
+}
+
+static void handle_server_msg(const char *msg)
+{
+	char cmd[MAX_MSG_LEN];
+	bool is_notice = strncmp(msg, "server: ", 8) == 0;
+	
+	/* Transfer progress stays out of the received messages */
+	if(strncmp(msg, "file: ", 6) == 0)
+	{
+		fprintf(stderr, "%s\n", msg);
+		return;
+	}
+	
+	/* Joining the default channel means the server let us in.  Only then
+	does stdin start flowing, so no line is lost to a pending login */
+	if(!is_ready && strncmp(msg, "server: Joined ", 15) == 0)
+	{
+		is_ready = true;
+		
+		if(config.channel_name != NULL)
+		{
+			snprintf(cmd, MAX_MSG_LEN, "/join %s", config.channel_name);
+			post_cmd(CLIENT_CMD_SEND, cmd);
+		}
+	}
+	
+	/* A wrong password would leave us waiting forever */
+	if(!is_ready && strcmp(msg, "server: Wrong password") == 0)
+	{
+		print_err("handle_server_msg", "Wrong password");
+		post_cmd(CLIENT_CMD_DISCONNECT, "");
+	}
+	
+	if(is_notice && config.is_quiet) return;
+	
+	fputs(msg, stdout);
+	fputc('\n', stdout);
+}
+
+static void handle_client_events(void)
+{
+	client_event_t *event;
+	
+	clear_wake_pipe(notify_fd_arr[0]);
+	ack_client_io_notify(&client_io);
+	
+	while((event = pop_client_event(&client_io)) != NULL)
+	{
+		switch(event->type)
+		{
+			case CLIENT_EVENT_CONNECTED:
+				fprintf(stderr, "Connected to %s\n", event->text);
+				
+				if(config.password != NULL)
+				{
+					char cmd[MAX_MSG_LEN];
+					
+					snprintf(cmd, MAX_MSG_LEN, "/login %s", config.password);
+					post_cmd(CLIENT_CMD_SEND, cmd);
+					sodium_memzero(cmd, sizeof(cmd));
+				}
+				
+				break;
+			case CLIENT_EVENT_DISCONNECTED:
+				/* Being dropped (or never getting in) is a failure */
+				if(!is_disconnecting) exit_code = 1;
+				
+				is_running = false;
+				break;
+			case CLIENT_EVENT_MSG:
+				handle_server_msg(event->text);
+				break;
+			case CLIENT_EVENT_UPLOAD_DONE:
+				fprintf(stderr, "%s\n", event->text);
+				upload_cnt -= 1;
+				break;
+			case CLIENT_EVENT_PRESENCE:
+				/* Only the transcript goes to stdout */
+				break;
+		}
+		
+		free(event);
+	}
+	
+	/* Received messages leave in one write per batch */
+	fflush(stdout);
+}
+
+static bool send_stdin_lines(void)
+{
+	bool is_posted = true;
+	int start = 0;
+	
+	/* Each whole line becomes one message.  Posting never blocks, so many
+	lines are in flight while the I/O thread writes them out.  When the
+	command ring is full the rest waits for the next pass */
+	for(int i = 0; is_posted && i < line_len; i++)
+	{
+		if(line_buf[i] != '\n') continue;
+		
+		line_buf[i] = '\0';
+		
+		/* Lines longer than a message are cut short */
+		if(i - start > MAX_MSG_LEN - 1)
+			line_buf[start + MAX_MSG_LEN - 1] = '\0';
+		
+		/* "/send <path>" sends a file to the current channel instead */
+		bool is_file = strncmp(&line_buf[start], "/send ", 6) == 0;
+		
+		if(is_file)
+			is_posted = post_client_cmd
+			(
+				&client_io,
+				CLIENT_CMD_SEND_FILE,
+				&line_buf[start + 6],
+				config.port
+			);
+		else if(line_buf[start] != '\0')
+			is_posted = post_client_cmd
+			(
+				&client_io,
+				CLIENT_CMD_SEND,
+				&line_buf[start],
+				config.port
+			);
+		
+		if(is_file && is_posted) upload_cnt += 1;
+		
+		if(is_posted)
+			start = i + 1;
+		else
+			line_buf[i] = '\n';
+	}
+	
+	line_len -= start;
+	memmove(line_buf, line_buf + start, line_len);
+	
+	return is_posted;
+}
+
+static void read_stdin(void)
+{
+	ssize_t read_len = read
+	(
+		STDIN_FILENO,
+		line_buf + line_len,
+		LINE_BUF_LEN - line_len
+	);
+	
+	if(read_len < 0)
+	{
+		if(errno == EINTR) return;
+		
+		print_errno_err("read");
+		read_len = 0;
+	}
+	
+	line_len += read_len;
+	
+	/* A line too long for the buffer is cut here.  It is far past the
+	message length anyway */
+	if(line_len == LINE_BUF_LEN && memchr(line_buf, '\n', line_len) == NULL)
+		line_buf[LINE_BUF_LEN - 1] = '\n';
+	
+	if(read_len > 0) return;
+	
+	/* The last line may have no newline */
+	if(line_len > 0 && line_len < LINE_BUF_LEN)
+	{
+		line_buf[line_len] = '\n';
+		line_len += 1;
+	}
+	
+	is_stdin_done = true;
+}
+
+static void run_cli(void)
+{
+	is_running = true;
+	post_cmd(CLIENT_CMD_CONNECT, config.hostname);
+	
+	while(is_running)
+	{
+		/* stdin is only read while there is room to put what it holds */
+		bool is_backlogged = is_ready && !send_stdin_lines();
+		bool is_reading = is_ready && !is_stdin_done && !is_backlogged;
+		
+		/* Everything read is posted, and the I/O thread sends it before
+		disconnecting.  Files are only done once the I/O thread says so */
+		if
+		(
+			is_ready &&
+			is_stdin_done &&
+			line_len == 0 &&
+			upload_cnt == 0 &&
+			!config.is_staying &&
+			!is_disconnecting
+		)
+		{
+			post_cmd(CLIENT_CMD_DISCONNECT, "");
+			is_disconnecting = true;
+		}
+		
+		struct pollfd pollfd_arr[2] =
+		{
+			{.fd = notify_fd_arr[0], .events = POLLIN},
+			{.fd = STDIN_FILENO, .events = POLLIN}
+		};
+		
+		int poll_return = poll
+		(
+			pollfd_arr,
+			is_reading ? 2 : 1,
+			is_backlogged ? CMD_RETRY_TIMEOUT : -1
+		);
+		
+		if(poll_return < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			print_errno_err("poll");
+			exit_code = 1;
+			break;
+		}
+		
+		if(pollfd_arr[0].revents != 0) handle_client_events();
+		
+		if(is_reading && pollfd_arr[1].revents != 0) read_stdin();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if(!parse_cli_args(argc, argv))
+	{
+		print_cli_arg_err();
+		return 1;
+	}
+	
+	if(!init_libsodium() || !open_wake_pipe(notify_fd_arr)) return 1;
+	
+	bool init_success = init_client_io
+	(
+		&client_io,
+		config.dict_path,
+		config.download_dir,
+		notify_main_thread,
+		NULL
+	);
+	
+	if(init_success)
+	{
+		run_cli();
+		terminate_client_io(&client_io);
+	}
+	else
+	{
+		exit_code = 1;
+	}
+	
+	close_socket(&notify_fd_arr[0]);
+	close_socket(&notify_fd_arr[1]);
+	
+	return exit_code;
+}
@@ -0,0 +1,547 @@
+/* Copyright (C) 2023 Elijah Day
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the “Software”), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "SDL2/SDL.h"
+#include "sodium.h"
+#include "src/err.h"
+#include "src/init.h"
+#include "src/net.h"
+#include "src/server-net.h"
+#include "src/susurrc.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "unistd.h"
+
+#define MAX_SIZE_CNT 16
+
+/* Members of the room the fan-out benchmarks deliver a message to */
+static const int ROOM_MEMBER_CNT = 16;
+
+/* Struct for one benchmark.  prepare runs once per payload size, outside
+the timing, and run is one operation */
+typedef struct micro_t
+{
+	const char *name;
+	bool is_sized;
+	bool (*prepare)(int payload_len);
+	bool (*run)(int payload_len);
+}
+micro_t;
+
+/* Struct for the command line options */
+typedef struct micro_config_t
+{
+	bool is_json;
+	int target_ms;
+	int size_cnt;
+	int size_arr[MAX_SIZE_CNT];
+	const char *filter;
+}
+micro_config_t;
+
+/* Struct for the state one message hop works on.  peer_session is the other
+end of session, since a frame only opens with the keys of the side it was
+sent to */
+typedef struct hop_t
+{
+	int sealed_len;
+	int fd_arr[2];
+	session_t session;
+	session_t peer_session;
+	msg_data_t msg_data;
+	client_t client;
+	char msg[MAX_MSG_LEN];
+	unsigned char payload[MAX_PAYLOAD_LEN];
+	unsigned char sealed[MAX_FRAME_LEN];
+	unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
+	unsigned char privkey[crypto_box_SECRETKEYBYTES];
+	unsigned char room_key[crypto_secretbox_KEYBYTES];
+}
+hop_t;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t cnt, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static micro_config_t config;
+static hop_t hop;
+static unsigned long alloc_cnt;
+
+/* The build links with --wrap for these, so every allocation made by this
+program's own objects passes through here.  Calls made inside shared
+libraries are not seen */
+void *__wrap_malloc(size_t size)
+{
+	alloc_cnt += 1;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t cnt, size_t size)
+{
+	alloc_cnt += 1;
+	return __real_calloc(cnt, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_cnt += 1;
+	return __real_realloc(ptr, size);
+}
+
+static bool run_nonce(int payload_len)
+{
+	randombytes_buf(hop.msg_data.frame, crypto_box_NONCEBYTES);
+	return true;
+}
+
+static bool run_box_easy(int payload_len)
+{
+	/* What every message cost before session keys were precomputed */
+	return crypto_box_easy
+	(
+		hop.msg_data.frame,
+		hop.payload,
+		payload_len,
+		hop.sealed,
+		hop.pubkey,
+		hop.privkey
+	) == 0;
+}
+
+static bool run_seal_frame(int payload_len)
+{
+	hop.msg_data.frame_len = seal_frame
+	(
+		hop.msg_data.frame,
+		FRAME_TYPE_MSG,
+		hop.payload,
+		payload_len,
+		&hop.session
+	);
+	
+	return hop.msg_data.frame_len >= 0;
+}
+
+static bool prepare_open_frame(int payload_len)
+{
+	hop.sealed_len = seal_frame
+	(
+		hop.sealed,
+		FRAME_TYPE_MSG,
+		hop.payload,
+		payload_len,
+		&hop.peer_session
+	);
+	
+	return hop.sealed_len >= 0;
+}
+
+static bool run_open_frame(int payload_len)
+{
+	return open_frame
+	(
+		hop.payload,
+		&payload_len,
+		FRAME_TYPE_MSG,
+		hop.sealed + FRAME_HEADER_LEN,
+		hop.sealed_len - FRAME_HEADER_LEN,
+		&hop.session
+	);
+}
+
+static bool prepare_room_box_easy(int payload_len)
+{
+	/* The nonce sits in front of the sealed payload */
+	return crypto_box_easy
+	(
+		hop.sealed + crypto_box_NONCEBYTES,
+		hop.payload,
+		payload_len,
+		hop.sealed,
+		hop.pubkey,
+		hop.privkey
+	) == 0;
+}
+
+static bool run_room_box_easy(int payload_len)
+{
+	/* A message to a room the way the server handled it before session
+	keys: opened once and sealed once per member, every call a full key
+	exchange */
+	if
+	(
+		crypto_box_open_easy
+		(
+			hop.payload,
+			hop.sealed + crypto_box_NONCEBYTES,
+			payload_len + crypto_box_MACBYTES,
+			hop.sealed,
+			hop.pubkey,
+			hop.privkey
+		) != 0
+	)
+		return false;
+	
+	for(int i = 0; i < ROOM_MEMBER_CNT; i++)
+		if(!run_box_easy(payload_len)) return false;
+	
+	return true;
+}
+
+static bool run_room_frame(int payload_len)
+{
+	/* The same with each connection's precomputed session key */
+	if(!run_open_frame(payload_len)) return false;
+	
+	for(int i = 0; i < ROOM_MEMBER_CNT; i++)
+		if(!run_seal_frame(payload_len)) return false;
+	
+	return true;
+}
+
+static bool run_seal_room_frame(int payload_len)
+{
+	hop.msg_data.frame_len = seal_room_frame
+	(
+		hop.msg_data.frame,
+		FRAME_TYPE_ROOM_MSG,
+		hop.payload,
+		payload_len,
+		1,
+		hop.room_key
+	);
+	
+	return hop.msg_data.frame_len >= 0;
+}
+
+static bool prepare_open_room_frame(int payload_len)
+{
+	hop.sealed_len = seal_room_frame
+	(
+		hop.sealed,
+		FRAME_TYPE_ROOM_MSG,
+		hop.payload,
+		payload_len,
+		1,
+		hop.room_key
+	);
+	
+	return hop.sealed_len >= 0;
+}
+
+static bool run_open_room_frame(int payload_len)
+{
+	return open_room_frame
+	(
+		hop.payload,
+		&payload_len,
+		FRAME_TYPE_ROOM_MSG,
+		hop.sealed + FRAME_HEADER_LEN,
+		hop.sealed_len - FRAME_HEADER_LEN,
+		hop.room_key
+	);
+}
+
+static bool run_modify_msg(int payload_len)
+{
+	/* The server copies the payload out into a string before adding the
+	prefix, so the copy is part of the operation */
+	memcpy(hop.msg, hop.payload, payload_len);
+	hop.msg[payload_len] = '\0';
+	modify_msg_with_info(hop.msg, &hop.client, DEFAULT_CHANNEL_NAME);
+	
+	return true;
+}
+
+static bool run_socket_hop(int payload_len)
+{
+	frame_type_t type;
+	
+	/* One frame through a loopback socket, sealed, written, read and
+	opened */
+	return
+		send_frame
+		(
+			FRAME_TYPE_MSG,
+			hop.payload,
+			payload_len,
+			&hop.msg_data,
+			hop.fd_arr[0],
+			&hop.session
+		) &&
+		recv_frame
+		(
+			&type,
+			hop.payload,
+			&payload_len,
+			&hop.msg_data,
+			hop.fd_arr[1],
+			&hop.peer_session
+		);
+}
+
+static const micro_t MICRO_ARR[] =
+{
+	{"nonce", false, NULL, run_nonce},
+	{"crypto_box_easy", true, NULL, run_box_easy},
+	{"seal_frame", true, NULL, run_seal_frame},
+	{"open_frame", true, prepare_open_frame, run_open_frame},
+	{"room_box_easy", true, prepare_room_box_easy, run_room_box_easy},
+	{"room_frame", true, prepare_open_frame, run_room_frame},
+	{"seal_room_frame", true, NULL, run_seal_room_frame},
+	{"open_room_frame", true, prepare_open_room_frame, run_open_room_frame},
+	{"modify_msg_with_info", true, NULL, run_modify_msg},
+	{"socket_hop", true, NULL, run_socket_hop}
+};
+
+static const size_t MICRO_CNT = sizeof(MICRO_ARR) / sizeof(micro_t);
+
+static bool parse_size_list(char *arg)
+{
+	config.size_cnt = 0;
+	
+	for
+	(
+		char *size = strtok(arg, ",");
+		size != NULL;
+		size = strtok(NULL, ",")
+	)
+	{
+		if(config.size_cnt == MAX_SIZE_CNT) return false;
+		
+		config.size_arr[config.size_cnt] = atoi(size);
+		
+		/* Payloads become strings in modify_msg_with_info */
+		if
+		(
+			config.size_arr[config.size_cnt] < 1 ||
+			config.size_arr[config.size_cnt] > MAX_MSG_LEN - 1
+		)
+			return false;
+		
+		config.size_cnt += 1;
+	}
+	
+	return config.size_cnt > 0;
+}
+
+static bool parse_micro_args(int argc, char *argv[])
+{
+	int opt;
+	const int default_size_arr[] = {16, 64, 256, 1024, 4000};
+	
+	config.is_json = false;
+	config.target_ms = 200;
+	config.size_cnt = sizeof(default_size_arr) / sizeof(int);
+	memcpy(config.size_arr, default_size_arr, sizeof(default_size_arr));
+	config.filter = NULL;
+	
+	while((opt = getopt(argc, argv, "js:t:")) != -1)
+		switch(opt)
+		{
+			case 'j':
+				config.is_json = true;
+				break;
+			case 's':
+				if(!parse_size_list(optarg)) return false;
+				
+				break;
+			case 't':
+				config.target_ms = atoi(optarg);
+				break;
+			default:
+				return false;
+		}
+	
+	if(optind < argc) config.filter = argv[optind];
+	
+	return config.target_ms >= 1;
+}
+
+static bool init_hop(void)
+{
+	unsigned char peer_pubkey[crypto_box_PUBLICKEYBYTES];
+	unsigned char peer_privkey[crypto_box_SECRETKEYBYTES];
+	
+	crypto_box_keypair(hop.pubkey, hop.privkey);
+	crypto_box_keypair(peer_pubkey, peer_privkey);
+	crypto_secretbox_keygen(hop.room_key);
+	randombytes_buf(hop.sealed, crypto_box_NONCEBYTES);
+	init_session(&hop.session);
+	init_session(&hop.peer_session);
+	init_client(&hop.client);
+	
+	/* Printable, so the payload can stand in for a message */
+	memset(hop.payload, 'x', MAX_PAYLOAD_LEN);
+	
+	if(!update_session(&hop.session, peer_pubkey, hop.pubkey, hop.privkey))
+		return false;
+	
+	if
+	(
+		!update_session
+		(
+			&hop.peer_session,
+			hop.pubkey,
+			peer_pubkey,
+			peer_privkey
+		)
+	)
+		return false;
+	
+	/* A whole frame of the largest size has to fit in the socket buffer,
+	since both ends are driven from this one thread */
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, hop.fd_arr) != 0)
+	{
+		print_errno_err("socketpair");
+		return false;
+	}
+	
+	return true;
+}
+
+static void terminate_hop(void)
+{
+	close_socket(&hop.fd_arr[0]);
+	close_socket(&hop.fd_arr[1]);
+	sodium_memzero(&hop, sizeof(hop));
+}
+
+static bool time_micro
+(
+	const micro_t *micro,
+	int payload_len,
+	double *ns_per_op,
+	double *allocs_per_op
+)
+{
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 target = freq * config.target_ms / 1000;
+	
+	if(micro->prepare != NULL && !micro->prepare(payload_len)) return false;
+	
+	/* Double the count until one timed run takes the target time, which
+	keeps the clock's overhead out of the fast operations */
+	for(unsigned long op_cnt = 1; ; op_cnt *= 2)
+	{
+		unsigned long start_alloc_cnt = alloc_cnt;
+		Uint64 start = SDL_GetPerformanceCounter();
+		
+		for(unsigned long i = 0; i < op_cnt; i++)
+			if(!micro->run(payload_len)) return false;
+		
+		Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+		
+		if(elapsed >= target)
+		{
+			*ns_per_op = elapsed * 1000000000.0 / freq / op_cnt;
+			*allocs_per_op = (double)(alloc_cnt - start_alloc_cnt) / op_cnt;
+			return true;
+		}
+	}
+}
+
+static bool run_micro(const micro_t *micro, int payload_len)
+{
+	double ns_per_op;
+	double allocs_per_op;
+	
+	if(!time_micro(micro, payload_len, &ns_per_op, &allocs_per_op))
+	{
+		print_err(micro->name, "Operation failed");
+		return false;
+	}
+	
+	if(config.is_json)
+		printf
+		(
+			"{\"name\": \"%s\", \"size\": %d, \"ns_per_op\": %.1f, "
+			"\"allocs_per_op\": %.2f}\n",
+			micro->name,
+			payload_len,
+			ns_per_op,
+			allocs_per_op
+		);
+	else
+		printf
+		(
+			"%-22s %6d %12.1f %10.2f\n",
+			micro->name,
+			payload_len,
+			ns_per_op,
+			allocs_per_op
+		);
+	
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool micro_success = true;
+	
+	if(!parse_micro_args(argc, argv))
+	{
+		print_micro_arg_err();
+		return 1;
+	}
+	
+	if(!init_libsodium() || !init_hop()) return 1;
+	
+	if(!config.is_json)
+		printf
+		(
+			"%-22s %6s %12s %10s\n",
+			"benchmark",
+			"size",
+			"ns/op",
+			"allocs/op"
+		);
+	
+	for(size_t i = 0; micro_success && i < MICRO_CNT; i++)
+	{
+		const micro_t *micro = &MICRO_ARR[i];
+		
+		/* An argument runs only the benchmarks whose names contain it */
+		if
+		(
+			config.filter != NULL &&
+			strstr(micro->name, config.filter) == NULL
+		)
+			continue;
+		
+		/* Size-independent operations are reported once, with size 0 */
+		if(!micro->is_sized)
+		{
+			micro_success = run_micro(micro, 0);
+			continue;
+		}
+		
+		for(int j = 0; micro_success && j < config.size_cnt; j++)
+			micro_success = run_micro(micro, config.size_arr[j]);
+	}
+	
+	terminate_hop();
+	
+	return micro_success ? 0 : 1;
+}
@@ -18,165 +18,3847 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
+
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_net.h"
+#include "errno.h"
 #include "sodium.h"
+#include "src/auth-pool.h"
+#include "src/channel.h"
+#include "src/client-table.h"
+#include "src/compress.h"
 #include "src/err.h"
+#include "src/federation.h"
+#include "src/frame-pool.h"
 #include "src/init.h"
+#include "src/metrics.h"
+#include "src/msg-log.h"
 #include "src/net.h"
+#include "src/presence.h"
+#include "src/reactor.h"
+#include "src/ring.h"
+#include "src/server-net.h"
 #include "src/susurrc.h"
+#include "signal.h"
+#include "stdatomic.h"
 #include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "unistd.h"
+
+/* Block until there is activity, unless a report or a batch of presence
+changes is due */
+static const int REACTOR_WAIT_TIMEOUT = -1;
+
+/* Descriptors kept free for the listening socket and its spare, the
+reactors, the wake pipes, the log writer (which only holds a descriptor
+while it opens a segment), the stats socket and stdio */
+static const int RESERVED_FD_CNT = 16;
+
+/* Messages a shard can have waiting from the other shards.  A power of
+two */
+static const size_t SHARD_INBOX_CAP = 16384;
+
+static const int INITIAL_FLUSH_CAP = 64;
+static const int INITIAL_SEND_CAP = 64;
+static const int INITIAL_HELD_CAP = 64;
+
+/* Broadcasts a shard holds for one other shard whose inbox is full.  A
+shard this far behind is stuck, and loses the rest until it catches up */
+static const int MAX_HELD_CNT = 16384;
+
+/* How often (in milliseconds) held broadcasts are posted again while
+nothing else wakes the shard up */
+static const int HELD_RETRY_INTERVAL = 1;
+
+/* Presence changes are gathered for this long (in milliseconds) from the
+first one, and then go out together with one entry per user however often
+it changed in between */
+static const Uint32 PRESENCE_WINDOW_LEN = 200;
+
+static const int INITIAL_PRESENCE_CAP = 64;
+
+/* Broadcasts per loop pass whose fan-out time is recorded.  The rest of a
+burst goes unsampled */
+#define MAX_FANOUT_SAMPLE_CNT 256
+
+/* Password checks one address can have queued or running at once */
+static const int MAX_IP_LOGIN_CNT = 4;
+
+/* Wrong passwords a connection gets before it is dropped */
+static const int MAX_LOGIN_ATTEMPT_CNT = 3;
+
+/* Files a shard relays at once */
+#define MAX_RELAY_CNT 64
+
+/* File chunks a sender may have in flight.  Credit for a chunk only comes
+back once every shard has queued it and none of its recipients there is
+backed up, so the slowest recipient sets the pace and no transfer holds
+more than this on the server */
+#define FILE_WINDOW_CHUNK_CNT 32
+
+/* A recipient with more file bytes queued than this holds up the sender */
+static const int MAX_FILE_QUEUED_LEN = 65536;
+
+/* Unsent bytes the kernel may hold for a client receiving files.  Chat
+queued after file chunks waits behind no more than this */
+static const int MAX_FILE_UNSENT_LEN = 131072;
+
+static const int INITIAL_RECIPIENT_CAP = 8;
+
+/* Logged messages a dictionary is trained on.  About a hundred times the
+dictionary size is what zstd recommends */
+static const int MAX_TRAIN_SAMPLE_CNT = 100000;
+static const size_t MAX_TRAIN_LEN = 100 * COMPRESS_DICT_LEN;
+
+/* What to do with a client whose outbound queue passes the high-water
+mark */
+typedef enum overflow_policy_t
+{
+	OVERFLOW_POLICY_DISCONNECT,
+	OVERFLOW_POLICY_DROP_OLDEST
+}
+overflow_policy_t;
+
+/* Struct for the command line options */
+typedef struct server_config_t
+{
+	int port;
+	int shard_cnt;
+	int max_client_cnt;
+	int max_queued_len;
+	overflow_policy_t overflow_policy;
+	bool is_group_mode;
+	bool is_uring_preferred;
+	int stats_interval;
+	int replay_cnt;
+	int max_log_segment_cnt;
+	log_durability_t log_durability;
+	const char *log_dir;
+	int auth_worker_cnt;
+	const char *password_path;
+	const char *stats_path;
+	const char *dict_path;
+	const char *train_path;
+	int link_port;
+	int peer_cnt;
+	char *peer_arr[MAX_LINK_CNT];
+	const char *link_key_path;
+}
+server_config_t;
+
+typedef enum shard_msg_type_t
+{
+	SHARD_MSG_TYPE_CLIENT,
+	SHARD_MSG_TYPE_BROADCAST,
+	SHARD_MSG_TYPE_LOGIN,
+	SHARD_MSG_TYPE_FILE_START,
+	SHARD_MSG_TYPE_FILE_CHUNK,
+	SHARD_MSG_TYPE_FILE_CANCEL,
+	SHARD_MSG_TYPE_FILE_CREDIT,
+	SHARD_MSG_TYPE_PRESENCE
+}
+shard_msg_type_t;
+
+/* Struct for something handed to a shard from another thread: a newly
+accepted socket, a broadcast, a finished password check, a step of a file
+transfer or a batch of presence changes.  A broadcast is shared by every
+other shard and freed by the last one to finish with it.  File and presence
+messages go to every shard, the sender's own included.  File messages name
+the sender by shard, slot and connection, and msg holds the FILE_START
+payload or the whole FILE_CHUNK frame.  A presence batch holds entries as
+they go out on the wire */
+typedef struct shard_msg_t
+{
+	atomic_int ref_cnt;
+	shard_msg_type_t type;
+	int fd;
+	Uint64 recv_counter;
+	auth_job_t *auth_job;
+	int shard_id;
+	unsigned long conn_id;
+	uint32_t file_id;
+	client_t *client;
+	char username[MAX_USERNAME_LEN];
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	int msg_len;
+	char msg[];
+}
+shard_msg_t;
+
+/* Struct for a file a shard relays to its own recipients, the members of
+the channel when the file started.  Chunks that found a recipient backed up
+are held here, and the sender gets no credit for them until it catches
+up */
+typedef struct file_relay_t
+{
+	bool is_done;
+	uint32_t file_id;
+	int recipient_cnt;
+	int recipient_cap;
+	int held_cnt;
+	client_t **recipient_arr;
+	shard_msg_t *held_arr[FILE_WINDOW_CHUNK_CNT];
+}
+file_relay_t;
+
+/* Struct for a send io_uring has not finished yet.  It holds a reference to
+every frame in it, so none is reused while the kernel can still read it,
+even once the client is gone.  The frames are out_cnt from the client's
+out_queue followed by file_cnt from its file_queue, the order flush_client
+writes them in.  conn_id tells whether the client is still the one the
+frames were meant for, and index is where the send sits in its shard's
+send_arr */
+typedef struct pending_send_t
+{
+	client_t *client;
+	unsigned long conn_id;
+	int out_cnt;
+	int file_cnt;
+	int index;
+	frame_buf_t *buf_arr[FLUSH_IOV_CNT];
+	struct iovec iov_arr[FLUSH_IOV_CNT];
+	struct msghdr msg;
+}
+pending_send_t;
+
+/* Struct for the broadcasts one shard has for another that found its inbox
+full.  They are posted again in order, and newer ones for the same shard
+wait behind them so that a channel's messages never overtake each other */
+typedef struct held_post_t
+{
+	int cnt;
+	int cap;
+	shard_msg_t **msg_arr;
+}
+held_post_t;
+
+/* Struct for one reactor thread and the clients it owns.  Nothing in here
+is touched by other threads except the inbox and the wake pipe.  In group
+mode each channel keeps its own room key for its members on this shard, and
+the shard keeps a presence key for all of its clients.  Room key ids are
+numbered per shard, so a client never holds two keys with the same id.  With a
+dictionary each shard compresses with its own contexts.  Outgoing frames
+come from the shard's own pool and are shared by every queue they go to.
+Presence changes from the shard's own clients wait in presence_arr until
+the window that presence_gen numbers closes, and presence_table is the
+shard's copy of everyone's presence.  With io_uring, the first send_cnt of
+send_arr are sends the kernel has not finished, and the rest are kept for
+reuse.  held_arr has an entry per shard for the broadcasts waiting on its
+inbox, held_cnt of them in all.  dealt_cnt is the number of connections
+dealt to the shard that it still holds or has yet to take, which the
+dealing shard adds to and the shard itself takes from */
+typedef struct shard_t
+{
+	int id;
+	bool is_presence_key_stale;
+	uint32_t presence_key_id;
+	uint32_t next_room_key_id;
+	atomic_bool is_wake_pending;
+	atomic_int dealt_cnt;
+	int wake_fd_arr[2];
+	client_table_t client_table;
+	channel_table_t channel_table;
+	int flush_cnt;
+	int flush_cap;
+	client_t **flush_arr;
+	int send_cnt;
+	int send_cap;
+	pending_send_t **send_arr;
+	int held_cnt;
+	held_post_t *held_arr;
+	unsigned long next_conn_id;
+	int relay_cnt;
+	file_relay_t relay_arr[MAX_RELAY_CNT];
+	compressor_t compressor;
+	frame_pool_t frame_pool;
+	unsigned int presence_gen;
+	int presence_cnt;
+	int presence_cap;
+	presence_t *presence_arr;
+	Uint32 presence_ticks;
+	presence_table_t presence_table;
+	reactor_event_t event_arr[REACTOR_EVENT_CNT];
+	reactor_t *reactor;
+	ring_t inbox;
+	SDL_Thread *thread;
+	int fanout_cnt;
+	Uint64 fanout_counter_arr[MAX_FANOUT_SAMPLE_CNT];
+	metrics_t *metrics;
+	unsigned long long printed_counter_arr[COUNTER_CNT];
+	Uint32 stats_ticks;
+	unsigned char presence_key[crypto_secretbox_KEYBYTES];
+	unsigned char zmsg[MAX_PAYLOAD_LEN];
+}
+shard_t;
+
+/* Struct for what a replay needs to queue one channel's messages for one
+client */
+typedef struct replay_t
+{
+	shard_t *shard;
+	client_t *client;
+}
+replay_t;
+
+/* Struct for a presence snapshot on its way to one client.  Entries are
+gathered into a payload and sent whenever it fills up */
+typedef struct snapshot_t
+{
+	shard_t *shard;
+	client_t *client;
+	int payload_len;
+	unsigned char payload[MAX_PAYLOAD_LEN];
+}
+snapshot_t;
 
-static const int SOCKET_CHECK_TIMEOUT = 1;
+/* Struct for the logged messages a dictionary is trained on, back to
+back */
+typedef struct train_t
+{
+	unsigned int sample_cnt;
+	size_t len;
+	size_t *sample_len_arr;
+	char *buf;
+}
+train_t;
 
-static client_t client_arr[MAX_CLIENT_CNT];
-static int connected_client_cnt;
-static int ready_socket_cnt;
-static IPaddress server_ip;
-static msg_data_t msg_data;
-static SDLNet_SocketSet socket_set;
-static TCPsocket server_socket;
+static int listen_fd = -1;
+static int next_shard_id;
+static atomic_uint next_file_id;
+static atomic_uint next_presence_id;
+static atomic_bool is_stopping;
+static server_config_t config;
+static auth_pool_t *auth_pool;
+static compress_dict_t *compress_dict;
+static federation_t *federation;
+static metrics_t *metrics_arr;
+static stats_server_t *stats_server;
+static msg_log_t *msg_log;
+static shard_t *shard_arr;
 static unsigned char privkey[crypto_box_SECRETKEYBYTES];
 static unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
 
-static void modify_msg_with_info(char *msg, client_t *client)
+static bool parse_server_args(int argc, char *argv[], bool *is_hashing)
+{
+	int opt;
+	
+	*is_hashing = false;	
+	config.shard_cnt = 1;
+	config.max_client_cnt = DEFAULT_MAX_CLIENT_CNT;
+	config.max_queued_len = DEFAULT_MAX_QUEUED_LEN;
+	config.overflow_policy = OVERFLOW_POLICY_DISCONNECT;
+	config.is_group_mode = false;
+	config.is_uring_preferred = false;
+	config.stats_interval = 0;
+	config.replay_cnt = DEFAULT_REPLAY_CNT;
+	config.max_log_segment_cnt = DEFAULT_MAX_LOG_SEGMENT_CNT;
+	config.log_durability = LOG_DURABILITY_INTERVAL;
+	config.log_dir = NULL;
+	config.auth_worker_cnt = 2;
+	config.password_path = NULL;
+	config.stats_path = NULL;
+	config.dict_path = NULL;
+	config.train_path = NULL;
+	config.link_port = 0;
+	config.peer_cnt = 0;
+	config.link_key_path = NULL;
+	
+	const char *opt_str = "a:c:df:gHK:l:L:m:p:P:r:R:s:T:uw:z:";
+	
+	while((opt = getopt(argc, argv, opt_str)) != -1)
+		switch(opt)
+		{
+			case 'a':
+				config.auth_worker_cnt = atoi(optarg);
+				break;
+			case 'c':
+				config.max_client_cnt = atoi(optarg);
+				break;
+			case 'd':
+				config.overflow_policy = OVERFLOW_POLICY_DROP_OLDEST;
+				break;
+			case 'f':
+				config.log_durability = atoi(optarg);
+				break;
+			case 'g':
+				config.is_group_mode = true;
+				break;
+			case 'H':
+				*is_hashing = true;
+				break;
+			case 'K':
+				config.link_key_path = optarg;
+				break;
+			case 'l':
+				config.log_dir = optarg;
+				break;
+			case 'L':
+				config.link_port = atoi(optarg);
+				break;
+			case 'm':
+				config.stats_path = optarg;
+				break;
+			case 'p':
+				config.password_path = optarg;
+				break;
+			case 'P':
+				if(config.peer_cnt == MAX_LINK_CNT) return false;
+				
+				config.peer_arr[config.peer_cnt] = optarg;
+				config.peer_cnt += 1;
+				break;
+			case 'r':
+				config.replay_cnt = atoi(optarg);
+				break;
+			case 'R':
+				config.max_log_segment_cnt = atoi(optarg);
+				break;
+			case 's':
+				config.stats_interval = atoi(optarg);
+				break;
+			case 'T':
+				config.train_path = optarg;
+				break;
+			case 'u':
+				config.is_uring_preferred = true;
+				break;
+			case 'w':
+				config.max_queued_len = atoi(optarg);
+				break;
+			case 'z':
+				config.dict_path = optarg;
+				break;
+			default:
+				return false;
+		}
+	
+	/* Hashing a password needs nothing else */
+	if(*is_hashing) return true;
+	
+	/* Training only reads the log */
+	if(config.train_path != NULL) return config.log_dir != NULL;
+	
+	if(optind >= argc) return false;
+	
+	config.port = atoi(argv[optind]);
+	
+	/* The thread count follows the port.  Zero means one per core */
+	if(optind + 1 < argc)
+	{
+		config.shard_cnt = atoi(argv[optind + 1]);
+		
+		if(config.shard_cnt == 0) config.shard_cnt = SDL_GetCPUCount();
+	}
+	
+	/* Links to other servers need the shared key.  The queue has to be
+	able to hold at least one whole frame */
+	bool is_federated = config.link_port > 0 || config.peer_cnt > 0;
+	
+	return
+		(!is_federated || config.link_key_path != NULL) &&
+		config.link_port >= 0 &&
+		config.shard_cnt >= 1 &&
+		config.auth_worker_cnt >= 1 &&
+		config.stats_interval >= 0 &&
+		config.replay_cnt >= 0 &&
+		config.max_log_segment_cnt >= 0 &&
+		config.log_durability >= LOG_DURABILITY_NONE &&
+		config.log_durability <= LOG_DURABILITY_BATCH &&
+		config.max_client_cnt >= 1 &&
+		config.max_queued_len >= (int)MAX_FRAME_LEN;
+}
+
+static void limit_max_client_cnt(void)
+{
+	/* Every client needs a descriptor, so the descriptor limit is the real
+	capacity.  Say so up front instead of failing accepts later */
+	int fd_limit = raise_fd_limit();
+	int reserved_fd_cnt = RESERVED_FD_CNT + 3 * config.shard_cnt;
+	
+	if
+	(
+		fd_limit > reserved_fd_cnt &&
+		config.max_client_cnt > fd_limit - reserved_fd_cnt
+	)
+	{
+		config.max_client_cnt = fd_limit - reserved_fd_cnt;
+		
+		printf
+		(
+			"Client capacity limited to %d by the descriptor limit (%d)\n",
+			config.max_client_cnt,
+			fd_limit
+		);
+	}
+}
+
+static bool init_shard(shard_t *shard, int id)
+{
+	bool init_success;
+	
+	/* Each shard holds its share of the capacity.  Clients go to the
+	shard with the fewest, so no shard fills up while another has room */
+	int max_client_cnt =
+		(config.max_client_cnt + config.shard_cnt - 1) / config.shard_cnt;
+	
+	shard->id = id;
+	shard->is_presence_key_stale = false;
+	shard->presence_key_id = 1;
+	shard->next_room_key_id = 2;
+	crypto_secretbox_keygen(shard->presence_key);
+	atomic_init(&shard->is_wake_pending, false);
+	atomic_init(&shard->dealt_cnt, 0);
+	shard->wake_fd_arr[0] = -1;
+	shard->wake_fd_arr[1] = -1;
+	shard->reactor = NULL;
+	shard->thread = NULL;
+	shard->flush_cnt = 0;
+	shard->flush_cap = INITIAL_FLUSH_CAP;
+	shard->flush_arr = malloc(INITIAL_FLUSH_CAP * sizeof(client_t *));
+	shard->send_cnt = 0;
+	shard->send_cap = 0;
+	shard->send_arr = NULL;
+	shard->held_cnt = 0;
+	shard->held_arr = calloc(config.shard_cnt, sizeof(held_post_t));
+	shard->next_conn_id = 0;
+	shard->relay_cnt = 0;
+	shard->channel_table.bucket_arr = NULL;
+	init_frame_pool(&shard->frame_pool);
+	shard->presence_gen = 1;
+	shard->presence_cnt = 0;
+	shard->presence_cap = INITIAL_PRESENCE_CAP;
+	shard->presence_arr = malloc(INITIAL_PRESENCE_CAP * sizeof(presence_t));
+	shard->presence_ticks = 0;
+	shard->presence_table.bucket_arr = NULL;
+	shard->fanout_cnt = 0;
+	shard->metrics = &metrics_arr[id];
+	init_metrics(shard->metrics);
+	memset(shard->printed_counter_arr, 0, sizeof(shard->printed_counter_arr));
+	shard->stats_ticks = SDL_GetTicks();
+	
+	init_success =
+		shard->flush_arr != NULL &&
+		shard->presence_arr != NULL &&
+		shard->held_arr != NULL;
+	
+	if(init_success && compress_dict != NULL)
+		init_success = init_compressor(&shard->compressor, compress_dict);
+	
+	if(init_success)
+		init_success = init_client_table(&shard->client_table, max_client_cnt);
+	
+	if(init_success)
+		init_success = init_channel_table(&shard->channel_table);
+	
+	if(init_success)
+		init_success = init_presence_table(&shard->presence_table);
+	
+	if(init_success)
+		init_success = init_ring(&shard->inbox, SHARD_INBOX_CAP);
+	
+	if(init_success)
+		init_success = open_wake_pipe(shard->wake_fd_arr);
+	
+	if(init_success)
+		init_success = init_reactor(&shard->reactor);
+	
+	/* The wake pipe and the listening socket are told apart from clients
+	by their data pointers */
+	if(init_success)
+		init_success = add_to_reactor
+		(
+			shard->reactor,
+			shard->wake_fd_arr[0],
+			shard->wake_fd_arr
+		);
+	
+	/* The first shard accepts every connection and deals them out */
+	if(init_success && id == 0)
+	{
+		init_success = accept_with_reactor
+		(
+			shard->reactor,
+			listen_fd,
+			&listen_fd
+		);
+	}
+	
+	return init_success;
+}
+
+static bool post_to_shard(shard_t *shard, shard_msg_t *shard_msg)
+{
+	if(!push_ring(&shard->inbox, shard_msg)) return false;
+	
+	/* Only the first post since the shard last woke up writes to the pipe */
+	if(!atomic_exchange(&shard->is_wake_pending, true))
+		signal_wake_pipe(shard->wake_fd_arr[1]);
+	
+	return true;
+}
+
+static shard_msg_t *alloc_shard_msg(shard_msg_type_t type, int msg_len)
+{
+	shard_msg_t *shard_msg = malloc(sizeof(*shard_msg) + msg_len);
+	
+	if(shard_msg == NULL) return NULL;
+	
+	/* Fields a type has no use for are zero rather than left over from
+	whatever had the memory before */
+	memset(shard_msg, 0, sizeof(*shard_msg));
+	atomic_init(&shard_msg->ref_cnt, 1);
+	shard_msg->type = type;
+	shard_msg->fd = -1;
+	
+	return shard_msg;
+}
+
+static void release_shard_msg(shard_msg_t *shard_msg)
+{
+	if(atomic_fetch_sub(&shard_msg->ref_cnt, 1) != 1) return;
+	
+	/* Once every shard is done with a file chunk, it goes back to the
+	sender's shard as credit for one more.  Credit lost to a full inbox
+	stalls the transfer, which is no worse than the broadcast it would
+	otherwise have cost */
+	if(shard_msg->type == SHARD_MSG_TYPE_FILE_CHUNK)
+	{
+		shard_msg->type = SHARD_MSG_TYPE_FILE_CREDIT;
+		atomic_store(&shard_msg->ref_cnt, 1);
+		
+		if(post_to_shard(&shard_arr[shard_msg->shard_id], shard_msg)) return;
+		
+		print_err("release_shard_msg", "Shard inbox is full");
+	}
+	
+	free(shard_msg);
+}
+
+static void terminate_relay(file_relay_t *relay)
+{
+	/* Nothing waits for credit any more */
+	for(int i = 0; i < relay->held_cnt; i++)
+	{
+		relay->held_arr[i]->type = SHARD_MSG_TYPE_FILE_CREDIT;
+		release_shard_msg(relay->held_arr[i]);
+	}
+	
+	free(relay->recipient_arr);
+	relay->recipient_arr = NULL;
+	relay->held_cnt = 0;
+}
+
+static void terminate_shard(shard_t *shard)
+{
+	client_table_t *client_table = &shard->client_table;
+	shard_msg_t *shard_msg;
+	
+	/* Close every connected client.  Removing from the table fills the
+	free list, which terminate_client_table releases */
+	while(client_table->active_client_cnt > 0)
+	{
+		client_t *client = client_table->active_client_arr[0];
+		
+		close_socket(&client->fd);
+		terminate_out_queue(&client->out_queue);
+		terminate_out_queue(&client->file_queue);
+		remove_client_from_table(client_table, client);
+	}
+	
+	for(int i = 0; i < shard->relay_cnt; i++)
+		terminate_relay(&shard->relay_arr[i]);
+	
+	shard->relay_cnt = 0;
+	terminate_client_table(client_table);
+	terminate_channel_table(&shard->channel_table);
+	terminate_presence_table(&shard->presence_table);
+	free(shard->flush_arr);
+	shard->flush_arr = NULL;
+	free(shard->presence_arr);
+	shard->presence_arr = NULL;
+	
+	/* Let go of anything still waiting in the inbox */
+	if(shard->inbox.cell_arr != NULL)
+		while((shard_msg = pop_ring(&shard->inbox)) != NULL)
+		{
+			if(shard_msg->type == SHARD_MSG_TYPE_CLIENT)
+				close_socket(&shard_msg->fd);
+			
+			if(shard_msg->type == SHARD_MSG_TYPE_FILE_CHUNK)
+				shard_msg->type = SHARD_MSG_TYPE_FILE_CREDIT;
+			
+			free(shard_msg->auth_job);
+			release_shard_msg(shard_msg);
+		}
+	
+	terminate_ring(&shard->inbox);
+	
+	/* Broadcasts are only ever held, so nothing goes back to a sender */
+	if(shard->held_arr != NULL)
+		for(int i = 0; i < config.shard_cnt; i++)
+		{
+			held_post_t *held = &shard->held_arr[i];
+			
+			for(int j = 0; j < held->cnt; j++)
+				release_shard_msg(held->msg_arr[j]);
+			
+			free(held->msg_arr);
+		}
+	
+	free(shard->held_arr);
+	shard->held_arr = NULL;
+	shard->held_cnt = 0;
+	
+	/* Sends the kernel never finished let go of their frames, which the
+	pool is about to free */
+	for(int i = 0; i < shard->send_cap; i++)
+	{
+		pending_send_t *send = shard->send_arr[i];
+		
+		if(send == NULL) continue;
+		
+		if(i < shard->send_cnt)
+			for(int j = 0; j < send->out_cnt + send->file_cnt; j++)
+				release_frame_buf(send->buf_arr[j]);
+		
+		free(send);
+	}
+	
+	free(shard->send_arr);
+	shard->send_arr = NULL;
+	shard->send_cnt = 0;
+	shard->send_cap = 0;
+	terminate_frame_pool(&shard->frame_pool);
+	terminate_compressor(&shard->compressor);
+	sodium_memzero(shard->presence_key, sizeof(shard->presence_key));
+	close_socket(&shard->wake_fd_arr[0]);
+	close_socket(&shard->wake_fd_arr[1]);
+	terminate_reactor(&shard->reactor);
+}
+
+static void post_auth_result(void *data, auth_job_t *auth_job)
+{
+	shard_msg_t *shard_msg = alloc_shard_msg(SHARD_MSG_TYPE_LOGIN, 0);
+	
+	/* The result goes back to the shard that owns the client, which is the
+	only thread allowed to touch it */
+	if(shard_msg != NULL)
+	{
+		shard_msg->auth_job = auth_job;
+		
+		if(post_to_shard(&shard_arr[auth_job->shard_id], shard_msg)) return;
+	}
+	
+	/* The client is left waiting and has to reconnect */
+	print_err("post_auth_result", "Could not return the login result");
+	free(shard_msg);
+	free(auth_job);
+}
+
+static void post_to_all_shards(shard_msg_t *shard_msg)
+{
+	atomic_store(&shard_msg->ref_cnt, config.shard_cnt);
+	
+	/* The posting shard takes its own copy from the inbox as well.  Handling
+	it right away could drop clients in the middle of whatever posted it */
+	for(int i = 0; i < config.shard_cnt; i++)
+		if(!post_to_shard(&shard_arr[i], shard_msg))
+		{
+			print_err("post_to_all_shards", "Shard inbox is full");
+			release_shard_msg(shard_msg);
+		}
+}
+
+static void deliver_relayed_msg
+(
+	void *data,
+	uint64_t node_id,
+	uint64_t seq,
+	const char *channel_name,
+	const char *msg,
+	int msg_len
+)
 {
-	char new_msg[MAX_MSG_LEN];
+	/* Logged here too, so replays cover the whole room.  The log drops it
+	if it already holds the same id */
+	if(msg_log != NULL)
+		append_msg_log(msg_log, node_id, seq, channel_name, msg, msg_len);
 	
-	/* Start the modified message with the client's username */
-	strcpy(new_msg, client->username);
-	strcat(new_msg, ": ");
+	shard_msg_t *shard_msg = alloc_shard_msg
+	(
+		SHARD_MSG_TYPE_BROADCAST,
+		msg_len
+	);
 	
-	/* Append the original message */
-	strcat(new_msg, msg);
+	if(shard_msg == NULL)
+	{
+		print_err("deliver_relayed_msg", "Could not allocate the broadcast");
+		return;
+	}
 	
-	/* Copy the modified message to the original message string */
-	strcpy(msg, new_msg);
+	/* Every shard broadcasts it to its own members, the same as a message
+	from another shard */
+	shard_msg->recv_counter = SDL_GetPerformanceCounter();
+	strcpy(shard_msg->channel_name, channel_name);
+	shard_msg->msg_len = msg_len;
+	memcpy(shard_msg->msg, msg, msg_len);
+	post_to_all_shards(shard_msg);
 }
 
 static bool init_server(int argc, char *argv[])
 {	
 	bool init_success = false;
+	char password_hash[crypto_pwhash_STRBYTES];
 
-	crypto_box_keypair(pubkey, privkey);
-	init_client_arr(client_arr, MAX_CLIENT_CNT);
-	connected_client_cnt = 0;
+	init_success = init_libsodium();
 	
-	init_success = setup_server_connection
-	(
-		&server_ip,
-		&server_socket,
-		NULL,
-		atoi(argv[1])
-	);
+	if(init_success) crypto_box_keypair(pubkey, privkey);
+	
+	limit_max_client_cnt();
+	next_shard_id = 0;
+	
+	if(init_success)
+		init_success = open_listen_socket(&listen_fd, config.port);
+	
+	/* Loaded before the shards, which each set up their contexts with it */
+	if(init_success && config.dict_path != NULL)
+	{
+		compress_dict = malloc(sizeof(*compress_dict));
+		
+		init_success =
+			compress_dict != NULL &&
+			load_compress_dict(compress_dict, config.dict_path);
+		
+		if(!init_success)
+		{
+			free(compress_dict);
+			compress_dict = NULL;
+		}
+	}
+	
+	if(init_success)
+	{
+		shard_arr = calloc(config.shard_cnt, sizeof(shard_t));
+		metrics_arr = calloc(config.shard_cnt, sizeof(metrics_t));
+		
+		if(shard_arr == NULL || metrics_arr == NULL)
+		{
+			print_err("init_server", "Could not allocate the shards");
+			init_success = false;
+		}
+	}
+	
+	/* Every shard's reactor falls back to epoll if the kernel will not
+	give it a ring */
+	if(config.is_uring_preferred) prefer_uring_reactor();
+	
+	for(int i = 0; init_success && i < config.shard_cnt; i++)
+		init_success = init_shard(&shard_arr[i], i);
+	
+	if(init_success && config.log_dir != NULL)
+	{
+		msg_log = malloc(sizeof(*msg_log));
+		
+		init_success =
+			msg_log != NULL &&
+			init_msg_log
+			(
+				msg_log,
+				config.log_dir,
+				config.log_durability,
+				config.max_log_segment_cnt,
+				config.replay_cnt
+			);
+		
+		if(!init_success)
+		{
+			free(msg_log);
+			msg_log = NULL;
+		}
+	}
+	
+	if(init_success && config.stats_path != NULL)
+	{
+		stats_server = malloc(sizeof(*stats_server));
+		
+		init_success =
+			stats_server != NULL &&
+			init_stats_server
+			(
+				stats_server,
+				config.stats_path,
+				metrics_arr,
+				config.shard_cnt
+			);
+		
+		if(!init_success)
+		{
+			free(stats_server);
+			stats_server = NULL;
+		}
+	}
+	
+	if(init_success && config.password_path != NULL)
+	{
+		auth_pool = malloc(sizeof(*auth_pool));
+		
+		init_success =
+			auth_pool != NULL &&
+			read_password_hash(config.password_path, password_hash) &&
+			init_auth_pool
+			(
+				auth_pool,
+				password_hash,
+				config.auth_worker_cnt,
+				MAX_IP_LOGIN_CNT,
+				post_auth_result,
+				NULL
+			);
+		
+		sodium_memzero(password_hash, sizeof(password_hash));
+		
+		if(!init_success)
+		{
+			free(auth_pool);
+			auth_pool = NULL;
+		}
+	}
+	
+	/* Started last, since relayed messages go straight to the shards and
+	the log */
+	if(init_success && (config.link_port > 0 || config.peer_cnt > 0))
+	{
+		federation = malloc(sizeof(*federation));
+		
+		init_success =
+			federation != NULL &&
+			init_federation
+			(
+				federation,
+				config.link_key_path,
+				config.link_port,
+				config.peer_cnt,
+				config.peer_arr,
+				deliver_relayed_msg,
+				NULL
+			);
+		
+		if(!init_success)
+		{
+			free(federation);
+			federation = NULL;
+		}
+	}
 	
 	if(init_success)
-		init_success = init_server_socket_set(&socket_set, &server_socket);
+		printf
+		(
+			"Listening on port %d for up to %d clients (%s, %d threads)\n",
+			config.port,
+			config.max_client_cnt,
+			get_reactor_name(),
+			config.shard_cnt
+		);
+	
+	if(init_success && compress_dict != NULL)
+		printf("Compressing with dictionary %u\n", compress_dict->id);
+	
+	return init_success;
 }
 
 static void terminate_server(void)
 {
-	if(server_socket && socket_set)
-		SDLNet_TCP_DelSocket(socket_set, server_socket);
+	if(stats_server != NULL) terminate_stats_server(stats_server);
+	
+	free(stats_server);
+	stats_server = NULL;
+	
+	/* The federation thread posts to the shards and the log, and the
+	workers post results to the shards, so they stop first */
+	if(federation != NULL) terminate_federation(federation);
+	
+	free(federation);
+	federation = NULL;
+	
+	if(auth_pool != NULL) terminate_auth_pool(auth_pool);
+	
+	free(auth_pool);
+	auth_pool = NULL;
+	
+	if(msg_log != NULL) terminate_msg_log(msg_log);
+	
+	free(msg_log);
+	msg_log = NULL;
 	
-	SDLNet_TCP_Close(server_socket);
-	server_socket = NULL;
+	if(shard_arr != NULL)
+		for(int i = 0; i < config.shard_cnt; i++)
+			terminate_shard(&shard_arr[i]);
 	
-	if(socket_set)
-		SDLNet_FreeSocketSet(socket_set);
+	free(shard_arr);
+	free(metrics_arr);
+	shard_arr = NULL;
+	metrics_arr = NULL;
+	
+	if(compress_dict != NULL) free_compress_dict(compress_dict);
+	
+	free(compress_dict);
+	compress_dict = NULL;
+	close_socket(&listen_fd);
 }
 
-static void run_server(void)
+static shard_msg_t *make_file_msg
+(
+	shard_t *shard,
+	client_t *client,
+	shard_msg_type_t type,
+	int msg_len
+)
 {
-	bool is_running = true;
+	shard_msg_t *shard_msg = alloc_shard_msg(type, msg_len);
 	
-	while(is_running)
-	{	
-		ready_socket_cnt = SDLNet_CheckSockets
-		(
-			socket_set,
-			SOCKET_CHECK_TIMEOUT
-		);
+	if(shard_msg == NULL)
+	{
+		print_err("make_file_msg", "Could not allocate the message");
+		return NULL;
+	}
+	
+	shard_msg->shard_id = shard->id;
+	shard_msg->conn_id = client->conn_id;
+	shard_msg->file_id = client->upload_file_id;
+	shard_msg->client = client;
+	strcpy(shard_msg->username, client->username);
+	strcpy(shard_msg->channel_name, client->upload_channel_name);
+	shard_msg->msg_len = msg_len;
+	
+	return shard_msg;
+}
+
+static void cancel_upload(shard_t *shard, client_t *client)
+{
+	client->is_uploading = false;
+	
+	/* Every shard stops relaying the file and tells its recipients */
+	shard_msg_t *shard_msg = make_file_msg
+	(
+		shard,
+		client,
+		SHARD_MSG_TYPE_FILE_CANCEL,
+		0
+	);
+	
+	if(shard_msg != NULL) post_to_all_shards(shard_msg);
+}
+
+static file_relay_t *find_relay(shard_t *shard, uint32_t file_id)
+{
+	for(int i = 0; i < shard->relay_cnt; i++)
+		if(shard->relay_arr[i].file_id == file_id) return &shard->relay_arr[i];
+	
+	return NULL;
+}
+
+static void remove_recipient_from_relay(file_relay_t *relay, client_t *client)
+{
+	for(int i = 0; i < relay->recipient_cnt; i++)
+	{
+		if(relay->recipient_arr[i] != client) continue;
 		
-		if(ready_socket_cnt > 0)
-			for(int i = 0; i < MAX_CLIENT_CNT; i++)
-			{
-				if(SDLNet_SocketReady(client_arr[i].socket))
-				{
-					/* Receive a message if activity is detected from the
-					client's socket and the client is already connected */
-					
-					char msg[MAX_MSG_LEN];
-					
-					bool recv_success = recv_msg
-					(
-						msg,
-						&msg_data,
-						&client_arr[i].socket,
-						privkey,
-						pubkey
-					);
-					
-					/* Drop a client from the server if they send an empty
-					message (occurs on client disconnect) */
-					if(recv_success == false)
-					{
-						remove_client_from_server
-						(
-							&socket_set,
-							&client_arr[i].socket,
-							&connected_client_cnt
-						);
-						
-						/* Exit this iteration so we don't send empty
-						messages to the other clients */
-						continue;
-					}
-					
-					modify_msg_with_info(msg, &client_arr[i]);
-					
-					for(int j = 0; j < MAX_CLIENT_CNT; j++)
-						if(client_arr[j].socket != NULL)
-							send_msg
-							(
-								msg,
-								&msg_data,
-								&client_arr[j].socket,
-								privkey,
-								pubkey
-							);
-				}
-				else if
-				(
-					SDLNet_SocketReady(socket_set) &&
-					!client_arr[i].socket
-				)
-				{
-					/* Try to connect a client if activity is detected from
-					the entire socket set and the current client's socket is
-					disconnected/NULL */
-					
-					add_client_to_server
-					(
-						&socket_set,
-						&client_arr[i].socket,
-						&server_socket,
-						&connected_client_cnt
-					);
-				}
-			}
+		/* The last recipient takes the departing one's place */
+		relay->recipient_cnt -= 1;
+		relay->recipient_arr[i] = relay->recipient_arr[relay->recipient_cnt];
+		client->relay_cnt -= 1;
+		return;
 	}
 }
 
-int main(int argc, char *argv[])
+static void remove_relay(shard_t *shard, file_relay_t *relay)
 {
-	if(argc < 2)
-		print_server_arg_err();
-	else
+	for(int i = 0; i < relay->recipient_cnt; i++)
+		relay->recipient_arr[i]->relay_cnt -= 1;
+	
+	/* Held chunks go back to the sender as credit.  It may still be
+	sending, and has to be able to finish */
+	for(int i = 0; i < relay->held_cnt; i++)
+		release_shard_msg(relay->held_arr[i]);
+	
+	relay->held_cnt = 0;
+	free(relay->recipient_arr);
+	shard->relay_cnt -= 1;
+	*relay = shard->relay_arr[shard->relay_cnt];
+}
+
+static void leave_relays(shard_t *shard, client_t *client)
+{
+	for(int i = 0; client->relay_cnt > 0 && i < shard->relay_cnt; i++)
+		remove_recipient_from_relay(&shard->relay_arr[i], client);
+}
+
+static void change_presence
+(
+	shard_t *shard,
+	client_t *client,
+	presence_state_t state
+)
+{
+	presence_t *presence;
+	
+	/* Typing is repeated to keep it from timing out.  Anything else is
+	only news once */
+	if(state == client->presence_state && state != PRESENCE_STATE_TYPING)
+		return;
+	
+	/* A client is listed once per window however often it changes, and
+	only its latest state goes out */
+	if(client->presence_gen == shard->presence_gen)
 	{
-		init_server(argc, argv);
-		run_server();
+		presence = &shard->presence_arr[client->presence_index];
+	}
+	else
+	{
+		if(shard->presence_cnt == shard->presence_cap)
+		{
+			presence_t *new_presence_arr = realloc
+			(
+				shard->presence_arr,
+				shard->presence_cap * 2 * sizeof(presence_t)
+			);
+			
+			/* Presence is only a hint.  Losing a change is no worse than a
+			dropped frame */
+			if(new_presence_arr == NULL)
+			{
+				print_err("change_presence", "Could not grow the changes");
+				return;
+			}
+			
+			shard->presence_arr = new_presence_arr;
+			shard->presence_cap *= 2;
+		}
+		
+		/* The window opens with its first change */
+		if(shard->presence_cnt == 0) shard->presence_ticks = SDL_GetTicks();
+		
+		client->presence_gen = shard->presence_gen;
+		client->presence_index = shard->presence_cnt;
+		presence = &shard->presence_arr[shard->presence_cnt];
+		shard->presence_cnt += 1;
+	}
+	
+	client->presence_state = state;
+	presence->is_self = false;
+	presence->id = client->presence_id;
+	presence->state = state;
+	strcpy(presence->username, client->username);
+	strcpy(presence->channel_name, "");
+	
+	/* Typing is in the channel the client posts to */
+	if(state == PRESENCE_STATE_TYPING && client->current_channel >= 0)
+	{
+		strcpy
+		(
+			presence->channel_name,
+			client->channel_arr[client->current_channel].channel->name
+		);
+	}
+}
+
+static void remove_client_from_server(shard_t *shard, client_t *client)
+{
+	/* The presence key has to change before the next presence batch if the
+	client was given it.  Leaving its channels marks their keys stale */
+	if(config.is_group_mode && client->is_logged_in)
+		shard->is_presence_key_stale = true;
+	
+	add_counter(shard->metrics, COUNTER_CONN_CLOSED, 1);
+	add_gauge(shard->metrics, GAUGE_CLIENT, -1);
+	add_gauge
+	(
+		shard->metrics,
+		GAUGE_QUEUED_BYTE,
+		-client->out_queue.queued_len - client->file_queue.queued_len
+	);
+	
+	if(client->is_write_blocked)
+		add_gauge(shard->metrics, GAUGE_WRITE_BLOCKED_CLIENT, -1);
+	
+	/* Everyone hears the client has gone with the next batch */
+	if(client->presence_id != 0)
+		change_presence(shard, client, PRESENCE_STATE_OFFLINE);
+	
+	/* A send io_uring has not finished holds on to the socket, and only
+	shutting it down makes the send give up */
+	if(client->is_send_pending) shutdown(client->fd, SHUT_RDWR);
+	
+	/* Remove the socket from the reactor and close the connection */
+	remove_from_reactor(shard->reactor, client->fd);
+	close_socket(&client->fd);
+	
+	/* Forget the departed client's channels, session key and buffered input
+	and output, then hand its slot back to the table */
+	leave_all_channels(&shard->channel_table, client);
+	
+	/* A file cut short is cancelled for everyone receiving it */
+	if(client->is_uploading) cancel_upload(shard, client);
+	
+	leave_relays(shard, client);
+	terminate_out_queue(&client->out_queue);
+	terminate_out_queue(&client->file_queue);
+	init_client(client);
+	remove_client_from_table(&shard->client_table, client);
+	atomic_fetch_sub(&shard->dealt_cnt, 1);
+}
+
+static pending_send_t *alloc_pending_send(shard_t *shard)
+{
+	if(shard->send_cnt == shard->send_cap)
+	{
+		int new_cap = shard->send_cap ? shard->send_cap * 2 : INITIAL_SEND_CAP;
+		
+		pending_send_t **new_send_arr = realloc
+		(
+			shard->send_arr,
+			new_cap * sizeof(pending_send_t *)
+		);
+		
+		if(new_send_arr == NULL) return NULL;
+		
+		for(int i = shard->send_cap; i < new_cap; i++) new_send_arr[i] = NULL;
+		
+		shard->send_arr = new_send_arr;
+		shard->send_cap = new_cap;
+	}
+	
+	/* Sends are reused, so only the first few ever allocate */
+	if(shard->send_arr[shard->send_cnt] == NULL)
+	{
+		shard->send_arr[shard->send_cnt] = malloc(sizeof(pending_send_t));
+		
+		if(shard->send_arr[shard->send_cnt] == NULL) return NULL;
+	}
+	
+	pending_send_t *send = shard->send_arr[shard->send_cnt];
+	
+	send->index = shard->send_cnt;
+	shard->send_cnt += 1;
+	
+	return send;
+}
+
+static void free_pending_send(shard_t *shard, pending_send_t *send)
+{
+	for(int i = 0; i < send->out_cnt + send->file_cnt; i++)
+		release_frame_buf(send->buf_arr[i]);
+	
+	/* The last send in flight takes its place */
+	int last = shard->send_cnt - 1;
+	
+	shard->send_arr[send->index] = shard->send_arr[last];
+	shard->send_arr[send->index]->index = send->index;
+	shard->send_arr[last] = send;
+	shard->send_cnt = last;
+}
+
+static void submit_client_send(shard_t *shard, client_t *client)
+{
+	out_queue_t *out_queue = &client->out_queue;
+	out_queue_t *file_queue = &client->file_queue;
+	
+	if(out_queue->frame_cnt == 0 && file_queue->frame_cnt == 0) return;
+	
+	pending_send_t *send = alloc_pending_send(shard);
+	
+	if(send == NULL)
+	{
+		print_err("submit_client_send", "Could not allocate the send");
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* The same order flush_client writes in.  A file chunk already partly
+	written goes out alone, and file chunks only follow chat once all of it
+	is in */
+	if(file_queue->head_offset > 0)
+	{
+		send->out_cnt = 0;
+		send->file_cnt =
+			gather_out_frames(file_queue, 1, send->iov_arr, send->buf_arr);
+	}
+	else
+	{
+		send->out_cnt = gather_out_frames
+		(
+			out_queue,
+			FLUSH_IOV_CNT,
+			send->iov_arr,
+			send->buf_arr
+		);
+		
+		send->file_cnt = 0;
+		
+		if(send->out_cnt == out_queue->frame_cnt)
+		{
+			send->file_cnt = gather_out_frames
+			(
+				file_queue,
+				FLUSH_IOV_CNT - send->out_cnt,
+				send->iov_arr + send->out_cnt,
+				send->buf_arr + send->out_cnt
+			);
+		}
+	}
+	
+	for(int i = 0; i < send->out_cnt + send->file_cnt; i++)
+		ref_frame_buf(send->buf_arr[i]);
+	
+	send->client = client;
+	send->conn_id = client->conn_id;
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_iov = send->iov_arr;
+	send->msg.msg_iovlen = send->out_cnt + send->file_cnt;
+	
+	if(!send_with_reactor(shard->reactor, client->fd, &send->msg, send))
+	{
+		free_pending_send(shard, send);
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* The frames stay queued, where nothing can drop them, until the
+	kernel says how much of them went out */
+	out_queue->sending_cnt = send->out_cnt;
+	file_queue->sending_cnt = send->file_cnt;
+	client->is_send_pending = true;
+	add_counter(shard->metrics, COUNTER_SEND_CALL, 1);
+}
+
+static void finish_client_send(shard_t *shard, pending_send_t *send, int result)
+{
+	client_t *client = send->client;
+	
+	/* The client is gone, and its slot may already be someone else's */
+	if(client->fd < 0 || client->conn_id != send->conn_id)
+	{
+		free_pending_send(shard, send);
+		return;
+	}
+	
+	client->is_send_pending = false;
+	client->out_queue.sending_cnt = 0;
+	client->file_queue.sending_cnt = 0;
+	
+	if(result < 0 && result != -EAGAIN && result != -EINTR)
+	{
+		errno = -result;
+		print_errno_err("sendmsg");
+		free_pending_send(shard, send);
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* What went out is taken off the queues in the order it was sent */
+	if(result > 0)
+	{
+		size_t out_len = 0;
+		
+		for(int i = 0; i < send->out_cnt; i++)
+			out_len += send->iov_arr[i].iov_len;
+		
+		if(out_len > (size_t)result) out_len = result;
+		
+		advance_out_queue(&client->out_queue, out_len);
+		advance_out_queue(&client->file_queue, result - out_len);
+		add_counter(shard->metrics, COUNTER_BYTE_OUT, result);
+		add_gauge(shard->metrics, GAUGE_QUEUED_BYTE, -result);
+	}
+	
+	free_pending_send(shard, send);
+	
+	/* Whatever was queued in the meantime, or did not fit, goes next */
+	submit_client_send(shard, client);
+}
+
+static void flush_client(shard_t *shard, client_t *client)
+{
+	/* With io_uring there is one send per client in flight, and the rest
+	waits for it to finish */
+	if(does_reactor_do_io(shard->reactor))
+	{
+		if(!client->is_send_pending) submit_client_send(shard, client);
+		
+		return;
+	}
+	
+	out_queue_t *file_queue = &client->file_queue;
+	int queued_len = client->out_queue.queued_len + file_queue->queued_len;
+	unsigned long send_call_cnt = 0;
+	
+	/* Chat goes first, and file chunks only get what the socket has left.
+	A chunk already partly written has to be finished before anything else
+	though, or the frames would interleave */
+	flush_status_t flush_status = finish_out_frame
+	(
+		file_queue,
+		client->fd,
+		&send_call_cnt
+	);
+	
+	if(flush_status == FLUSH_STATUS_DONE)
+	{
+		flush_status = flush_out_queue
+		(
+			&client->out_queue,
+			client->fd,
+			&send_call_cnt
+		);
+	}
+	
+	if(flush_status == FLUSH_STATUS_DONE)
+		flush_status = flush_out_queue(file_queue, client->fd, &send_call_cnt);
+	
+	int sent_len =
+		queued_len - client->out_queue.queued_len - file_queue->queued_len;
+	
+	add_counter(shard->metrics, COUNTER_SEND_CALL, send_call_cnt);
+	add_counter(shard->metrics, COUNTER_BYTE_OUT, sent_len);
+	add_gauge(shard->metrics, GAUGE_QUEUED_BYTE, -sent_len);
+	
+	if(flush_status == FLUSH_STATUS_ERROR)
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* Only wait for write readiness while the socket is full */
+	bool is_write_blocked = flush_status == FLUSH_STATUS_AGAIN;
+	
+	if(is_write_blocked != client->is_write_blocked)
+	{
+		set_reactor_write_interest
+		(
+			shard->reactor,
+			client->fd,
+			client,
+			is_write_blocked
+		);
+		
+		client->is_write_blocked = is_write_blocked;
+		add_gauge
+		(
+			shard->metrics,
+			GAUGE_WRITE_BLOCKED_CLIENT,
+			is_write_blocked ? 1 : -1
+		);
+	}
+}
+
+static void flush_pending_clients(shard_t *shard)
+{
+	/* Everything queued for a client during one pass of the loop goes out
+	in as few sendmsg calls as possible.  A client dropped after being
+	listed has had its flag cleared */
+	for(int i = 0; i < shard->flush_cnt; i++)
+	{
+		client_t *client = shard->flush_arr[i];
+		
+		if(!client->is_flush_pending) continue;
+		
+		client->is_flush_pending = false;
+		
+		if(!client->is_write_blocked) flush_client(shard, client);
+	}
+	
+	shard->flush_cnt = 0;
+	
+	/* Every broadcast handled in this pass is now with the kernel (or
+	queued behind a full socket) for all of this shard's members */
+	if(shard->fanout_cnt > 0)
+	{
+		Uint64 now = SDL_GetPerformanceCounter();
+		
+		for(int i = 0; i < shard->fanout_cnt; i++)
+			record_latency
+			(
+				shard->metrics,
+				LATENCY_FANOUT,
+				get_elapsed_ns(shard->fanout_counter_arr[i], now)
+			);
+		
+		shard->fanout_cnt = 0;
+	}
+}
+
+static void add_flush_pending_client(shard_t *shard, client_t *client)
+{
+	/* Writing is left to the end of the loop pass.  A blocked socket is
+	flushed when the reactor says it is writable again */
+	if(client->is_flush_pending || client->is_write_blocked) return;
+	
+	if(shard->flush_cnt == shard->flush_cap)
+	{
+		client_t **new_flush_arr = realloc
+		(
+			shard->flush_arr,
+			shard->flush_cap * 2 * sizeof(client_t *)
+		);
+		
+		/* Fall back to writing right away */
+		if(new_flush_arr == NULL)
+		{
+			flush_client(shard, client);
+			return;
+		}
+		
+		shard->flush_arr = new_flush_arr;
+		shard->flush_cap *= 2;
+	}
+	
+	client->is_flush_pending = true;
+	shard->flush_arr[shard->flush_cnt] = client;
+	shard->flush_cnt += 1;
+}
+
+static void queue_frame_for_client
+(
+	shard_t *shard,
+	client_t *client,
+	frame_buf_t *buf,
+	bool is_droppable
+)
+{
+	int frame_len = buf->len;
+	int max_queued_len = config.max_queued_len - frame_len;
+	
+	/* Queued presence goes first, whatever the policy.  The client gets a
+	snapshot instead once it has caught up */
+	if(client->out_queue.queued_len > max_queued_len)
+	{
+		int queued_len = client->out_queue.queued_len;
+		
+		if(drop_ephemeral_out_frames(&client->out_queue, max_queued_len) > 0)
+			client->is_presence_stale = true;
+		
+		add_gauge
+		(
+			shard->metrics,
+			GAUGE_QUEUED_BYTE,
+			client->out_queue.queued_len - queued_len
+		);
+	}
+	
+	/* A client that cannot keep up is disconnected or loses its oldest
+	frames.  Either way nobody else waits for it */
+	if(client->out_queue.queued_len > max_queued_len)
+	{
+		add_counter(shard->metrics, COUNTER_QUEUE_OVERFLOW, 1);
+		
+		if(config.overflow_policy == OVERFLOW_POLICY_DISCONNECT)
+		{
+			print_err("queue_frame_for_client", "Client is too slow");
+			remove_client_from_server(shard, client);
+			return;
+		}
+		
+		int queued_len = client->out_queue.queued_len;
+		
+		drop_oldest_out_frames(&client->out_queue, max_queued_len);
+		
+		add_gauge
+		(
+			shard->metrics,
+			GAUGE_QUEUED_BYTE,
+			client->out_queue.queued_len - queued_len
+		);
+	}
+	
+	if(!push_out_frame(&client->out_queue, buf, is_droppable))
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	add_counter(shard->metrics, COUNTER_MSG_OUT, 1);
+	add_gauge(shard->metrics, GAUGE_QUEUED_BYTE, frame_len);
+	add_flush_pending_client(shard, client);
+}
+
+static void queue_file_frame_for_client
+(
+	shard_t *shard,
+	client_t *client,
+	frame_buf_t *buf
+)
+{
+	/* No overflow policy here.  The window bounds what a transfer can
+	queue, and a recipient that falls behind holds up the sender instead */
+	if(!push_out_frame(&client->file_queue, buf, false))
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	add_counter(shard->metrics, COUNTER_MSG_OUT, 1);
+	add_gauge(shard->metrics, GAUGE_QUEUED_BYTE, buf->len);
+	add_flush_pending_client(shard, client);
+}
+
+static frame_buf_t *seal_frame_buf
+(
+	shard_t *shard,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	const session_t *session
+)
+{
+	/* Sealed straight into the buffer the queues will hold */
+	frame_buf_t *buf = alloc_frame_buf
+	(
+		&shard->frame_pool,
+		SEALED_FRAME_LEN(payload_len)
+	);
+	
+	if(buf == NULL) return NULL;
+	
+	buf->len = seal_frame(buf->data, type, payload, payload_len, session);
+	
+	if(buf->len < 0)
+	{
+		release_frame_buf(buf);
+		return NULL;
+	}
+	
+	return buf;
+}
+
+static frame_buf_t *seal_msg_frame_buf
+(
+	shard_t *shard,
+	const char *msg,
+	int msg_len,
+	const session_t *session
+)
+{
+	/* A compressed payload is always shorter than the plain one */
+	frame_buf_t *buf = alloc_frame_buf
+	(
+		&shard->frame_pool,
+		SEALED_FRAME_LEN(msg_len)
+	);
+	
+	if(buf == NULL) return NULL;
+	
+	buf->len = seal_msg_frame
+	(
+		buf->data,
+		(const unsigned char *)msg,
+		msg_len,
+		session
+	);
+	
+	if(buf->len < 0)
+	{
+		release_frame_buf(buf);
+		return NULL;
+	}
+	
+	return buf;
+}
+
+static void send_sealed_frame_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len,
+	bool is_droppable
+)
+{
+	frame_buf_t *buf = seal_frame_buf
+	(
+		shard,
+		type,
+		payload,
+		payload_len,
+		&client->session
+	);
+	
+	if(buf == NULL)
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	queue_frame_for_client(shard, client, buf, is_droppable);
+	release_frame_buf(buf);
+}
+
+static void print_shard_stats(shard_t *shard)
+{
+	unsigned long long delta_arr[COUNTER_CNT];
+	
+	/* Report what happened since the last report */
+	for(int i = 0; i < COUNTER_CNT; i++)
+	{
+		unsigned long long value = atomic_load_explicit
+		(
+			&shard->metrics->counter_arr[i],
+			memory_order_relaxed
+		);
+		
+		delta_arr[i] = value - shard->printed_counter_arr[i];
+		shard->printed_counter_arr[i] = value;
+	}
+	
+	/* Keep quiet while idle */
+	if(delta_arr[COUNTER_MSG_OUT] == 0) return;
+	
+	/* Guard against dividing by zero on an idle interval */
+	double msg_cnt = delta_arr[COUNTER_BROADCAST] ?
+		delta_arr[COUNTER_BROADCAST] : 1;
+	double call_cnt = delta_arr[COUNTER_SEND_CALL] ?
+		delta_arr[COUNTER_SEND_CALL] : 1;
+	
+	printf
+	(
+		"shard %d: %llu msgs, %llu frames, %llu send calls "
+		"(%.2f calls per msg, %.2f frames per call)\n",
+		shard->id,
+		delta_arr[COUNTER_BROADCAST],
+		delta_arr[COUNTER_MSG_OUT],
+		delta_arr[COUNTER_SEND_CALL],
+		delta_arr[COUNTER_SEND_CALL] / msg_cnt,
+		delta_arr[COUNTER_MSG_OUT] / call_cnt
+	);
+}
+
+static int get_shard_wait_timeout(shard_t *shard)
+{
+	int timeout = REACTOR_WAIT_TIMEOUT;
+	
+	/* Wake up in time for the next report */
+	if(config.stats_interval > 0)
+	{
+		Uint32 interval = config.stats_interval * 1000;
+		Uint32 elapsed = SDL_GetTicks() - shard->stats_ticks;
+		
+		if(elapsed >= interval)
+		{
+			print_shard_stats(shard);
+			shard->stats_ticks += interval * (elapsed / interval);
+			elapsed %= interval;
+		}
+		
+		timeout = interval - elapsed;
+	}
+	
+	/* And to post held broadcasts again */
+	if(shard->held_cnt > 0 && (timeout < 0 || HELD_RETRY_INTERVAL < timeout))
+		timeout = HELD_RETRY_INTERVAL;
+	
+	/* And for the end of the presence window */
+	if(shard->presence_cnt > 0)
+	{
+		Uint32 elapsed = SDL_GetTicks() - shard->presence_ticks;
+		int presence_timeout = elapsed < PRESENCE_WINDOW_LEN ?
+			(int)(PRESENCE_WINDOW_LEN - elapsed) : 0;
+		
+		if(timeout < 0 || presence_timeout < timeout)
+			timeout = presence_timeout;
+	}
+	
+	return timeout;
+}
+
+static void add_client_to_shard(shard_t *shard, int fd)
+{
+	client_t *client = add_client_to_table(&shard->client_table);
+	
+	/* Turn away clients beyond the capacity rather than leaving them in the
+	backlog */
+	if(client == NULL)
+	{
+		print_err("add_client_to_shard", "Server is full");
+		add_counter(shard->metrics, COUNTER_CONN_REJECTED, 1);
+		close_socket(&fd);
+		atomic_fetch_sub(&shard->dealt_cnt, 1);
+		return;
+	}
+	
+	client->fd = fd;
+	client->conn_id = shard->next_conn_id;
+	shard->next_conn_id += 1;
+	read_client_ip(client);
+	
+	/* Incoming compressed frames are only ever sent after the offer below,
+	but the contexts are in place from the start */
+	if(compress_dict != NULL) client->session.compressor = &shard->compressor;
+	
+	if(!read_with_reactor(shard->reactor, fd, client))
+	{
+		close_socket(&client->fd);
+		remove_client_from_table(&shard->client_table, client);
+		atomic_fetch_sub(&shard->dealt_cnt, 1);
+		return;
+	}
+	
+	add_counter(shard->metrics, COUNTER_CONN_OPENED, 1);
+	add_gauge(shard->metrics, GAUGE_CLIENT, 1);
+	
+	/* Send the server's public key once.  The client's key arrives as the
+	first bytes it sends */
+	frame_buf_t *buf = copy_frame_buf
+	(
+		&shard->frame_pool,
+		pubkey,
+		crypto_box_PUBLICKEYBYTES
+	);
+	
+	if(buf == NULL)
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	queue_frame_for_client(shard, client, buf, false);
+	release_frame_buf(buf);
+}
+
+static void send_room_key_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	uint32_t room_key_id,
+	const unsigned char room_key[crypto_secretbox_KEYBYTES],
+	const char *channel_name
+)
+{
+	unsigned char payload[ROOM_KEY_LEN + MAX_CHANNEL_NAME_LEN];
+	int channel_name_len = strlen(channel_name);
+	
+	SDLNet_Write32(room_key_id, payload);
+	memcpy(payload + ROOM_KEY_ID_LEN, room_key, crypto_secretbox_KEYBYTES);
+	memcpy(payload + ROOM_KEY_LEN, channel_name, channel_name_len);
+	
+	/* The room key travels sealed with the client's own session key and is
+	never dropped, since nothing after it could be read without it */
+	send_sealed_frame_to_client
+	(
+		shard,
+		client,
+		FRAME_TYPE_ROOM_KEY,
+		payload,
+		ROOM_KEY_LEN + channel_name_len,
+		false
+	);
+	
+	sodium_memzero(payload, ROOM_KEY_LEN);
+}
+
+static void take_room_key_from_client
+(
+	shard_t *shard,
+	client_t *client,
+	const char *channel_name
+)
+{
+	const unsigned char no_key[crypto_secretbox_KEYBYTES] = {0};
+	
+	/* Id 0 tells the client to forget the channel's key */
+	send_room_key_to_client(shard, client, 0, no_key, channel_name);
+}
+
+static void offer_dict_to_client(shard_t *shard, client_t *client)
+{
+	unsigned char dict_id[DICT_PAYLOAD_LEN];
+	
+	/* The client answers with the same id if it has the dictionary.  Until
+	then it only gets plain frames */
+	SDLNet_Write32(compress_dict->id, dict_id);
+	send_sealed_frame_to_client
+	(
+		shard,
+		client,
+		FRAME_TYPE_DICT,
+		dict_id,
+		DICT_PAYLOAD_LEN,
+		false
+	);
+}
+
+static bool replay_msg_to_client(void *data, const char *msg, int msg_len)
+{
+	replay_t *replay = data;
+	shard_t *shard = replay->shard;
+	client_t *client = replay->client;
+	
+	frame_buf_t *buf = seal_msg_frame_buf
+	(
+		shard,
+		msg,
+		msg_len,
+		&client->session
+	);
+	
+	if(buf == NULL) return false;
+	
+	/* History is never worth disconnecting a client over.  Stop once its
+	queue is full and let live traffic take over */
+	bool is_full =
+		client->out_queue.queued_len + buf->len > config.max_queued_len;
+	
+	if(!is_full) queue_frame_for_client(shard, client, buf, true);
+	
+	release_frame_buf(buf);
+	
+	return !is_full && client->fd >= 0;
+}
+
+static void replay_log_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	const char *channel_name
+)
+{
+	replay_t replay = {.shard = shard, .client = client};
+	
+	/* The channel's own latest replay_cnt messages, copied out of the mapped
+	segments.  The writer is never held up while they are sealed */
+	read_channel_msg_log
+	(
+		msg_log,
+		channel_name,
+		config.replay_cnt,
+		replay_msg_to_client,
+		&replay
+	);
+}
+
+static uint32_t get_room_key_id(shard_t *shard)
+{
+	uint32_t room_key_id = shard->next_room_key_id;
+	
+	/* Id 0 means no key at all */
+	shard->next_room_key_id += 1;
+	if(shard->next_room_key_id == 0) shard->next_room_key_id = 1;
+	
+	return room_key_id;
+}
+
+static void rotate_presence_key(shard_t *shard)
+{
+	client_table_t *client_table = &shard->client_table;
+	
+	crypto_secretbox_keygen(shard->presence_key);
+	shard->presence_key_id = get_room_key_id(shard);
+	shard->is_presence_key_stale = false;
+	
+	/* Walk backwards since a client can be dropped on the way.  Dropping
+	one marks the new key stale again, which the next batch handles */
+	for(int j = client_table->active_client_cnt - 1; j >= 0; j--)
+	{
+		client_t *client = client_table->active_client_arr[j];
+		
+		if(!client->is_logged_in) continue;
+		
+		send_room_key_to_client
+		(
+			shard,
+			client,
+			shard->presence_key_id,
+			shard->presence_key,
+			""
+		);
+	}
+}
+
+static void rotate_channel_key(shard_t *shard, channel_t *channel)
+{
+	crypto_secretbox_keygen(channel->room_key);
+	channel->room_key_id = get_room_key_id(shard);
+	channel->is_room_key_stale = false;
+	
+	/* Only the members get the new key.  Walk backwards since one can be
+	dropped on the way, which marks the key stale again and, for the last
+	member, frees the channel once the loop is done with it */
+	for(int j = channel->member_cnt - 1; j >= 0; j--)
+	{
+		send_room_key_to_client
+		(
+			shard,
+			channel->member_arr[j],
+			channel->room_key_id,
+			channel->room_key,
+			channel->name
+		);
+	}
+}
+
+static shard_t *find_least_dealt_shard(void)
+{
+	shard_t *target_shard = NULL;
+	int min_dealt_cnt = 0;
+	
+	/* Shards with as few clients as each other take turns, starting after
+	the last one picked */
+	for(int i = 0; i < config.shard_cnt; i++)
+	{
+		int other_id = (next_shard_id + i) % config.shard_cnt;
+		shard_t *other_shard = &shard_arr[other_id];
+		int dealt_cnt = atomic_load(&other_shard->dealt_cnt);
+		
+		if(dealt_cnt >= other_shard->client_table.max_client_cnt) continue;
+		
+		if(target_shard == NULL || dealt_cnt < min_dealt_cnt)
+		{
+			target_shard = other_shard;
+			min_dealt_cnt = dealt_cnt;
+		}
+	}
+	
+	if(target_shard != NULL)
+		next_shard_id = (target_shard->id + 1) % config.shard_cnt;
+	
+	return target_shard;
+}
+
+static void deal_out_client(shard_t *shard, int fd)
+{
+	shard_t *target_shard = find_least_dealt_shard();
+	
+	/* Every shard is full, so the server is */
+	if(target_shard == NULL)
+	{
+		print_err("deal_out_client", "Server is full");
+		add_counter(shard->metrics, COUNTER_CONN_REJECTED, 1);
+		close_socket(&fd);
+		return;
+	}
+	
+	atomic_fetch_add(&target_shard->dealt_cnt, 1);
+	
+	if(target_shard == shard)
+	{
+		add_client_to_shard(shard, fd);
+		return;
+	}
+	
+	shard_msg_t *shard_msg = alloc_shard_msg(SHARD_MSG_TYPE_CLIENT, 0);
+	
+	if(shard_msg == NULL)
+	{
+		close_socket(&fd);
+		atomic_fetch_sub(&target_shard->dealt_cnt, 1);
+		return;
+	}
+	
+	shard_msg->fd = fd;
+	
+	if(!post_to_shard(target_shard, shard_msg))
+	{
+		print_err("deal_out_client", "Shard inbox is full");
+		close_socket(&fd);
+		atomic_fetch_sub(&target_shard->dealt_cnt, 1);
+		free(shard_msg);
+	}
+}
+
+static void add_clients_to_server(shard_t *shard)
+{
+	int fd;
+
+	/* Accept every pending connection since the reactor only reports the
+	listening socket once per burst */
+	while(accept_client(listen_fd, &fd)) deal_out_client(shard, fd);
+}
+
+static void broadcast_msg_to_shard
+(
+	shard_t *shard,
+	const char *channel_name,
+	const char *msg,
+	int msg_len,
+	Uint64 recv_counter
+)
+{
+	int zmsg_len = 0;
+	
+	/* Timed to the end of the loop pass, when the frames are written */
+	if(shard->fanout_cnt < MAX_FANOUT_SAMPLE_CNT)
+	{
+		shard->fanout_counter_arr[shard->fanout_cnt] = recv_counter;
+		shard->fanout_cnt += 1;
+	}
+	
+	/* Only the channel's members on this shard are visited */
+	channel_t *channel = find_channel(&shard->channel_table, channel_name);
+	
+	if(channel == NULL) return;
+	
+	/* Joins and leaves since the last broadcast are all covered by a single
+	rotation.  It goes first since it can drop members, and with the last
+	of them the channel */
+	if(config.is_group_mode && channel->is_room_key_stale)
+	{
+		rotate_channel_key(shard, channel);
+		channel = find_channel(&shard->channel_table, channel_name);
+		
+		if(channel == NULL) return;
+	}
+	
+	/* In group mode the message is sealed once with the channel's room key,
+	and the same buffer is queued for every member.  Members that agreed on
+	the dictionary get the compressed payload instead.  It is compressed
+	once, for the first of them, and sealed once more in group mode.
+	Otherwise every member's frame is sealed straight into its own buffer */
+	frame_buf_t *room_buf_arr[2] = {NULL, NULL};
+
+	/* Walk backwards so that dropping a client (which moves the last member
+	into its place) does not skip anyone.  The channel itself only goes
+	away when its member at index 0 leaves, which ends the loop */
+	for(int j = channel->member_cnt - 1; j >= 0; j--)
+	{
+		client_t *client = channel->member_arr[j];
+		bool is_compressed = client->session.is_compressed;
+		frame_buf_t *buf;
+		
+		if(is_compressed && zmsg_len == 0)
+		{
+			zmsg_len = compress_payload
+			(
+				&shard->compressor,
+				shard->zmsg,
+				(const unsigned char *)msg,
+				msg_len
+			);
+		}
+		
+		/* Short or incompressible messages go out plain to everyone */
+		if(zmsg_len < 0) is_compressed = false;
+		
+		const unsigned char *payload =
+			is_compressed ? shard->zmsg : (const unsigned char *)msg;
+		
+		int payload_len = is_compressed ? zmsg_len : msg_len;
+		
+		if(!config.is_group_mode)
+		{
+			buf = seal_frame_buf
+			(
+				shard,
+				is_compressed ? FRAME_TYPE_ZMSG : FRAME_TYPE_MSG,
+				payload,
+				payload_len,
+				&client->session
+			);
+			
+			if(buf == NULL)
+			{
+				remove_client_from_server(shard, client);
+				continue;
+			}
+			
+			queue_frame_for_client(shard, client, buf, true);
+			release_frame_buf(buf);
+			continue;
+		}
+		
+		buf = room_buf_arr[is_compressed];
+		
+		if(buf == NULL)
+		{
+			buf = alloc_frame_buf
+			(
+				&shard->frame_pool,
+				SEALED_FRAME_LEN(payload_len)
+			);
+			
+			if(buf == NULL) break;
+			
+			room_buf_arr[is_compressed] = buf;
+			buf->len = seal_room_frame
+			(
+				buf->data,
+				is_compressed ? FRAME_TYPE_ROOM_ZMSG : FRAME_TYPE_ROOM_MSG,
+				payload,
+				payload_len,
+				channel->room_key_id,
+				channel->room_key
+			);
+		}
+		
+		if(buf->len < 0) break;
+		
+		queue_frame_for_client(shard, client, buf, true);
+	}
+	
+	/* Each queue holds its own reference, so the buffers live until the
+	last member's copy of the frame has been written */
+	for(int i = 0; i < 2; i++)
+		if(room_buf_arr[i] != NULL) release_frame_buf(room_buf_arr[i]);
+}
+
+static void hold_post(shard_t *shard, int target_id, shard_msg_t *shard_msg)
+{
+	held_post_t *held = &shard->held_arr[target_id];
+	
+	if(held->cnt == held->cap && held->cap < MAX_HELD_CNT)
+	{
+		int new_cap = held->cap == 0 ? INITIAL_HELD_CAP : held->cap * 2;
+		
+		shard_msg_t **new_msg_arr = realloc
+		(
+			held->msg_arr,
+			new_cap * sizeof(shard_msg_t *)
+		);
+		
+		if(new_msg_arr != NULL)
+		{
+			held->cap = new_cap;
+			held->msg_arr = new_msg_arr;
+		}
+	}
+	
+	if(held->cnt == held->cap)
+	{
+		print_err("hold_post", "Shard is too far behind");
+		add_counter(shard->metrics, COUNTER_BROADCAST_DROP, 1);
+		release_shard_msg(shard_msg);
+		return;
+	}
+	
+	held->msg_arr[held->cnt] = shard_msg;
+	held->cnt += 1;
+	shard->held_cnt += 1;
+	add_counter(shard->metrics, COUNTER_BROADCAST_HOLD, 1);
+}
+
+static void post_or_hold(shard_t *shard, int target_id, shard_msg_t *shard_msg)
+{
+	/* Behind anything already held for the same shard, to keep the order */
+	if(shard->held_arr[target_id].cnt > 0)
+	{
+		hold_post(shard, target_id, shard_msg);
+		return;
+	}
+	
+	if(!post_to_shard(&shard_arr[target_id], shard_msg))
+		hold_post(shard, target_id, shard_msg);
+}
+
+static void retry_held_posts(shard_t *shard)
+{
+	for(int i = 0; i < config.shard_cnt; i++)
+	{
+		held_post_t *held = &shard->held_arr[i];
+		int post_cnt = 0;
+		
+		/* Oldest first, up to the first that still does not fit */
+		while
+		(
+			post_cnt < held->cnt &&
+			post_to_shard(&shard_arr[i], held->msg_arr[post_cnt])
+		)
+			post_cnt += 1;
+		
+		if(post_cnt == 0) continue;
+		
+		memmove
+		(
+			held->msg_arr,
+			held->msg_arr + post_cnt,
+			(held->cnt - post_cnt) * sizeof(shard_msg_t *)
+		);
+		
+		held->cnt -= post_cnt;
+		shard->held_cnt -= post_cnt;
+	}
+}
+
+static void broadcast_msg
+(
+	shard_t *shard,
+	const char *channel_name,
+	const char *msg,
+	Uint64 recv_counter
+)
+{
+	int msg_len = strlen(msg);
+	
+	add_counter(shard->metrics, COUNTER_BROADCAST, 1);
+	
+	/* The log writer copes with the disk on its own thread, and the
+	federation thread with the other servers.  Origin 0 is this server */
+	if(msg_log != NULL)
+		append_msg_log(msg_log, 0, 0, channel_name, msg, msg_len);
+	
+	if(federation != NULL)
+		forward_to_federation(federation, channel_name, msg, msg_len);
+	
+	/* Hand one shared copy to every other shard.  Each of them seals and
+	sends it to its own members of the channel in parallel with this one */
+	if(config.shard_cnt > 1)
+	{
+		shard_msg_t *shard_msg = alloc_shard_msg
+		(
+			SHARD_MSG_TYPE_BROADCAST,
+			msg_len
+		);
+		
+		if(shard_msg == NULL)
+		{
+			print_err("broadcast_msg", "Could not allocate the broadcast");
+		}
+		else
+		{
+			atomic_store(&shard_msg->ref_cnt, config.shard_cnt - 1);
+			shard_msg->recv_counter = recv_counter;
+			strcpy(shard_msg->channel_name, channel_name);
+			shard_msg->msg_len = msg_len;
+			memcpy(shard_msg->msg, msg, msg_len);
+			
+			/* A shard with a full inbox gets it later, from this shard's
+			held posts */
+			for(int i = 0; i < config.shard_cnt; i++)
+				if(i != shard->id) post_or_hold(shard, i, shard_msg);
+		}
+	}
+	
+	broadcast_msg_to_shard(shard, channel_name, msg, msg_len, recv_counter);
+}
+
+static bool is_presence_backed_up(client_t *client)
+{
+	/* Presence is the first thing a backed up client goes without */
+	return client->out_queue.queued_len > config.max_queued_len / 2;
+}
+
+static bool queue_presence_for_client
+(
+	shard_t *shard,
+	client_t *client,
+	frame_buf_t *buf
+)
+{
+	/* Left out rather than making room for it.  The client is marked so
+	that it gets a snapshot once it has caught up */
+	if
+	(
+		is_presence_backed_up(client) ||
+		client->out_queue.queued_len + buf->len > config.max_queued_len
+	)
+	{
+		client->is_presence_stale = true;
+		add_counter(shard->metrics, COUNTER_PRESENCE_DROP, 1);
+		return false;
+	}
+	
+	if(!push_ephemeral_out_frame(&client->out_queue, buf))
+	{
+		remove_client_from_server(shard, client);
+		return false;
+	}
+	
+	add_counter(shard->metrics, COUNTER_MSG_OUT, 1);
+	add_gauge(shard->metrics, GAUGE_QUEUED_BYTE, buf->len);
+	add_flush_pending_client(shard, client);
+	
+	return true;
+}
+
+static bool send_presence_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	frame_buf_t *buf = seal_frame_buf
+	(
+		shard,
+		FRAME_TYPE_PRESENCE,
+		payload,
+		payload_len,
+		&client->session
+	);
+	
+	if(buf == NULL)
+	{
+		remove_client_from_server(shard, client);
+		return false;
+	}
+	
+	bool is_queued = queue_presence_for_client(shard, client, buf);
+	
+	release_frame_buf(buf);
+	
+	return is_queued;
+}
+
+static bool add_presence_to_snapshot(void *data, presence_t *presence)
+{
+	snapshot_t *snapshot = data;
+	
+	/* The client's own entry already went first */
+	if(presence->id == snapshot->client->presence_id) return true;
+	
+	if(snapshot->payload_len + MAX_PRESENCE_LEN > MAX_PAYLOAD_LEN)
+	{
+		if
+		(
+			!send_presence_to_client
+			(
+				snapshot->shard,
+				snapshot->client,
+				snapshot->payload,
+				snapshot->payload_len
+			)
+		)
+			return false;
+		
+		snapshot->payload_len = 0;
+	}
+	
+	snapshot->payload_len += write_presence
+	(
+		snapshot->payload + snapshot->payload_len,
+		presence
+	);
+	
+	return true;
+}
+
+static void send_presence_snapshot(shard_t *shard, client_t *client)
+{
+	snapshot_t snapshot = {.shard = shard, .client = client};
+	presence_t self = {.is_self = true, .id = client->presence_id};
+	
+	self.state = client->presence_state;
+	strcpy(self.username, client->username);
+	
+	/* The client's own entry goes first and tells it to forget whatever it
+	knew.  The rest comes from this shard's copy of the room */
+	client->is_presence_stale = false;
+	snapshot.payload_len = write_presence(snapshot.payload, &self);
+	read_presence_table
+	(
+		&shard->presence_table,
+		add_presence_to_snapshot,
+		&snapshot
+	);
+	
+	if(client->fd < 0 || client->is_presence_stale) return;
+	
+	send_presence_to_client
+	(
+		shard,
+		client,
+		snapshot.payload,
+		snapshot.payload_len
+	);
+}
+
+static void deliver_presence(shard_t *shard, const shard_msg_t *shard_msg)
+{
+	client_table_t *client_table = &shard->client_table;
+	const unsigned char *batch = (const unsigned char *)shard_msg->msg;
+	int batch_len = shard_msg->msg_len;
+	frame_buf_t *room_buf = NULL;
+	presence_t presence;
+	
+	for(int offset = 0; offset < batch_len;)
+	{
+		int presence_len = read_presence
+		(
+			batch + offset,
+			batch_len - offset,
+			&presence
+		);
+		
+		if(presence_len < 0) break;
+		
+		update_presence_table(&shard->presence_table, &presence);
+		offset += presence_len;
+	}
+	
+	if(config.is_group_mode && shard->is_presence_key_stale)
+		rotate_presence_key(shard);
+	
+	/* In group mode the batch is sealed once for everyone with the presence
+	key, the same as a broadcast */
+	if(config.is_group_mode)
+	{
+		room_buf = alloc_frame_buf
+		(
+			&shard->frame_pool,
+			SEALED_FRAME_LEN(batch_len)
+		);
+		
+		if(room_buf == NULL) return;
+		
+		room_buf->len = seal_room_frame
+		(
+			room_buf->data,
+			FRAME_TYPE_ROOM_PRESENCE,
+			batch,
+			batch_len,
+			shard->presence_key_id,
+			shard->presence_key
+		);
+		
+		if(room_buf->len < 0)
+		{
+			release_frame_buf(room_buf);
+			return;
+		}
+	}
+	
+	/* Walk backwards since a client can be dropped on the way.  A client
+	that missed some presence gets all of it again instead of the batch */
+	for(int j = client_table->active_client_cnt - 1; j >= 0; j--)
+	{
+		client_t *client = client_table->active_client_arr[j];
+		
+		if(!client->is_logged_in || !client->is_presence_wanted) continue;
+		
+		if(client->is_presence_stale && !is_presence_backed_up(client))
+			send_presence_snapshot(shard, client);
+		else if(client->is_presence_stale)
+			add_counter(shard->metrics, COUNTER_PRESENCE_DROP, 1);
+		else if(room_buf != NULL)
+			queue_presence_for_client(shard, client, room_buf);
+		else
+			send_presence_to_client(shard, client, batch, batch_len);
+	}
+	
+	if(room_buf != NULL) release_frame_buf(room_buf);
+}
+
+static void flush_presence(shard_t *shard)
+{
+	shard_msg_t *shard_msg = NULL;
+	
+	if(SDL_GetTicks() - shard->presence_ticks < PRESENCE_WINDOW_LEN) return;
+	
+	/* Everything that changed in the window goes to every shard, this one
+	included, in as few batches as fit */
+	for(int i = 0; i < shard->presence_cnt; i++)
+	{
+		if
+		(
+			shard_msg != NULL &&
+			shard_msg->msg_len + MAX_PRESENCE_LEN > MAX_PAYLOAD_LEN
+		)
+		{
+			post_to_all_shards(shard_msg);
+			shard_msg = NULL;
+		}
+		
+		if(shard_msg == NULL)
+		{
+			shard_msg = alloc_shard_msg
+			(
+				SHARD_MSG_TYPE_PRESENCE,
+				MAX_PAYLOAD_LEN
+			);
+			
+			if(shard_msg == NULL)
+			{
+				print_err("flush_presence", "Could not allocate the batch");
+				break;
+			}
+		}
+		
+		shard_msg->msg_len += write_presence
+		(
+			(unsigned char *)shard_msg->msg + shard_msg->msg_len,
+			&shard->presence_arr[i]
+		);
+	}
+	
+	if(shard_msg != NULL) post_to_all_shards(shard_msg);
+	
+	/* Changes that did not make it are not retried.  The next change from
+	the same client, or its leaving, puts things right */
+	shard->presence_cnt = 0;
+	shard->presence_gen += 1;
+}
+
+static void send_notice_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	const char *notice
+)
+{
+	frame_buf_t *buf = seal_msg_frame_buf
+	(
+		shard,
+		notice,
+		strlen(notice),
+		&client->session
+	);
+	
+	if(buf == NULL)
+	{
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	queue_frame_for_client(shard, client, buf, true);
+	release_frame_buf(buf);
+}
+
+static void send_file_frame_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	/* Control frames go with the chat, ahead of any queued chunks */
+	send_sealed_frame_to_client
+	(
+		shard,
+		client,
+		type,
+		payload,
+		payload_len,
+		false
+	);
+}
+
+static void send_file_ack_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	uint32_t id,
+	int credit_cnt
+)
+{
+	unsigned char payload[FILE_ACK_LEN];
+	
+	SDLNet_Write32(id, payload);
+	SDLNet_Write32(credit_cnt, payload + FILE_ID_LEN);
+	send_file_frame_to_client
+	(
+		shard,
+		client,
+		FRAME_TYPE_FILE_ACK,
+		payload,
+		FILE_ACK_LEN
+	);
+}
+
+static void send_file_cancel_to_client
+(
+	shard_t *shard,
+	client_t *client,
+	uint32_t id
+)
+{
+	unsigned char payload[FILE_ID_LEN];
+	
+	SDLNet_Write32(id, payload);
+	send_file_frame_to_client
+	(
+		shard,
+		client,
+		FRAME_TYPE_FILE_CANCEL,
+		payload,
+		FILE_ID_LEN
+	);
+}
+
+static file_relay_t *add_relay(shard_t *shard, uint32_t file_id)
+{
+	if(shard->relay_cnt == MAX_RELAY_CNT)
+	{
+		print_err("add_relay", "Too many files at once");
+		return NULL;
+	}
+	
+	client_t **recipient_arr =
+		malloc(INITIAL_RECIPIENT_CAP * sizeof(client_t *));
+	
+	if(recipient_arr == NULL)
+	{
+		print_err("add_relay", "Could not allocate the recipients");
+		return NULL;
+	}
+	
+	file_relay_t *relay = &shard->relay_arr[shard->relay_cnt];
+	
+	relay->is_done = false;
+	relay->file_id = file_id;
+	relay->recipient_cnt = 0;
+	relay->recipient_cap = INITIAL_RECIPIENT_CAP;
+	relay->held_cnt = 0;
+	relay->recipient_arr = recipient_arr;
+	shard->relay_cnt += 1;
+	
+	return relay;
+}
+
+static bool add_recipient_to_relay(file_relay_t *relay, client_t *client)
+{
+	if(relay->recipient_cnt == relay->recipient_cap)
+	{
+		client_t **new_recipient_arr = realloc
+		(
+			relay->recipient_arr,
+			relay->recipient_cap * 2 * sizeof(client_t *)
+		);
+		
+		if(new_recipient_arr == NULL)
+		{
+			print_err("add_recipient_to_relay", "Could not grow the array");
+			return false;
+		}
+		
+		relay->recipient_arr = new_recipient_arr;
+		relay->recipient_cap *= 2;
+	}
+	
+	relay->recipient_arr[relay->recipient_cnt] = client;
+	relay->recipient_cnt += 1;
+	client->relay_cnt += 1;
+	
+	/* Keep the kernel from soaking up so many chunks that chat queued after
+	them is held up */
+	if(!client->is_unsent_limited)
+	{
+		limit_unsent_len(client->fd, MAX_FILE_UNSENT_LEN);
+		client->is_unsent_limited = true;
+	}
+	
+	return true;
+}
+
+static bool is_relay_backed_up(const file_relay_t *relay)
+{
+	for(int i = 0; i < relay->recipient_cnt; i++)
+		if(relay->recipient_arr[i]->file_queue.queued_len > MAX_FILE_QUEUED_LEN)
+			return true;
+	
+	return false;
+}
+
+static void release_relay_credits(shard_t *shard)
+{
+	/* Walk backwards since finished relays are swapped out of the array */
+	for(int i = shard->relay_cnt - 1; i >= 0; i--)
+	{
+		file_relay_t *relay = &shard->relay_arr[i];
+		
+		if(relay->held_cnt > 0 && !is_relay_backed_up(relay))
+		{
+			for(int j = 0; j < relay->held_cnt; j++)
+				release_shard_msg(relay->held_arr[j]);
+			
+			relay->held_cnt = 0;
+		}
+		
+		if(relay->is_done && relay->held_cnt == 0) remove_relay(shard, relay);
+	}
+}
+
+static void start_relay(shard_t *shard, const shard_msg_t *shard_msg)
+{
+	char notice[MAX_MSG_LEN];
+	const unsigned char *payload = (const unsigned char *)shard_msg->msg;
+	
+	channel_t *channel =
+		find_channel(&shard->channel_table, shard_msg->channel_name);
+	
+	if(channel == NULL) return;
+	
+	file_relay_t *relay = add_relay(shard, shard_msg->file_id);
+	
+	if(relay == NULL) return;
+	
+	unsigned long long file_len =
+		(unsigned long long)SDLNet_Read32(payload + FILE_ID_LEN) << 32 |
+		SDLNet_Read32(payload + FILE_ID_LEN + 4);
+	
+	snprintf
+	(
+		notice,
+		MAX_MSG_LEN,
+		"server: %s is sending %.*s (%llu bytes)",
+		shard_msg->username,
+		shard_msg->msg_len - FILE_START_LEN,
+		shard_msg->msg + FILE_START_LEN,
+		file_len
+	);
+	
+	/* Walk backwards for the same reason as broadcasts do.  Members are
+	only added as recipients once both frames are queued, so dropping one
+	never touches the relay */
+	for(int j = channel->member_cnt - 1; j >= 0; j--)
+	{
+		client_t *client = channel->member_arr[j];
+		
+		if(client == shard_msg->client) continue;
+		
+		send_notice_to_client(shard, client, notice);
+		
+		if(client->fd < 0) continue;
+		
+		send_file_frame_to_client
+		(
+			shard,
+			client,
+			FRAME_TYPE_FILE_START,
+			payload,
+			shard_msg->msg_len
+		);
+		
+		if(client->fd < 0) continue;
+		
+		if(!add_recipient_to_relay(relay, client))
+			send_file_cancel_to_client(shard, client, shard_msg->file_id);
+	}
+	
+	/* Chunks for a file nobody here receives are simply passed over */
+	if(relay->recipient_cnt == 0) remove_relay(shard, relay);
+}
+
+static bool relay_chunk(shard_t *shard, shard_msg_t *shard_msg)
+{
+	file_relay_t *relay = find_relay(shard, shard_msg->file_id);
+	
+	if(relay == NULL) return false;
+	
+	/* Copied once into this shard's pool, and every recipient queues the
+	same buffer.  Dropping one swaps the last recipient, already visited,
+	into its place */
+	frame_buf_t *buf = copy_frame_buf
+	(
+		&shard->frame_pool,
+		(const unsigned char *)shard_msg->msg,
+		shard_msg->msg_len
+	);
+	
+	for(int i = relay->recipient_cnt - 1; i >= 0; i--)
+	{
+		if(buf == NULL)
+			remove_client_from_server(shard, relay->recipient_arr[i]);
+		else
+			queue_file_frame_for_client(shard, relay->recipient_arr[i], buf);
+	}
+	
+	if(buf != NULL) release_frame_buf(buf);
+	
+	int flag_index = FRAME_HEADER_LEN + FILE_ID_LEN;
+	
+	if(shard_msg->msg[flag_index] == FILE_CHUNK_FINAL) relay->is_done = true;
+	
+	/* The chunk is held back, and with it the sender's credit, until every
+	recipient has caught up */
+	if(relay->held_cnt < FILE_WINDOW_CHUNK_CNT && is_relay_backed_up(relay))
+	{
+		relay->held_arr[relay->held_cnt] = shard_msg;
+		relay->held_cnt += 1;
+		return true;
+	}
+	
+	if(relay->is_done && relay->held_cnt == 0) remove_relay(shard, relay);
+	
+	return false;
+}
+
+static void cancel_relay(shard_t *shard, const shard_msg_t *shard_msg)
+{
+	file_relay_t *relay = find_relay(shard, shard_msg->file_id);
+	
+	if(relay == NULL) return;
+	
+	uint32_t file_id = relay->file_id;
+	
+	/* Taken off the shard first, since telling a recipient can drop it */
+	for(int i = relay->recipient_cnt - 1; i >= 0; i--)
+	{
+		client_t *client = relay->recipient_arr[i];
+		
+		remove_recipient_from_relay(relay, client);
+		send_file_cancel_to_client(shard, client, file_id);
+	}
+	
+	remove_relay(shard, relay);
+}
+
+static void credit_upload(shard_t *shard, const shard_msg_t *shard_msg)
+{
+	client_t *client = shard_msg->client;
+	
+	/* The sender may have finished, cancelled or gone since */
+	bool is_same_upload =
+		client->fd >= 0 &&
+		client->conn_id == shard_msg->conn_id &&
+		client->is_uploading &&
+		client->upload_file_id == shard_msg->file_id;
+	
+	if(!is_same_upload) return;
+	
+	client->upload_credit_cnt += 1;
+	send_file_ack_to_client(shard, client, client->upload_id, 1);
+}
+
+static void refuse_upload
+(
+	shard_t *shard,
+	client_t *client,
+	uint32_t id,
+	const char *notice
+)
+{
+	send_notice_to_client(shard, client, notice);
+	
+	if(client->fd >= 0) send_file_cancel_to_client(shard, client, id);
+}
+
+static void start_upload
+(
+	shard_t *shard,
+	client_t *client,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	int name_len = payload_len - FILE_START_LEN;
+	
+	if(name_len < 1 || name_len > MAX_FILE_NAME_LEN)
+	{
+		print_err("start_upload", "Unexpected file start");
+		return;
+	}
+	
+	uint32_t id = SDLNet_Read32(payload);
+	
+	if(client->current_channel < 0)
+	{
+		refuse_upload
+		(
+			shard,
+			client,
+			id,
+			"server: Join a channel with /join <channel> first"
+		);
+		
+		return;
+	}
+	
+	if(client->is_uploading)
+	{
+		refuse_upload(shard, client, id, "server: Send one file at a time");
+		return;
+	}
+	
+	client->is_uploading = true;
+	client->upload_credit_cnt = FILE_WINDOW_CHUNK_CNT;
+	client->upload_id = id;
+	
+	client->upload_file_id =
+		FILE_RELAY_ID_BIT | atomic_fetch_add(&next_file_id, 1);
+	
+	strcpy
+	(
+		client->upload_channel_name,
+		client->channel_arr[client->current_channel].channel->name
+	);
+	
+	shard_msg_t *shard_msg = make_file_msg
+	(
+		shard,
+		client,
+		SHARD_MSG_TYPE_FILE_START,
+		payload_len
+	);
+	
+	if(shard_msg == NULL)
+	{
+		client->is_uploading = false;
+		refuse_upload(shard, client, id, "server: Try again later");
+		return;
+	}
+	
+	/* Recipients only ever see the server's id for the file */
+	memcpy(shard_msg->msg, payload, payload_len);
+	SDLNet_Write32(client->upload_file_id, shard_msg->msg);
+	post_to_all_shards(shard_msg);
+	send_file_ack_to_client(shard, client, id, FILE_WINDOW_CHUNK_CNT);
+}
+
+static void relay_upload_chunk
+(
+	shard_t *shard,
+	client_t *client,
+	const unsigned char *body,
+	int body_len
+)
+{
+	/* Only chunks the client was given credit for are taken.  Anything
+	else would let it queue without bound */
+	bool is_expected =
+		client->is_uploading &&
+		client->upload_credit_cnt > 0 &&
+		SDLNet_Read32(body) == client->upload_id;
+	
+	if(!is_expected)
+	{
+		print_err("relay_upload_chunk", "Unexpected file chunk");
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	shard_msg_t *shard_msg = make_file_msg
+	(
+		shard,
+		client,
+		SHARD_MSG_TYPE_FILE_CHUNK,
+		FRAME_HEADER_LEN + body_len
+	);
+	
+	if(shard_msg == NULL)
+	{
+		cancel_upload(shard, client);
+		send_file_cancel_to_client(shard, client, client->upload_id);
+		return;
+	}
+	
+	/* The frame is rebuilt once, with the server's id, and every shard
+	queues it as is */
+	unsigned char *frame = (unsigned char *)shard_msg->msg;
+	
+	SDLNet_Write32(body_len, frame);
+	frame[4] = FRAME_TYPE_FILE_CHUNK;
+	memcpy(frame + FRAME_HEADER_LEN, body, body_len);
+	SDLNet_Write32(client->upload_file_id, frame + FRAME_HEADER_LEN);
+	client->upload_credit_cnt -= 1;
+	
+	if(body[FILE_ID_LEN] == FILE_CHUNK_FINAL) client->is_uploading = false;
+	
+	post_to_all_shards(shard_msg);
+}
+
+static void cancel_file(shard_t *shard, client_t *client, uint32_t id)
+{
+	/* A recipient turning a file down only leaves that relay */
+	if(id & FILE_RELAY_ID_BIT)
+	{
+		file_relay_t *relay = find_relay(shard, id);
+		
+		if(relay == NULL) return;
+		
+		remove_recipient_from_relay(relay, client);
+		
+		if(relay->recipient_cnt == 0) remove_relay(shard, relay);
+		
+		return;
+	}
+	
+	if(client->is_uploading && client->upload_id == id)
+		cancel_upload(shard, client);
+}
+
+static void handle_file_frame
+(
+	shard_t *shard,
+	client_t *client,
+	frame_type_t type,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	if(type == FRAME_TYPE_FILE_START)
+		start_upload(shard, client, payload, payload_len);
+	else if(type == FRAME_TYPE_FILE_CHUNK)
+		relay_upload_chunk(shard, client, payload, payload_len);
+	else if(type == FRAME_TYPE_FILE_CANCEL && payload_len == FILE_ID_LEN)
+		cancel_file(shard, client, SDLNet_Read32(payload));
+	else
+		print_err("handle_file_frame", "Unexpected frame");
+}
+
+static void join_channel_on_server
+(
+	shard_t *shard,
+	client_t *client,
+	const char *channel_name
+)
+{
+	char notice[MAX_MSG_LEN];
+	int client_channel_index = find_client_channel(client, channel_name);
+	
+	/* Joining a channel again just makes it the current one */
+	if(client_channel_index >= 0)
+	{
+		client->current_channel = client_channel_index;
+		snprintf(notice, MAX_MSG_LEN, "server: Posting to %s", channel_name);
+		send_notice_to_client(shard, client, notice);
+		return;
+	}
+	
+	if(!is_channel_name_valid(channel_name))
+	{
+		send_notice_to_client
+		(
+			shard,
+			client,
+			"server: Channel names are letters, digits, - and _"
+		);
+		
+		return;
+	}
+	
+	if(!join_channel(&shard->channel_table, client, channel_name))
+	{
+		send_notice_to_client(shard, client, "server: Could not join");
+		return;
+	}
+	
+	snprintf(notice, MAX_MSG_LEN, "server: Joined %s", channel_name);
+	send_notice_to_client(shard, client, notice);
+	
+	if(msg_log != NULL && client->fd >= 0)
+		replay_log_to_client(shard, client, channel_name);
+}
+
+static void handle_command(shard_t *shard, client_t *client, const char *msg)
+{
+	char channel_name[MAX_CHANNEL_NAME_LEN + 2];
+	char notice[MAX_MSG_LEN];
+	
+	/* One character too many is read so that overlong names are refused
+	rather than cut short */
+	if(sscanf(msg, "/join %33s", channel_name) == 1)
+	{
+		join_channel_on_server(shard, client, channel_name);
+		return;
+	}
+	
+	if(strncmp(msg, "/leave", 6) == 0)
+	{
+		int client_channel_index = client->current_channel;
+		
+		if(sscanf(msg, "/leave %33s", channel_name) == 1)
+			client_channel_index = find_client_channel(client, channel_name);
+		
+		if(client_channel_index < 0)
+		{
+			send_notice_to_client(shard, client, "server: Not in that channel");
+			return;
+		}
+		
+		/* The channel can go away with the client */
+		strcpy
+		(
+			channel_name,
+			client->channel_arr[client_channel_index].channel->name
+		);
+		
+		leave_channel(&shard->channel_table, client, client_channel_index);
+		snprintf(notice, MAX_MSG_LEN, "server: Left %s", channel_name);
+		send_notice_to_client(shard, client, notice);
+		
+		if(config.is_group_mode)
+			take_room_key_from_client(shard, client, channel_name);
+		
+		return;
+	}
+	
+	send_notice_to_client
+	(
+		shard,
+		client,
+		"server: Commands are /join <channel> and /leave [channel]"
+	);
+}
+
+static void log_in_client(shard_t *shard, client_t *client)
+{
+	client->is_logged_in = true;
+	client->presence_id = atomic_fetch_add(&next_presence_id, 1) + 1;
+	
+	/* Hand out the presence key and put the client in the default channel.
+	The channel's key follows with its next post */
+	if(config.is_group_mode)
+	{
+		send_room_key_to_client
+		(
+			shard,
+			client,
+			shard->presence_key_id,
+			shard->presence_key,
+			""
+		);
+	}
+	
+	if(client->fd >= 0)
+		join_channel_on_server(shard, client, DEFAULT_CHANNEL_NAME);
+	
+	/* Show everyone else the client, and the client who is around if it
+	asked */
+	if(client->fd >= 0) change_presence(shard, client, PRESENCE_STATE_ONLINE);
+	
+	if(client->fd >= 0 && client->is_presence_wanted)
+		send_presence_snapshot(shard, client);
+}
+
+static void handle_auth_result(shard_t *shard, auth_job_t *auth_job)
+{
+	client_t *client = auth_job->client;
+	bool is_verified = auth_job->is_verified;
+	
+	/* The slot may have been handed to someone else while the password was
+	being checked */
+	bool is_same_client =
+		client->fd >= 0 &&
+		client->is_login_pending &&
+		client->conn_id == auth_job->conn_id;
+	
+	free(auth_job);
+	
+	if(!is_same_client) return;
+	
+	client->is_login_pending = false;
+	
+	if(is_verified)
+	{
+		log_in_client(shard, client);
+		return;
+	}
+	
+	client->login_fail_cnt += 1;
+	
+	if(client->login_fail_cnt >= MAX_LOGIN_ATTEMPT_CNT)
+	{
+		print_err("handle_auth_result", "Too many wrong passwords");
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	send_notice_to_client(shard, client, "server: Wrong password");
+}
+
+static void submit_login(shard_t *shard, client_t *client, const char *msg)
+{
+	if(client->is_login_pending)
+	{
+		send_notice_to_client(shard, client, "server: Still checking");
+		return;
+	}
+	
+	if(strncmp(msg, "/login ", 7) != 0)
+	{
+		send_notice_to_client
+		(
+			shard,
+			client,
+			"server: This server needs a password.  Send /login <password>"
+		);
+		
+		return;
+	}
+	
+	auth_job_t *auth_job = malloc(sizeof(*auth_job));
+	
+	if(auth_job == NULL)
+	{
+		send_notice_to_client(shard, client, "server: Try again later");
+		return;
+	}
+	
+	auth_job->is_verified = false;
+	auth_job->shard_id = shard->id;
+	auth_job->conn_id = client->conn_id;
+	auth_job->client = client;
+	strcpy(auth_job->ip, client->ip);
+	auth_job->password_len = strlen(msg + 7);
+	memcpy(auth_job->password, msg + 7, auth_job->password_len + 1);
+	
+	/* The hash is far too slow for the reactor.  Its result comes back
+	through the inbox */
+	auth_status_t auth_status = submit_auth_job(auth_pool, auth_job);
+	
+	if(auth_status == AUTH_STATUS_QUEUED)
+	{
+		client->is_login_pending = true;
+		return;
+	}
+	
+	sodium_memzero(auth_job->password, sizeof(auth_job->password));
+	free(auth_job);
+	
+	send_notice_to_client
+	(
+		shard,
+		client,
+		auth_status == AUTH_STATUS_IP_LIMIT ?
+			"server: Too many logins from your address" :
+			"server: Try again later"
+	);
+}
+
+static void handle_inbox(shard_t *shard)
+{
+	shard_msg_t *shard_msg;
+	
+	/* Clear the flag before draining so that a post made during the drain
+	wakes the shard again */
+	clear_wake_pipe(shard->wake_fd_arr[0]);
+	atomic_store(&shard->is_wake_pending, false);
+	
+	while((shard_msg = pop_ring(&shard->inbox)) != NULL)
+	{
+		if(shard_msg->type == SHARD_MSG_TYPE_CLIENT)
+			add_client_to_shard(shard, shard_msg->fd);
+		else if(shard_msg->type == SHARD_MSG_TYPE_LOGIN)
+			handle_auth_result(shard, shard_msg->auth_job);
+		else if(shard_msg->type == SHARD_MSG_TYPE_FILE_START)
+			start_relay(shard, shard_msg);
+		else if(shard_msg->type == SHARD_MSG_TYPE_FILE_CANCEL)
+			cancel_relay(shard, shard_msg);
+		else if(shard_msg->type == SHARD_MSG_TYPE_FILE_CREDIT)
+			credit_upload(shard, shard_msg);
+		else if(shard_msg->type == SHARD_MSG_TYPE_FILE_CHUNK)
+		{
+			/* A held chunk is released once its recipients catch up */
+			if(relay_chunk(shard, shard_msg)) continue;
+		}
+		else if(shard_msg->type == SHARD_MSG_TYPE_PRESENCE)
+			deliver_presence(shard, shard_msg);
+		else
+			broadcast_msg_to_shard
+			(
+				shard,
+				shard_msg->channel_name,
+				shard_msg->msg,
+				shard_msg->msg_len,
+				shard_msg->recv_counter
+			);
+		
+		release_shard_msg(shard_msg);
+	}
+}
+
+static void handle_presence_frame
+(
+	shard_t *shard,
+	client_t *client,
+	const unsigned char *payload,
+	int payload_len
+)
+{
+	/* Clients only say they are online, away or typing.  Going offline is
+	up to the server */
+	bool is_valid =
+		payload_len == 1 &&
+		payload[0] >= PRESENCE_STATE_ONLINE &&
+		payload[0] <= PRESENCE_STATE_TYPING;
+	
+	if(!is_valid)
+	{
+		print_err("handle_presence_frame", "Unexpected presence");
+		return;
+	}
+	
+	/* A client that has not logged in yet gets its snapshot once it
+	has */
+	if(!client->is_logged_in)
+	{
+		client->is_presence_wanted = true;
+		return;
+	}
+	
+	if(!client->is_presence_wanted)
+	{
+		client->is_presence_wanted = true;
+		send_presence_snapshot(shard, client);
+		
+		if(client->fd < 0) return;
+	}
+	
+	/* Nobody is told about typing outside a channel */
+	if(payload[0] == PRESENCE_STATE_TYPING && client->current_channel < 0)
+		return;
+	
+	change_presence(shard, client, payload[0]);
+}
+
+static void handle_frame
+(
+	shard_t *shard,
+	client_t *client,
+	frame_type_t type,
+	unsigned char *payload,
+	int payload_len,
+	Uint64 recv_counter
+)
+{
+	char channel_name[MAX_CHANNEL_NAME_LEN + 1];
+	char msg[MAX_MSG_LEN];
+	
+	if(!decompress_frame(&type, payload, &payload_len, &client->session))
+	{
+		add_counter(shard->metrics, COUNTER_CRYPTO_FAIL, 1);
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* The client has the dictionary that was offered */
+	if(type == FRAME_TYPE_DICT)
+	{
+		client->session.is_compressed =
+			compress_dict != NULL &&
+			payload_len == DICT_PAYLOAD_LEN &&
+			SDLNet_Read32(payload) == compress_dict->id;
+		
+		return;
+	}
+	
+	/* Files are only taken from clients that have logged in */
+	bool is_file_frame =
+		type == FRAME_TYPE_FILE_START ||
+		type == FRAME_TYPE_FILE_CHUNK ||
+		type == FRAME_TYPE_FILE_ACK ||
+		type == FRAME_TYPE_FILE_CANCEL;
+	
+	if(is_file_frame && client->is_logged_in)
+	{
+		handle_file_frame(shard, client, type, payload, payload_len);
+		return;
+	}
+	
+	if(type == FRAME_TYPE_PRESENCE)
+	{
+		handle_presence_frame(shard, client, payload, payload_len);
+		return;
+	}
+	
+	if(type != FRAME_TYPE_MSG || payload_len > MAX_MSG_LEN - 1)
+	{
+		print_err("handle_frame", "Unexpected frame");
+		return;
+	}
+	
+	memcpy(msg, payload, payload_len);
+	msg[payload_len] = '\0';
+	
+	/* Nothing but a password is accepted until one has been checked */
+	if(!client->is_logged_in)
+	{
+		submit_login(shard, client, msg);
+		sodium_memzero(msg, sizeof(msg));
+		sodium_memzero(payload, payload_len);
+		return;
+	}
+	
+	if(msg[0] == '/')
+	{
+		handle_command(shard, client, msg);
+		return;
+	}
+	
+	if(client->current_channel < 0)
+	{
+		send_notice_to_client
+		(
+			shard,
+			client,
+			"server: Join a channel with /join <channel> first"
+		);
+		
+		return;
+	}
+	
+	/* Copied since the broadcast can drop the sender, and with it the
+	channel */
+	strcpy
+	(
+		channel_name,
+		client->channel_arr[client->current_channel].channel->name
+	);
+	
+	modify_msg_with_info(msg, client, channel_name);
+	broadcast_msg(shard, channel_name, msg, recv_counter);
+}
+
+static bool handle_client_frames(shard_t *shard, client_t *client)
+{
+	frame_type_t type;
+	int payload_len;
+	pop_status_t pop_status;
+	unsigned char payload[MAX_PAYLOAD_LEN];
+	
+	/* Handles every complete frame in the buffer.  False once the client
+	has been dropped */
+	do
+	{
+		bool had_key = client->session.has_key;
+		Uint64 recv_counter = SDL_GetPerformanceCounter();
+	
+		pop_status = pop_client_frame
+		(
+			client,
+			pubkey,
+			privkey,
+			&type,
+			payload,
+			&payload_len
+		);
+		
+		/* Let the client in as soon as the key exchange is done, or ask for
+		the password first */
+		if(!had_key && client->session.has_key)
+		{
+			if(compress_dict != NULL) offer_dict_to_client(shard, client);
+			
+			if(client->fd < 0) return false;
+			
+			if(auth_pool == NULL)
+				log_in_client(shard, client);
+			else
+				submit_login(shard, client, "");
+		}
+		
+		if(client->fd < 0) return false;
+		
+		if(pop_status == POP_STATUS_FRAME)
+		{
+			add_counter(shard->metrics, COUNTER_MSG_IN, 1);
+			
+			add_counter
+			(
+				shard->metrics,
+				COUNTER_BYTE_IN,
+				FRAME_HEADER_LEN + FRAME_OVERHEAD + payload_len
+			);
+			
+			handle_frame
+			(
+				shard,
+				client,
+				type,
+				payload,
+				payload_len,
+				recv_counter
+			);
+		}
+		
+		/* The client may have been dropped while broadcasting */
+		if(client->fd < 0) return false;
+	}
+	while(pop_status == POP_STATUS_FRAME);
+	
+	/* Anything that fails to open is counted, garbled framing included */
+	if(pop_status == POP_STATUS_ERROR)
+	{
+		add_counter(shard->metrics, COUNTER_CRYPTO_FAIL, 1);
+		remove_client_from_server(shard, client);
+		return false;
+	}
+	
+	return true;
+}
+
+static void handle_client(shard_t *shard, client_t *client)
+{
+	recv_status_t recv_status;
+	
+	/* Read until the socket would block (required by edge-triggered
+	readiness), handling every complete frame along the way */
+	do
+	{
+		recv_status = fill_client_buf(client);
+		
+		/* Drop a client from the server on disconnect */
+		if(recv_status == RECV_STATUS_CLOSED)
+		{
+			remove_client_from_server(shard, client);
+			return;
+		}
+		
+		if(!handle_client_frames(shard, client)) return;
+	}
+	while(recv_status == RECV_STATUS_DATA);
+}
+
+static void handle_client_recv
+(
+	shard_t *shard,
+	client_t *client,
+	const unsigned char *buf,
+	int len
+)
+{
+	/* io_uring reports the end of the stream, or a failed read, instead of
+	bytes */
+	if(len <= 0)
+	{
+		if(len < 0)
+		{
+			errno = -len;
+			print_errno_err("recv");
+		}
+		
+		remove_client_from_server(shard, client);
+		return;
+	}
+	
+	/* The bytes already read can be more than the buffer has room for, so
+	they go in as frames come out */
+	while(len > 0)
+	{
+		int append_len = append_client_buf(client, buf, len);
+		
+		buf += append_len;
+		len -= append_len;
+		
+		if(!handle_client_frames(shard, client)) return;
+	}
+}
+
+static void publish_compress_stats(shard_t *shard)
+{
+	compress_stats_t *stats = &shard->compressor.stats;
+	
+	/* The compressor keeps plain totals of its own, which move over to the
+	shared counters once per loop pass */
+	add_counter(shard->metrics, COUNTER_COMPRESS_IN_BYTE, stats->in_len);
+	add_counter(shard->metrics, COUNTER_COMPRESS_OUT_BYTE, stats->out_len);
+	add_counter(shard->metrics, COUNTER_COMPRESS_SKIP, stats->skip_cnt);
+	add_counter(shard->metrics, COUNTER_COMPRESS_NS, stats->compress_ns);
+	add_counter(shard->metrics, COUNTER_DECOMPRESS_NS, stats->decompress_ns);
+	memset(stats, 0, sizeof(*stats));
+}
+
+static int run_shard(void *data)
+{
+	shard_t *shard = data;
+	
+	while(!atomic_load(&is_stopping))
+	{	
+		/* Sleep until a socket is ready.  Only the ready ones are
+		visited */
+		int ready_cnt = wait_for_reactor
+		(
+			shard->reactor,
+			shard->event_arr,
+			get_shard_wait_timeout(shard)
+		);
+		
+		Uint64 loop_counter = SDL_GetPerformanceCounter();
+		
+		for(int i = 0; i < ready_cnt; i++)
+		{
+			reactor_event_t *event = &shard->event_arr[i];
+			
+			if(event->type == REACTOR_EVENT_TYPE_SEND)
+			{
+				finish_client_send(shard, event->data, event->result);
+				continue;
+			}
+			
+			/* io_uring has accepted the connection already */
+			if(event->type == REACTOR_EVENT_TYPE_ACCEPT)
+			{
+				set_nodelay(event->result);
+				deal_out_client(shard, event->result);
+				continue;
+			}
+		
+			if(event->data == &listen_fd)
+			{
+				add_clients_to_server(shard);
+				continue;
+			}
+			
+			if(event->data == shard->wake_fd_arr)
+			{
+				handle_inbox(shard);
+				continue;
+			}
+			
+			client_t *client = event->data;
+			
+			/* Skip events for clients dropped earlier in this batch */
+			if(client->fd < 0) continue;
+			
+			if(event->type == REACTOR_EVENT_TYPE_RECV)
+			{
+				handle_client_recv(shard, client, event->buf, event->result);
+				continue;
+			}
+			
+			if(event->is_writable && client->is_write_blocked)
+				flush_client(shard, client);
+			
+			if(client->fd < 0) continue;
+			
+			if(event->is_readable || event->is_hung_up)
+				handle_client(shard, client);
+		}
+		
+		/* Presence changes go out once their window has closed */
+		if(shard->presence_cnt > 0) flush_presence(shard);
+		
+		flush_pending_clients(shard);
+		
+		/* Shards that were behind may have room again */
+		if(shard->held_cnt > 0) retry_held_posts(shard);
+		
+		/* Recipients that caught up in this pass free up their senders */
+		if(shard->relay_cnt > 0) release_relay_credits(shard);
+		
+		if(compress_dict != NULL) publish_compress_stats(shard);
+		
+		/* Only the work is timed, not the wait */
+		record_latency
+		(
+			shard->metrics,
+			LATENCY_LOOP,
+			get_elapsed_ns(loop_counter, SDL_GetPerformanceCounter())
+		);
+	}
+	
+	return 0;
+}
+
+static void stop_server(int sig)
+{
+	/* Only async-signal-safe calls from here.  Every shard wakes up, sees
+	the flag and leaves its loop */
+	atomic_store(&is_stopping, true);
+	
+	for(int i = 0; i < config.shard_cnt; i++)
+		signal_wake_pipe(shard_arr[i].wake_fd_arr[1]);
+}
+
+static void run_server(void)
+{
+	struct sigaction stop_action;
+	
+	/* SIGINT and SIGTERM shut the server down cleanly, so the log gets
+	synced and every thread is joined */
+	memset(&stop_action, 0, sizeof(stop_action));
+	stop_action.sa_handler = stop_server;
+	sigemptyset(&stop_action.sa_mask);
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+	
+	/* The main thread runs the first shard itself.  A shard that fails to
+	start stops the ones already running */
+	for(int i = 1; i < config.shard_cnt; i++)
+	{
+		shard_arr[i].thread = SDL_CreateThread
+		(
+			run_shard,
+			"susurrc-shard",
+			&shard_arr[i]
+		);
+		
+		if(shard_arr[i].thread == NULL)
+		{
+			print_libsdl_err("SDL_CreateThread");
+			stop_server(0);
+			break;
+		}
+	}
+	
+	run_shard(&shard_arr[0]);
+	
+	/* SDL_WaitThread does nothing for a thread that never started */
+	for(int i = 1; i < config.shard_cnt; i++)
+		SDL_WaitThread(shard_arr[i].thread, NULL);
+	
+	printf("Shutting down\n");
+}
+
+static bool collect_train_sample(void *data, const char *msg, int msg_len)
+{
+	train_t *train = data;
+	
+	if(train->len + msg_len > MAX_TRAIN_LEN) return false;
+	
+	memcpy(train->buf + train->len, msg, msg_len);
+	train->len += msg_len;
+	train->sample_len_arr[train->sample_cnt] = msg_len;
+	train->sample_cnt += 1;
+	
+	return true;
+}
+
+static void train_dict_from_log(void)
+{
+	msg_log_t train_log;
+	train_t train = {.sample_cnt = 0, .len = 0};
+	
+	/* Training only reads.  The log is opened read-only and cannot be used
+	by a server at the same time */
+	if(!init_read_only_msg_log(&train_log, config.log_dir)) return;
+	
+	train.buf = malloc(MAX_TRAIN_LEN);
+	train.sample_len_arr = malloc(MAX_TRAIN_SAMPLE_CNT * sizeof(size_t));
+	
+	/* Logged messages are exactly what gets broadcast, prefixes and all,
+	so the latest of them make a good sample of the traffic */
+	if(train.buf == NULL || train.sample_len_arr == NULL)
+	{
+		print_err("train_dict_from_log", "Could not allocate the samples");
+	}
+	else
+	{
+		read_recent_msg_log
+		(
+			&train_log,
+			MAX_TRAIN_SAMPLE_CNT,
+			collect_train_sample,
+			&train
+		);
+		
+		train_compress_dict
+		(
+			config.train_path,
+			train.buf,
+			train.sample_len_arr,
+			train.sample_cnt
+		);
+	}
+	
+	free(train.buf);
+	free(train.sample_len_arr);
+	terminate_msg_log(&train_log);
+}
+
+int main(int argc, char *argv[])
+{
+	bool is_hashing;
+	
+	if(!parse_server_args(argc, argv, &is_hashing))
+		print_server_arg_err();
+	else if(is_hashing)
+	{
+		if(init_libsodium()) print_password_hash();
+	}
+	else if(config.train_path != NULL)
+	{
+		train_dict_from_log();
+	}
+	else
+	{
+		if(init_server(argc, argv))
+			run_server();
+		
 		terminate_server();
 	}
 }
@@ -21,13 +21,16 @@ SOFTWARE. */
 #include "gtk/gtk.h"
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_net.h"
-#include "sodium.h"
+#include "src/client-io.h"
 #include "src/err.h"
 #include "src/init.h"
 #include "src/net.h"
+#include "src/presence.h"
 #include "src/susurrc.h"
 #include "stdbool.h"
 #include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
 
 static const char *HEADER_BAR_CONNECTED_TITLE = "Connected";
 static const char *HEADER_BAR_DISCONNECTED_TITLE = "Disconnected";
@@ -43,16 +46,36 @@ static const int BOX_PACK_PADDING = 2;
 static const int BOX_SPACING = 4;
 static const int DEFAULT_WINDOW_HEIGHT = 360;
 static const int DEFAULT_WINDOW_WIDTH = 640;
-static const int SOCKET_CHECK_TIMEOUT = 1;
 
-static char msg_recv_buf[MAX_MSG_LEN * MAX_MSG_CNT];
-static int ready_socket_cnt;
-static IPaddress server_ip;
-static msg_data_t msg_data;
-static SDLNet_SocketSet socket_set;
-static TCPsocket server_socket;
-static unsigned char privkey[crypto_box_SECRETKEYBYTES];
-static unsigned char pubkey[crypto_box_PUBLICKEYBYTES];
+/* Seconds without focus before the user counts as away */
+static const int AWAY_DELAY = 120;
+
+/* Seconds between checks for typing that has gone quiet */
+static const int TYPING_CHECK_INTERVAL = 1;
+
+/* Users named in the presence label.  The rest are only counted */
+static const int MAX_LISTED_USER_CNT = 20;
+
+/* Struct for the presence label text as it is built */
+typedef struct presence_text_t
+{
+	int user_cnt;
+	int typing_cnt;
+	GString *user_str;
+	GString *typing_str;
+}
+presence_text_t;
+
+static bool is_connected;
+static int scrollback_len;
+static guint away_source_id;
+static presence_state_t presence_state;
+static uint32_t self_presence_id;
+static Uint32 typing_ticks;
+static const char *dict_path;
+static const char *download_dir;
+static client_io_t client_io;
+static presence_table_t presence_table;
 
 static GtkEntryBuffer *msg_send_entry_buffer;
 static GtkEntryBuffer *server_hostname_entry_buffer;
@@ -66,104 +89,292 @@ static GtkWidget *msg_recv_scrolled_window;
 static GtkWidget *msg_recv_text_view;
 static GtkWidget *msg_send_entry;
 static GtkWidget *outer_box;
+static GtkWidget *presence_label;
 static GtkWidget *server_connect_button;
 static GtkWidget *server_hostname_entry;
 static GtkWidget *server_port_entry;
+static GtkWidget *typing_label;
 static GtkWidget *window;
-static guint recv_msg_from_server_id;
 
 static void append_to_msg_recv_buffer(const char *msg)
 {
-	/* Append the new message to the received message buffer */
-	strcat(msg_recv_buf, msg);
-	strcat(msg_recv_buf, "\n");
+	GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER(msg_recv_text_buffer);
+	GtkTextIter start_iter;
+	GtkTextIter end_iter;
+	
+	/* Insert only the new line at the end so the text view lays out just
+	that line instead of the whole transcript */
+	gtk_text_buffer_get_end_iter(text_buffer, &end_iter);
+	gtk_text_buffer_insert(text_buffer, &end_iter, msg, -1);
+	gtk_text_buffer_insert(text_buffer, &end_iter, "\n", 1);
+	
+	/* The transcript keeps the last scrollback_len lines, like a ring
+	buffer.  The trailing newline leaves an empty last line, which is not
+	counted */
+	int excess_line_cnt =
+		gtk_text_buffer_get_line_count(text_buffer) - 1 - scrollback_len;
+	
+	if(excess_line_cnt > 0)
+	{
+		gtk_text_buffer_get_start_iter(text_buffer, &start_iter);
+		
+		gtk_text_buffer_get_iter_at_line
+		(
+			text_buffer,
+			&end_iter,
+			excess_line_cnt
+		);
+		
+		gtk_text_buffer_delete(text_buffer, &start_iter, &end_iter);
+	}
+}
+
+static bool add_presence_to_text(void *data, presence_t *presence)
+{
+	presence_text_t *text = data;
 	
-	/* Update text view with the new received message buffer */
-	gtk_text_buffer_set_text
-	(
-		GTK_TEXT_BUFFER(msg_recv_text_buffer),
-		msg_recv_buf,
-		-1
-	);
+	if(presence->id == self_presence_id) return true;
+	
+	text->user_cnt += 1;
+	
+	if(text->user_cnt <= MAX_LISTED_USER_CNT)
+	{
+		g_string_append_printf
+		(
+			text->user_str,
+			"%s%s#%u%s",
+			text->user_cnt > 1 ? ", " : "",
+			presence->username,
+			presence->id,
+			presence->state == PRESENCE_STATE_AWAY ? " (away)" : ""
+		);
+	}
+	
+	if(presence->state != PRESENCE_STATE_TYPING) return true;
+	
+	text->typing_cnt += 1;
+	
+	if(text->typing_cnt <= MAX_LISTED_USER_CNT)
+	{
+		g_string_append_printf
+		(
+			text->typing_str,
+			"%s%s#%u (%s)",
+			text->typing_cnt > 1 ? ", " : "",
+			presence->username,
+			presence->id,
+			presence->channel_name
+		);
+	}
+	
+	return true;
 }
 
-static void set_header_bar_title_and_subtitle
-(
-	const char *title,
-	const char *subtitle
-)
+static void update_presence_labels(void)
 {
-	gtk_header_bar_set_title(GTK_HEADER_BAR(header_bar), title);
-	gtk_header_bar_set_subtitle(GTK_HEADER_BAR(header_bar), subtitle);
+	presence_text_t text =
+	{
+		.user_cnt = 0,
+		.typing_cnt = 0,
+		.user_str = g_string_new(""),
+		.typing_str = g_string_new("")
+	};
+	
+	read_presence_table(&presence_table, add_presence_to_text, &text);
+	
+	if(text.user_cnt > MAX_LISTED_USER_CNT)
+	{
+		g_string_append_printf
+		(
+			text.user_str,
+			" and %d more",
+			text.user_cnt - MAX_LISTED_USER_CNT
+		);
+	}
+	
+	if(text.typing_cnt > 0)
+	{
+		g_string_append
+		(
+			text.typing_str,
+			text.typing_cnt > 1 ? " are typing" : " is typing"
+		);
+	}
+	
+	if(is_connected && text.user_cnt == 0)
+		g_string_assign(text.user_str, "Nobody else is here");
+	else if(is_connected)
+		g_string_prepend(text.user_str, "Here: ");
+	
+	/* Only the labels change.  The transcript is left alone */
+	gtk_label_set_text(GTK_LABEL(presence_label), text.user_str->str);
+	gtk_label_set_text(GTK_LABEL(typing_label), text.typing_str->str);
+	g_string_free(text.user_str, TRUE);
+	g_string_free(text.typing_str, TRUE);
 }
 
-static void terminate_socket_connection(void)
+static void handle_presence_event(presence_t *presence)
 {
-	if(server_socket && socket_set)
-		SDLNet_TCP_DelSocket(socket_set, server_socket);
-		
-	if(server_socket)
-		SDLNet_TCP_Close(server_socket);
+	/* The user's own entry starts a snapshot of the whole room */
+	if(presence->is_self)
+	{
+		clear_presence_table(&presence_table);
+		self_presence_id = presence->id;
+	}
 	
-	if(socket_set)
-		SDLNet_FreeSocketSet(socket_set);
-		
-	server_socket = NULL;
-	socket_set = NULL;
-		
-	/* Possible TODO: Move the header bar setups from the socket
-	connection/termination functions.  They aren't related to socket
-	connections (Though, they make sense here logically based on when each
-	function is called, since the header is going to be set
-	simultaneously) */
-	set_header_bar_title_and_subtitle
+	presence->change_ticks = SDL_GetTicks();
+	update_presence_table(&presence_table, presence);
+}
+
+static bool expire_typing_presence(void *data, presence_t *presence)
+{
+	bool *is_expired = data;
+	
+	/* Typing that has not been heard of again has stopped */
+	if
 	(
-		HEADER_BAR_DISCONNECTED_TITLE,
-		""
-	);
+		presence->state == PRESENCE_STATE_TYPING &&
+		SDL_GetTicks() - presence->change_ticks >= PRESENCE_TYPING_TIMEOUT
+	)
+	{
+		presence->state = PRESENCE_STATE_ONLINE;
+		*is_expired = true;
+	}
+	
+	return true;
 }
 
-static bool init_socket_connection
-(
-	const char *server_hostname,
-	int server_port
-)
-{	
-	bool init_success;
+static gboolean check_typing_presence(gpointer data)
+{
+	bool is_expired = false;
+	
+	read_presence_table(&presence_table, expire_typing_presence, &is_expired);
+	
+	if(is_expired) update_presence_labels();
+	
+	/* Keep the timer */
+	return TRUE;
+}
 
-	/* Terminate any active connections beforehand so the client doesn't
-	accidentally fill up unnecessary slots */
-	terminate_socket_connection();
+static void set_presence_state(presence_state_t state)
+{
+	if(!is_connected) return;
 	
-	/* Setup the socket connection */
-	init_success = setup_server_connection
+	/* Posting can only fail with the I/O thread far behind, and presence
+	is not worth retrying */
+	if(state == PRESENCE_STATE_TYPING) typing_ticks = SDL_GetTicks();
+	
+	presence_state = state;
+	post_client_cmd(&client_io, CLIENT_CMD_SET_PRESENCE, "", state);
+}
+
+static void handle_msg_send_entry_change(GtkEditable *editable, gpointer data)
+{
+	const char *msg = gtk_entry_get_text(GTK_ENTRY(msg_send_entry));
+	
+	/* Commands are not worth announcing, and an emptied entry (after a
+	send, too) means the user has stopped */
+	if(strcmp(msg, "") == 0 || msg[0] == '/')
+	{
+		if(presence_state == PRESENCE_STATE_TYPING)
+			set_presence_state(PRESENCE_STATE_ONLINE);
+		
+		return;
+	}
+	
+	/* Keystrokes in between are not sent.  Receivers only need to hear
+	often enough not to time the user out */
+	if
 	(
-		&server_ip,
-		&server_socket,
-		server_hostname,
-		server_port
-	);
+		presence_state != PRESENCE_STATE_TYPING ||
+		SDL_GetTicks() - typing_ticks >= PRESENCE_TYPING_INTERVAL
+	)
+		set_presence_state(PRESENCE_STATE_TYPING);
+}
+
+static gboolean set_away_presence(gpointer data)
+{
+	away_source_id = 0;
 	
-	/* Check if the connection could be made */
-	if(init_success)
-		init_success = init_client_socket_set(&socket_set, &server_socket);
+	if(presence_state == PRESENCE_STATE_ONLINE)
+		set_presence_state(PRESENCE_STATE_AWAY);
 	
-	/* Setup the header on success */
-	if(init_success)
-		set_header_bar_title_and_subtitle
+	return FALSE;
+}
+
+static void handle_window_focus_change
+(
+	GObject *object,
+	GParamSpec *pspec,
+	gpointer data
+)
+{
+	if(away_source_id != 0)
+	{
+		g_source_remove(away_source_id);
+		away_source_id = 0;
+	}
+	
+	/* The user is away once the window has been left alone for a while */
+	if(!gtk_window_is_active(GTK_WINDOW(window)))
+	{
+		away_source_id = g_timeout_add_seconds
 		(
-			HEADER_BAR_CONNECTED_TITLE,
-			server_hostname
+			AWAY_DELAY,
+			set_away_presence,
+			NULL
 		);
+		
+		return;
+	}
 	
-	/* Return */
-	return init_success;
+	if(presence_state == PRESENCE_STATE_AWAY)
+		set_presence_state(PRESENCE_STATE_ONLINE);
+}
+
+static bool parse_client_args(int argc, char *argv[])
+{
+	int opt;
+	
+	scrollback_len = DEFAULT_SCROLLBACK_LEN;
+	dict_path = NULL;
+	download_dir = NULL;
+	
+	while((opt = getopt(argc, argv, "l:o:z:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'l':
+				scrollback_len = atoi(optarg);
+				break;
+			case 'o':
+				download_dir = optarg;
+				break;
+			case 'z':
+				dict_path = optarg;
+				break;
+			default:
+				return false;
+		}
+	}
+	
+	return optind == argc && scrollback_len >= 1;
+}
+
+static void set_header_bar_title_and_subtitle
+(
+	const char *title,
+	const char *subtitle
+)
+{
+	gtk_header_bar_set_title(GTK_HEADER_BAR(header_bar), title);
+	gtk_header_bar_set_subtitle(GTK_HEADER_BAR(header_bar), subtitle);
 }
 
 static void send_msg_to_server(GtkWidget *msg_send_entry, gpointer data)
 {
 	/* Avoid trying to send a message while there are no socket connections */
-	if(server_socket == NULL)
+	if(!is_connected)
 	{
 		print_err
 		(
@@ -173,61 +384,105 @@ static void send_msg_to_server(GtkWidget *msg_send_entry, gpointer data)
 		
 		return;
 	}
-
-	/* Send the message to the server */	
-	char msg[MAX_MSG_LEN];
-	strcpy(msg, gtk_entry_get_text(GTK_ENTRY(msg_send_entry)));
 	
-	send_msg
+	const char *msg = gtk_entry_get_text(GTK_ENTRY(msg_send_entry));
+	
+	/* Abort on an empty message */
+	if(strcmp(msg, "") == 0) return;
+	
+	/* "/send <path>" sends a file to the current channel instead */
+	bool is_file = strncmp(msg, "/send ", 6) == 0;
+	
+	/* Hand the message to the I/O thread, which encrypts and sends it.
+	send_msg truncates anything longer than MAX_MSG_LEN */
+	bool is_posted = post_client_cmd
 	(
-		msg,
-		&msg_data,
-		&server_socket,
-		privkey,
-		pubkey
+		&client_io,
+		is_file ? CLIENT_CMD_SEND_FILE : CLIENT_CMD_SEND,
+		is_file ? msg + 6 : msg,
+		0
 	);
 	
+	if(!is_posted)
+	{
+		print_err
+		(
+			"send_msg_to_server",
+			"Could not send message.  Too many messages are waiting"
+		);
+		
+		return;
+	}
+	
 	/* Clear the message entry */
 	gtk_entry_set_text(GTK_ENTRY(msg_send_entry), "");
 }
 
-static gboolean recv_msg_from_server(gpointer data)
+static gboolean handle_client_events(gpointer data)
 {
-	/* Check for socket activity */
-	ready_socket_cnt = SDLNet_CheckSockets(socket_set, SOCKET_CHECK_TIMEOUT);
+	client_event_t *event;
+	bool is_presence_changed = false;
 	
-	/* Receive the message on socket activity */
-	if(ready_socket_cnt > 0)
-		if(SDLNet_SocketReady(server_socket))
+	/* Acknowledge first so events pushed while draining get a dispatch of
+	their own */
+	ack_client_io_notify(&client_io);
+	
+	while((event = pop_client_event(&client_io)) != NULL)
+	{
+		switch(event->type)
 		{
-			/* Receive the message */
-			char msg[MAX_MSG_LEN];
-		
-			bool recv_success = recv_msg
-			(
-				msg,
-				&msg_data,
-				&server_socket,
-				privkey,
-				pubkey
-			);
-			
-			if(strcmp(msg, "") != 0)
-			{
-				append_to_msg_recv_buffer(msg);
-			}
-			
-			if(recv_success == false)
-			{
-				/* Close the connection and return false so that GLib stops
-				attempting to receive messages */
-				terminate_socket_connection();
-				return FALSE;
-			}
+			case CLIENT_EVENT_CONNECTED:
+				is_connected = true;
+				is_presence_changed = true;
+				
+				/* Which also asks the server for everyone else's */
+				set_presence_state(PRESENCE_STATE_ONLINE);
+				
+				set_header_bar_title_and_subtitle
+				(
+					HEADER_BAR_CONNECTED_TITLE,
+					event->text
+				);
+				
+				break;
+			case CLIENT_EVENT_DISCONNECTED:
+				is_connected = false;
+				self_presence_id = 0;
+				clear_presence_table(&presence_table);
+				is_presence_changed = true;
+				
+				set_header_bar_title_and_subtitle
+				(
+					HEADER_BAR_DISCONNECTED_TITLE,
+					""
+				);
+				
+				break;
+			case CLIENT_EVENT_MSG:
+			case CLIENT_EVENT_UPLOAD_DONE:
+				append_to_msg_recv_buffer(event->text);
+				break;
+			case CLIENT_EVENT_PRESENCE:
+				handle_presence_event(&event->presence);
+				is_presence_changed = true;
+				break;
 		}
 		
-	/* Return true so GLib doesn't remove this fucntion from the main loop */
-	return TRUE;
+		free(event);
+	}
+	
+	/* A whole batch of changes is shown at once */
+	if(is_presence_changed) update_presence_labels();
+	
+	/* Return false so GLib drops this dispatch */
+	return FALSE;
+}
+
+static void notify_main_context(void *data)
+{
+	/* Called from the I/O thread.  Runs handle_client_events on the main
+	loop once for the whole batch */
+	g_main_context_invoke(NULL, handle_client_events, NULL);
 }
 
 static void connect_to_server(gpointer data)
@@ -241,37 +496,20 @@ static void connect_to_server(gpointer data)
 		atoi(gtk_entry_buffer_get_text(GTK_ENTRY_BUFFER
 		(server_port_entry_buffer)));
 
-	/* Attempt to make the socket connection */
-	bool init_success = init_socket_connection
+	/* The I/O thread connects and exchanges keys, then reports back with
+	a CONNECTED or DISCONNECTED event.  The UI stays responsive while it
+	waits */
+	if
 	(
-		server_hostname,
-		server_port
-	);
-	
-	if(init_success)
-	{
-		/* Generate the client's keypair */
-		crypto_box_keypair(pubkey, privkey);
-		
-		/* Add message receiving to the GLib event loop */
-		recv_msg_from_server_id = g_idle_add
+		!post_client_cmd
 		(
-			(void *)recv_msg_from_server,
-			NULL
-		);
-	}
-	else
-	{
+			&client_io,
+			CLIENT_CMD_CONNECT,
+			server_hostname,
+			server_port
+		)
+	)
 		print_err("connect_to_server", "Could not connect to server");
-		
-		/* Remove message receiving from the GLib event loop.  Otherwise,
-		it will try to receive messages on the terminated socket */
-		if(recv_msg_from_server_id != 0)
-			g_source_remove(recv_msg_from_server_id);
-		
-		/* Terminate the socket connection */
-		terminate_socket_connection();
-	}
 }
 
 static void setup_widgets(void)
@@ -289,6 +527,14 @@ static void setup_widgets(void)
 	
 	g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
 	
+	g_signal_connect
+	(
+		window,
+		"notify::is-active",
+		G_CALLBACK(handle_window_focus_change),
+		NULL
+	);
+	
 	/* outer_box */
 	outer_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, BOX_SPACING);
 	gtk_container_add(GTK_CONTAINER(window), outer_box);
@@ -392,6 +638,20 @@ static void setup_widgets(void)
 		NULL
 	);
 	
+	/* presence_label */
+	presence_label = gtk_label_new("");
+	gtk_label_set_line_wrap(GTK_LABEL(presence_label), TRUE);
+	gtk_label_set_xalign(GTK_LABEL(presence_label), 0);
+	
+	gtk_box_pack_start
+	(
+		GTK_BOX(control_box),
+		presence_label,
+		FALSE,
+		FALSE,
+		BOX_PACK_PADDING
+	);
+	
 	/* msg_box */
 	msg_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, BOX_SPACING);
 	
@@ -432,6 +692,20 @@ static void setup_widgets(void)
 	
 	gtk_container_add(GTK_CONTAINER(msg_recv_scrolled_window), msg_recv_text_view);
 	
+	/* typing_label */
+	typing_label = gtk_label_new("");
+	gtk_label_set_ellipsize(GTK_LABEL(typing_label), PANGO_ELLIPSIZE_END);
+	gtk_label_set_xalign(GTK_LABEL(typing_label), 0);
+	
+	gtk_box_pack_start
+	(
+		GTK_BOX(msg_box),
+		typing_label,
+		FALSE,
+		FALSE,
+		BOX_PACK_PADDING
+	);
+	
 	/* msg_send_entry */
 	msg_send_entry = gtk_entry_new();
 	
@@ -446,6 +720,14 @@ static void setup_widgets(void)
 	
 	g_signal_connect(msg_send_entry, "activate", G_CALLBACK(send_msg_to_server), NULL);
 	
+	g_signal_connect
+	(
+		msg_send_entry,
+		"changed",
+		G_CALLBACK(handle_msg_send_entry_change),
+		NULL
+	);
+	
 	gtk_box_pack_start
 	(
 		GTK_BOX(msg_box),
@@ -464,22 +746,62 @@ int main(int argc, char *argv[])
 	init_success = init_libsdlnet();
 	init_success = init_libsodium();
 	
-	server_socket = NULL;
-	socket_set = NULL;
+	is_connected = false;
+	away_source_id = 0;
+	presence_state = PRESENCE_STATE_OFFLINE;
+	self_presence_id = 0;
+	typing_ticks = 0;
+	
+	if(init_success) init_success = init_presence_table(&presence_table);
 	
 	if(init_success)
 	{
+		/* GTK removes its own options from argv first */
 		gtk_init(&argc, &argv);
+		
+		init_success = parse_client_args(argc, argv);
+		
+		if(!init_success) print_client_arg_err();
+	}
+	
+	if(init_success)
+	{
+		init_success = init_client_io
+		(
+			&client_io,
+			dict_path,
+			download_dir,
+			notify_main_context,
+			NULL
+		);
+	}
+	
+	if(init_success)
+	{
 		setup_widgets();
 		gtk_widget_show_all(window);
 		
-		/* Called here to set the header bar to "disconnected" */
-		terminate_socket_connection();
+		g_timeout_add_seconds
+		(
+			TYPING_CHECK_INTERVAL,
+			check_typing_presence,
+			NULL
+		);
+		
+		set_header_bar_title_and_subtitle
+		(
+			HEADER_BAR_DISCONNECTED_TITLE,
+			""
+		);
 		
 		gtk_main();
+		
+		/* Closes the connection */
+		terminate_client_io(&client_io);
 	}
 	
-	terminate_socket_connection();
+	terminate_presence_table(&presence_table);
+	
 	SDLNet_Quit();
 	SDL_Quit();
 	
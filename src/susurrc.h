@@ -21,8 +21,12 @@ SOFTWARE. */
 #ifndef SUSURRC_H
 #define SUSURRC_H
 
-#define MAX_CLIENT_CNT 16
-#define MAX_MSG_CNT 128
+#define DEFAULT_MAX_CLIENT_CNT 1024
+#define DEFAULT_MAX_QUEUED_LEN 262144
+#define DEFAULT_REPLAY_CNT 50
+#define DEFAULT_MAX_LOG_SEGMENT_CNT 64
+#define DEFAULT_CHANNEL_NAME "general"
+#define DEFAULT_SCROLLBACK_LEN 10000
 
 #endif /* SUSURRC_H */
 